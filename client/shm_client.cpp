@@ -11,6 +11,9 @@
 #include <fcntl.h>
 #include <grpcpp/grpcpp.h>
 
+#include "arena_handle.h"
+#include "descriptor_ring.h"
+#include "fd_channel.h"
 #include "spdlog/spdlog.h"
 
 
@@ -19,41 +22,149 @@ using grpc::ClientContext;
 using grpc::Status;
 using std::string;
 
+struct ShmClientRing {
+    DescriptorRing ring;
+    mutex m; // rings are single producer/consumer, serialize client threads
+};
+
 ShmClient::ShmClient(std::shared_ptr<Channel> channel) :
-    mStub(Shm::NewStub(channel))
+    mStub(Shm::NewStub(channel)),
+    mFdSocketPath(FD_SOCKET_DEFAULT_PATH),
+    mFdSocket(-1),
+    mServerEpoch(0),
+    mSession(0),
+    mHeartbeatStop(false)
 {
+    mMapCache.setOpen([this](const string& name) { return openBuffer(name); });
 }
 
-ShmClient::ShmClient(const string& ip, const string& port) {
+ShmClient::ShmClient(const string& ip, const string& port) :
+    mFdSocketPath(FD_SOCKET_DEFAULT_PATH),
+    mFdSocket(-1),
+    mServerEpoch(0),
+    mSession(0),
+    mHeartbeatStop(false)
+{
     string addr = ip + ":" + port;
     auto channel = grpc::CreateChannel(addr, grpc::InsecureChannelCredentials());
     mStub = Shm::NewStub(channel);
+    mMapCache.setOpen([this](const string& name) { return openBuffer(name); });
+}
+
+ShmClient::~ShmClient() {
+    if (mSession)
+        CloseSession();
+
+    {
+        // closing a ring stops the server thread serving it
+        lock_guard<mutex> lock(mRingMutex);
+        for (auto& it : mPublishRings)
+            it.second->ring.close();
+        for (auto& it : mPullRings)
+            it.second->ring.close();
+    }
+
+    {
+        lock_guard<mutex> lock(mArenaMutex);
+        for (auto& it : mArenas)
+            munmap(it.second.first, it.second.second);
+    }
+
+    lock_guard<mutex> lock(mFdMutex);
+    if (mFdSocket >= 0)
+        close(mFdSocket);
+}
+
+ShmClientRing* ShmClient::findRing(unordered_map<string, unique_ptr<ShmClientRing>>& rings, const string& key) {
+    lock_guard<mutex> lock(mRingMutex);
+    if (rings.empty())
+        return nullptr;
+    auto it = rings.find(key);
+    return it == rings.end() ? nullptr : it->second.get();
+}
+
+bool ShmClient::attachRing(unordered_map<string, unique_ptr<ShmClientRing>>& rings, const string& key, const string& ring_name) {
+    auto ring = make_unique<ShmClientRing>();
+    if (!ring->ring.open(ring_name)) {
+        spdlog::error("failed to open descriptor ring: {}", ring_name);
+        return false;
+    }
+
+    lock_guard<mutex> lock(mRingMutex);
+    auto it = rings.find(key);
+    if (it != rings.end())
+        it->second->ring.close();
+    rings[key] = std::move(ring);
+    return true;
+}
+
+uint64_t ShmClient::findHandle(unordered_map<string, uint64_t>& handles, const string& key) {
+    lock_guard<mutex> lock(mHandleMutex);
+    auto it = handles.find(key);
+    return it == handles.end() ? 0 : it->second;
+}
+
+// A handle of 0 removes the key
+void ShmClient::setHandle(unordered_map<string, uint64_t>& handles, const string& key, uint64_t handle) {
+    lock_guard<mutex> lock(mHandleMutex);
+    if (handle)
+        handles[key] = handle;
+    else
+        handles.erase(key);
+}
+
+// The server fails a request with NOT_FOUND if it no longer knows the handle
+// it carries, e.g. because the topic was removed. The request is then sent
+// again with the names.
+static bool handleExpired(const Status& status, uint64_t handle) {
+    return handle && status.error_code() == grpc::StatusCode::NOT_FOUND;
 }
 
 int32_t ShmClient::CreateBuffer(string& name, int32_t size) {
+    uint64_t epoch;
+    return CreateBuffer(name, size, epoch);
+}
+
+int32_t ShmClient::CreateBuffer(string& name, int32_t size, uint64_t& epoch, uint32_t pageFlags,
+                                const string& topicName) {
     CreateBufferRequest request;
     CreateBufferReply reply;
     ClientContext context;
     request.set_size(size);
+    request.set_page_flags(pageFlags);
+    request.set_topic_name(topicName);
     Status status = mStub->CreateBuffer(&context, request, &reply);
-    if (status.ok() && !reply.name().empty())
+    if (status.ok() && !reply.name().empty()) {
         name = reply.name();
-    else {
+        epoch = reply.server_epoch();
+        sawEpoch(epoch);
+    } else {
         spdlog::error("CreateBuffer() failed with error code: {}, error message: {}",
                 status.error_code(), status.error_message());
+        return -1;
     }
     return reply.result();
 }
 
 int32_t ShmClient::GetBuffer(const string& name, int32_t& size) {
+    uint64_t epoch;
+    return GetBuffer(name, size, epoch);
+}
+
+int32_t ShmClient::GetBuffer(const string& name, int32_t& size, uint64_t& epoch) {
     GetBufferRequest request;
     GetBufferReply reply;
     ClientContext context;
     request.set_name(name);
     Status status = mStub->GetBuffer(&context, request, &reply);
-    if (status.ok() && reply.result() == 0)
+    if (status.ok() && reply.result() == 0) {
         size = reply.size();
-    else {
+        epoch = reply.server_epoch();
+        sawEpoch(epoch);
+    } else {
+        // the server no longer knows this segment, drop any cached mapping
+        if (status.ok())
+            mMapCache.invalidate(name);
         spdlog::error("GetBuffer() failed with error code: {}, error message: {}",
                 status.error_code(), status.error_message());
     }
@@ -65,6 +176,43 @@ int32_t ShmClient::ReleaseBuffer(const string& name) {
     StandardReply reply;
     ClientContext context;
     request.set_name(name);
+    {
+        lock_guard<mutex> lock(mStreamMutex);
+        auto it = mStreamBuffers.find(name);
+        if (it != mStreamBuffers.end()) {
+            request.set_topic_name(it->second.first);
+            request.set_subscriber_name(it->second.second);
+            mStreamBuffers.erase(it);
+        }
+        auto group_it = mGroupBuffers.find(name);
+        if (group_it != mGroupBuffers.end()) {
+            GroupBuffer& buffer = group_it->second;
+            uint64_t member = findHandle(mGroupMembers,
+                    buffer.topic_name + "/" + buffer.group_name + "/" + buffer.member_name);
+            if (member) {
+                request.set_group_member(member);
+            } else {
+                request.set_topic_name(buffer.topic_name);
+                request.set_group_name(buffer.group_name);
+                request.set_subscriber_name(buffer.member_name);
+            }
+            mGroupBuffers.erase(group_it);
+        }
+    }
+    {
+        lock_guard<mutex> lock(mStreamMutex);
+        auto session_it = mSessionBuffers.find(name);
+        if (session_it != mSessionBuffers.end()) {
+            request.set_session(session_it->second);
+            mSessionBuffers.erase(session_it);
+        }
+        auto pulled_it = mPulledBuffers.find(name);
+        if (pulled_it != mPulledBuffers.end()) {
+            if (request.subscriber_name().empty())
+                request.set_subscriber_name(pulled_it->second);
+            mPulledBuffers.erase(pulled_it);
+        }
+    }
     Status status = mStub->ReleaseBuffer(&context, request, &reply);
     if (status.ok())
         return reply.result();
@@ -74,26 +222,104 @@ int32_t ShmClient::ReleaseBuffer(const string& name) {
     return -1;
 }
 
-int32_t ShmClient::RegisterTopic(const string& name, bool dropMsgs, bool wait) {
+int32_t ShmClient::GetArenaStats(vector<ArenaStats>& stats) {
+    Empty request;
+    ArenaStatsReply reply;
+    ClientContext context;
+    Status status = mStub->GetArenaStats(&context, request, &reply);
+    if (status.ok()) {
+        stats.assign(reply.arenas().begin(), reply.arenas().end());
+        return reply.result();
+    }
+
+    spdlog::error("GetArenaStats() failed with error code: {}, error message: {}",
+            status.error_code(), status.error_message());
+    return -1;
+}
+
+int32_t ShmClient::GetStats(StatsReply& stats) {
+    Empty request;
+    ClientContext context;
+    Status status = mStub->GetStats(&context, request, &stats);
+    if (status.ok())
+        return stats.result();
+
+    spdlog::error("GetStats() failed with error code: {}, error message: {}",
+            status.error_code(), status.error_message());
+    return -1;
+}
+
+int32_t ShmClient::GetLatency(vector<LatencyStats>& stages) {
+    Empty request;
+    LatencyReply reply;
+    ClientContext context;
+    Status status = mStub->GetLatency(&context, request, &reply);
+    if (status.ok()) {
+        stages.assign(reply.stages().begin(), reply.stages().end());
+        return reply.result();
+    }
+
+    spdlog::error("GetLatency() failed with error code: {}, error message: {}",
+            status.error_code(), status.error_message());
+    return -1;
+}
+
+int32_t ShmClient::GetTrace(string& trace) {
+    Empty request;
+    TraceReply reply;
+    ClientContext context;
+    Status status = mStub->GetTrace(&context, request, &reply);
+    if (status.ok()) {
+        trace = std::move(*reply.mutable_trace());
+        return reply.result();
+    }
+
+    spdlog::error("GetTrace() failed with error code: {}, error message: {}",
+            status.error_code(), status.error_message());
+    return -1;
+}
+
+int32_t ShmClient::RegisterTopic(const string& name, bool dropMsgs, bool wait, bool useRing) {
     RegisterTopicRequest request;
-    StandardReply reply;
+    RegisterTopicReply reply;
     ClientContext context;
     request.set_name(name);
     request.set_dropmsgs(dropMsgs);
+    request.set_ring(useRing);
     Status status = mStub->RegisterTopic(&context, request, &reply);
     while (wait && (!status.ok() || reply.result() == -1)) {
         ClientContext newcontext; // for some reason a new context var is needed.
         status = mStub->RegisterTopic(&newcontext, request, &reply);
     }
 
-    if (status.ok())
+    if (status.ok()) {
+        if (reply.result() == 0)
+            setHandle(mTopicHandles, name, reply.topic_handle());
+        if (reply.result() == 0 && useRing && !attachRing(mPublishRings, name, reply.ring_name()))
+            return -1;
         return reply.result();
+    }
 
     spdlog::error("RegisterTopic() failed with error code: {}, error message: {}",
             status.error_code(), status.error_message());
     return -1;
 }
 
+int32_t ShmClient::RemoveTopic(const string& name) {
+    RemoveTopicRequest request;
+    StandardReply reply;
+    ClientContext context;
+    request.set_name(name);
+    setHandle(mTopicHandles, name, 0);
+    Status status = mStub->RemoveTopic(&context, request, &reply);
+    if (status.ok())
+        return reply.result();
+
+    spdlog::error("RemoveTopic() failed with error code: {}, error message: {}",
+            status.error_code(), status.error_message());
+    return -1;
+}
+
 int32_t ShmClient::Publish(const string& topic_name,
         const string& buffer_name, uint64_t timestamp) {
     string metadata = "";
@@ -101,15 +327,41 @@ int32_t ShmClient::Publish(const string& topic_name,
 }
 
 int32_t ShmClient::Publish(const string& topic_name,
-        const string& buffer_name, const string& metadata, uint64_t timestamp) {
+        const string& buffer_name, const string& metadata, uint64_t timestamp,
+        const vector<string>& parents) {
+    // rings don't carry parents
+    ShmClientRing* ring = parents.empty() ? findRing(mPublishRings, topic_name) : nullptr;
+    if (ring && ring->ring.fits(metadata.size())) {
+        lock_guard<mutex> lock(ring->m);
+        if (ring->ring.push(buffer_name, metadata, timestamp))
+            return 0;
+
+        spdlog::error("Publish() failed, descriptor ring for {} is closed", topic_name);
+        return -1;
+    }
+
+    // metadata too large for the ring is sent with an RPC
     PublishRequest request;
     StandardReply reply;
     ClientContext context;
-    request.set_topic_name(topic_name);
+    uint64_t handle = findHandle(mTopicHandles, topic_name);
+    if (handle)
+        request.set_topic_handle(handle);
+    else
+        request.set_topic_name(topic_name);
     request.set_buffer_name(buffer_name);
     request.set_metadata(metadata);
     request.set_timestamp(timestamp);
+    for (auto& parent : parents)
+        request.add_parent_buffers(parent);
     Status status = mStub->Publish(&context, request, &reply);
+    if (handleExpired(status, handle)) {
+        setHandle(mTopicHandles, topic_name, 0);
+        request.clear_topic_handle();
+        request.set_topic_name(topic_name);
+        ClientContext retry_context;
+        status = mStub->Publish(&retry_context, request, &reply);
+    }
     if (status.ok())
         return reply.result();
 
@@ -118,6 +370,58 @@ int32_t ShmClient::Publish(const string& topic_name,
     return -1;
 }
 
+// Messages for topics with a descriptor ring are pushed to the ring, all
+// others are sent with a single PublishBatch RPC.
+int32_t ShmClient::PublishBatch(const vector<PublishMessage>& messages, vector<int32_t>* results) {
+    vector<int32_t> local_results;
+    if (!results)
+        results = &local_results;
+    results->assign(messages.size(), -1);
+
+    PublishBatchRequest request;
+    vector<size_t> rpc_index;
+    int32_t result = 0;
+    for (size_t i = 0; i < messages.size(); ++i) {
+        const PublishMessage& msg = messages[i];
+        ShmClientRing* ring = msg.parents.empty() ? findRing(mPublishRings, msg.topic_name) : nullptr;
+        if (ring && ring->ring.fits(msg.metadata.size())) {
+            lock_guard<mutex> lock(ring->m);
+            if (ring->ring.push(msg.buffer_name, msg.metadata, msg.timestamp)) {
+                (*results)[i] = 0;
+            } else {
+                spdlog::error("PublishBatch() failed, descriptor ring for {} is closed", msg.topic_name);
+                result = -1;
+            }
+            continue;
+        }
+
+        PublishRequest* entry = request.add_entries();
+        entry->set_topic_name(msg.topic_name);
+        entry->set_buffer_name(msg.buffer_name);
+        entry->set_metadata(msg.metadata);
+        entry->set_timestamp(msg.timestamp);
+        for (auto& parent : msg.parents)
+            entry->add_parent_buffers(parent);
+        rpc_index.push_back(i);
+    }
+
+    if (rpc_index.empty())
+        return result;
+
+    PublishBatchReply reply;
+    ClientContext context;
+    Status status = mStub->PublishBatch(&context, request, &reply);
+    if (!status.ok()) {
+        spdlog::error("PublishBatch() failed with error code: {}, error message: {}",
+                status.error_code(), status.error_message());
+        return -1;
+    }
+
+    for (size_t i = 0; i < (size_t)reply.results_size() && i < rpc_index.size(); ++i)
+        (*results)[rpc_index[i]] = reply.results(i);
+    return reply.result() == 0 ? result : -1;
+}
+
 int32_t ShmClient::GetSubscriberCount(const string& topic_name, unsigned int& num_subs) {
     SubscriberCountRequest request;
     SubscriberCountReply reply;
@@ -130,19 +434,42 @@ int32_t ShmClient::GetSubscriberCount(const string& topic_name, unsigned int& nu
     return reply.result();
 }
 
-int32_t ShmClient::Subscribe(const string& topic_name, const string& subscriber_name, unsigned int maxQueueSize, bool wait) {
+int32_t ShmClient::GetTopics(vector<TopicInfo>& topics) {
+    Empty request;
+    TopicList reply;
+    ClientContext context;
+    Status status = mStub->GetTopics(&context, request, &reply);
+    if (status.ok()) {
+        topics.assign(reply.topics().begin(), reply.topics().end());
+        return reply.result();
+    }
+
+    spdlog::error("GetTopics() failed with error code: {}, error message: {}",
+            status.error_code(), status.error_message());
+    return -1;
+}
+
+int32_t ShmClient::Subscribe(const string& topic_name, const string& subscriber_name, unsigned int maxQueueSize, bool wait, bool useRing) {
     vector<string> v;
-    return Subscribe(topic_name, subscriber_name, v, maxQueueSize, wait);
+    return Subscribe(topic_name, subscriber_name, v, maxQueueSize, wait, useRing);
+}
+
+int32_t ShmClient::Subscribe(const string& topic_name, const string& subscriber_name, vector<string>& dependencies, unsigned int maxQueueSize, bool wait, bool useRing) {
+    return Subscribe(topic_name, subscriber_name, dependencies, FlowControl(), maxQueueSize, wait, useRing);
 }
 
-int32_t ShmClient::Subscribe(const string& topic_name, const string& subscriber_name, vector<string>& dependencies, unsigned int maxQueueSize, bool wait) {
+int32_t ShmClient::Subscribe(const string& topic_name, const string& subscriber_name, vector<string>& dependencies, const FlowControl& flow, unsigned int maxQueueSize, bool wait, bool useRing) {
 std::cout << "maxQueueSize: " << maxQueueSize << std::endl;
     SubscribeRequest request;
-    StandardReply reply;
+    SubscribeReply reply;
     ClientContext context;
     request.set_topic_name(topic_name);
     request.set_subscriber_name(subscriber_name);
     request.set_maxqueuesize(maxQueueSize);
+    request.set_ring(useRing);
+    request.set_flow_policy(flow.policy);
+    request.set_flow_credits(flow.credits);
+    request.set_flow_max_age_ms(flow.max_age_ms);
     for (int i=0; i < dependencies.size(); ++i)
         request.add_dependencies(dependencies[i]);
 
@@ -152,14 +479,51 @@ std::cout << "maxQueueSize: " << maxQueueSize << std::endl;
         status = mStub->Subscribe(&newcontext, request, &reply);
     }
 
-    if (status.ok())
+    if (status.ok()) {
+        if (reply.result() == 0)
+            setHandle(mSubscriptions, topic_name + "/" + subscriber_name, reply.subscription());
+        sawEpoch(reply.server_epoch());
+        if (reply.result() == 0 && useRing &&
+                !attachRing(mPullRings, topic_name + "/" + subscriber_name, reply.ring_name()))
+            return -1;
         return reply.result();
+    }
 
     spdlog::error("Subscribe() failed with error code: {}, error message: {}",
             status.error_code(), status.error_message());
     return -1;
 }
 
+int32_t ShmClient::GrantCredits(const string& topic_name, const string& subscriber_name, unsigned int credits) {
+    GrantCreditsRequest request;
+    StandardReply reply;
+    ClientContext context;
+    string key = topic_name + "/" + subscriber_name;
+    uint64_t subscription = findHandle(mSubscriptions, key);
+    if (subscription) {
+        request.set_subscription(subscription);
+    } else {
+        request.set_topic_name(topic_name);
+        request.set_subscriber_name(subscriber_name);
+    }
+    request.set_credits(credits);
+    Status status = mStub->GrantCredits(&context, request, &reply);
+    if (handleExpired(status, subscription)) {
+        setHandle(mSubscriptions, key, 0);
+        request.clear_subscription();
+        request.set_topic_name(topic_name);
+        request.set_subscriber_name(subscriber_name);
+        ClientContext retry_context;
+        status = mStub->GrantCredits(&retry_context, request, &reply);
+    }
+    if (status.ok())
+        return reply.result();
+
+    spdlog::error("GrantCredits() failed with error code: {}, error message: {}",
+            status.error_code(), status.error_message());
+    return -1;
+}
+
 int32_t ShmClient::Pull(const string& topic_name, const string& subscriber_name,
         string& buffer_name, uint64_t& timestamp, int timeout) {
     string metadata;
@@ -168,18 +532,51 @@ int32_t ShmClient::Pull(const string& topic_name, const string& subscriber_name,
 
 int32_t ShmClient::Pull(const string& topic_name, const string& subscriber_name,
         string& buffer_name, string& metadata, uint64_t& timestamp, int timeout) {
+    string key = topic_name + "/" + subscriber_name;
+    ShmClientRing* ring = findRing(mPullRings, key);
+    if (ring) {
+        lock_guard<mutex> lock(ring->m);
+        uint32_t flags;
+        if (ring->ring.pop(buffer_name, metadata, timestamp, flags, timeout)) {
+            if (flags & RING_FLAG_TRUNCATED)
+                spdlog::warn("Pull() metadata truncated for buffer: {}", buffer_name);
+            pulled(subscriber_name, buffer_name);
+            return 0;
+        }
+
+        spdlog::info("Pull() timed out");
+        return -1;
+    }
+
     PullRequest request;
     PullReply reply;
     ClientContext context;
-    request.set_topic_name(topic_name);
-    request.set_subscriber_name(subscriber_name);
+    uint64_t subscription = findHandle(mSubscriptions, key);
+    if (subscription) {
+        request.set_subscription(subscription);
+    } else {
+        request.set_topic_name(topic_name);
+        request.set_subscriber_name(subscriber_name);
+    }
     request.set_timeout(timeout);
+    request.set_session(mSession);
     Status status = mStub->Pull(&context, request, &reply);
+    if (handleExpired(status, subscription)) {
+        setHandle(mSubscriptions, key, 0);
+        request.clear_subscription();
+        request.set_topic_name(topic_name);
+        request.set_subscriber_name(subscriber_name);
+        ClientContext retry_context;
+        status = mStub->Pull(&retry_context, request, &reply);
+    }
     if (status.ok()) {
         if (reply.result() == 0) {
             buffer_name = reply.buffer_name();
             metadata = reply.metadata();
             timestamp = reply.timestamp();
+            sawEpoch(reply.server_epoch());
+            leased(request.session(), buffer_name);
+            pulled(subscriber_name, buffer_name);
             return 0;
         }
 
@@ -191,14 +588,674 @@ int32_t ShmClient::Pull(const string& topic_name, const string& subscriber_name,
     return -1;
 }
 
-void* MapBuffer(const string& name, size_t size) {
+int32_t ShmClient::PullBatch(const string& topic_name, const string& subscriber_name,
+        vector<StreamMessage>& messages, unsigned int maxItems, int timeout) {
+    messages.clear();
+    string key = topic_name + "/" + subscriber_name;
+    ShmClientRing* ring = findRing(mPullRings, key);
+    if (ring) {
+        // wait for the first descriptor only, then take what is ready
+        lock_guard<mutex> lock(ring->m);
+        StreamMessage msg;
+        uint32_t flags;
+        while (messages.size() < max(maxItems, 1u) &&
+                ring->ring.pop(msg.buffer_name, msg.metadata, msg.timestamp, flags,
+                               messages.empty() ? timeout : 0)) {
+            if (flags & RING_FLAG_TRUNCATED)
+                spdlog::warn("PullBatch() metadata truncated for buffer: {}", msg.buffer_name);
+            pulled(subscriber_name, msg.buffer_name);
+            messages.push_back(msg);
+        }
+
+        if (!messages.empty())
+            return 0;
+        spdlog::info("PullBatch() timed out");
+        return -1;
+    }
+
+    PullBatchRequest request;
+    PullBatchReply reply;
+    ClientContext context;
+    uint64_t subscription = findHandle(mSubscriptions, key);
+    if (subscription) {
+        request.set_subscription(subscription);
+    } else {
+        request.set_topic_name(topic_name);
+        request.set_subscriber_name(subscriber_name);
+    }
+    request.set_timeout(timeout);
+    request.set_max_items(maxItems);
+    request.set_session(mSession);
+    Status status = mStub->PullBatch(&context, request, &reply);
+    if (handleExpired(status, subscription)) {
+        setHandle(mSubscriptions, key, 0);
+        request.clear_subscription();
+        request.set_topic_name(topic_name);
+        request.set_subscriber_name(subscriber_name);
+        ClientContext retry_context;
+        status = mStub->PullBatch(&retry_context, request, &reply);
+    }
+    if (status.ok()) {
+        if (reply.result() == 0) {
+            messages.resize(reply.items_size());
+            if (reply.items_size() > 0)
+                sawEpoch(reply.items(0).server_epoch());
+            for (int i = 0; i < reply.items_size(); ++i) {
+                messages[i].buffer_name = reply.items(i).buffer_name();
+                messages[i].metadata = reply.items(i).metadata();
+                messages[i].timestamp = reply.items(i).timestamp();
+                leased(request.session(), messages[i].buffer_name);
+                pulled(subscriber_name, messages[i].buffer_name);
+            }
+            return 0;
+        }
+
+        spdlog::info("PullBatch() timed out");
+        return -1;
+    }
+
+    spdlog::error("PullBatch() failed with error code: {}, error message: {}",
+            status.error_code(), status.error_message());
+    return -1;
+}
+
+int32_t ShmClient::SubscribeSync(const vector<string>& topic_names, const string& subscriber_name,
+        uint64_t tolerance, bool latest, unsigned int maxQueueSize, bool wait) {
+    SubscribeSyncRequest request;
+    SubscribeReply reply;
+    ClientContext context;
+    request.set_subscriber_name(subscriber_name);
+    for (auto& topic_name : topic_names)
+        request.add_topic_names(topic_name);
+    request.set_tolerance(tolerance);
+    request.set_latest(latest);
+    request.set_maxqueuesize(maxQueueSize);
+
+    Status status = mStub->SubscribeSync(&context, request, &reply);
+    while (wait && (!status.ok() || reply.result() == -1)) {
+        ClientContext newcontext;
+        status = mStub->SubscribeSync(&newcontext, request, &reply);
+    }
+
+    if (status.ok()) {
+        if (reply.result() == 0)
+            setHandle(mSyncSubscriptions, subscriber_name, reply.subscription());
+        return reply.result();
+    }
+
+    spdlog::error("SubscribeSync() failed with error code: {}, error message: {}",
+            status.error_code(), status.error_message());
+    return -1;
+}
+
+int32_t ShmClient::PullSync(const string& subscriber_name, vector<StreamMessage>& messages, int timeout) {
+    messages.clear();
+    PullSyncRequest request;
+    PullBatchReply reply;
+    ClientContext context;
+    uint64_t subscription = findHandle(mSyncSubscriptions, subscriber_name);
+    if (subscription)
+        request.set_subscription(subscription);
+    else
+        request.set_subscriber_name(subscriber_name);
+    request.set_timeout(timeout);
+    request.set_session(mSession);
+    Status status = mStub->PullSync(&context, request, &reply);
+    if (handleExpired(status, subscription)) {
+        setHandle(mSyncSubscriptions, subscriber_name, 0);
+        request.clear_subscription();
+        request.set_subscriber_name(subscriber_name);
+        ClientContext retry_context;
+        status = mStub->PullSync(&retry_context, request, &reply);
+    }
+    if (status.ok()) {
+        if (reply.result() == 0) {
+            messages.resize(reply.items_size());
+            if (reply.items_size() > 0)
+                sawEpoch(reply.items(0).server_epoch());
+            for (int i = 0; i < reply.items_size(); ++i) {
+                messages[i].buffer_name = reply.items(i).buffer_name();
+                messages[i].metadata = reply.items(i).metadata();
+                messages[i].timestamp = reply.items(i).timestamp();
+                leased(request.session(), messages[i].buffer_name);
+                pulled(subscriber_name, messages[i].buffer_name);
+            }
+            return 0;
+        }
+
+        spdlog::info("PullSync() timed out");
+        return -1;
+    }
+
+    spdlog::error("PullSync() failed with error code: {}, error message: {}",
+            status.error_code(), status.error_message());
+    return -1;
+}
+
+int32_t ShmClient::JoinGroup(const string& topic_name, const string& group_name, const string& member_name,
+        unsigned int maxQueueSize, unsigned int leaseMs, bool wait) {
+    JoinGroupRequest request;
+    SubscribeReply reply;
+    ClientContext context;
+    request.set_topic_name(topic_name);
+    request.set_group_name(group_name);
+    request.set_member_name(member_name);
+    request.set_maxqueuesize(maxQueueSize);
+    request.set_lease_ms(leaseMs);
+
+    Status status = mStub->JoinGroup(&context, request, &reply);
+    while (wait && (!status.ok() || reply.result() == -1)) {
+        ClientContext newcontext;
+        status = mStub->JoinGroup(&newcontext, request, &reply);
+    }
+
+    if (status.ok()) {
+        if (reply.result() == 0)
+            setHandle(mGroupMembers, topic_name + "/" + group_name + "/" + member_name,
+                    reply.subscription());
+        return reply.result();
+    }
+
+    spdlog::error("JoinGroup() failed with error code: {}, error message: {}",
+            status.error_code(), status.error_message());
+    return -1;
+}
+
+int32_t ShmClient::PullGroup(const string& topic_name, const string& group_name, const string& member_name,
+        string& buffer_name, string& metadata, uint64_t& timestamp, int timeout) {
+    PullGroupRequest request;
+    PullReply reply;
+    ClientContext context;
+    string key = topic_name + "/" + group_name + "/" + member_name;
+    uint64_t member = findHandle(mGroupMembers, key);
+    if (member) {
+        request.set_member(member);
+    } else {
+        request.set_topic_name(topic_name);
+        request.set_group_name(group_name);
+        request.set_member_name(member_name);
+    }
+    request.set_timeout(timeout);
+    Status status = mStub->PullGroup(&context, request, &reply);
+    if (handleExpired(status, member)) {
+        setHandle(mGroupMembers, key, 0);
+        request.clear_member();
+        request.set_topic_name(topic_name);
+        request.set_group_name(group_name);
+        request.set_member_name(member_name);
+        ClientContext retry_context;
+        status = mStub->PullGroup(&retry_context, request, &reply);
+    }
+    if (status.ok()) {
+        if (reply.result() == 0) {
+            buffer_name = reply.buffer_name();
+            metadata = reply.metadata();
+            timestamp = reply.timestamp();
+            sawEpoch(reply.server_epoch());
+            lock_guard<mutex> lock(mStreamMutex);
+            mGroupBuffers.emplace(buffer_name, GroupBuffer{topic_name, group_name, member_name});
+            return 0;
+        }
+
+        spdlog::info("PullGroup() timed out");
+        return -1;
+    }
+
+    spdlog::error("PullGroup() failed with error code: {}, error message: {}",
+            status.error_code(), status.error_message());
+    return -1;
+}
+
+void ShmClient::leased(uint64_t session, const string& buffer_name) {
+    if (!session)
+        return;
+    lock_guard<mutex> lock(mStreamMutex);
+    mSessionBuffers.emplace(buffer_name, session);
+}
+
+void ShmClient::pulled(const string& subscriber_name, const string& buffer_name) {
+    lock_guard<mutex> lock(mStreamMutex);
+    mPulledBuffers.emplace(buffer_name, subscriber_name);
+}
+
+// Renews the lease three times per lease period, so that one late or lost
+// heartbeat doesn't expire the session
+void ShmClient::heartbeat(uint64_t session, unsigned int leaseMs) {
+    auto interval = chrono::milliseconds(max(leaseMs / 3, 1u));
+    unique_lock<mutex> lock(mSessionMutex);
+    while (!mSessionCV.wait_for(lock, interval, [this]() { return mHeartbeatStop; })) {
+        lock.unlock();
+        SessionRequest request;
+        StandardReply reply;
+        ClientContext context;
+        // a heartbeat that takes longer than the interval is late anyway,
+        // the next one is sent instead of waiting on a stalled server
+        context.set_deadline(chrono::system_clock::now() + interval);
+        request.set_session(session);
+        Status status = mStub->Heartbeat(&context, request, &reply);
+        lock.lock();
+        if (status.error_code() == grpc::StatusCode::NOT_FOUND) {
+            spdlog::error("session {} expired, its buffers were released by the server", session);
+            return;
+        }
+        if (!status.ok())
+            spdlog::warn("Heartbeat() failed with error code: {}, error message: {}",
+                    status.error_code(), status.error_message());
+    }
+}
+
+int32_t ShmClient::OpenSession(const string& clientName, unsigned int leaseMs) {
+    if (mSession)
+        CloseSession();
+
+    OpenSessionRequest request;
+    OpenSessionReply reply;
+    ClientContext context;
+    request.set_client_name(clientName);
+    request.set_lease_ms(leaseMs);
+    Status status = mStub->OpenSession(&context, request, &reply);
+    if (!status.ok() || reply.result() != 0) {
+        spdlog::error("OpenSession() failed with error code: {}, error message: {}",
+                status.error_code(), status.error_message());
+        return -1;
+    }
+
+    lock_guard<mutex> lock(mSessionMutex);
+    mHeartbeatStop = false;
+    mSession = reply.session();
+    mHeartbeat = thread(&ShmClient::heartbeat, this, reply.session(), reply.lease_ms());
+    return 0;
+}
+
+int32_t ShmClient::CloseSession() {
+    uint64_t session = mSession.exchange(0);
+    {
+        lock_guard<mutex> lock(mSessionMutex);
+        mHeartbeatStop = true;
+    }
+    mSessionCV.notify_all();
+    if (mHeartbeat.joinable())
+        mHeartbeat.join();
+    if (!session)
+        return -1;
+
+    {
+        // the server releases what is left
+        lock_guard<mutex> lock(mStreamMutex);
+        for (auto it = mSessionBuffers.begin(); it != mSessionBuffers.end();) {
+            if (it->second == session) {
+                auto pulled_it = mPulledBuffers.find(it->first);
+                if (pulled_it != mPulledBuffers.end())
+                    mPulledBuffers.erase(pulled_it);
+                it = mSessionBuffers.erase(it);
+            } else
+                ++it;
+        }
+    }
+    SessionRequest request;
+    StandardReply reply;
+    ClientContext context;
+    request.set_session(session);
+    Status status = mStub->CloseSession(&context, request, &reply);
+    if (status.ok())
+        return reply.result();
+
+    spdlog::error("CloseSession() failed with error code: {}, error message: {}",
+            status.error_code(), status.error_message());
+    return -1;
+}
+
+unique_ptr<ShmStream> ShmClient::Stream(const string& topic_name, const string& subscriber_name, unsigned int maxQueueSize) {
+    vector<string> v;
+    return Stream(topic_name, subscriber_name, v, maxQueueSize);
+}
+
+unique_ptr<ShmStream> ShmClient::Stream(const string& topic_name, const string& subscriber_name, vector<string>& dependencies, unsigned int maxQueueSize) {
+    SubscribeRequest request;
+    request.set_topic_name(topic_name);
+    request.set_subscriber_name(subscriber_name);
+    request.set_maxqueuesize(maxQueueSize);
+    for (auto& dependency : dependencies)
+        request.add_dependencies(dependency);
+    return make_unique<ShmStream>(this, request);
+}
+
+ShmStream::ShmStream(ShmClient* client, const SubscribeRequest& request) :
+    mClient(client),
+    mTopic(request.topic_name()),
+    mSubscriber(request.subscriber_name()),
+    mDone(false)
+{
+    mReader = mClient->mStub->Stream(&mContext, request);
+}
+
+ShmStream::~ShmStream() {
+    Cancel();
+}
+
+bool ShmStream::Next(StreamMessage& msg) {
+    if (mDone)
+        return false;
+
+    PullReply reply;
+    if (!mReader->Read(&reply)) {
+        mDone = true;
+        Status status = mReader->Finish();
+        if (!status.ok() && status.error_code() != grpc::StatusCode::CANCELLED)
+            spdlog::error("Stream() failed with error code: {}, error message: {}",
+                    status.error_code(), status.error_message());
+        return false;
+    }
+
+    msg.buffer_name = reply.buffer_name();
+    msg.metadata = reply.metadata();
+    msg.timestamp = reply.timestamp();
+    mClient->sawEpoch(reply.server_epoch());
+    lock_guard<mutex> lock(mClient->mStreamMutex);
+    mClient->mStreamBuffers.emplace(msg.buffer_name, make_pair(mTopic, mSubscriber));
+    return true;
+}
+
+void ShmStream::Cancel() {
+    if (!mDone) {
+        mContext.TryCancel();
+        StreamMessage msg;
+        while (Next(msg)) // drain until the server acknowledges the cancel
+            mClient->ReleaseBuffer(msg.buffer_name);
+    }
+}
+
+ShmStream::iterator ShmStream::begin() {
+    iterator it(this);
+    return ++it;
+}
+
+void* ShmClient::mapArena(const string& arena) {
+    lock_guard<mutex> lock(mArenaMutex);
+    auto it = mArenas.find(arena);
+    if (it != mArenas.end())
+        return it->second.first;
+
+    int fd = shm_open(arena.c_str(), O_RDWR, 0);
+    if (fd < 0) {
+        spdlog::error("failed to open shm arena: {}", arena);
+        return nullptr;
+    }
+
+    struct stat st;
+    void* addr = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+        addr = mmap(NULL, st.st_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        spdlog::error("failed to map shm arena: {}", arena);
+        return nullptr;
+    }
+
+    mArenas[arena] = make_pair(addr, (size_t)st.st_size);
+    return addr;
+}
+
+// memfd buffers have no name to open, their descriptor is received from the
+// server over the fd socket. The descriptor is closed once the buffer is
+// mapped, the mapping cache keeps the mapping.
+int ShmClient::openBuffer(const string& name) {
+    uint64_t id;
+    if (!parseMemfdHandle(name, id))
+        return shm_open(name.c_str(), O_RDWR, 0);
+
+    lock_guard<mutex> lock(mFdMutex);
+    size_t size;
+    int fd = -1;
+    // reconnect once in case the server was restarted
+    for (int attempt = 0; attempt < 2 && fd < 0; ++attempt) {
+        if (mFdSocket < 0)
+            mFdSocket = connectFdSocket(mFdSocketPath);
+        if (mFdSocket < 0) {
+            spdlog::error("failed to connect to fd socket: {}", mFdSocketPath);
+            return -1;
+        }
+
+        fd = requestBufferFd(mFdSocket, id, size);
+        if (fd < 0 && attempt == 0) {
+            close(mFdSocket);
+            mFdSocket = -1;
+        }
+    }
+
+    if (fd < 0)
+        spdlog::error("failed to receive descriptor for buffer: {}", name);
+    return fd;
+}
+
+void ShmClient::SetFdSocketPath(const string& path) {
+    lock_guard<mutex> lock(mFdMutex);
+    mFdSocketPath = path;
+    if (mFdSocket >= 0) {
+        close(mFdSocket);
+        mFdSocket = -1;
+    }
+}
+
+void* ShmClient::MapBuffer(const string& name, size_t size, uint64_t epoch, uint32_t pageFlags) {
+    string arena;
+    size_t offset, length;
+    if (parseArenaHandle(name, arena, offset, length)) {
+        char* base = (char*)mapArena(arena);
+        return base ? base + offset : nullptr;
+    }
+    if (!epoch)
+        epoch = mServerEpoch.load(memory_order_relaxed);
+    return mMapCache.map(name, size, epoch, pageFlags);
+}
+
+// The epoch only changes when the client talks to another run of the
+// server, whose buffer names may repeat the ones mapped before
+void ShmClient::sawEpoch(uint64_t epoch) {
+    if (epoch && mServerEpoch.load(memory_order_relaxed) != epoch) {
+        mServerEpoch.store(epoch, memory_order_relaxed);
+        spdlog::info("server epoch is now {}, mappings of other epochs are remapped", epoch);
+    }
+}
+
+void ShmClient::UnmapBuffer(const string& name) {
+    string arena;
+    size_t offset, length;
+    if (!parseArenaHandle(name, arena, offset, length))
+        mMapCache.unmap(name);
+}
+
+void ShmClient::SetMapCacheLimits(size_t maxEntries, size_t maxBytes) {
+    mMapCache.setLimits(maxEntries, maxBytes);
+}
+
+MapCacheStats ShmClient::GetMapCacheStats() {
+    return mMapCache.getStats();
+}
+
+ShmMapCache::ShmMapCache(size_t maxEntries, size_t maxBytes) :
+    mOpen([](const string& name) { return shm_open(name.c_str(), O_RDWR, 0); }),
+    mMaxEntries(maxEntries), mMaxBytes(maxBytes)
+{
+}
+
+ShmMapCache::~ShmMapCache() {
+    for (auto& entry : mLru)
+        munmap(entry.addr, entry.size);
+}
+
+// The whole segment is mapped (not just the requested size) so that the
+// mapping can be reused when the server recycles the segment for a larger
+// message of the same size class.
+void* ShmMapCache::map(const string& name, size_t size, uint64_t epoch, uint32_t pageFlags) {
+    vector<Entry> evicted;
+    void* addr = nullptr;
+    {
+        lock_guard<mutex> lock(mMutex);
+        auto it = mEntries.find(name);
+        if (it != mEntries.end() && !it->second->stale && it->second->size >= size &&
+                (!epoch || epoch == it->second->epoch)) {
+            mStats.hits++;
+            it->second->pins++;
+            mLru.splice(mLru.begin(), mLru, it->second);
+            return it->second->addr;
+        }
+
+        mStats.misses++;
+        if (it != mEntries.end()) {
+            // the cached mapping can't be reused, unmap it once it is unpinned
+            it->second->stale = true;
+            if (it->second->pins > 0) {
+                spdlog::error("mapping for {} is still in use", name);
+                return nullptr;
+            }
+            evicted.push_back(*it->second);
+            mLru.erase(it->second);
+            mEntries.erase(it);
+            mStats.mappedBytes -= evicted.back().size;
+        }
+
+        int fd = mOpen(name);
+        if (fd >= 0) {
+            struct stat st;
+            size_t mapSize = (fstat(fd, &st) == 0) ? std::max(size, (size_t)st.st_size) : size;
+            addr = mmap(NULL, mapSize, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+            close(fd);
+            if (addr == MAP_FAILED)
+                addr = nullptr;
+            else {
+                if (!applyPageFlags(addr, mapSize, pageFlags))
+                    spdlog::warn("failed to lock mapping of {}", name);
+                mLru.push_front({name, addr, mapSize, epoch, 1, false});
+                mEntries[name] = mLru.begin();
+                mStats.mappedBytes += mapSize;
+                evict(evicted);
+            }
+        }
+    }
+
+    for (auto& entry : evicted)
+        munmap(entry.addr, entry.size);
+    return addr;
+}
+
+void ShmMapCache::unmap(const string& name) {
+    vector<Entry> evicted;
+    {
+        lock_guard<mutex> lock(mMutex);
+        auto it = mEntries.find(name);
+        if (it == mEntries.end() || it->second->pins == 0)
+            return;
+
+        Entry& entry = *it->second;
+        if (--entry.pins == 0 && entry.stale) {
+            evicted.push_back(entry);
+            mStats.mappedBytes -= entry.size;
+            mLru.erase(it->second);
+            mEntries.erase(it);
+        } else {
+            // entries pinned while the cache was full can be evicted now
+            evict(evicted);
+        }
+    }
+
+    for (auto& entry : evicted)
+        munmap(entry.addr, entry.size);
+}
+
+void ShmMapCache::invalidate(const string& name) {
+    void* addr = nullptr;
+    size_t size = 0;
+    {
+        lock_guard<mutex> lock(mMutex);
+        auto it = mEntries.find(name);
+        if (it == mEntries.end())
+            return;
+
+        mStats.invalidations++;
+        Entry& entry = *it->second;
+        entry.stale = true;
+        if (entry.pins == 0) {
+            addr = entry.addr;
+            size = entry.size;
+            mStats.mappedBytes -= size;
+            mLru.erase(it->second);
+            mEntries.erase(it);
+        }
+    }
+
+    if (addr)
+        munmap(addr, size);
+}
+
+void ShmMapCache::setLimits(size_t maxEntries, size_t maxBytes) {
+    vector<Entry> evicted;
+    {
+        lock_guard<mutex> lock(mMutex);
+        mMaxEntries = maxEntries;
+        mMaxBytes = maxBytes;
+        evict(evicted);
+    }
+
+    for (auto& entry : evicted)
+        munmap(entry.addr, entry.size);
+}
+
+// Note: must be called before the cache is used
+void ShmMapCache::setOpen(function<int(const string&)> open) {
+    mOpen = open;
+}
+
+MapCacheStats ShmMapCache::getStats() {
+    lock_guard<mutex> lock(mMutex);
+    MapCacheStats stats = mStats;
+    stats.entries = mEntries.size();
+    return stats;
+}
+
+// Remove least recently used, unpinned entries until the cache is within its
+// limits. Evicted mappings are unmapped by the caller outside of the lock.
+void ShmMapCache::evict(vector<Entry>& evicted) {
+    auto it = mLru.end();
+    while ((mEntries.size() > mMaxEntries || mStats.mappedBytes > mMaxBytes) &&
+            it != mLru.begin()) {
+        --it;
+        if (it->pins > 0)
+            continue;
+
+        mStats.evictions++;
+        mStats.mappedBytes -= it->size;
+        evicted.push_back(*it);
+        mEntries.erase(it->name);
+        it = mLru.erase(it);
+    }
+}
+
+void* MapBuffer(const string& name, size_t size, uint32_t pageFlags) {
+    // arena buffers are mapped on their own, their offset is page aligned
+    string arena;
+    size_t offset = 0, length;
+    bool inArena = parseArenaHandle(name, arena, offset, length);
+
     int fd;
     void* addr = nullptr;
-    int result = shm_open(name.c_str(), O_RDWR, 0);
+    int result;
+    uint64_t id;
+    if (parseMemfdHandle(name, id)) {
+        size_t memfdSize;
+        int sock = connectFdSocket(FD_SOCKET_DEFAULT_PATH);
+        result = sock >= 0 ? requestBufferFd(sock, id, memfdSize) : -1;
+        if (sock >= 0)
+            close(sock);
+    } else
+        result = shm_open(inArena ? arena.c_str() : name.c_str(), O_RDWR, 0);
+
     if ( result > 0 ){
         fd = result;
-        addr = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+        addr = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, offset);
         close(fd);
+        if (addr != MAP_FAILED && !applyPageFlags(addr, size, pageFlags))
+            spdlog::warn("failed to lock mapping of {}", name);
     }
     return addr;
 }
@@ -1,8 +1,19 @@
 #pragma once
 
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <list>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <sys/types.h>
 #include <grpcpp/grpcpp.h>
 
+#include "flow_policy.h"
+#include "page_mode.h"
 #include "shm_server.grpc.pb.h"
 
 using grpc::Channel;
@@ -10,28 +21,274 @@ using std::string;
 
 using namespace std;
 
+struct MapCacheStats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+    uint64_t invalidations = 0;
+    size_t entries = 0;
+    size_t mappedBytes = 0;
+};
+
+// Keeps shm segments mapped after use so that recycled or repeatedly pulled
+// buffers are only mapped once. Entries that are in use (mapped but not yet
+// unmapped by the caller) are pinned and never evicted. A segment is known by
+// its name and the epoch of the server that named it, names are only reused
+// by another run of the server. A hit makes no syscall; a mapping made under
+// another epoch is a miss and the segment is mapped again.
+class ShmMapCache {
+private:
+    struct Entry {
+        string name;
+        void* addr;
+        size_t size;
+        uint64_t epoch;
+        unsigned int pins;
+        bool stale; // unmapped once the last pin is released
+    };
+
+    list<Entry> mLru; // most recently used at the front
+    function<int(const string&)> mOpen; // returns a descriptor for a segment
+    unordered_map<string, list<Entry>::iterator> mEntries;
+    size_t mMaxEntries;
+    size_t mMaxBytes;
+    MapCacheStats mStats;
+    mutex mMutex;
+
+    // Note: functions below are not thread safe
+    void evict(vector<Entry>& evicted);
+
+public:
+    ShmMapCache(size_t maxEntries=64, size_t maxBytes=size_t(512) << 20);
+    virtual ~ShmMapCache();
+
+    // An epoch of 0 is unknown and takes whatever mapping the name has
+    void* map(const string& name, size_t size, uint64_t epoch=0, uint32_t pageFlags=0);
+    void unmap(const string& name);
+    void invalidate(const string& name);
+    void setLimits(size_t maxEntries, size_t maxBytes);
+    void setOpen(function<int(const string&)> open);
+    MapCacheStats getStats();
+};
+
+// A message received from PullBatch or Stream
+struct StreamMessage {
+    string buffer_name;
+    string metadata;
+    uint64_t timestamp = 0;
+};
+
+struct PublishMessage {
+    string topic_name;
+    string buffer_name;
+    string metadata;
+    uint64_t timestamp = 0;
+    vector<string> parents; // buffers this one was derived from, for tracing
+};
+
+struct ShmClientRing;
+class ShmStream;
+
 class ShmClient {
 private:
     unique_ptr<Shm::Stub> mStub;
+    ShmMapCache mMapCache;
+
+    // Data plane descriptor rings. Publish and Pull use a ring instead of an
+    // RPC when one was requested in RegisterTopic or Subscribe.
+    unordered_map<string, unique_ptr<ShmClientRing>> mPublishRings; // by topic
+    unordered_map<string, unique_ptr<ShmClientRing>> mPullRings; // by topic and subscriber
+    mutex mRingMutex;
+
+    // Arenas are mapped on first use and stay mapped until the client is
+    // destroyed, resolving an arena buffer is then pointer arithmetic.
+    unordered_map<string, pair<void*, size_t>> mArenas;
+    mutex mArenaMutex;
+
+    // Connection to the server's fd socket, opened on the first memfd buffer
+    string mFdSocketPath;
+    int mFdSocket;
+    mutex mFdMutex;
+
+    // Handles returned by RegisterTopic (by topic) and Subscribe (by topic and
+    // subscriber). Publish and Pull send them instead of the names.
+    unordered_map<string, uint64_t> mTopicHandles;
+    unordered_map<string, uint64_t> mSubscriptions;
+    unordered_map<string, uint64_t> mSyncSubscriptions; // by subscriber
+    unordered_map<string, uint64_t> mGroupMembers; // by topic, group and member
+    mutex mHandleMutex;
+
+    // Buffers received from Stream, releasing them returns stream credit
+    unordered_multimap<string, pair<string, string>> mStreamBuffers;
+    // Buffers received from PullGroup by the topic, group and member, releasing
+    // them acknowledges them to the group
+    struct GroupBuffer {
+        string topic_name;
+        string group_name;
+        string member_name;
+    };
+    unordered_multimap<string, GroupBuffer> mGroupBuffers;
+    // Buffers pulled with a session, by the session that leased them
+    unordered_multimap<string, uint64_t> mSessionBuffers;
+    // Buffers received from Pull, PullBatch and PullSync, by the subscriber
+    // that pulled them, so the server's tracer can match their release
+    unordered_multimap<string, string> mPulledBuffers;
+    mutex mStreamMutex;
+
+    // Epoch of the server the last buffer names came from, see MapBuffer
+    atomic<uint64_t> mServerEpoch;
+
+    // Session opened by OpenSession and the thread renewing its lease
+    atomic<uint64_t> mSession;
+    thread mHeartbeat;
+    bool mHeartbeatStop;
+    mutex mSessionMutex;
+    condition_variable mSessionCV;
+
+    ShmClientRing* findRing(unordered_map<string, unique_ptr<ShmClientRing>>& rings, const string& key);
+    bool attachRing(unordered_map<string, unique_ptr<ShmClientRing>>& rings, const string& key, const string& ring_name);
+    uint64_t findHandle(unordered_map<string, uint64_t>& handles, const string& key);
+    void setHandle(unordered_map<string, uint64_t>& handles, const string& key, uint64_t handle);
+    void* mapArena(const string& arena);
+    int openBuffer(const string& name);
+    void leased(uint64_t session, const string& buffer_name);
+    void pulled(const string& subscriber_name, const string& buffer_name);
+    void heartbeat(uint64_t session, unsigned int leaseMs);
+    void sawEpoch(uint64_t epoch);
 
 public:
     ShmClient(shared_ptr<Channel> channel);
     ShmClient(const string& ip="localhost", const string& port="50051");
+    virtual ~ShmClient();
 
     int32_t CreateBuffer(string& name, int32_t size);
+    // topicName charges the buffer to the topic's shm budget right away. Returns -1 if the
+    // buffer couldn't be created, including when a budget has no room for it.
+    // epoch is the server's, see MapBuffer
+    int32_t CreateBuffer(string& name, int32_t size, uint64_t& epoch, uint32_t pageFlags=0,
+                         const string& topicName="");
     int32_t GetBuffer(const string& name, int32_t& size);
+    int32_t GetBuffer(const string& name, int32_t& size, uint64_t& epoch);
     int32_t ReleaseBuffer(const string& name);
-    int32_t RegisterTopic(const string& name, bool dropMsgs=true, bool wait=false);
+    int32_t GetArenaStats(vector<ArenaStats>& stats);
+    // Rates, queue depths, drops and pull latencies of every topic and the
+    // server's buffer usage
+    int32_t GetStats(StatsReply& stats);
+    // Per stage latencies and a Chrome trace JSON, see tracer.h. Both fail
+    // if tracing is not enabled on the server.
+    int32_t GetLatency(vector<LatencyStats>& stages);
+    int32_t GetTrace(string& trace);
+    int32_t RegisterTopic(const string& name, bool dropMsgs=true, bool wait=false, bool useRing=false);
+    // Fails the topic's pending pulls and publishes on the server, returns -1
+    // if the topic isn't registered
+    int32_t RemoveTopic(const string& name);
+    // With a descriptor ring (useRing) Publish returns 0 once the descriptor
+    // is queued in the ring. Whether the server then publishes the message is
+    // not reported, a message it can't publish is released by the server.
     int32_t Publish(const string& topic_name, const string& buffer_name, uint64_t timestamp);
-    int32_t Publish(const string& topic_name, const string& buffer_name, const string& metadata, uint64_t timestamp);
+    // parents are the pulled buffers this one was derived from, not released
+    // yet. The server links their traces when tracing is enabled.
+    int32_t Publish(const string& topic_name, const string& buffer_name, const string& metadata, uint64_t timestamp, const vector<string>& parents={});
+    int32_t PublishBatch(const vector<PublishMessage>& messages, vector<int32_t>* results=nullptr);
     int32_t GetSubscriberCount(const string& topic_name, unsigned int& num_subs);
-    int32_t Subscribe(const string& topic_name, const string& subscriber_name, unsigned int maxQueueSize=3, bool wait=false);
-    int32_t Subscribe(const string& topic_name, const string& subscriber_name, vector<string>& dependencies, unsigned int maxQueueSize=3, bool wait=false);
+    int32_t GetTopics(vector<TopicInfo>& topics);
+    int32_t Subscribe(const string& topic_name, const string& subscriber_name, unsigned int maxQueueSize=3, bool wait=false, bool useRing=false);
+    int32_t Subscribe(const string& topic_name, const string& subscriber_name, vector<string>& dependencies, unsigned int maxQueueSize=3, bool wait=false, bool useRing=false);
+    // flow sets the subscriber's flow control policy, see flow_policy.h
+    int32_t Subscribe(const string& topic_name, const string& subscriber_name, vector<string>& dependencies, const FlowControl& flow, unsigned int maxQueueSize=3, bool wait=false, bool useRing=false);
+    int32_t GrantCredits(const string& topic_name, const string& subscriber_name, unsigned int credits);
     int32_t Pull(const string& topic_name, const string& subscriber_name,
             string& buffer_name, uint64_t& timestamp, int timeout=-1);
     int32_t Pull(const string& topic_name, const string& subscriber_name,
             string& buffer_name, string& metadata, uint64_t& timestamp, int timeout=-1);
+    int32_t PullBatch(const string& topic_name, const string& subscriber_name,
+            vector<StreamMessage>& messages, unsigned int maxItems, int timeout=-1);
+    // Joins the topics by timestamp on the server. PullSync returns one
+    // message per topic, in the order of topic_names, with timestamps within
+    // tolerance of each other. With latest only the newest match is kept.
+    int32_t SubscribeSync(const vector<string>& topic_names, const string& subscriber_name,
+            uint64_t tolerance, bool latest=false, unsigned int maxQueueSize=3, bool wait=false);
+    int32_t PullSync(const string& subscriber_name, vector<StreamMessage>& messages, int timeout=-1);
+    // Competing consumers: each message of the topic goes to one member of
+    // the group, whichever has waited longest. A member that neither pulls
+    // nor releases for leaseMs loses its unreleased buffers to the others,
+    // 0 disables the lease. The first member sets maxQueueSize and leaseMs.
+    int32_t JoinGroup(const string& topic_name, const string& group_name, const string& member_name,
+            unsigned int maxQueueSize=3, unsigned int leaseMs=5000, bool wait=false);
+    int32_t PullGroup(const string& topic_name, const string& group_name, const string& member_name,
+            string& buffer_name, string& metadata, uint64_t& timestamp, int timeout=-1);
+    // Leases the buffers pulled from now on by Pull, PullBatch and PullSync
+    // to a session of this client, descriptor rings excepted. A thread renews
+    // the lease, if the process dies the server releases the buffers once
+    // the lease runs out. A leaseMs of 0 takes the server's default. Buffers
+    // of a session that expired anyway can't be released any more.
+    int32_t OpenSession(const string& clientName, unsigned int leaseMs=0);
+    // Releases the buffers still leased to the session, as does the destructor
+    int32_t CloseSession();
+    unique_ptr<ShmStream> Stream(const string& topic_name, const string& subscriber_name, unsigned int maxQueueSize=3);
+    unique_ptr<ShmStream> Stream(const string& topic_name, const string& subscriber_name, vector<string>& dependencies, unsigned int maxQueueSize=3);
+
+    // Cached alternatives to the free MapBuffer/UnmapBuffer functions. The
+    // mapping stays valid until UnmapBuffer is called for the same name.
+    // Buffers inside an arena resolve into the client's arena mapping.
+    // pageFlags (PAGES_* in page_mode.h) apply when the buffer is first mapped.
+    // A name is mapped once per server run: an epoch of 0 takes the epoch of
+    // the server's last reply, so names from a restarted server are remapped.
+    void* MapBuffer(const string& name, size_t size, uint64_t epoch=0, uint32_t pageFlags=0);
+    void UnmapBuffer(const string& name);
+    void SetMapCacheLimits(size_t maxEntries, size_t maxBytes);
+    MapCacheStats GetMapCacheStats();
+    // Must match the server's memfd socket if it isn't the default
+    void SetFdSocketPath(const string& path);
+
+    friend class ShmStream;
+};
+
+// Reader for the Stream RPC. Messages arrive as soon as they are published;
+// up to maxQueueSize of them may be held before ReleaseBuffer is called.
+// Buffers still held when the stream ends are released by the server and
+// must not be used after that.
+//   auto stream = client.Stream(topic, subscriber);
+//   for (auto& msg : *stream) {
+//       ...
+//       client.ReleaseBuffer(msg.buffer_name);
+//   }
+class ShmStream {
+private:
+    ShmClient* mClient;
+    string mTopic;
+    string mSubscriber;
+    grpc::ClientContext mContext;
+    unique_ptr<grpc::ClientReader<PullReply>> mReader;
+    StreamMessage mCurrent;
+    bool mDone;
+
+public:
+    class iterator {
+    private:
+        ShmStream* mStream;
+
+    public:
+        iterator(ShmStream* stream) : mStream(stream) {}
+        StreamMessage& operator*() { return mStream->mCurrent; }
+        StreamMessage* operator->() { return &mStream->mCurrent; }
+        iterator& operator++() {
+            if (!mStream->Next(mStream->mCurrent))
+                mStream = nullptr;
+            return *this;
+        }
+        bool operator!=(const iterator& other) const { return mStream != other.mStream; }
+    };
+
+    ShmStream(ShmClient* client, const SubscribeRequest& request);
+    virtual ~ShmStream();
+
+    bool Next(StreamMessage& msg);
+    void Cancel();
+    iterator begin();
+    iterator end() { return iterator(nullptr); }
 };
 
-void* MapBuffer(const string& handle, size_t size);
+// memfd buffers are requested from the default fd socket
+void* MapBuffer(const string& handle, size_t size, uint32_t pageFlags=0);
 void UnmapBuffer(void* memory, size_t size);
@@ -1,14 +1,80 @@
 import grpc
 import posix_ipc
 import mmap
+import os
+import socket
+import struct
 
 import sys
+import threading
 sys.path.append("../generated")
 
 import shm_server_pb2
 import shm_server_pb2_grpc
 
-def MapBuffer(bufferHandle):
+def ParseArenaHandle(bufferHandle):
+    """Split an arena buffer name "<arena>@<offset>+<length>" into its parts.
+    Returns None for standalone shm segments."""
+    arena, sep, location = bufferHandle.rpartition("@")
+    offset, plus, length = location.partition("+")
+    if not sep or not plus or not offset.isdigit() or not length.isdigit():
+        return None
+    return (arena, int(offset), int(length))
+
+# page options for CreateBuffer and MapBuffer, see server/page_mode.h
+PAGES_HUGE = 0x1
+PAGES_PREFAULT = 0x2
+PAGES_LOCK = 0x4 # honored by the server only, Python can't mlock a mapping
+
+# subscriber flow control policies for Subscribe, see server/flow_policy.h
+FLOW_QUEUE = 0
+FLOW_CREDIT = 1
+FLOW_LATEST = 2
+FLOW_MAX_AGE = 3
+
+FD_SOCKET_DEFAULT_PATH = "/tmp/tensor_bus_fd.sock"
+MEMFD_HANDLE_PREFIX = "memfd:"
+
+def ReceiveBufferFd(memfdId, socketPath=FD_SOCKET_DEFAULT_PATH):
+    """Ask the server's fd socket for the descriptor of a memfd buffer.
+    Returns (fd, size), see FdRequest/FdReply in server/fd_channel.h."""
+    with socket.socket(socket.AF_UNIX, socket.SOCK_STREAM) as sock:
+        sock.connect(socketPath)
+        sock.sendall(struct.pack("=Q", memfdId))
+        reply, fds, _, _ = socket.recv_fds(sock, struct.calcsize("=iIQ"), 1)
+    result, _, size = struct.unpack("=iIQ", reply)
+    if result != 0 or not fds:
+        raise OSError("no descriptor for memfd buffer %d" % memfdId)
+    return (fds[0], size)
+
+def ApplyPageFlags(mapfile, pageFlags):
+    if pageFlags & PAGES_HUGE and hasattr(mmap, "MADV_HUGEPAGE"):
+        mapfile.madvise(mmap.MADV_HUGEPAGE)
+    if pageFlags & PAGES_PREFAULT:
+        # read one byte per page, shmem allocates the page on a read fault
+        for offset in range(0, len(mapfile), mmap.PAGESIZE):
+            mapfile[offset]
+    return mapfile
+
+def MapBuffer(bufferHandle, pageFlags=0):
+    return ApplyPageFlags(MapSegment(bufferHandle), pageFlags)
+
+def MapSegment(bufferHandle):
+    if bufferHandle.startswith(MEMFD_HANDLE_PREFIX):
+        fd, size = ReceiveBufferFd(int(bufferHandle[len(MEMFD_HANDLE_PREFIX):]))
+        mapfile = mmap.mmap(fd, size)
+        os.close(fd)
+        return mapfile
+
+    handle = ParseArenaHandle(bufferHandle)
+    if handle is not None:
+        # arena buffers are mapped on their own, their offset is page aligned
+        arena, offset, length = handle
+        shm = posix_ipc.SharedMemory(arena)
+        mapfile = mmap.mmap(shm.fd, length, offset=offset)
+        shm.close_fd()
+        return mapfile
+
     shm = posix_ipc.SharedMemory(bufferHandle)
     mapfile = mmap.mmap(shm.fd, shm.size)
     shm.close_fd()
@@ -22,10 +88,32 @@ class ShmClient:
         addr = ip + ":" + port
         self.channel = grpc.insecure_channel(addr)
         self.stub = shm_server_pb2_grpc.ShmStub(self.channel)
+        self.stream_buffers = {} # buffers received from Stream
+        self.group_buffers = {} # buffers received from PullGroup
+        # handles from RegisterTopic (by topic) and Subscribe (by topic and
+        # subscriber), Publish and Pull send them instead of the names
+        self.topic_handles = {}
+        self.subscriptions = {}
+        self.sync_subscriptions = {} # by subscriber
+        self.group_members = {} # by topic, group and member
+        # session of OpenSession, its heartbeat thread and the buffers pulled
+        # with a session, by buffer name
+        self.session = 0
+        self.session_buffers = {}
+        self._heartbeat = None
+        self._heartbeat_stop = threading.Event()
 
-    def CreateBuffer(self, size):
-        request = shm_server_pb2.CreateBufferRequest(size=size)
-        response = self.stub.CreateBuffer(request)
+    def CreateBuffer(self, size, page_flags=0, topic_name=""):
+        # topic_name charges the buffer to the topic's shm budget right away,
+        # a buffer no budget has room for returns ("", -1)
+        request = shm_server_pb2.CreateBufferRequest(
+                size=size, page_flags=page_flags, topic_name=topic_name)
+        try:
+            response = self.stub.CreateBuffer(request)
+        except grpc.RpcError as e:
+            if e.code() != grpc.StatusCode.RESOURCE_EXHAUSTED:
+                raise
+            return ("", -1)
         return (response.name, response.result)
 
     def GetBuffer(self, name):
@@ -34,33 +122,118 @@ class ShmClient:
         return (response.size, response.result)
 
     def ReleaseBuffer(self, name):
-        request = shm_server_pb2.ReleaseBufferRequest(name=name)
+        # releasing a streamed buffer returns flow control credit to the stream,
+        # releasing a buffer pulled from a group acknowledges it
+        topic_name, subscriber_name = self.stream_buffers.pop(name, ("", ""))
+        request = shm_server_pb2.ReleaseBufferRequest(
+                name=name,
+                topic_name=topic_name,
+                subscriber_name=subscriber_name)
+        key = self.group_buffers.pop(name, None)
+        if key is not None:
+            request.group_member = self.group_members.get(key, 0)
+            if not request.group_member:
+                request.topic_name, request.group_name, request.subscriber_name = key
+        sessions = self.session_buffers.get(name)
+        if sessions:
+            request.session = sessions.pop()
+            if not sessions:
+                del self.session_buffers[name]
         response = self.stub.ReleaseBuffer(request)
         return response.result
 
+    def GetArenaStats(self):
+        response = self.stub.GetArenaStats(shm_server_pb2.Empty())
+        return (list(response.arenas), response.result)
+
+    def GetStats(self):
+        """Returns the StatsReply, with the stats of every topic's queues and
+        the server's buffer usage."""
+        return self.stub.GetStats(shm_server_pb2.Empty())
+
     def RegisterTopic(self, name, drop_msgs=True, wait=False):
         request = shm_server_pb2.RegisterTopicRequest(name=name, dropmsgs=drop_msgs)
         response = self.stub.RegisterTopic(request)
         while (wait and response.result == -1):
             response = self.stub.RegisterTopic(request)
 
+        if response.result == 0:
+            self.topic_handles[name] = response.topic_handle
         return response.result
 
-    def Publish(self, topic_name, buffer_name, metadata, timestamp):
+    def _CallWithHandle(self, rpc, request, handles, key, names):
+        """Send a request that carries a cached handle. If the server no
+        longer knows the handle it fails with NOT_FOUND, the request is then
+        sent again with the names."""
+        try:
+            return rpc(request)
+        except grpc.RpcError as e:
+            if e.code() != grpc.StatusCode.NOT_FOUND or key not in handles:
+                raise
+        del handles[key]
+        for field, value in names.items():
+            setattr(request, field, value)
+        return rpc(request)
+
+    def Publish(self, topic_name, buffer_name, metadata, timestamp, parents=None):
+        """parents are the pulled buffers this one was derived from, not
+        released yet. The server links their traces when tracing is
+        enabled."""
         request = shm_server_pb2.PublishRequest(
-                topic_name=topic_name,
+                topic_handle=self.topic_handles.get(topic_name, 0),
                 buffer_name=buffer_name,
                 metadata=metadata,
-                timestamp=timestamp)
-        response = self.stub.Publish(request)
+                timestamp=timestamp,
+                parent_buffers=parents or [])
+        if not request.topic_handle:
+            request.topic_name = topic_name
+        response = self._CallWithHandle(self.stub.Publish, request,
+                self.topic_handles, topic_name,
+                {"topic_handle": 0, "topic_name": topic_name})
         return response.result
 
+    def PublishBatch(self, messages):
+        """Publish (topic_name, buffer_name, metadata, timestamp) tuples with
+        a single RPC. Returns (result, results) where results holds the
+        result of each message."""
+        request = shm_server_pb2.PublishBatchRequest(entries=[
+                shm_server_pb2.PublishRequest(
+                    topic_name=topic_name,
+                    buffer_name=buffer_name,
+                    metadata=metadata,
+                    timestamp=timestamp)
+                for topic_name, buffer_name, metadata, timestamp in messages])
+        response = self.stub.PublishBatch(request)
+        return (response.result, list(response.results))
+
     def GetSubscriberCount(self, topic_name):
         request = shm_server_pb2.SubscriberCountRequest(topic_name=topic_name)
         response = self.stub.GetSubscriberCount(request)
         return (response.num_subs, response.result)
 
-    def Subscribe(self, topic_name, subscriber_name, depends=None, maxQueueSize=3, wait=False):
+    def GetLatency(self):
+        """Per stage latencies, result is -1 if tracing is not enabled on
+        the server."""
+        response = self.stub.GetLatency(shm_server_pb2.Empty())
+        return (list(response.stages), response.result)
+
+    def GetTrace(self, path=None):
+        """Returns the Chrome trace JSON of the recent messages and writes it
+        to path if given, for Perfetto or chrome://tracing."""
+        response = self.stub.GetTrace(shm_server_pb2.Empty())
+        if path and response.result == 0:
+            with open(path, "w") as f:
+                f.write(response.trace)
+        return (response.trace, response.result)
+
+    def GetTopics(self):
+        response = self.stub.GetTopics(shm_server_pb2.Empty())
+        return (list(response.topics), response.result)
+
+    def Subscribe(self, topic_name, subscriber_name, depends=None, maxQueueSize=3, wait=False,
+            flow_policy=FLOW_QUEUE, credits=0, max_age_ms=0):
+        """flow_policy is one of the FLOW_* policies. credits is the initial
+        credit of FLOW_CREDIT and max_age_ms the age limit of FLOW_MAX_AGE."""
         if depends is None:
             depends = []
 
@@ -68,14 +241,197 @@ class ShmClient:
                 topic_name=topic_name,
                 subscriber_name=subscriber_name,
                 maxqueuesize=maxQueueSize,
-                dependencies=depends)
+                dependencies=depends,
+                flow_policy=flow_policy,
+                flow_credits=credits,
+                flow_max_age_ms=max_age_ms)
         response = self.stub.Subscribe(request)
         while (wait and response.result == -1):
             response = self.stub.Subscribe(request)
 
+        if response.result == 0:
+            self.subscriptions[(topic_name, subscriber_name)] = response.subscription
+        return response.result
+
+    def _SetSubscription(self, request, topic_name, subscriber_name):
+        key = (topic_name, subscriber_name)
+        request.subscription = self.subscriptions.get(key, 0)
+        if not request.subscription:
+            request.topic_name = topic_name
+            request.subscriber_name = subscriber_name
+        return key
+
+    def GrantCredits(self, topic_name, subscriber_name, credits):
+        request = shm_server_pb2.GrantCreditsRequest(credits=credits)
+        key = self._SetSubscription(request, topic_name, subscriber_name)
+        response = self._CallWithHandle(self.stub.GrantCredits, request,
+                self.subscriptions, key,
+                {"subscription": 0, "topic_name": topic_name, "subscriber_name": subscriber_name})
         return response.result
 
     def Pull(self, topic_name, subscriber_name, timeout=-1):
-        request = shm_server_pb2.PullRequest(topic_name=topic_name, subscriber_name=subscriber_name, timeout=timeout)
-        response = self.stub.Pull(request)
+        request = shm_server_pb2.PullRequest(timeout=timeout, session=self.session)
+        key = self._SetSubscription(request, topic_name, subscriber_name)
+        response = self._CallWithHandle(self.stub.Pull, request,
+                self.subscriptions, key,
+                {"subscription": 0, "topic_name": topic_name, "subscriber_name": subscriber_name})
+        if response.result == 0:
+            self._Leased(request.session, [response.buffer_name])
         return (response.buffer_name, response.metadata, response.timestamp, response.result)
+
+    def PullBatch(self, topic_name, subscriber_name, max_items, timeout=-1):
+        """Wait up to timeout ms for the first message and return up to
+        max_items ready messages as a list of (buffer_name, metadata,
+        timestamp) tuples together with the result."""
+        request = shm_server_pb2.PullBatchRequest(
+                timeout=timeout,
+                max_items=max_items,
+                session=self.session)
+        key = self._SetSubscription(request, topic_name, subscriber_name)
+        response = self._CallWithHandle(self.stub.PullBatch, request,
+                self.subscriptions, key,
+                {"subscription": 0, "topic_name": topic_name, "subscriber_name": subscriber_name})
+        items = [(item.buffer_name, item.metadata, item.timestamp) for item in response.items]
+        self._Leased(request.session, [item[0] for item in items])
+        return (items, response.result)
+
+    def SubscribeSync(self, topic_names, subscriber_name, tolerance, latest=False, maxQueueSize=3, wait=False):
+        """Join the topics by timestamp on the server. Each PullSync returns
+        one message per topic with timestamps within tolerance of each
+        other. With latest set only the newest match is kept."""
+        request = shm_server_pb2.SubscribeSyncRequest(
+                subscriber_name=subscriber_name,
+                topic_names=topic_names,
+                tolerance=tolerance,
+                latest=latest,
+                maxqueuesize=maxQueueSize)
+        response = self.stub.SubscribeSync(request)
+        while (wait and response.result == -1):
+            response = self.stub.SubscribeSync(request)
+
+        if response.result == 0:
+            self.sync_subscriptions[subscriber_name] = response.subscription
+        return response.result
+
+    def PullSync(self, subscriber_name, timeout=-1):
+        """Wait up to timeout ms for the next match. Returns a list of
+        (buffer_name, metadata, timestamp) tuples, in the order of the topics
+        given to SubscribeSync, together with the result."""
+        request = shm_server_pb2.PullSyncRequest(
+                timeout=timeout,
+                subscription=self.sync_subscriptions.get(subscriber_name, 0),
+                session=self.session)
+        if not request.subscription:
+            request.subscriber_name = subscriber_name
+        response = self._CallWithHandle(self.stub.PullSync, request,
+                self.sync_subscriptions, subscriber_name,
+                {"subscription": 0, "subscriber_name": subscriber_name})
+        items = [(item.buffer_name, item.metadata, item.timestamp) for item in response.items]
+        self._Leased(request.session, [item[0] for item in items])
+        return (items, response.result)
+
+    def JoinGroup(self, topic_name, group_name, member_name, maxQueueSize=3, lease_ms=5000, wait=False):
+        """Join a group of competing consumers, each message of the topic goes
+        to one member. A member that neither pulls nor releases for lease_ms
+        loses its unreleased buffers to the others, 0 disables the lease. The
+        first member sets maxQueueSize and lease_ms."""
+        request = shm_server_pb2.JoinGroupRequest(
+                topic_name=topic_name,
+                group_name=group_name,
+                member_name=member_name,
+                maxqueuesize=maxQueueSize,
+                lease_ms=lease_ms)
+        response = self.stub.JoinGroup(request)
+        while (wait and response.result == -1):
+            response = self.stub.JoinGroup(request)
+
+        if response.result == 0:
+            self.group_members[(topic_name, group_name, member_name)] = response.subscription
+        return response.result
+
+    def PullGroup(self, topic_name, group_name, member_name, timeout=-1):
+        key = (topic_name, group_name, member_name)
+        request = shm_server_pb2.PullGroupRequest(
+                timeout=timeout,
+                member=self.group_members.get(key, 0))
+        if not request.member:
+            request.topic_name, request.group_name, request.member_name = key
+        response = self._CallWithHandle(self.stub.PullGroup, request,
+                self.group_members, key,
+                {"member": 0, "topic_name": topic_name, "group_name": group_name,
+                 "member_name": member_name})
+        if response.result == 0:
+            self.group_buffers[response.buffer_name] = key
+        return (response.buffer_name, response.metadata, response.timestamp, response.result)
+
+    def OpenSession(self, client_name, lease_ms=0):
+        """Lease the buffers pulled from now on by Pull, PullBatch and
+        PullSync to a session of this client. A thread renews the lease, if
+        the process dies the server releases the buffers once the lease runs
+        out. A lease_ms of 0 takes the server's default."""
+        if self.session:
+            self.CloseSession()
+        request = shm_server_pb2.OpenSessionRequest(
+                client_name=client_name,
+                lease_ms=lease_ms)
+        response = self.stub.OpenSession(request)
+        if response.result != 0:
+            return response.result
+
+        self.session = response.session
+        self._heartbeat_stop.clear()
+        self._heartbeat = threading.Thread(target=self._Heartbeat,
+                args=(response.session, response.lease_ms), daemon=True)
+        self._heartbeat.start()
+        return 0
+
+    def CloseSession(self):
+        """Release the buffers still leased to the session."""
+        session, self.session = self.session, 0
+        self._heartbeat_stop.set()
+        if self._heartbeat is not None:
+            self._heartbeat.join()
+            self._heartbeat = None
+        if not session:
+            return -1
+        for name in list(self.session_buffers):
+            sessions = [s for s in self.session_buffers[name] if s != session]
+            if sessions:
+                self.session_buffers[name] = sessions
+            else:
+                del self.session_buffers[name]
+        response = self.stub.CloseSession(shm_server_pb2.SessionRequest(session=session))
+        return response.result
+
+    def _Leased(self, session, buffer_names):
+        if session:
+            for name in buffer_names:
+                self.session_buffers.setdefault(name, []).append(session)
+
+    def _Heartbeat(self, session, lease_ms):
+        # three renewals per lease so that one late heartbeat doesn't expire it
+        interval = max(lease_ms / 3, 1) / 1000.0
+        while not self._heartbeat_stop.wait(interval):
+            try:
+                self.stub.Heartbeat(shm_server_pb2.SessionRequest(session=session))
+            except grpc.RpcError as e:
+                if e.code() == grpc.StatusCode.NOT_FOUND:
+                    print("session {} expired, its buffers were released by the server".format(session),
+                            file=sys.stderr)
+                    return
+
+    def Stream(self, topic_name, subscriber_name, depends=None, maxQueueSize=3):
+        """Subscribe and yield (buffer_name, metadata, timestamp, result) for
+        every message. At most maxQueueSize buffers may be held before they
+        are released with ReleaseBuffer."""
+        if depends is None:
+            depends = []
+
+        request = shm_server_pb2.SubscribeRequest(
+                topic_name=topic_name,
+                subscriber_name=subscriber_name,
+                maxqueuesize=maxQueueSize,
+                dependencies=depends)
+        for response in self.stub.Stream(request):
+            self.stream_buffers[response.buffer_name] = (topic_name, subscriber_name)
+            yield (response.buffer_name, response.metadata, response.timestamp, response.result)
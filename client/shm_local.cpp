@@ -0,0 +1,332 @@
+#include "shm_local.h"
+
+#include <chrono>
+#include <cstring>
+
+#include "spdlog/spdlog.h"
+
+ShmLocalBroker::ShmLocalBroker(ShmClient* bridge, size_t maxPooledBytes) :
+    mBridge(bridge), mMaxPooledBytes(maxPooledBytes), mPooledBytes(0), mNameCount(0),
+    mAllocations(0), mPublished(0), mBridged(0) {}
+
+// Items still queued or pulled free their buffers as they are destroyed, so
+// the topics go before the buffer map
+ShmLocalBroker::~ShmLocalBroker() {
+    vector<shared_ptr<LocalTopic>> topics;
+    {
+        unique_lock<shared_mutex> lock(mTopicMutex);
+        for (auto& it : mTopics)
+            topics.push_back(it.second);
+        mSubscriptions.clear();
+        mTopics.clear();
+    }
+    for (auto& topic : topics)
+        topic->topic->close();
+
+    unordered_multimap<string, TopicQueueItem> pulled;
+    {
+        lock_guard<mutex> lock(mBufferMutex);
+        pulled.swap(mPulled);
+    }
+    pulled.clear();
+    topics.clear();
+}
+
+shared_ptr<ShmLocalBroker::LocalTopic> ShmLocalBroker::findTopic(const string& topic_name) {
+    shared_lock<shared_mutex> lock(mTopicMutex);
+    auto it = mTopics.find(topic_name);
+    return it == mTopics.end() ? nullptr : it->second;
+}
+
+bool ShmLocalBroker::findSubscription(const string& topic_name, const string& subscriber_name, LocalSubscription& sub) {
+    shared_lock<shared_mutex> lock(mTopicMutex);
+    auto it = mSubscriptions.find(topic_name + "/" + subscriber_name);
+    if (it == mSubscriptions.end())
+        return false;
+    sub = it->second;
+    return true;
+}
+
+// The item owns the buffer once published. It is destroyed when no queue
+// holds it and every subscriber that pulled it has released it, possibly
+// under a queue lock, so freeBuffer must not call into the topics.
+TopicQueueItem ShmLocalBroker::makeItem(const string& buffer_name, const string& metadata, uint64_t timestamp) {
+    return TopicQueueItem(new TopicMessage(buffer_name, metadata, timestamp),
+            [this](const TopicMessage* msg) {
+                freeBuffer(msg->buffer_name);
+                delete msg;
+            });
+}
+
+void ShmLocalBroker::freeBuffer(const string& name) {
+    lock_guard<mutex> lock(mBufferMutex);
+    auto it = mBuffers.find(name);
+    if (it == mBuffers.end())
+        return;
+    if (mPooledBytes + it->second.capacity <= mMaxPooledBytes) {
+        mPooledBytes += it->second.capacity;
+        mPool.emplace(it->second.capacity, std::move(it->second.data));
+    }
+    mBuffers.erase(it);
+}
+
+// A pooled block is reused if it is less than twice the requested size
+int32_t ShmLocalBroker::CreateBuffer(string& name, int32_t size) {
+    if (size < 0) {
+        spdlog::error("CreateBuffer() invalid size: {}", size);
+        return -1;
+    }
+    Block block;
+    block.size = size;
+    block.published = false;
+    lock_guard<mutex> lock(mBufferMutex);
+    auto pooled = mPool.lower_bound(size);
+    if (pooled != mPool.end() && pooled->first / 2 <= (size_t)size) {
+        block.capacity = pooled->first;
+        block.data = std::move(pooled->second);
+        mPooledBytes -= pooled->first;
+        mPool.erase(pooled);
+    } else {
+        block.capacity = max<size_t>(size, 1);
+        block.data.reset(new char[block.capacity]);
+        mAllocations++;
+    }
+    name = "local_" + to_string(++mNameCount);
+    mBuffers.emplace(name, std::move(block));
+    return 0;
+}
+
+int32_t ShmLocalBroker::GetBuffer(const string& name, int32_t& size) {
+    lock_guard<mutex> lock(mBufferMutex);
+    auto it = mBuffers.find(name);
+    if (it == mBuffers.end())
+        return -1;
+    size = it->second.size;
+    return 0;
+}
+
+void* ShmLocalBroker::MapBuffer(const string& name) {
+    lock_guard<mutex> lock(mBufferMutex);
+    auto it = mBuffers.find(name);
+    return it == mBuffers.end() ? nullptr : it->second.data.get();
+}
+
+// Subscribers release the buffers they pulled, publishers only those they
+// haven't published
+int32_t ShmLocalBroker::ReleaseBuffer(const string& name) {
+    TopicQueueItem item;
+    {
+        lock_guard<mutex> lock(mBufferMutex);
+        auto pulled = mPulled.find(name);
+        if (pulled != mPulled.end()) {
+            item = std::move(pulled->second);
+            mPulled.erase(pulled);
+        } else {
+            auto it = mBuffers.find(name);
+            if (it == mBuffers.end() || it->second.published) {
+                spdlog::error("ReleaseBuffer() buffer: {} is not held", name);
+                return -1;
+            }
+            it->second.published = true; // freed below
+        }
+    }
+    // the last reference frees the buffer, outside of mBufferMutex
+    if (!item)
+        freeBuffer(name);
+    return 0;
+}
+
+int32_t ShmLocalBroker::RegisterTopic(const string& name, bool dropMsgs, bool bridge) {
+    if (bridge && !mBridge) {
+        spdlog::error("RegisterTopic() topic: {} can't be bridged without a ShmClient", name);
+        return -1;
+    }
+    if (bridge && mBridge->RegisterTopic(name, dropMsgs) < 0)
+        return -1;
+
+    unique_lock<shared_mutex> lock(mTopicMutex);
+    shared_ptr<LocalTopic>& topic = mTopics[name];
+    if (!topic) {
+        topic = make_shared<LocalTopic>();
+        topic->topic = make_shared<Topic>(name, dropMsgs);
+        mTopicCV.notify_all();
+    }
+    if (bridge)
+        topic->bridged = true;
+    return 0;
+}
+
+int32_t ShmLocalBroker::Publish(const string& topic_name, const string& buffer_name, uint64_t timestamp) {
+    return Publish(topic_name, buffer_name, "", timestamp);
+}
+
+int32_t ShmLocalBroker::Publish(const string& topic_name, const string& buffer_name, const string& metadata, uint64_t timestamp) {
+    {
+        lock_guard<mutex> lock(mBufferMutex);
+        auto it = mBuffers.find(buffer_name);
+        if (it == mBuffers.end() || it->second.published) {
+            spdlog::error("Publish() buffer: {} can't be published", buffer_name);
+            return -1;
+        }
+        it->second.published = true;
+    }
+    // from here on the buffer is freed with the item
+    TopicQueueItem item = makeItem(buffer_name, metadata, timestamp);
+    shared_ptr<LocalTopic> topic = findTopic(topic_name);
+    if (!topic) {
+        spdlog::error("topic:{} has not been registered", topic_name);
+        return -1;
+    }
+
+    bool posted = topic->topic->size() > 0;
+    if (posted)
+        topic->topic->post(item);
+    if (topic->bridged && bridge(*topic, item))
+        posted = true;
+    if (!posted) {
+        spdlog::warn("topic:{} registered but no subscribers", topic_name);
+        return -1;
+    }
+    mPublished++;
+    return 0;
+}
+
+// Copies the message into a server buffer and publishes it on the server,
+// unless the server topic had no subscribers when last checked
+bool ShmLocalBroker::bridge(LocalTopic& topic, const TopicQueueItem& item) {
+    const string& topic_name = topic.topic->getName();
+    int64_t now = chrono::duration_cast<chrono::milliseconds>(
+            chrono::steady_clock::now().time_since_epoch()).count();
+    if (topic.remoteCheckedMs < 0 || now - topic.remoteCheckedMs >= BRIDGE_REFRESH_MS) {
+        unsigned int num_subs = 0;
+        if (mBridge->GetSubscriberCount(topic_name, num_subs) == 0)
+            topic.remoteSubscribers = num_subs;
+        topic.remoteCheckedMs = now;
+    }
+    if (topic.remoteSubscribers == 0)
+        return false;
+
+    // the item keeps the block alive
+    const char* data;
+    size_t size;
+    {
+        lock_guard<mutex> lock(mBufferMutex);
+        auto it = mBuffers.find(item->buffer_name);
+        if (it == mBuffers.end())
+            return false;
+        data = it->second.data.get();
+        size = it->second.size;
+    }
+
+    string remote_name;
+    if (mBridge->CreateBuffer(remote_name, size) < 0 || remote_name.empty())
+        return false;
+    void* remote = mBridge->MapBuffer(remote_name, size);
+    if (!remote) {
+        spdlog::error("failed to map buffer: {} to bridge topic: {}", remote_name, topic_name);
+        mBridge->ReleaseBuffer(remote_name);
+        return false;
+    }
+    memcpy(remote, data, size);
+    mBridge->UnmapBuffer(remote_name);
+    // the server releases the buffer if the publish fails
+    if (mBridge->Publish(topic_name, remote_name, item->metadata, item->timestamp) < 0)
+        return false;
+    mBridged++;
+    return true;
+}
+
+int32_t ShmLocalBroker::GetSubscriberCount(const string& topic_name, unsigned int& num_subs) {
+    shared_ptr<LocalTopic> topic = findTopic(topic_name);
+    if (!topic)
+        return -1;
+    num_subs = topic->topic->size();
+    return 0;
+}
+
+int32_t ShmLocalBroker::Subscribe(const string& topic_name, const string& subscriber_name, unsigned int maxQueueSize, bool wait) {
+    vector<string> dependencies;
+    return Subscribe(topic_name, subscriber_name, dependencies, FlowControl(), maxQueueSize, wait);
+}
+
+int32_t ShmLocalBroker::Subscribe(const string& topic_name, const string& subscriber_name, vector<string>& dependencies, unsigned int maxQueueSize, bool wait) {
+    return Subscribe(topic_name, subscriber_name, dependencies, FlowControl(), maxQueueSize, wait);
+}
+
+int32_t ShmLocalBroker::Subscribe(const string& topic_name, const string& subscriber_name, vector<string>& dependencies, const FlowControl& flow, unsigned int maxQueueSize, bool wait) {
+    shared_ptr<LocalTopic> topic;
+    {
+        unique_lock<shared_mutex> lock(mTopicMutex);
+        while (true) {
+            auto it = mTopics.find(topic_name);
+            if (it != mTopics.end()) {
+                topic = it->second;
+                break;
+            }
+            if (!wait) {
+                spdlog::error("topic:{} has not been registered", topic_name);
+                return -1;
+            }
+            mTopicCV.wait(lock);
+        }
+    }
+
+    string name = subscriber_name;
+    if (!topic->topic->subscribe(name, dependencies, maxQueueSize, flow))
+        return -1;
+    shared_ptr<TopicQueue> queue = topic->topic->queue(subscriber_name);
+    unsigned int slot = queue ? queue->slot(subscriber_name) : NO_SLOT;
+    if (slot == NO_SLOT)
+        return -1;
+
+    unique_lock<shared_mutex> lock(mTopicMutex);
+    mSubscriptions[topic_name + "/" + subscriber_name] = LocalSubscription{queue, slot};
+    return 0;
+}
+
+int32_t ShmLocalBroker::GrantCredits(const string& topic_name, const string& subscriber_name, unsigned int credits) {
+    LocalSubscription sub;
+    if (!findSubscription(topic_name, subscriber_name, sub))
+        return -1;
+    sub.queue->grant_credits(credits);
+    return 0;
+}
+
+int32_t ShmLocalBroker::Pull(const string& topic_name, const string& subscriber_name,
+        string& buffer_name, uint64_t& timestamp, int timeout) {
+    string metadata;
+    return Pull(topic_name, subscriber_name, buffer_name, metadata, timestamp, timeout);
+}
+
+int32_t ShmLocalBroker::Pull(const string& topic_name, const string& subscriber_name,
+        string& buffer_name, string& metadata, uint64_t& timestamp, int timeout) {
+    LocalSubscription sub;
+    if (!findSubscription(topic_name, subscriber_name, sub)) {
+        spdlog::error("Pull() subscriber: {} is not subscribed to topic: {}", subscriber_name, topic_name);
+        return -1;
+    }
+    sub.queue->clear_old();
+    TopicQueueItem item;
+    if (!sub.queue->pull(sub.slot, item, timeout))
+        return -1;
+
+    buffer_name = item->buffer_name;
+    metadata = item->metadata;
+    timestamp = item->timestamp;
+    lock_guard<mutex> lock(mBufferMutex);
+    mPulled.emplace(buffer_name, std::move(item));
+    return 0;
+}
+
+LocalBrokerStats ShmLocalBroker::GetStats() {
+    LocalBrokerStats stats;
+    stats.published = mPublished;
+    stats.bridged = mBridged;
+    lock_guard<mutex> lock(mBufferMutex);
+    stats.allocations = mAllocations;
+    stats.liveBuffers = mBuffers.size();
+    for (auto& it : mBuffers)
+        stats.liveBytes += it.second.capacity;
+    stats.pooledBytes = mPooledBytes;
+    return stats;
+}
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "shm_client.h"
+#include "topic_queue.h"
+
+using namespace std;
+
+struct LocalBrokerStats {
+    uint64_t published = 0;
+    uint64_t bridged = 0; // messages copied to the external server
+    uint64_t allocations = 0; // blocks that couldn't be taken from the pool
+    size_t liveBuffers = 0;
+    size_t liveBytes = 0;
+    size_t pooledBytes = 0;
+};
+
+// An embedded broker for pipeline stages that are threads of one process.
+// Topics run on the same Topic engine as shm_server, inside the process, and
+// buffers are heap blocks handed to the subscribers by pointer: publishing
+// and pulling make no RPC and map no segment. The API follows ShmClient,
+// MapBuffer returns the block itself.
+//
+// A topic registered with bridge set is also registered on the external
+// server through the ShmClient given to the broker. While the server topic
+// has subscribers, every message is copied once into a server buffer and
+// published there, for subscribers in other processes. Local subscribers
+// never see the copy. Messages published on the server by other processes
+// are not forwarded to local subscribers.
+//
+// A buffer is freed once it has been released by every subscriber that
+// pulled it and dropped or pulled by every other one. Freed blocks are kept
+// for reuse up to maxPooledBytes.
+class ShmLocalBroker {
+private:
+    struct Block {
+        unique_ptr<char[]> data;
+        size_t size;
+        size_t capacity;
+        bool published;
+    };
+
+    struct LocalTopic {
+        shared_ptr<Topic> topic;
+        atomic<bool> bridged{false};
+        // server subscribers, refreshed every BRIDGE_REFRESH_MS
+        atomic<unsigned int> remoteSubscribers{0};
+        atomic<int64_t> remoteCheckedMs{-1};
+    };
+
+    struct LocalSubscription {
+        shared_ptr<TopicQueue> queue;
+        unsigned int slot;
+    };
+
+    static const int64_t BRIDGE_REFRESH_MS = 100;
+
+    ShmClient* mBridge;
+    size_t mMaxPooledBytes;
+
+    unordered_map<string, shared_ptr<LocalTopic>> mTopics;
+    unordered_map<string, LocalSubscription> mSubscriptions; // by topic and subscriber
+    shared_mutex mTopicMutex;
+    condition_variable_any mTopicCV;
+
+    unordered_map<string, Block> mBuffers;
+    unordered_multimap<string, TopicQueueItem> mPulled; // held until released
+    multimap<size_t, unique_ptr<char[]>> mPool; // by capacity
+    size_t mPooledBytes;
+    uint64_t mNameCount;
+    uint64_t mAllocations;
+    mutex mBufferMutex;
+
+    atomic<uint64_t> mPublished;
+    atomic<uint64_t> mBridged;
+
+    shared_ptr<LocalTopic> findTopic(const string& topic_name);
+    bool bridge(LocalTopic& topic, const TopicQueueItem& item);
+    bool findSubscription(const string& topic_name, const string& subscriber_name, LocalSubscription& sub);
+    TopicQueueItem makeItem(const string& buffer_name, const string& metadata, uint64_t timestamp);
+    void freeBuffer(const string& name);
+
+public:
+    ShmLocalBroker(ShmClient* bridge=nullptr, size_t maxPooledBytes=size_t(256) << 20);
+    virtual ~ShmLocalBroker();
+
+    int32_t CreateBuffer(string& name, int32_t size);
+    int32_t GetBuffer(const string& name, int32_t& size);
+    // Valid until the buffer is released by the caller
+    void* MapBuffer(const string& name);
+    int32_t ReleaseBuffer(const string& name);
+    // bridge requires the ShmClient given to the constructor
+    int32_t RegisterTopic(const string& name, bool dropMsgs=true, bool bridge=false);
+    int32_t Publish(const string& topic_name, const string& buffer_name, uint64_t timestamp);
+    int32_t Publish(const string& topic_name, const string& buffer_name, const string& metadata, uint64_t timestamp);
+    // Local subscribers only
+    int32_t GetSubscriberCount(const string& topic_name, unsigned int& num_subs);
+    int32_t Subscribe(const string& topic_name, const string& subscriber_name, unsigned int maxQueueSize=3, bool wait=false);
+    int32_t Subscribe(const string& topic_name, const string& subscriber_name, vector<string>& dependencies, unsigned int maxQueueSize=3, bool wait=false);
+    // flow sets the subscriber's flow control policy, see flow_policy.h
+    int32_t Subscribe(const string& topic_name, const string& subscriber_name, vector<string>& dependencies, const FlowControl& flow, unsigned int maxQueueSize=3, bool wait=false);
+    int32_t GrantCredits(const string& topic_name, const string& subscriber_name, unsigned int credits);
+    int32_t Pull(const string& topic_name, const string& subscriber_name,
+            string& buffer_name, uint64_t& timestamp, int timeout=-1);
+    int32_t Pull(const string& topic_name, const string& subscriber_name,
+            string& buffer_name, string& metadata, uint64_t& timestamp, int timeout=-1);
+    LocalBrokerStats GetStats();
+};
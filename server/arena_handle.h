@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstdlib>
+#include <string>
+
+using namespace std;
+
+// Buffers carved out of a shared memory arena are named
+// "<arena>@<offset>+<length>". The name alone locates the buffer, so a client
+// that receives it from Pull can address the buffer inside its mapping of the
+// arena without asking the server. Offsets are page aligned. This header is
+// shared by the server and the C++ client.
+
+inline string makeArenaHandle(const string &arena, size_t offset,
+                              size_t length) {
+  return arena + "@" + to_string(offset) + "+" + to_string(length);
+}
+
+// Returns false for names of standalone shm segments
+inline bool parseArenaHandle(const string &name, string &arena, size_t &offset,
+                             size_t &length) {
+  size_t at = name.rfind('@');
+  size_t plus = name.rfind('+');
+  if (at == string::npos || plus == string::npos || plus < at)
+    return false;
+
+  char *end;
+  offset = strtoull(name.c_str() + at + 1, &end, 10);
+  if (end != name.c_str() + plus)
+    return false;
+  length = strtoull(name.c_str() + plus + 1, &end, 10);
+  if (*end != '\0')
+    return false;
+
+  arena = name.substr(0, at);
+  return true;
+}
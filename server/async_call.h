@@ -0,0 +1,102 @@
+#pragma once
+
+#include <functional>
+#include <grpcpp/grpcpp.h>
+
+#include <shm_server.grpc.pb.h>
+
+#include "blocking_pool.h"
+#include "flow_policy.h"
+
+using namespace std;
+using grpc::ServerAsyncResponseWriter;
+using grpc::ServerCompletionQueue;
+using grpc::ServerContext;
+using grpc::Status;
+
+// Flow control requested by Subscribe and Stream, unknown policies fall back
+// to FLOW_QUEUE
+inline FlowControl flowControl(const SubscribeRequest &request) {
+  FlowControl flow;
+  if (request.flow_policy() <= FLOW_MAX_AGE)
+    flow.policy = request.flow_policy();
+  flow.credits = request.flow_credits();
+  flow.max_age_ms = request.flow_max_age_ms();
+  return flow;
+}
+
+// State machines that drive the RPCs of the asynchronous Shm service. Every
+// tag placed on a completion queue is a CallEvent owned by its call, so a
+// worker only needs to forward the event to the call.
+class AsyncCall;
+
+struct CallEvent {
+  AsyncCall *call;
+  int type;
+};
+
+class AsyncCall {
+public:
+  virtual ~AsyncCall() {}
+  virtual void proceed(int event, bool ok) = 0;
+};
+
+// A unary RPC that is handled to completion on the worker thread that
+// received it, or on the BlockingPool if mayBlock says the request may wait
+// on other clients. The next request of the same method is armed before the
+// handler runs. The handler gets the request the call owns and may consume
+// it, nothing reads it once the handler returns.
+template <typename REQUEST_T, typename REPLY_T>
+class UnaryCall : public AsyncCall {
+public:
+  typedef void (Shm::AsyncService::*RequestFn)(
+      ServerContext *, REQUEST_T *, ServerAsyncResponseWriter<REPLY_T> *,
+      grpc::CompletionQueue *, ServerCompletionQueue *, void *);
+  typedef function<Status(ServerContext *, REQUEST_T *, REPLY_T *)> HandlerFn;
+  typedef function<bool(const REQUEST_T &)> MayBlockFn;
+
+private:
+  enum { REQUEST, FINISH };
+
+  Shm::AsyncService *mService;
+  ServerCompletionQueue *mCQ;
+  RequestFn mRequestFn;
+  HandlerFn mHandler;
+  MayBlockFn mMayBlock;
+  ServerContext mContext;
+  REQUEST_T mRequest;
+  REPLY_T mReply;
+  ServerAsyncResponseWriter<REPLY_T> mResponder;
+  CallEvent mRequestEvent;
+  CallEvent mFinishEvent;
+
+public:
+  UnaryCall(Shm::AsyncService *service, ServerCompletionQueue *cq,
+            RequestFn requestFn, HandlerFn handler,
+            MayBlockFn mayBlock = nullptr)
+      : mService(service), mCQ(cq), mRequestFn(requestFn), mHandler(handler),
+        mMayBlock(mayBlock), mResponder(&mContext),
+        mRequestEvent{this, REQUEST}, mFinishEvent{this, FINISH} {
+    (mService->*mRequestFn)(&mContext, &mRequest, &mResponder, mCQ, mCQ,
+                            &mRequestEvent);
+  }
+
+  void handle() {
+    Status status = mHandler(&mContext, &mRequest, &mReply);
+    mResponder.Finish(mReply, status, &mFinishEvent);
+  }
+
+  void proceed(int event, bool ok) override {
+    if (event == REQUEST && ok) {
+      new UnaryCall(mService, mCQ, mRequestFn, mHandler, mMayBlock);
+      if (mMayBlock && mMayBlock(mRequest))
+        BlockingPool::getInstance()->run([this]() { handle(); });
+      else
+        handle();
+      return;
+    }
+
+    // the call is finished or the server is shutting down
+    delete this;
+  }
+};
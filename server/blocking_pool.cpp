@@ -0,0 +1,48 @@
+#include "blocking_pool.h"
+
+#include <algorithm>
+
+BlockingPool *BlockingPool::instance = nullptr;
+
+void BlockingPool::configure(unsigned int idleTimeoutMs) {
+  lock_guard<mutex> lock(mMutex);
+  mIdleTimeout = chrono::milliseconds(max(idleTimeoutMs, 1u));
+}
+
+void BlockingPool::run(function<void()> task) {
+  lock_guard<mutex> lock(mMutex);
+  mTasks.push_back(std::move(task));
+  if (mTasks.size() <= mIdle) {
+    mCV.notify_one();
+    return;
+  }
+  mThreads++;
+  thread(&BlockingPool::work, this).detach();
+}
+
+unsigned int BlockingPool::threads() {
+  lock_guard<mutex> lock(mMutex);
+  return mThreads;
+}
+
+void BlockingPool::work() {
+  unique_lock<mutex> lock(mMutex);
+  while (true) {
+    if (mTasks.empty()) {
+      mIdle++;
+      bool woken = mCV.wait_for(lock, mIdleTimeout,
+                                [this]() { return !mTasks.empty(); });
+      mIdle--;
+      if (!woken) {
+        mThreads--;
+        return;
+      }
+    }
+
+    function<void()> task = std::move(mTasks.front());
+    mTasks.pop_front();
+    lock.unlock();
+    task();
+    lock.lock();
+  }
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+using namespace std;
+
+// Runs the RPC handlers that may wait on other clients, such as a Publish to
+// a topic that doesn't drop messages or a Subscribe waiting for the
+// subscriber it depends on. They would otherwise hold one of the completion
+// queue workers, and enough of them hold every worker, including the ones
+// that would serve the pulls they wait for. A blocked task keeps its
+// thread, so a thread is started whenever more tasks are queued than
+// threads are idle. Threads idle for longer than mIdleTimeout exit.
+class BlockingPool {
+private:
+  static BlockingPool *instance;
+  mutex mMutex;
+  condition_variable mCV;
+  deque<function<void()>> mTasks;
+  unsigned int mIdle;    // threads waiting for a task
+  unsigned int mThreads; // threads started and not exited
+  chrono::milliseconds mIdleTimeout;
+
+  BlockingPool() : mIdle(0), mThreads(0), mIdleTimeout(10000) {}
+
+  void work();
+
+public:
+  static BlockingPool *getInstance() {
+    if (!instance)
+      instance = new BlockingPool();
+    return instance;
+  }
+
+  void configure(unsigned int idleTimeoutMs);
+  void run(function<void()> task);
+  unsigned int threads();
+
+  ~BlockingPool() { delete instance; }
+};
@@ -0,0 +1,362 @@
+#include "consumer_group.h"
+#include "shm_manager.h"
+#include "spdlog/spdlog.h"
+
+#include <algorithm>
+
+GroupManager *GroupManager::instance = nullptr;
+
+ConsumerGroup::ConsumerGroup(const string &topic, const string &name,
+                             unsigned int maxQueueSize, unsigned int leaseMs)
+    : mTopic(topic), mName(name), mMaxQueueSize(maxQueueSize),
+      mLease(leaseMs), mWaiterParked(false), mClosed(false) {}
+
+// The waiter only holds a weak reference, a group that was replaced after it
+// closed is not kept alive by the queue.
+bool ConsumerGroup::start() {
+  TopicManager *tm = TopicManager::getInstance();
+  vector<string> dependencies;
+  uint64_t handle;
+  SubscriptionPtr sub;
+  if (tm->subscribe(mTopic, memberName(), dependencies, mMaxQueueSize,
+                    &handle))
+    sub = tm->findSubscription(handle);
+  if (!sub) {
+    spdlog::error("group:{} failed to subscribe to topic:{}", mName, mTopic);
+    return false;
+  }
+
+  PullWaiterPtr waiter = make_shared<PullWaiter>();
+  waiter->subscriber_name = memberName();
+  waiter->slot = sub->slot;
+  weak_ptr<ConsumerGroup> self = shared_from_this();
+  waiter->callback = [self](vector<TopicQueueItem> &items) {
+    if (ConsumerGroupPtr group = self.lock())
+      group->on_items(items);
+    else
+      for (auto &item : items)
+        ShmManager::getInstance()->release(item->buffer_name);
+  };
+
+  lock_guard<mutex> lock(mMutex);
+  mSub = sub;
+  mWaiter = waiter;
+  return true;
+}
+
+// Hand the unreleased items of members whose lease ran out to the front of
+// the group. Members with a parked pull are alive.
+void ConsumerGroup::expire() {
+  if (mLease.count() == 0)
+    return;
+  auto now = chrono::steady_clock::now();
+  for (auto &it : mMembers) {
+    Member &m = it.second;
+    if (m.waiting > 0 || m.inFlight.empty() || now < m.deadline)
+      continue;
+    spdlog::warn("member:{} of group:{} timed out, reassigning {} items",
+                 it.first, mName, m.inFlight.size());
+    mPending.insert(mPending.begin(), m.inFlight.begin(), m.inFlight.end());
+    m.inFlight.clear();
+  }
+}
+
+// Give waiting members one item each, oldest waiter first. Items are taken
+// from the topic one at a time, the group's waiter is parked on the topic
+// once it has nothing for them. Closes the group if the topic was removed.
+void ConsumerGroup::serve(ReadyWaiters &ready, vector<string> &dropped) {
+  expire();
+  vector<TopicQueueItem> items;
+  while (!mWaiters.empty() && !mClosed) {
+    if (mPending.empty()) {
+      if (mWaiterParked)
+        return;
+      mSub->queue->clear_old();
+      items.clear();
+      if (!mSub->queue->pull_async(mWaiter, items)) {
+        close_locked(ready, dropped);
+        return;
+      }
+      if (items.empty()) {
+        mWaiterParked = true;
+        return;
+      }
+      mPending.push_back(std::move(items.front()));
+    }
+
+    Member &m = mMembers[mWaiters.front().first];
+    m.waiting--;
+    m.inFlight.push_back(mPending.front());
+    ready.emplace_back(std::move(mWaiters.front().second),
+                       vector<TopicQueueItem>{std::move(mPending.front())});
+    mWaiters.pop_front();
+    mPending.pop_front();
+  }
+}
+
+// Parked pulls complete without data and the items the group holds are
+// released. Items held by members stay theirs to release.
+void ConsumerGroup::close_locked(ReadyWaiters &ready,
+                                 vector<string> &dropped) {
+  if (mClosed)
+    return;
+  spdlog::info("closing group:{} of topic:{}", mName, mTopic);
+  mClosed = true;
+  for (auto &waiter : mWaiters)
+    ready.emplace_back(waiter.second, vector<TopicQueueItem>());
+  mWaiters.clear();
+  for (auto &it : mMembers)
+    it.second.waiting = 0;
+  for (auto &item : mPending)
+    dropped.push_back(item->buffer_name);
+  mPending.clear();
+  // a waiter that can't be cancelled is being completed, on_items releases
+  // what it brings
+  if (mWaiterParked && mSub)
+    mSub->queue->cancel_waiter(mWaiter);
+  mWaiterParked = false;
+}
+
+// Invoked by the thread that posted to the topic, outside the queue lock. No
+// items means the topic was removed.
+void ConsumerGroup::on_items(vector<TopicQueueItem> &items) {
+  ReadyWaiters ready;
+  vector<string> dropped;
+  {
+    lock_guard<mutex> lock(mMutex);
+    mWaiterParked = false;
+    if (mClosed) {
+      for (auto &item : items)
+        dropped.push_back(item->buffer_name);
+    } else if (items.empty()) {
+      close_locked(ready, dropped);
+    } else {
+      for (auto &item : items)
+        mPending.push_back(std::move(item));
+      serve(ready, dropped);
+    }
+  }
+
+  for (auto &it : ready)
+    it.first->callback(it.second);
+  if (!dropped.empty())
+    ShmManager::getInstance()->release(dropped);
+}
+
+void ConsumerGroup::join(const string &member) {
+  ReadyWaiters ready;
+  vector<string> dropped;
+  {
+    lock_guard<mutex> lock(mMutex);
+    Member &m = mMembers[member];
+    m.deadline = chrono::steady_clock::now() + mLease;
+    if (!m.inFlight.empty()) {
+      spdlog::info("member:{} of group:{} joined again, reassigning {} items",
+                   member, mName, m.inFlight.size());
+      mPending.insert(mPending.begin(), m.inFlight.begin(), m.inFlight.end());
+      m.inFlight.clear();
+    }
+    serve(ready, dropped);
+  }
+
+  for (auto &it : ready)
+    it.first->callback(it.second);
+  if (!dropped.empty())
+    ShmManager::getInstance()->release(dropped);
+}
+
+// Non-blocking pull of the next item for a member. If there is none, or
+// other members are already waiting, the waiter is parked behind them.
+bool ConsumerGroup::pull_async(const string &member, PullWaiterPtr waiter,
+                               vector<TopicQueueItem> &items) {
+  ReadyWaiters ready;
+  vector<string> dropped;
+  bool open;
+  {
+    lock_guard<mutex> lock(mMutex);
+    auto it = mMembers.find(member);
+    if (mClosed || it == mMembers.end())
+      return false;
+    it->second.deadline = chrono::steady_clock::now() + mLease;
+    it->second.waiting++;
+    mWaiters.emplace_back(member, waiter);
+    serve(ready, dropped);
+    open = !mClosed;
+  }
+
+  // the caller's own pull is returned rather than completed
+  for (auto it = ready.begin(); it != ready.end(); ++it) {
+    if (it->first == waiter) {
+      items = std::move(it->second);
+      ready.erase(it);
+      break;
+    }
+  }
+  for (auto &it : ready)
+    it.first->callback(it.second);
+  if (!dropped.empty())
+    ShmManager::getInstance()->release(dropped);
+  return open || !items.empty();
+}
+
+// Returns true if the waiter was still parked, in which case its callback
+// will never be invoked.
+bool ConsumerGroup::cancel_waiter(const PullWaiterPtr &waiter) {
+  lock_guard<mutex> lock(mMutex);
+  for (auto it = mWaiters.begin(); it != mWaiters.end(); ++it) {
+    if (it->second == waiter) {
+      mMembers[it->first].waiting--;
+      mWaiters.erase(it);
+      return true;
+    }
+  }
+  return false;
+}
+
+// An item that was reassigned in the meantime is left to its new member
+void ConsumerGroup::requeue(const string &member, const TopicQueueItem &item) {
+  ReadyWaiters ready;
+  vector<string> dropped;
+  {
+    lock_guard<mutex> lock(mMutex);
+    auto it = mMembers.find(member);
+    if (it == mMembers.end())
+      return;
+    auto &inFlight = it->second.inFlight;
+    auto pos = find(inFlight.begin(), inFlight.end(), item);
+    if (pos == inFlight.end())
+      return;
+    inFlight.erase(pos);
+    if (mClosed) {
+      dropped.push_back(item->buffer_name);
+    } else {
+      mPending.push_front(item);
+      serve(ready, dropped);
+    }
+  }
+
+  for (auto &it : ready)
+    it.first->callback(it.second);
+  if (!dropped.empty())
+    ShmManager::getInstance()->release(dropped);
+}
+
+bool ConsumerGroup::release(const string &member, const string &buffer_name) {
+  ReadyWaiters ready;
+  vector<string> dropped;
+  bool held = false;
+  {
+    lock_guard<mutex> lock(mMutex);
+    auto it = mMembers.find(member);
+    if (it == mMembers.end())
+      return false;
+    auto &inFlight = it->second.inFlight;
+    auto pos = find_if(inFlight.begin(), inFlight.end(),
+                       [&](const TopicQueueItem &item) {
+                         return item->buffer_name == buffer_name;
+                       });
+    if (pos != inFlight.end()) {
+      inFlight.erase(pos);
+      held = true;
+    }
+    it->second.deadline = chrono::steady_clock::now() + mLease;
+    if (!mClosed)
+      serve(ready, dropped);
+  }
+
+  for (auto &it : ready)
+    it.first->callback(it.second);
+  if (!dropped.empty())
+    ShmManager::getInstance()->release(dropped);
+  return held;
+}
+
+void ConsumerGroup::close() {
+  ReadyWaiters ready;
+  vector<string> dropped;
+  {
+    lock_guard<mutex> lock(mMutex);
+    close_locked(ready, dropped);
+  }
+
+  for (auto &it : ready)
+    it.first->callback(it.second);
+  if (!dropped.empty())
+    ShmManager::getInstance()->release(dropped);
+}
+
+// The group only learns that its topic was removed from a pull, check that
+// it is still subscribed if nobody has pulled since
+bool ConsumerGroup::closed() {
+  {
+    lock_guard<mutex> lock(mMutex);
+    if (mClosed)
+      return true;
+  }
+  if (TopicManager::getInstance()->findSubscription(mTopic, memberName()) ==
+      mSub)
+    return false;
+  close();
+  return true;
+}
+
+// Groups are created under the manager lock so a concurrent join of the same
+// group waits for this one. Members of a replaced group lose their handles.
+uint64_t GroupManager::join(const string &topic_name,
+                            const string &group_name,
+                            const string &member_name,
+                            unsigned int maxQueueSize, unsigned int leaseMs) {
+  if (!TopicManager::getInstance()->hasTopic(topic_name)) {
+    spdlog::error("member:{} cannot join group:{}, topic:{} doesn't exist",
+                  member_name, group_name, topic_name);
+    return 0;
+  }
+
+  lock_guard<mutex> lock(mMutex);
+  auto it = mGroups.find(key(topic_name, group_name));
+  if (it == mGroups.end() || it->second.group->closed()) {
+    spdlog::info("adding group:{} to topic:{}", group_name, topic_name);
+    ConsumerGroupPtr group = make_shared<ConsumerGroup>(
+        topic_name, group_name, maxQueueSize, leaseMs);
+    if (!group->start()) {
+      group->close();
+      return 0;
+    }
+    if (it != mGroups.end()) {
+      for (auto &member : it->second.members)
+        mMembers.remove(member.second);
+      it->second.members.clear();
+    } else
+      it = mGroups.emplace(key(topic_name, group_name), GroupEntry()).first;
+    it->second.group = group;
+  }
+
+  GroupEntry &entry = it->second;
+  entry.group->join(member_name);
+  uint64_t &handle = entry.members[member_name];
+  if (!handle)
+    handle = mMembers.add(
+        make_shared<GroupMember>(GroupMember{entry.group, member_name}));
+  return handle;
+}
+
+GroupMemberPtr GroupManager::find(uint64_t handle) {
+  return mMembers.find(handle);
+}
+
+GroupMemberPtr GroupManager::find(const string &topic_name,
+                                  const string &group_name,
+                                  const string &member_name) {
+  uint64_t handle;
+  {
+    lock_guard<mutex> lock(mMutex);
+    auto it = mGroups.find(key(topic_name, group_name));
+    if (it == mGroups.end())
+      return GroupMemberPtr();
+    auto member = it->second.members.find(member_name);
+    if (member == it->second.members.end())
+      return GroupMemberPtr();
+    handle = member->second;
+  }
+  return mMembers.find(handle);
+}
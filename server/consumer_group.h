@@ -0,0 +1,128 @@
+#pragma once
+
+#include <chrono>
+#include <deque>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "handle_table.h"
+#include "topic_manager.h"
+
+// Competing consumers of a topic. The group subscribes to the topic once, as
+// memberName(), so every message is referenced once for the whole group and
+// goes to exactly one member: the one that has waited longest for work. Items
+// are only taken from the topic while a member is waiting, the topic's queue
+// size and drop policy therefore apply to the group as a whole.
+// Every member holds the items it pulled until it releases them. A member
+// whose lease ran out without it pulling or releasing has its unreleased
+// items handed to the other members, a release of such an item is then
+// ignored. Leases are checked whenever a member pulls or releases and when
+// items are posted for a waiting member. A lease of 0 never runs out.
+class ConsumerGroup : public enable_shared_from_this<ConsumerGroup> {
+private:
+  struct Member {
+    vector<TopicQueueItem> inFlight; // pulled, not yet released
+    chrono::steady_clock::time_point deadline;
+    unsigned int waiting = 0; // parked pulls
+  };
+
+  string mTopic;
+  string mName;
+  unsigned int mMaxQueueSize;
+  chrono::milliseconds mLease;
+  SubscriptionPtr mSub;
+  PullWaiterPtr mWaiter; // the group's pull on the topic
+  bool mWaiterParked;
+  mutex mMutex;
+  unordered_map<string, Member> mMembers;
+  deque<TopicQueueItem> mPending; // taken or reassigned, not yet delivered
+  list<pair<string, PullWaiterPtr>> mWaiters;
+  bool mClosed;
+
+  // Note: functions under private require mMutex
+  void expire();
+  void serve(ReadyWaiters &ready, vector<string> &dropped);
+  void close_locked(ReadyWaiters &ready, vector<string> &dropped);
+  void on_items(vector<TopicQueueItem> &items);
+
+public:
+  ConsumerGroup(const string &topic, const string &name,
+                unsigned int maxQueueSize, unsigned int leaseMs);
+  virtual ~ConsumerGroup() {}
+
+  // Subscribes the group to its topic
+  bool start();
+  // Adds a member, or renews it. A member that joins again, for instance
+  // after a restart, gives up the items it had not released.
+  void join(const string &member);
+  // Like TopicQueue::pull_async, items receive one item. Returns false if
+  // the member is unknown or the group is closed.
+  bool pull_async(const string &member, PullWaiterPtr waiter,
+                  vector<TopicQueueItem> &items);
+  bool cancel_waiter(const PullWaiterPtr &waiter);
+  // Returns an item whose reply never reached the member to the group
+  void requeue(const string &member, const TopicQueueItem &item);
+  // Returns true if the member still held the buffer, only then must the
+  // caller release it
+  bool release(const string &member, const string &buffer_name);
+  void close();
+  bool closed();
+
+  const string &getTopic() const { return mTopic; }
+  const string &getName() const { return mName; }
+  string memberName() const { return "group:" + mName; }
+};
+
+typedef shared_ptr<ConsumerGroup> ConsumerGroupPtr;
+
+// A member as resolved from its handle
+struct GroupMember {
+  ConsumerGroupPtr group;
+  string name;
+};
+
+typedef shared_ptr<GroupMember> GroupMemberPtr;
+
+// Consumer groups by topic and group name, members get a handle when they
+// join. The first member creates the group with its queue size and lease. A
+// group is closed when its topic is removed, after which joining creates a
+// new one.
+class GroupManager {
+private:
+  struct GroupEntry {
+    ConsumerGroupPtr group;
+    unordered_map<string, uint64_t> members; // handles by member name
+  };
+
+  static GroupManager *instance;
+  mutex mMutex;
+  unordered_map<string, GroupEntry> mGroups;
+  HandleTable<GroupMember> mMembers;
+
+  GroupManager() {}
+
+  static string key(const string &topic_name, const string &group_name) {
+    return topic_name + "/" + group_name;
+  }
+
+public:
+  static GroupManager *getInstance() {
+    if (!instance)
+      instance = new GroupManager();
+    return instance;
+  }
+
+  // Returns the member's handle, 0 if it could not join
+  uint64_t join(const string &topic_name, const string &group_name,
+                const string &member_name, unsigned int maxQueueSize,
+                unsigned int leaseMs);
+  GroupMemberPtr find(uint64_t handle);
+  GroupMemberPtr find(const string &topic_name, const string &group_name,
+                      const string &member_name);
+
+  ~GroupManager() { delete instance; }
+};
@@ -0,0 +1,303 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <new>
+#include <string>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+using namespace std;
+
+// Shared memory layout and accessors for the single producer, single consumer
+// descriptor rings used by the data plane. A ring carries the same fields as
+// PublishRequest/PullReply so Publish and Pull can bypass gRPC entirely. This
+// header is shared by the server and the C++ client.
+
+#define RING_MAGIC 0x54425253 // "TBRS"
+#define RING_VERSION 2
+#define RING_BUFFER_NAME_SIZE 64
+#define RING_DEFAULT_SIZE 2
+#define RING_DEFAULT_METADATA_SIZE 4096
+
+#define RING_FLAG_TRUNCATED 0x1 // metadata did not fit in the slot
+
+struct RingSlot {
+  char buffer_name[RING_BUFFER_NAME_SIZE];
+  uint64_t timestamp;
+  uint32_t metadata_size;
+  uint32_t flags;
+  char metadata[]; // metadata capacity is fixed per ring
+};
+
+struct RingHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t capacity;      // number of slots, always a power of 2
+  uint32_t slot_size;     // sizeof(RingSlot) + metadata capacity
+  atomic<uint32_t> closed; // set by either side to tear down the ring
+  atomic<int32_t> client_pid; // the process that opened the ring, 0 if none
+  uint64_t client_pid_ns;     // inode of its pid namespace
+
+  alignas(64) atomic<uint64_t> head; // next sequence to write
+  atomic<uint32_t> data_seq;         // futex word, bumped on every push
+  atomic<uint32_t> data_waiters;
+
+  alignas(64) atomic<uint64_t> tail; // next sequence to read
+  atomic<uint32_t> space_seq;        // futex word, bumped on every pop
+  atomic<uint32_t> space_waiters;
+};
+
+static_assert(atomic<uint64_t>::is_always_lock_free &&
+                  atomic<uint32_t>::is_always_lock_free,
+              "ring cursors must be lock free to live in shared memory");
+
+class DescriptorRing {
+private:
+  string mName;
+  RingHeader *mHeader;
+  size_t mMapSize;
+  bool mOwner;
+
+  static size_t slotSize(uint32_t metadataSize) {
+    return (sizeof(RingSlot) + metadataSize + 63) & ~size_t(63);
+  }
+
+  inline RingSlot *slot(uint64_t seq) const {
+    char *base = (char *)mHeader + sizeof(RingHeader);
+    return (RingSlot *)(base + (seq & (mHeader->capacity - 1)) *
+                                   mHeader->slot_size);
+  }
+
+  inline uint32_t metadataCapacity() const {
+    return mHeader->slot_size - sizeof(RingSlot);
+  }
+
+  // 0 if it can't be read, e.g. without /proc
+  static uint64_t pidNamespace() {
+    struct stat st;
+    return stat("/proc/self/ns/pid", &st) == 0 ? st.st_ino : 0;
+  }
+
+  static void futexWake(atomic<uint32_t> &word) {
+    syscall(SYS_futex, (uint32_t *)&word, FUTEX_WAKE, INT32_MAX, nullptr,
+            nullptr, 0);
+  }
+
+  // Block until word changes from expected, the deadline passes or a signal
+  // arrives. Returns false once the deadline has passed.
+  static bool futexWait(atomic<uint32_t> &word, uint32_t expected,
+                        chrono::steady_clock::time_point *deadline) {
+    struct timespec ts, *pts = nullptr;
+    if (deadline) {
+      auto left = *deadline - chrono::steady_clock::now();
+      if (left <= chrono::nanoseconds(0))
+        return false;
+      auto ns = chrono::duration_cast<chrono::nanoseconds>(left).count();
+      ts.tv_sec = ns / 1000000000;
+      ts.tv_nsec = ns % 1000000000;
+      pts = &ts;
+    }
+    syscall(SYS_futex, (uint32_t *)&word, FUTEX_WAIT, expected, pts, nullptr,
+            0);
+    return true;
+  }
+
+  // Wait until cond() holds, parking on a futex word. timeout < 0 waits
+  // forever, matching the Pull timeout convention.
+  template <typename COND_T>
+  bool waitFor(COND_T cond, atomic<uint32_t> &seq, atomic<uint32_t> &waiters,
+               int timeout) {
+    chrono::steady_clock::time_point deadline =
+        chrono::steady_clock::now() + chrono::milliseconds(max(timeout, 0));
+    while (!cond()) {
+      if (isClosed())
+        return false;
+      uint32_t expected = seq.load();
+      if (cond())
+        break;
+      waiters.fetch_add(1);
+      bool waited = futexWait(seq, expected, timeout < 0 ? nullptr : &deadline);
+      waiters.fetch_sub(1);
+      if (!waited)
+        return false;
+    }
+    return true;
+  }
+
+public:
+  DescriptorRing() : mHeader(nullptr), mMapSize(0), mOwner(false) {}
+  DescriptorRing(const DescriptorRing &) = delete;
+  DescriptorRing &operator=(const DescriptorRing &) = delete;
+  virtual ~DescriptorRing() { detach(); }
+
+  // Create a new ring segment. capacity is rounded up to a power of 2.
+  bool create(const string &name, uint32_t capacity, uint32_t metadataSize) {
+    uint32_t slots = 1;
+    while (slots < max(capacity, 1u))
+      slots <<= 1;
+
+    size_t size = sizeof(RingHeader) + slots * slotSize(metadataSize);
+    int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR,
+                      S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    if (fd < 0)
+      return false;
+
+    void *addr = MAP_FAILED;
+    if (ftruncate(fd, size) == 0)
+      addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (addr == MAP_FAILED) {
+      shm_unlink(name.c_str());
+      return false;
+    }
+
+    mName = name;
+    mMapSize = size;
+    mOwner = true;
+    mHeader = new (addr) RingHeader();
+    mHeader->capacity = slots;
+    mHeader->slot_size = slotSize(metadataSize);
+    mHeader->version = RING_VERSION;
+    atomic_thread_fence(memory_order_release);
+    mHeader->magic = RING_MAGIC;
+    return true;
+  }
+
+  // Attach to a ring created by the other side of the connection, which can
+  // then tell when this process dies, see clientAlive.
+  bool open(const string &name) {
+    int fd = shm_open(name.c_str(), O_RDWR, 0);
+    if (fd < 0)
+      return false;
+
+    struct stat st;
+    void *addr = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(RingHeader))
+      addr = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (addr == MAP_FAILED)
+      return false;
+
+    mHeader = (RingHeader *)addr;
+    mMapSize = st.st_size;
+    if (mHeader->magic != RING_MAGIC || mHeader->version != RING_VERSION) {
+      detach();
+      return false;
+    }
+    mName = name;
+    mHeader->client_pid_ns = pidNamespace();
+    mHeader->client_pid.store(getpid());
+    return true;
+  }
+
+  // Unmap the ring. The creator also removes the segment name.
+  void detach() {
+    if (!mHeader)
+      return;
+    munmap(mHeader, mMapSize);
+    if (mOwner)
+      shm_unlink(mName.c_str());
+    mHeader = nullptr;
+    mOwner = false;
+  }
+
+  // Mark the ring closed and wake both sides.
+  void close() {
+    if (!mHeader)
+      return;
+    mHeader->closed.store(1);
+    mHeader->data_seq.fetch_add(1);
+    mHeader->space_seq.fetch_add(1);
+    futexWake(mHeader->data_seq);
+    futexWake(mHeader->space_seq);
+  }
+
+  // False once the process that opened the ring has exited. A ring nobody
+  // opened yet, or opened from another pid namespace whose pids mean nothing
+  // here, counts as alive.
+  bool clientAlive() const {
+    static const uint64_t ns = pidNamespace();
+    pid_t pid = mHeader ? mHeader->client_pid.load() : 0;
+    if (pid <= 0 || mHeader->client_pid_ns != ns)
+      return true;
+    return kill(pid, 0) == 0 || errno != ESRCH;
+  }
+
+  inline bool isOpen() const { return mHeader != nullptr; }
+  inline bool isClosed() const { return !mHeader || mHeader->closed.load(); }
+  inline const string &getName() const { return mName; }
+  inline bool fits(size_t metadataSize) const {
+    return metadataSize <= metadataCapacity();
+  }
+
+  // Producer side. Waits for a free slot for up to timeout ms.
+  bool push(const string &buffer_name, const string &metadata,
+            uint64_t timestamp, int timeout = -1) {
+    if (isClosed() || buffer_name.size() >= RING_BUFFER_NAME_SIZE)
+      return false;
+
+    uint64_t head = mHeader->head.load(memory_order_relaxed);
+    auto hasSpace = [&]() {
+      return head - mHeader->tail.load(memory_order_acquire) <
+             mHeader->capacity;
+    };
+    if (!waitFor(hasSpace, mHeader->space_seq, mHeader->space_waiters,
+                 timeout))
+      return false;
+
+    RingSlot *s = slot(head);
+    memcpy(s->buffer_name, buffer_name.c_str(), buffer_name.size() + 1);
+    s->timestamp = timestamp;
+    s->flags = 0;
+    s->metadata_size = metadata.size();
+    if (!fits(metadata.size())) {
+      s->metadata_size = metadataCapacity();
+      s->flags |= RING_FLAG_TRUNCATED;
+    }
+    memcpy(s->metadata, metadata.data(), s->metadata_size);
+
+    mHeader->head.store(head + 1, memory_order_release);
+    mHeader->data_seq.fetch_add(1);
+    if (mHeader->data_waiters.load())
+      futexWake(mHeader->data_seq);
+    return true;
+  }
+
+  // Consumer side. Waits for a descriptor for up to timeout ms.
+  bool pop(string &buffer_name, string &metadata, uint64_t &timestamp,
+           uint32_t &flags, int timeout = -1) {
+    if (!mHeader)
+      return false;
+
+    uint64_t tail = mHeader->tail.load(memory_order_relaxed);
+    auto hasData = [&]() {
+      return mHeader->head.load(memory_order_acquire) != tail;
+    };
+    if (!waitFor(hasData, mHeader->data_seq, mHeader->data_waiters, timeout))
+      return false;
+
+    RingSlot *s = slot(tail);
+    buffer_name.assign(s->buffer_name,
+                       strnlen(s->buffer_name, RING_BUFFER_NAME_SIZE));
+    metadata.assign(s->metadata, min(s->metadata_size, metadataCapacity()));
+    timestamp = s->timestamp;
+    flags = s->flags;
+
+    mHeader->tail.store(tail + 1, memory_order_release);
+    mHeader->space_seq.fetch_add(1);
+    if (mHeader->space_waiters.load())
+      futexWake(mHeader->space_seq);
+    return true;
+  }
+};
@@ -0,0 +1,148 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace std;
+
+// Wire format of the Unix socket that hands out memfd buffers. Buffers backed
+// by a memfd have no name in /dev/shm, so gRPC only carries their id (and the
+// buffer name "memfd:<id>"). A client sends the id as an FdRequest and the
+// server replies with an FdReply carrying the descriptor in an SCM_RIGHTS
+// control message. This header is shared by the server and the C++ client.
+
+#define FD_SOCKET_DEFAULT_PATH "/tmp/tensor_bus_fd.sock"
+#define MEMFD_HANDLE_PREFIX "memfd:"
+
+struct FdRequest {
+  uint64_t id;
+};
+
+struct FdReply {
+  int32_t result; // 0 if a descriptor is attached
+  uint32_t reserved;
+  uint64_t size; // size of the memfd
+};
+
+inline string makeMemfdHandle(uint64_t id) {
+  return MEMFD_HANDLE_PREFIX + to_string(id);
+}
+
+// Returns false for buffers that have a name in /dev/shm
+inline bool parseMemfdHandle(const string &name, uint64_t &id) {
+  const size_t prefix = sizeof(MEMFD_HANDLE_PREFIX) - 1;
+  if (name.compare(0, prefix, MEMFD_HANDLE_PREFIX) != 0 ||
+      name.size() == prefix)
+    return false;
+
+  char *end;
+  id = strtoull(name.c_str() + prefix, &end, 10);
+  return *end == '\0';
+}
+
+inline bool sendAll(int sock, const void *data, size_t size) {
+  const char *p = (const char *)data;
+  while (size > 0) {
+    ssize_t n = send(sock, p, size, MSG_NOSIGNAL);
+    if (n <= 0)
+      return false;
+    p += n;
+    size -= n;
+  }
+  return true;
+}
+
+inline bool recvAll(int sock, void *data, size_t size) {
+  char *p = (char *)data;
+  while (size > 0) {
+    ssize_t n = recv(sock, p, size, 0);
+    if (n <= 0)
+      return false;
+    p += n;
+    size -= n;
+  }
+  return true;
+}
+
+// fd is attached only if it is >= 0
+inline bool sendFdReply(int sock, const FdReply &reply, int fd) {
+  iovec iov = {(void *)&reply, sizeof(reply)};
+  msghdr msg = {};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+
+  char control[CMSG_SPACE(sizeof(int))] = {};
+  if (fd >= 0) {
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+  }
+  return sendmsg(sock, &msg, MSG_NOSIGNAL) == sizeof(reply);
+}
+
+// Returns the received descriptor, or -1 if none was attached
+inline int recvFdReply(int sock, FdReply &reply) {
+  iovec iov = {&reply, sizeof(reply)};
+  msghdr msg = {};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  char control[CMSG_SPACE(sizeof(int))] = {};
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != sizeof(reply)) {
+    reply.result = -1;
+    return -1;
+  }
+
+  int fd = -1;
+  cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if (cmsg && cmsg->cmsg_level == SOL_SOCKET &&
+      cmsg->cmsg_type == SCM_RIGHTS)
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+  return fd;
+}
+
+inline int connectFdSocket(const string &path) {
+  sockaddr_un addr = {};
+  if (path.size() >= sizeof(addr.sun_path))
+    return -1;
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+  int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (sock < 0)
+    return -1;
+  if (connect(sock, (sockaddr *)&addr, sizeof(addr)) < 0) {
+    close(sock);
+    return -1;
+  }
+  return sock;
+}
+
+// Asks the server for the descriptor of a memfd buffer over a connected
+// socket. Returns -1 on failure.
+inline int requestBufferFd(int sock, uint64_t id, size_t &size) {
+  FdRequest request = {id};
+  if (!sendAll(sock, &request, sizeof(request)))
+    return -1;
+
+  FdReply reply;
+  int fd = recvFdReply(sock, reply);
+  if (reply.result != 0) {
+    if (fd >= 0)
+      close(fd);
+    return -1;
+  }
+  size = reply.size;
+  return fd;
+}
@@ -0,0 +1,110 @@
+#include "fd_server.h"
+#include "fd_channel.h"
+#include "shm_manager.h"
+#include "spdlog/spdlog.h"
+#include <sys/stat.h>
+#include <thread>
+
+FdServer *FdServer::instance = nullptr;
+
+bool FdServer::start(const string &path) {
+  sockaddr_un addr = {};
+  if (path.size() >= sizeof(addr.sun_path)) {
+    spdlog::error("fd socket path:{} is too long", path);
+    return false;
+  }
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    spdlog::error("failed to create fd socket");
+    return false;
+  }
+
+  // a socket left behind by a server that died would fail bind. Only the
+  // server's user and group may connect, like the shm segments themselves,
+  // which is set before listen so that no one can connect in between.
+  unlink(path.c_str());
+  if (bind(fd, (sockaddr *)&addr, sizeof(addr)) < 0 ||
+      chmod(path.c_str(), S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP) < 0 ||
+      listen(fd, 16) < 0) {
+    spdlog::error("failed to listen on fd socket:{}", path);
+    close(fd);
+    return false;
+  }
+
+  mPath = path;
+  mListenFd = fd;
+  mRunning = true;
+  spdlog::info("serving memfd buffers on:{}", path);
+  thread(&FdServer::acceptClients, this).detach();
+  return true;
+}
+
+// Peers are checked again by their credentials, in case the socket's mode
+// was changed: root, the server's user and members of its group only.
+bool FdServer::allowed(int sock) {
+  ucred cred;
+  socklen_t len = sizeof(cred);
+  if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0)
+    return false;
+  return cred.uid == 0 || cred.uid == geteuid() || cred.gid == getegid();
+}
+
+void FdServer::acceptClients() {
+  while (mRunning) {
+    int sock = accept4(mListenFd, nullptr, nullptr, SOCK_CLOEXEC);
+    if (sock < 0) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      break;
+    }
+    if (!allowed(sock)) {
+      spdlog::warn("refused fd socket connection from another user");
+      close(sock);
+      continue;
+    }
+
+    lock_guard<mutex> lock(mMutex);
+    mClients.insert(sock);
+    thread(&FdServer::serveClient, this, sock).detach();
+  }
+}
+
+void FdServer::serveClient(int sock) {
+  FdRequest request;
+  while (recvAll(sock, &request, sizeof(request))) {
+    FdReply reply = {-1, 0, 0};
+    int fd = -1;
+    // the buffer reference keeps the descriptor open while it is sent
+    shared_ptr<ShmBuffer> buffer =
+        ShmManager::getInstance()->getBuffer(makeMemfdHandle(request.id));
+    if (buffer && buffer->getFd() >= 0) {
+      fd = buffer->getFd();
+      reply.result = 0;
+      reply.size = buffer->getCapacity();
+    } else
+      spdlog::error("no memfd buffer with id:{}", request.id);
+
+    if (!sendFdReply(sock, reply, fd))
+      break;
+  }
+
+  lock_guard<mutex> lock(mMutex);
+  mClients.erase(sock);
+  close(sock);
+}
+
+// Called on shutdown
+void FdServer::stop() {
+  lock_guard<mutex> lock(mMutex);
+  if (!mRunning)
+    return;
+
+  mRunning = false;
+  shutdown(mListenFd, SHUT_RDWR);
+  for (int sock : mClients)
+    shutdown(sock, SHUT_RDWR);
+  unlink(mPath.c_str());
+}
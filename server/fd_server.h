@@ -0,0 +1,42 @@
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <unordered_set>
+
+using namespace std;
+
+// Serves the descriptors of memfd backed buffers over a Unix-domain socket
+// (see fd_channel.h). Each client connection is handled by its own thread and
+// stays open so clients can ask for descriptors without reconnecting. Only
+// the server's user and group can connect.
+class FdServer {
+private:
+  static FdServer *instance;
+  string mPath;
+  int mListenFd;
+  unordered_set<int> mClients;
+  atomic<bool> mRunning;
+  mutex mMutex;
+
+  FdServer() : mListenFd(-1), mRunning(false) {}
+
+  bool allowed(int sock);
+  void acceptClients();
+  void serveClient(int sock);
+
+public:
+  static FdServer *getInstance() {
+    if (!instance)
+      instance = new FdServer();
+    return instance;
+  }
+
+  bool start(const string &path);
+  void stop();
+
+  inline const string &getPath() const { return mPath; }
+
+  ~FdServer() { delete instance; }
+};
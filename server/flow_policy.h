@@ -0,0 +1,26 @@
+#pragma once
+
+// Flow control of a subscriber's queue, passed as SubscribeRequest.flow_policy
+// and set when the queue is created. Subscribers that depend on another one
+// share its queue and its policy. This header is shared by the server and the
+// C++ client.
+//   FLOW_QUEUE   the topic decides: a full queue replaces its oldest item, or
+//                blocks the publisher if the topic doesn't drop messages
+//   FLOW_CREDIT  items are queued only while the subscriber has credit, each
+//                one takes a credit. Credit is granted when subscribing and
+//                with GrantCredits, items posted without credit are skipped
+//   FLOW_LATEST  only the newest unread item is kept
+//   FLOW_MAX_AGE items queued for longer than max_age_ms are skipped
+// Only FLOW_QUEUE can block the publisher. Skipped items are released for the
+// subscriber as if it had pulled them.
+
+#define FLOW_QUEUE 0
+#define FLOW_CREDIT 1
+#define FLOW_LATEST 2
+#define FLOW_MAX_AGE 3
+
+struct FlowControl {
+  unsigned int policy = FLOW_QUEUE;
+  unsigned int credits = 0;    // initial credit of FLOW_CREDIT
+  unsigned int max_age_ms = 0; // FLOW_MAX_AGE
+};
@@ -0,0 +1,153 @@
+#include "group_call.h"
+#include "shm_manager.h"
+#include "spdlog/spdlog.h"
+#include "tracer.h"
+
+GroupPullCall::GroupPullCall(Shm::AsyncService *service,
+                             ServerCompletionQueue *cq)
+    : mService(service), mCQ(cq), mResponder(&mContext), mPending(1),
+      mFinished(false), mAlarmSet(false), mRequestEvent{this, REQUEST},
+      mAlarmEvent{this, ALARM}, mDoneEvent{this, DONE},
+      mFinishEvent{this, FINISH} {
+  mContext.AsyncNotifyWhenDone(&mDoneEvent);
+  mService->RequestPullGroup(&mContext, &mRequest, &mResponder, mCQ, mCQ,
+                             &mRequestEvent);
+}
+
+// Note: caller must hold mMutex
+void GroupPullCall::finish(vector<TopicQueueItem> *items,
+                           const Status &status) {
+  mFinished = true;
+  mReply.set_result(-1);
+  if (items && !items->empty()) {
+    mItem = items->front();
+    mReply.set_result(0);
+    mReply.set_buffer_name(mItem->buffer_name);
+    mReply.set_metadata(mItem->metadata);
+    mReply.set_timestamp(mItem->timestamp);
+    mReply.set_server_epoch(ShmManager::getInstance()->getEpoch());
+    Tracer::getInstance()->pulled(mItem, mMember->group->memberName());
+    spdlog::debug("pulling buffer:{} from topic:{} by member:{} of group:{}",
+                  mItem->buffer_name, mMember->group->getTopic(),
+                  mMember->name, mMember->group->getName());
+  }
+
+  mPending++;
+  mResponder.Finish(mReply, status, &mFinishEvent);
+}
+
+// The call lock is never held while calling into the group, the waiter
+// callback may run on a posting thread.
+void GroupPullCall::start() {
+  GroupManager *gm = GroupManager::getInstance();
+  GroupMemberPtr member =
+      mRequest.member()
+          ? gm->find(mRequest.member())
+          : gm->find(mRequest.topic_name(), mRequest.group_name(),
+                     mRequest.member_name());
+  if (!member) {
+    spdlog::error("failed to pull from topic:{} member:{} of group:{}",
+                  mRequest.topic_name(), mRequest.member_name(),
+                  mRequest.group_name());
+    lock_guard<mutex> lock(mMutex);
+    if (mRequest.member())
+      finish(nullptr, Status(grpc::StatusCode::NOT_FOUND, "unknown member"));
+    else
+      finish(nullptr);
+    return;
+  }
+
+  PullWaiterPtr waiter = make_shared<PullWaiter>();
+  waiter->subscriber_name = member->name;
+  waiter->callback = [this](vector<TopicQueueItem> &items) {
+    onItems(items);
+  };
+  {
+    lock_guard<mutex> lock(mMutex);
+    mMember = member;
+    mWaiter = waiter;
+  }
+
+  vector<TopicQueueItem> items;
+  bool joined = member->group->pull_async(member->name, waiter, items);
+
+  lock_guard<mutex> lock(mMutex);
+  if (!joined) {
+    spdlog::error("group:{} of topic:{} is closed",
+                  member->group->getName(), member->group->getTopic());
+    finish(nullptr, Status(grpc::StatusCode::NOT_FOUND, "group closed"));
+  } else if (!items.empty())
+    finish(&items);
+  else if (!mFinished && mRequest.timeout() >= 0) {
+    mPending++;
+    mAlarmSet = true;
+    mAlarm.Set(mCQ,
+               chrono::system_clock::now() +
+                   chrono::milliseconds(mRequest.timeout()),
+               &mAlarmEvent);
+  }
+}
+
+// Invoked once by the serving thread if the waiter was not cancelled
+void GroupPullCall::onItems(vector<TopicQueueItem> &items) {
+  lock_guard<mutex> lock(mMutex);
+  finish(&items);
+  if (mAlarmSet)
+    mAlarm.Cancel();
+}
+
+// The triggering event is still counted in mPending, which keeps the call
+// alive while the waiter is cancelled without holding mMutex.
+void GroupPullCall::expire(bool cancel) {
+  bool finished;
+  GroupMemberPtr member;
+  PullWaiterPtr waiter;
+  {
+    lock_guard<mutex> lock(mMutex);
+    finished = mFinished;
+    member = mMember;
+    waiter = mWaiter;
+  }
+
+  bool cancelled = cancel && !finished && member &&
+                   member->group->cancel_waiter(waiter);
+  lock_guard<mutex> lock(mMutex);
+  if (cancelled)
+    finish(nullptr);
+}
+
+void GroupPullCall::proceed(int event, bool ok) {
+  switch (event) {
+  case REQUEST:
+    if (!ok) {
+      delete this; // server is shutting down
+      return;
+    }
+    new GroupPullCall(mService, mCQ);
+    mPending++; // done event
+    start();
+    break;
+  case ALARM:
+    expire(ok); // ok is false if the alarm was cancelled
+    break;
+  case DONE:
+    if (mContext.IsCancelled())
+      spdlog::warn("context canceled, canceling pull request for topic:{} "
+                   "from member:{} of group:{}",
+                   mRequest.topic_name(), mRequest.member_name(),
+                   mRequest.group_name());
+    expire(mContext.IsCancelled());
+    break;
+  case FINISH:
+    // the reply never reached the member, give the item to another one
+    if (!ok && mItem)
+      mMember->group->requeue(mMember->name, mItem);
+    break;
+  }
+
+  unique_lock<mutex> lock(mMutex);
+  if (--mPending == 0) {
+    lock.unlock();
+    delete this;
+  }
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <grpcpp/alarm.h>
+#include <grpcpp/grpcpp.h>
+#include <mutex>
+
+#include "async_call.h"
+#include "consumer_group.h"
+
+// Server side of the PullGroup RPC. Like PullCall, a pull without an item is
+// parked, here on the consumer group behind the members that are already
+// waiting, and an alarm implements the timeout. An item whose reply never
+// reaches the member is returned to the group.
+class GroupPullCall : public AsyncCall {
+private:
+  enum { REQUEST, ALARM, DONE, FINISH };
+
+  Shm::AsyncService *mService;
+  ServerCompletionQueue *mCQ;
+  ServerContext mContext;
+  PullGroupRequest mRequest;
+  PullReply mReply;
+  ServerAsyncResponseWriter<PullReply> mResponder;
+  grpc::Alarm mAlarm;
+  GroupMemberPtr mMember;
+  PullWaiterPtr mWaiter;
+  TopicQueueItem mItem; // delivered item
+  mutex mMutex;
+  unsigned int mPending; // outstanding completion queue events
+  bool mFinished;
+  bool mAlarmSet;
+  CallEvent mRequestEvent, mAlarmEvent, mDoneEvent, mFinishEvent;
+
+  void start();
+  void finish(vector<TopicQueueItem> *items, const Status &status = Status::OK);
+  void onItems(vector<TopicQueueItem> &items);
+  void expire(bool cancel);
+
+public:
+  GroupPullCall(Shm::AsyncService *service, ServerCompletionQueue *cq);
+
+  void proceed(int event, bool ok) override;
+};
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <vector>
+
+using namespace std;
+
+// Maps compact numeric handles to objects. A handle is the slot index + 1 in
+// the low 32 bits and the slot's generation in the high 32 bits, so looking
+// one up is an index into a vector and a handle whose slot was reused no
+// longer resolves. 0 is never a valid handle.
+template <typename T> class HandleTable {
+private:
+  struct Slot {
+    shared_ptr<T> value;
+    uint32_t generation = 0;
+  };
+
+  mutable shared_mutex mMutex;
+  vector<Slot> mSlots;
+  vector<uint32_t> mFree;
+
+public:
+  uint64_t add(shared_ptr<T> value) {
+    unique_lock<shared_mutex> lock(mMutex);
+    uint32_t index;
+    if (!mFree.empty()) {
+      index = mFree.back();
+      mFree.pop_back();
+    } else {
+      index = mSlots.size();
+      mSlots.emplace_back();
+    }
+    mSlots[index].value = std::move(value);
+    return (uint64_t)mSlots[index].generation << 32 | (index + 1);
+  }
+
+  shared_ptr<T> find(uint64_t handle) const {
+    uint32_t index = (uint32_t)handle - 1;
+    shared_lock<shared_mutex> lock(mMutex);
+    if (index >= mSlots.size() ||
+        mSlots[index].generation != (uint32_t)(handle >> 32))
+      return shared_ptr<T>();
+    return mSlots[index].value;
+  }
+
+  bool remove(uint64_t handle) {
+    uint32_t index = (uint32_t)handle - 1;
+    unique_lock<shared_mutex> lock(mMutex);
+    if (index >= mSlots.size() || !mSlots[index].value ||
+        mSlots[index].generation != (uint32_t)(handle >> 32))
+      return false;
+    mSlots[index].value.reset();
+    mSlots[index].generation++;
+    mFree.push_back(index);
+    return true;
+  }
+};
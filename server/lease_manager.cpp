@@ -0,0 +1,170 @@
+#include "lease_manager.h"
+#include "shm_manager.h"
+#include "spdlog/spdlog.h"
+#include "tracer.h"
+
+#include <random>
+
+LeaseManager *LeaseManager::instance = nullptr;
+
+// Handles start at a random value so that a client that still holds a
+// session of a previous server doesn't renew another client's session
+LeaseManager::LeaseManager()
+    : mNextSession((uint64_t)random_device()() << 32 | 1),
+      mDefaultLease(10000), mCheckInterval(1000), mLeased(0),
+      mRunning(false) {}
+
+void LeaseManager::configure(unsigned int defaultLeaseMs,
+                             unsigned int checkIntervalMs) {
+  lock_guard<mutex> lock(mMutex);
+  mDefaultLease = chrono::milliseconds(max(defaultLeaseMs, 1u));
+  mCheckInterval = chrono::milliseconds(max(checkIntervalMs, 1u));
+}
+
+void LeaseManager::start() {
+  lock_guard<mutex> lock(mMutex);
+  if (mRunning)
+    return;
+  mRunning = true;
+  mReaper = thread(&LeaseManager::reap, this);
+}
+
+void LeaseManager::stop() {
+  {
+    lock_guard<mutex> lock(mMutex);
+    mRunning = false;
+  }
+  mCV.notify_all();
+  if (mReaper.joinable())
+    mReaper.join();
+}
+
+void LeaseManager::reap() {
+  unique_lock<mutex> lock(mMutex);
+  while (mRunning) {
+    mCV.wait_for(lock, mCheckInterval);
+    TimePoint now = chrono::steady_clock::now();
+    vector<string> reclaimed;
+    for (auto it = mSessions.begin(); it != mSessions.end();) {
+      if (it->second.deadline > now) {
+        ++it;
+        continue;
+      }
+      spdlog::warn("lease of session:{} client:{} expired, reclaiming {} "
+                   "buffers",
+                   it->first, it->second.client, it->second.buffers.size());
+      reclaim(it->second, reclaimed);
+      mStats.expired++;
+      it = mSessions.erase(it);
+    }
+    if (reclaimed.empty())
+      continue;
+    lock.unlock();
+    releaseReclaimed(reclaimed);
+    lock.lock();
+  }
+}
+
+void LeaseManager::reclaim(Session &session, vector<string> &reclaimed) {
+  for (auto &it : session.buffers) {
+    reclaimed.insert(reclaimed.end(), it.second, it.first);
+    mLeased -= it.second;
+    mStats.reclaimedBuffers += it.second;
+  }
+  session.buffers.clear();
+}
+
+void LeaseManager::forget(Session &session, const string &buffer_name) {
+  auto it = session.buffers.find(buffer_name);
+  if (it == session.buffers.end())
+    return;
+  mLeased--;
+  if (--it->second == 0)
+    session.buffers.erase(it);
+}
+
+void LeaseManager::releaseReclaimed(const vector<string> &reclaimed) {
+  for (auto &name : reclaimed)
+    Tracer::getInstance()->released(name, "");
+  ShmManager::getInstance()->release(reclaimed);
+}
+
+uint64_t LeaseManager::open(const string &client, unsigned int &leaseMs) {
+  lock_guard<mutex> lock(mMutex);
+  uint64_t handle = mNextSession++;
+  Session &session = mSessions[handle];
+  session.client = client;
+  session.lease = leaseMs ? chrono::milliseconds(leaseMs) : mDefaultLease;
+  leaseMs = session.lease.count();
+  session.deadline = chrono::steady_clock::now() + session.lease;
+  mStats.opened++;
+  spdlog::info("opened session:{} for client:{} lease:{}ms", handle, client,
+               session.lease.count());
+  return handle;
+}
+
+bool LeaseManager::renew(uint64_t session) {
+  lock_guard<mutex> lock(mMutex);
+  auto it = mSessions.find(session);
+  if (it == mSessions.end())
+    return false;
+  it->second.deadline = chrono::steady_clock::now() + it->second.lease;
+  return true;
+}
+
+bool LeaseManager::close(uint64_t session) {
+  vector<string> reclaimed;
+  {
+    lock_guard<mutex> lock(mMutex);
+    auto it = mSessions.find(session);
+    if (it == mSessions.end())
+      return false;
+    reclaim(it->second, reclaimed);
+    mStats.closed++;
+    mSessions.erase(it);
+  }
+  releaseReclaimed(reclaimed);
+  return true;
+}
+
+bool LeaseManager::lease(uint64_t session,
+                         const vector<TopicQueueItem> &items) {
+  lock_guard<mutex> lock(mMutex);
+  auto it = mSessions.find(session);
+  if (it == mSessions.end())
+    return false;
+  for (auto &item : items)
+    it->second.buffers[item->buffer_name]++;
+  mLeased += items.size();
+  it->second.deadline = chrono::steady_clock::now() + it->second.lease;
+  return true;
+}
+
+bool LeaseManager::unlease(uint64_t session,
+                           const vector<TopicQueueItem> &items) {
+  lock_guard<mutex> lock(mMutex);
+  auto it = mSessions.find(session);
+  if (it == mSessions.end())
+    return false;
+  for (auto &item : items)
+    forget(it->second, item->buffer_name);
+  return true;
+}
+
+bool LeaseManager::release(uint64_t session, const string &buffer_name) {
+  lock_guard<mutex> lock(mMutex);
+  auto it = mSessions.find(session);
+  if (it == mSessions.end())
+    return false;
+  forget(it->second, buffer_name);
+  it->second.deadline = chrono::steady_clock::now() + it->second.lease;
+  return true;
+}
+
+SessionStats LeaseManager::getStats() {
+  lock_guard<mutex> lock(mMutex);
+  SessionStats stats = mStats;
+  stats.sessions = mSessions.size();
+  stats.leasedBuffers = mLeased;
+  return stats;
+}
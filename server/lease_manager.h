@@ -0,0 +1,100 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "topic_queue.h"
+
+using namespace std;
+
+struct SessionStats {
+  uint64_t sessions = 0;      // open
+  uint64_t leasedBuffers = 0; // pulled with a session, not yet released
+  uint64_t opened = 0;
+  uint64_t closed = 0;
+  uint64_t expired = 0;
+  uint64_t reclaimedBuffers = 0; // released for closed or expired sessions
+};
+
+// Ties the buffers a client pulled to the client, so that a client that dies
+// between Pull and ReleaseBuffer doesn't pin them until the server exits. A
+// client opens a session with a lease and renews it with heartbeats, every
+// pull made with the session renews it too. Pulls record the buffers they
+// deliver against the session and releases made with it remove them.
+// A session whose lease ran out is closed by the reaper thread, which
+// releases every buffer still recorded against it once per pull. Releases
+// made with a session that is no longer open are refused, the buffers may
+// already have been reused.
+class LeaseManager {
+private:
+  typedef chrono::steady_clock::time_point TimePoint;
+
+  struct Session {
+    string client;
+    chrono::milliseconds lease;
+    TimePoint deadline;
+    unordered_map<string, unsigned int> buffers; // pulls not yet released
+  };
+
+  static LeaseManager *instance;
+  mutex mMutex;
+  unordered_map<uint64_t, Session> mSessions;
+  uint64_t mNextSession;
+  chrono::milliseconds mDefaultLease;
+  chrono::milliseconds mCheckInterval;
+  uint64_t mLeased; // buffers recorded against the open sessions
+  SessionStats mStats;
+  bool mRunning;
+  condition_variable mCV;
+  thread mReaper;
+
+  LeaseManager();
+
+  void reap();
+  // Note: functions below require mMutex. Reclaimed buffers are released
+  // by the caller once the lock is released.
+  void reclaim(Session &session, vector<string> &reclaimed);
+  void forget(Session &session, const string &buffer_name);
+
+  void releaseReclaimed(const vector<string> &reclaimed);
+
+public:
+  static LeaseManager *getInstance() {
+    if (!instance)
+      instance = new LeaseManager();
+    return instance;
+  }
+
+  // leaseMs applies to sessions opened without a lease of their own
+  void configure(unsigned int defaultLeaseMs, unsigned int checkIntervalMs);
+  void start();
+  void stop();
+
+  // Returns the session's handle, never 0. A leaseMs of 0 is set to the
+  // default lease.
+  uint64_t open(const string &client, unsigned int &leaseMs);
+  // Returns false if the session is not open
+  bool renew(uint64_t session);
+  // Releases what the session still holds, as if it had expired
+  bool close(uint64_t session);
+  // Records the pulled items against the session and renews it. Returns
+  // false if the session is not open, the items are then not recorded.
+  bool lease(uint64_t session, const vector<TopicQueueItem> &items);
+  // Forgets items whose reply never reached the client. Returns false if
+  // the session is not open, its buffers were then reclaimed already.
+  bool unlease(uint64_t session, const vector<TopicQueueItem> &items);
+  // Returns false if the session is not open, the caller must then not
+  // release the buffer. A buffer the session didn't pull is released by the
+  // caller as usual.
+  bool release(uint64_t session, const string &buffer_name);
+  SessionStats getStats();
+
+  ~LeaseManager() { delete instance; }
+};
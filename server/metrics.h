@@ -0,0 +1,114 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+using namespace std;
+
+// Counters for GetStats and the metrics endpoint. Recording is a relaxed
+// atomic increment so the publish and pull paths don't take another lock,
+// only readers do any further work.
+
+// Latency histogram with fixed bucket bounds. Bucket i counts samples up to
+// BOUNDS_US[i], the last bucket those above every bound.
+class LatencyHistogram {
+public:
+  static constexpr size_t BUCKETS = 13;
+  static constexpr uint64_t BOUNDS_US[BUCKETS - 1] = {
+      10,    50,     100,    500,    1000,    5000,
+      10000, 50000, 100000, 500000, 1000000, 5000000};
+
+  void record(chrono::steady_clock::duration d) {
+    uint64_t us = chrono::duration_cast<chrono::microseconds>(d).count();
+    size_t i = 0;
+    while (i < BUCKETS - 1 && us > BOUNDS_US[i])
+      ++i;
+    mCounts[i].fetch_add(1, memory_order_relaxed);
+    mSumUs.fetch_add(us, memory_order_relaxed);
+  }
+
+  void snapshot(vector<uint64_t> &counts, uint64_t &sumUs) const {
+    counts.resize(BUCKETS);
+    for (size_t i = 0; i < BUCKETS; ++i)
+      counts[i] = mCounts[i].load(memory_order_relaxed);
+    sumUs = mSumUs.load(memory_order_relaxed);
+  }
+
+private:
+  atomic<uint64_t> mCounts[BUCKETS] = {};
+  atomic<uint64_t> mSumUs{0};
+};
+
+// Event counter with a rate. rate() averages over the time since the
+// previous reading, once at least a second has passed, so frequent readers
+// see the rate of the last second.
+class RateMeter {
+public:
+  RateMeter()
+      : mSampleTime(chrono::steady_clock::now()), mSampleCount(0), mRate(0) {}
+
+  void add(uint64_t n = 1) { mCount.fetch_add(n, memory_order_relaxed); }
+  uint64_t count() const { return mCount.load(memory_order_relaxed); }
+
+  double rate() {
+    lock_guard<mutex> lock(mMutex);
+    auto now = chrono::steady_clock::now();
+    double seconds = chrono::duration<double>(now - mSampleTime).count();
+    if (seconds >= 1) {
+      uint64_t total = count();
+      mRate = (total - mSampleCount) / seconds;
+      mSampleTime = now;
+      mSampleCount = total;
+    }
+    return mRate;
+  }
+
+private:
+  atomic<uint64_t> mCount{0};
+  mutex mMutex;
+  chrono::steady_clock::time_point mSampleTime;
+  uint64_t mSampleCount;
+  double mRate;
+};
+
+// The last samples of a latency, for percentiles. Not thread safe, the owner
+// locks around it.
+class LatencyWindow {
+public:
+  explicit LatencyWindow(size_t capacity = 1024)
+      : mCapacity(std::max<size_t>(capacity, 1)), mNext(0), mCount(0), mMax(0) {}
+
+  void record(uint64_t us) {
+    if (mSamples.size() < mCapacity)
+      mSamples.push_back(us);
+    else
+      mSamples[mNext] = us;
+    mNext = (mNext + 1) % mCapacity;
+    mCount++;
+    mMax = std::max(mMax, us);
+  }
+
+  // p in [0, 1], over the samples still in the window
+  uint64_t percentile(double p) const {
+    if (mSamples.empty())
+      return 0;
+    vector<uint64_t> samples(mSamples);
+    size_t n = std::min(samples.size() - 1, (size_t)(p * samples.size()));
+    nth_element(samples.begin(), samples.begin() + n, samples.end());
+    return samples[n];
+  }
+
+  uint64_t count() const { return mCount; }
+  uint64_t largest() const { return mMax; }
+
+private:
+  size_t mCapacity;
+  size_t mNext;
+  uint64_t mCount;
+  uint64_t mMax;
+  vector<uint64_t> mSamples;
+};
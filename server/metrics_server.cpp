@@ -0,0 +1,298 @@
+#include "metrics_server.h"
+#include "lease_manager.h"
+#include "shm_manager.h"
+#include "spdlog/spdlog.h"
+#include "topic_manager.h"
+#include "tracer.h"
+
+#include <sstream>
+#include <thread>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+MetricsServer *MetricsServer::instance = nullptr;
+
+// Only meant for local scrapers, the address defaults to the loopback
+bool MetricsServer::start(const string &address, unsigned short port) {
+  sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  if (inet_pton(AF_INET, address.c_str(), &addr.sin_addr) != 1) {
+    spdlog::error("invalid metrics address:{}", address);
+    return false;
+  }
+
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    spdlog::error("failed to create metrics socket");
+    return false;
+  }
+  int reuse = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+  if (bind(fd, (sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 16) < 0) {
+    spdlog::error("failed to listen for metrics on {}:{}", address, port);
+    close(fd);
+    return false;
+  }
+
+  mListenFd = fd;
+  mRunning = true;
+  spdlog::info("serving metrics on {}:{}", address, port);
+  thread(&MetricsServer::acceptClients, this).detach();
+  return true;
+}
+
+void MetricsServer::acceptClients() {
+  while (mRunning) {
+    int sock = accept4(mListenFd, nullptr, nullptr, SOCK_CLOEXEC);
+    if (sock < 0) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      break;
+    }
+    serveClient(sock);
+  }
+}
+
+// The request itself is not needed, it is read up to the end of its headers
+// so that closing the socket doesn't reset the connection before the client
+// has read the reply. Clients are served one at a time, so both directions
+// time out: a client that stops reading can't hold up the next scrape.
+void MetricsServer::serveClient(int sock) {
+  timeval timeout = {1, 0};
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+  string request;
+  char buf[1024];
+  while (request.find("\r\n\r\n") == string::npos && request.size() < 8192) {
+    ssize_t n = recv(sock, buf, sizeof(buf), 0);
+    if (n <= 0)
+      break;
+    request.append(buf, n);
+  }
+
+  string body = render();
+  string reply = "HTTP/1.0 200 OK\r\n"
+                 "Content-Type: text/plain; version=0.0.4\r\n"
+                 "Content-Length: " +
+                 to_string(body.size()) + "\r\nConnection: close\r\n\r\n" +
+                 body;
+  for (size_t sent = 0; sent < reply.size();) {
+    ssize_t n = send(sock, reply.data() + sent, reply.size() - sent,
+                     MSG_NOSIGNAL);
+    if (n <= 0)
+      break;
+    sent += n;
+  }
+  close(sock);
+}
+
+// Called on shutdown
+void MetricsServer::stop() {
+  if (!mRunning.exchange(false))
+    return;
+  shutdown(mListenFd, SHUT_RDWR);
+}
+
+namespace {
+
+string label(const string &value) {
+  string escaped;
+  for (char c : value) {
+    if (c == '\\' || c == '"')
+      escaped += '\\';
+    if (c == '\n')
+      escaped += "\\n";
+    else
+      escaped += c;
+  }
+  return escaped;
+}
+
+void header(ostringstream &out, const char *name, const char *type,
+            const char *help) {
+  out << "# HELP tensorbus_" << name << " " << help << "\n"
+      << "# TYPE tensorbus_" << name << " " << type << "\n";
+}
+
+} // namespace
+
+string MetricsServer::render() {
+  vector<TopicUsageStats> topics;
+  TopicManager::getInstance()->getStats(topics);
+  ShmManager *sm = ShmManager::getInstance();
+  ShmBufferStats buffers = sm->getBufferStats();
+  vector<ShmArenaStats> arenas = sm->getArenaStats();
+  ostringstream out;
+
+  header(out, "topic_published_total", "counter", "Messages published.");
+  for (auto &t : topics)
+    out << "tensorbus_topic_published_total{topic=\"" << label(t.name)
+        << "\"} " << t.published << "\n";
+  header(out, "topic_publish_rate", "gauge",
+         "Messages published per second.");
+  for (auto &t : topics)
+    out << "tensorbus_topic_publish_rate{topic=\"" << label(t.name) << "\"} "
+        << t.publishRate << "\n";
+
+  // per queue counters, a queue is named after the subscriber that created it
+  struct Counter {
+    const char *name;
+    const char *type;
+    const char *help;
+    double (*value)(const TopicQueueStats &q);
+  };
+  static const Counter counters[] = {
+      {"queue_size", "gauge", "Items held by the queue.",
+       [](const TopicQueueStats &q) { return (double)q.size; }},
+      {"queue_pushed_total", "counter", "Items queued.",
+       [](const TopicQueueStats &q) { return (double)q.pushed; }},
+      {"queue_pulled_total", "counter", "Items pulled.",
+       [](const TopicQueueStats &q) { return (double)q.pulled; }},
+      {"queue_dropped_total", "counter",
+       "Items replaced by newer ones in a full queue.",
+       [](const TopicQueueStats &q) { return (double)q.dropped; }},
+      {"queue_skipped_total", "counter",
+       "Items skipped by the flow policy.",
+       [](const TopicQueueStats &q) { return (double)q.skipped; }},
+      {"queue_blocked_posts_total", "counter",
+       "Posts that waited for room in a full queue.",
+       [](const TopicQueueStats &q) { return (double)q.blockedPosts; }},
+      {"queue_blocked_seconds_total", "counter",
+       "Time posts waited for room in a full queue.",
+       [](const TopicQueueStats &q) { return q.blockedUs / 1e6; }},
+  };
+  for (auto &c : counters) {
+    header(out, c.name, c.type, c.help);
+    for (auto &t : topics)
+      for (auto &q : t.queues)
+        out << "tensorbus_" << c.name << "{topic=\"" << label(t.name)
+            << "\",queue=\"" << label(q.owner) << "\"} " << c.value(q)
+            << "\n";
+  }
+
+  header(out, "queue_pull_wait_seconds", "histogram",
+         "Time from a pull to its first item.");
+  for (auto &t : topics) {
+    for (auto &q : t.queues) {
+      string labels =
+          "topic=\"" + label(t.name) + "\",queue=\"" + label(q.owner) + "\"";
+      uint64_t count = 0;
+      for (size_t i = 0; i < q.pullWait.size(); ++i) {
+        count += q.pullWait[i];
+        out << "tensorbus_queue_pull_wait_seconds_bucket{" << labels
+            << ",le=\"";
+        if (i < q.pullWait.size() - 1)
+          out << LatencyHistogram::BOUNDS_US[i] / 1e6;
+        else
+          out << "+Inf";
+        out << "\"} " << count << "\n";
+      }
+      out << "tensorbus_queue_pull_wait_seconds_sum{" << labels << "} "
+          << q.pullWaitSumUs / 1e6 << "\n"
+          << "tensorbus_queue_pull_wait_seconds_count{" << labels << "} "
+          << count << "\n";
+    }
+  }
+
+  header(out, "subscriber_depth", "gauge",
+         "Items the subscriber hasn't pulled.");
+  for (auto &t : topics)
+    for (auto &q : t.queues)
+      for (auto &s : q.subscribers)
+        out << "tensorbus_subscriber_depth{topic=\"" << label(t.name)
+            << "\",subscriber=\"" << label(s.name) << "\"} " << s.depth
+            << "\n";
+  header(out, "subscriber_lag_seconds", "gauge",
+         "Age of the oldest item the subscriber hasn't pulled.");
+  for (auto &t : topics)
+    for (auto &q : t.queues)
+      for (auto &s : q.subscribers)
+        out << "tensorbus_subscriber_lag_seconds{topic=\"" << label(t.name)
+            << "\",subscriber=\"" << label(s.name) << "\"} "
+            << s.lagMs / 1e3 << "\n";
+
+  header(out, "shm_live_buffers", "gauge", "Buffers in use.");
+  out << "tensorbus_shm_live_buffers " << buffers.liveBuffers << "\n";
+  header(out, "shm_live_bytes", "gauge", "Capacity of the buffers in use.");
+  out << "tensorbus_shm_live_bytes " << buffers.liveBytes << "\n";
+  header(out, "shm_pooled_buffers", "gauge",
+         "Released buffers kept for reuse.");
+  out << "tensorbus_shm_pooled_buffers " << buffers.pooledBuffers << "\n";
+  header(out, "shm_pooled_bytes", "gauge",
+         "Capacity of the released buffers kept for reuse.");
+  out << "tensorbus_shm_pooled_bytes " << buffers.pooledBytes << "\n";
+  header(out, "arena_used_bytes", "gauge", "Bytes allocated from the arena.");
+  for (auto &a : arenas)
+    out << "tensorbus_arena_used_bytes{arena=\"" << label(a.name) << "\"} "
+        << a.usedBytes << "\n";
+  header(out, "arena_failed_allocations_total", "counter",
+         "Allocations the arena could not satisfy.");
+  for (auto &a : arenas)
+    out << "tensorbus_arena_failed_allocations_total{arena=\""
+        << label(a.name) << "\"} " << a.failedAllocations << "\n";
+
+  // only present when budgets are configured, the global budget has no label
+  vector<ShmBudgetStats> budgets = ShmManager::getInstance()->getBudgetStats();
+  auto budget = [](const ShmBudgetStats &b) {
+    return b.topic.empty() ? string(" ")
+                           : "{topic=\"" + label(b.topic) + "\"} ";
+  };
+  if (!budgets.empty()) {
+    header(out, "shm_budget_live_bytes", "gauge",
+           "Bytes charged to the shm budget.");
+    for (auto &b : budgets)
+      out << "tensorbus_shm_budget_live_bytes" << budget(b) << b.liveBytes
+          << "\n";
+    header(out, "shm_budget_max_bytes", "gauge",
+           "Limit of the shm budget, 0 if unlimited.");
+    for (auto &b : budgets)
+      out << "tensorbus_shm_budget_max_bytes" << budget(b) << b.maxBytes
+          << "\n";
+    header(out, "shm_budget_rejected_total", "counter",
+           "Buffers the shm budget had no room for.");
+    for (auto &b : budgets)
+      out << "tensorbus_shm_budget_rejected_total" << budget(b)
+          << b.rejected << "\n";
+    header(out, "shm_budget_evicted_messages_total", "counter",
+           "Queued messages dropped to make room in the shm budget.");
+    for (auto &b : budgets)
+      out << "tensorbus_shm_budget_evicted_messages_total" << budget(b)
+          << b.evictedMessages << "\n";
+  }
+
+  SessionStats leases = LeaseManager::getInstance()->getStats();
+  header(out, "sessions", "gauge", "Open client sessions.");
+  out << "tensorbus_sessions " << leases.sessions << "\n";
+  header(out, "leased_buffers", "gauge",
+         "Buffers pulled with a session and not released yet.");
+  out << "tensorbus_leased_buffers " << leases.leasedBuffers << "\n";
+  header(out, "sessions_expired_total", "counter",
+         "Sessions closed because their lease ran out.");
+  out << "tensorbus_sessions_expired_total " << leases.expired << "\n";
+  header(out, "reclaimed_buffers_total", "counter",
+         "Pulled buffers released by the server for closed or expired "
+         "sessions.");
+  out << "tensorbus_reclaimed_buffers_total " << leases.reclaimedBuffers
+      << "\n";
+
+  // only present while tracing is enabled
+  vector<StageLatency> stages = Tracer::getInstance()->getLatency();
+  if (!stages.empty())
+    header(out, "stage_latency_seconds", "summary",
+           "Latency of a message lifecycle stage over its recent samples.");
+  for (auto &s : stages) {
+    string labels = "stage=\"" + s.stage + "\",topic=\"" + label(s.topic) +
+                    "\",subscriber=\"" + label(s.subscriber) + "\"";
+    out << "tensorbus_stage_latency_seconds{" << labels
+        << ",quantile=\"0.5\"} " << s.p50Us / 1e6 << "\n"
+        << "tensorbus_stage_latency_seconds{" << labels
+        << ",quantile=\"0.99\"} " << s.p99Us / 1e6 << "\n"
+        << "tensorbus_stage_latency_seconds_count{" << labels << "} "
+        << s.count << "\n";
+  }
+  return out.str();
+}
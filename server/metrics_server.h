@@ -0,0 +1,36 @@
+#pragma once
+
+#include <atomic>
+#include <string>
+
+using namespace std;
+
+// Serves the stats of GetStats in the Prometheus text format on a local TCP
+// port, for scrapers that don't speak gRPC. Every request gets the metrics
+// whatever its path, connections are served one at a time by a single
+// thread and closed after the reply.
+class MetricsServer {
+private:
+  static MetricsServer *instance;
+  int mListenFd;
+  atomic<bool> mRunning;
+
+  MetricsServer() : mListenFd(-1), mRunning(false) {}
+
+  void acceptClients();
+  void serveClient(int sock);
+
+public:
+  static MetricsServer *getInstance() {
+    if (!instance)
+      instance = new MetricsServer();
+    return instance;
+  }
+
+  bool start(const string &address, unsigned short port);
+  void stop();
+  // The metrics of every topic, queue and buffer in the text format
+  static string render();
+
+  ~MetricsServer() { delete instance; }
+};
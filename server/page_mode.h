@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Page options for large buffers, passed as CreateBufferRequest.page_flags
+// and to the client MapBuffer functions. This header is shared by the server
+// and the C++ client.
+//   PAGES_HUGE     back the buffer with huge pages (MFD_HUGETLB for memfd
+//                  buffers, otherwise madvise(MADV_HUGEPAGE) on the mapping)
+//   PAGES_PREFAULT fault every page in when the buffer is mapped
+//   PAGES_LOCK     mlock the mapping so its pages are never swapped out
+
+#define PAGES_HUGE 0x1
+#define PAGES_PREFAULT 0x2
+#define PAGES_LOCK 0x4
+
+#define HUGE_PAGE_SIZE (size_t(2) << 20)
+
+inline size_t hugePageAlign(size_t size) {
+  return (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+}
+
+// Applies page flags to a fresh shared mapping. Returns false if the pages
+// could not be locked, the other options are best effort.
+inline bool applyPageFlags(void *addr, size_t size, uint32_t flags) {
+  if (flags & PAGES_HUGE)
+    madvise(addr, size, MADV_HUGEPAGE);
+
+  if (flags & PAGES_LOCK)
+    return mlock(addr, size) == 0; // mlock faults the pages in
+
+  if (flags & PAGES_PREFAULT) {
+#ifdef MADV_POPULATE_WRITE
+    if (madvise(addr, size, MADV_POPULATE_WRITE) == 0)
+      return true;
+#endif
+    // older kernels: read one byte per page, shmem allocates the page on a
+    // read fault so this doesn't race with a writer in another process
+    const size_t page = sysconf(_SC_PAGESIZE);
+    volatile const char *p = (volatile const char *)addr;
+    for (size_t offset = 0; offset < size; offset += page)
+      (void)p[offset];
+  }
+  return true;
+}
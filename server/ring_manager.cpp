@@ -0,0 +1,160 @@
+#include "ring_manager.h"
+#include "shm_manager.h"
+#include "spdlog/spdlog.h"
+#include "topic_manager.h"
+#include "tracer.h"
+#include <thread>
+
+RingManager *RingManager::instance = nullptr;
+
+// Server threads poll the ring/topic with this timeout so that they notice
+// rings closed, or clients that died, without being woken.
+static const int RING_POLL_MS = 100;
+
+shared_ptr<DescriptorRing> RingManager::createRing(uint32_t size,
+                                                   uint32_t metadataSize) {
+  auto ring = make_shared<DescriptorRing>();
+  string name = "/shmsvr_ring_" + to_string(getpid()) + "_" +
+                to_string(mCount++);
+  if (!ring->create(name, size ? size : RING_DEFAULT_SIZE,
+                    metadataSize ? metadataSize : RING_DEFAULT_METADATA_SIZE)) {
+    spdlog::error("failed to create descriptor ring:{}", name);
+    return shared_ptr<DescriptorRing>();
+  }
+
+  lock_guard<mutex> lock(mMutex);
+  mRings[name] = ring;
+  return ring;
+}
+
+void RingManager::removeRing(const string &name) {
+  lock_guard<mutex> lock(mMutex);
+  mRings.erase(name);
+}
+
+string RingManager::createPublisherRing(const string &topic_name,
+                                        uint32_t size, uint32_t metadataSize) {
+  shared_ptr<DescriptorRing> ring = createRing(size, metadataSize);
+  if (!ring)
+    return "";
+
+  spdlog::info("publisher ring:{} created for topic:{}", ring->getName(),
+               topic_name);
+  thread(&RingManager::drainPublisherRing, this, ring, topic_name).detach();
+  return ring->getName();
+}
+
+string RingManager::createSubscriberRing(const string &topic_name,
+                                         const string &subscriber_name,
+                                         uint32_t size,
+                                         uint32_t metadataSize) {
+  shared_ptr<DescriptorRing> ring = createRing(size, metadataSize);
+  if (!ring)
+    return "";
+
+  spdlog::info("subscriber ring:{} created for subscriber:{} topic:{}",
+               ring->getName(), subscriber_name, topic_name);
+  thread(&RingManager::fillSubscriberRing, this, ring, topic_name,
+         subscriber_name)
+      .detach();
+  return ring->getName();
+}
+
+void RingManager::drainPublisherRing(shared_ptr<DescriptorRing> ring,
+                                     string topic_name) {
+  string buffer_name, metadata;
+  uint64_t timestamp;
+  uint32_t flags;
+  while (true) {
+    if (!ring->pop(buffer_name, metadata, timestamp, flags, RING_POLL_MS)) {
+      if (ring->isClosed())
+        break;
+      if (!ring->clientAlive()) {
+        spdlog::warn("publisher of ring:{} died", ring->getName());
+        ring->close();
+        break;
+      }
+      continue;
+    }
+
+    if (flags & RING_FLAG_TRUNCATED)
+      spdlog::warn("metadata truncated for buffer:{} on topic:{}",
+                   buffer_name, topic_name);
+    uint64_t trace = Tracer::getInstance()->published(buffer_name, topic_name);
+    TopicManager::getInstance()->publishBuffer(
+        topic_name,
+        makeTopicQueueItem(std::move(buffer_name), std::move(metadata),
+                           timestamp, trace));
+  }
+
+  spdlog::info("publisher ring:{} closed", ring->getName());
+  removeRing(ring->getName());
+}
+
+// A subscriber that dies never closes its ring, so the thread checks that
+// the process that opened the ring is still alive whenever it waits. Once it
+// is gone the buffers it was never handed are released and the subscription
+// removed, its queue would otherwise pin buffers and block the topic's
+// publishers.
+void RingManager::fillSubscriberRing(shared_ptr<DescriptorRing> ring,
+                                     string topic_name,
+                                     string subscriber_name) {
+  TopicManager *tm = TopicManager::getInstance();
+  TopicQueueItem item;
+  bool alive = true;
+  while (!ring->isClosed()) {
+    // same sequence as the Pull RPC
+    tm->clearOldPosts(topic_name, subscriber_name);
+    if (!tm->pull(topic_name, subscriber_name, item, RING_POLL_MS)) {
+      if (!tm->hasTopic(topic_name))
+        break; // the topic was removed
+      if (!(alive = ring->clientAlive()))
+        break;
+      continue;
+    }
+
+    if (!ring->fits(item->metadata.size()))
+      spdlog::warn("metadata for buffer:{} truncated in ring:{}",
+                   item->buffer_name, ring->getName());
+
+    // the subscriber may release the buffer as soon as it is pushed
+    Tracer::getInstance()->pulled(item, subscriber_name);
+    bool pushed = false;
+    while (!pushed && !ring->isClosed() && (alive = ring->clientAlive()))
+      pushed = ring->push(item->buffer_name, item->metadata, item->timestamp,
+                          RING_POLL_MS);
+    if (!pushed) {
+      // nobody will release this buffer
+      ShmManager::getInstance()->release(item->buffer_name);
+      break;
+    }
+  }
+
+  if (!alive) {
+    spdlog::warn("subscriber:{} of ring:{} died, unsubscribing it from "
+                 "topic:{}",
+                 subscriber_name, ring->getName(), topic_name);
+    ring->close();
+    // descriptors pushed but never popped, this thread is the reader now
+    string buffer_name, metadata;
+    uint64_t timestamp;
+    uint32_t flags;
+    while (ring->pop(buffer_name, metadata, timestamp, flags, 0))
+      ShmManager::getInstance()->release(buffer_name);
+    SubscriptionPtr sub = tm->findSubscription(topic_name, subscriber_name);
+    if (sub)
+      tm->unsubscribe(sub);
+  }
+  spdlog::info("subscriber ring:{} closed", ring->getName());
+  removeRing(ring->getName());
+}
+
+// Called on shutdown. Rings are closed and unlinked but stay mapped because
+// the ring threads may still be using them.
+void RingManager::closeAll() {
+  lock_guard<mutex> lock(mMutex);
+  for (auto &it : mRings) {
+    it.second->close();
+    shm_unlink(it.first.c_str());
+  }
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "descriptor_ring.h"
+
+// Owns the data plane descriptor rings. A publisher ring is drained by a
+// server thread that posts each descriptor to its topic. A subscriber ring
+// is filled by a server thread that pulls from the subscriber's TopicQueue,
+// so the queue's drop/block semantics are unchanged and the ring only adds
+// a fixed number of in-flight messages.
+class RingManager {
+private:
+  static RingManager *instance;
+  unordered_map<string, shared_ptr<DescriptorRing>> mRings;
+  atomic<unsigned int> mCount;
+  mutex mMutex;
+
+  RingManager() : mCount(0) {}
+
+  shared_ptr<DescriptorRing> createRing(uint32_t size, uint32_t metadataSize);
+  void removeRing(const string &name);
+  void drainPublisherRing(shared_ptr<DescriptorRing> ring, string topic_name);
+  void fillSubscriberRing(shared_ptr<DescriptorRing> ring, string topic_name,
+                          string subscriber_name);
+
+public:
+  static RingManager *getInstance() {
+    if (!instance)
+      instance = new RingManager();
+    return instance;
+  }
+
+  string createPublisherRing(const string &topic_name, uint32_t size,
+                             uint32_t metadataSize);
+  string createSubscriberRing(const string &topic_name,
+                              const string &subscriber_name, uint32_t size,
+                              uint32_t metadataSize);
+  void closeAll();
+
+  ~RingManager() { delete instance; }
+};
@@ -0,0 +1,130 @@
+#include "shm_arena.h"
+#include "spdlog/spdlog.h"
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+ShmArena::ShmArena(const string &name, size_t size)
+    : mName(name), mSize(size / ALIGNMENT * ALIGNMENT), mCreated(false),
+      mUsedBytes(0), mAllocations(0), mFailedAllocations(0) {}
+
+ShmArena::~ShmArena() {
+  if (mCreated)
+    shm_unlink(mName.c_str());
+}
+
+// The segment must be a new one. A segment left under the same name, by a
+// server that didn't exit cleanly, is unlinked and created again, so that
+// clients still mapping it don't share pages with the new arena.
+bool ShmArena::create() {
+  int fd = shm_open(mName.c_str(), O_CREAT | O_EXCL | O_RDWR,
+                    S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+  if (fd < 0 && errno == EEXIST) {
+    spdlog::warn("shm arena:{} already exists, replacing it", mName);
+    shm_unlink(mName.c_str());
+    fd = shm_open(mName.c_str(), O_CREAT | O_EXCL | O_RDWR,
+                  S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+  }
+  if (fd < 0) {
+    spdlog::error("failed to open shm arena:{}", mName);
+    return false;
+  }
+
+  if (ftruncate(fd, mSize) < 0) {
+    spdlog::error("failed to size shm arena:{} to {} bytes", mName, mSize);
+    close(fd);
+    shm_unlink(mName.c_str());
+    return false;
+  }
+
+  close(fd);
+  lock_guard<mutex> lock(mMutex);
+  mCreated = true;
+  mFreeByOffset.clear();
+  mFreeBySize.clear();
+  insertFree(0, mSize);
+  return true;
+}
+
+void ShmArena::insertFree(size_t offset, size_t length) {
+  mFreeByOffset[offset] = length;
+  mFreeBySize.emplace(length, offset);
+}
+
+void ShmArena::eraseFree(map<size_t, size_t>::iterator it) {
+  auto range = mFreeBySize.equal_range(it->second);
+  for (auto s_it = range.first; s_it != range.second; ++s_it) {
+    if (s_it->second == it->first) {
+      mFreeBySize.erase(s_it);
+      break;
+    }
+  }
+  mFreeByOffset.erase(it);
+}
+
+// length is the page aligned size of the range that was reserved
+bool ShmArena::allocate(size_t size, size_t &offset, size_t &length) {
+  length = (std::max(size, size_t(1)) + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+  lock_guard<mutex> lock(mMutex);
+  auto best = mFreeBySize.lower_bound(length);
+  if (best == mFreeBySize.end()) {
+    mFailedAllocations++;
+    return false;
+  }
+
+  size_t free_offset = best->second;
+  size_t free_length = best->first;
+  eraseFree(mFreeByOffset.find(free_offset));
+  if (length <= SMALL_ALLOCATION) {
+    offset = free_offset + free_length - length;
+    if (free_length > length)
+      insertFree(free_offset, free_length - length);
+  } else {
+    offset = free_offset;
+    if (free_length > length)
+      insertFree(free_offset + length, free_length - length);
+  }
+
+  mUsedBytes += length;
+  mAllocations++;
+  return true;
+}
+
+void ShmArena::free(size_t offset, size_t length) {
+  lock_guard<mutex> lock(mMutex);
+  mUsedBytes -= length;
+  mAllocations--;
+
+  // coalesce with the free ranges on either side
+  auto next = mFreeByOffset.lower_bound(offset);
+  if (next != mFreeByOffset.end() && offset + length == next->first) {
+    length += next->second;
+    eraseFree(next);
+  }
+
+  auto prev = mFreeByOffset.lower_bound(offset);
+  if (prev != mFreeByOffset.begin()) {
+    --prev;
+    if (prev->first + prev->second == offset) {
+      offset = prev->first;
+      length += prev->second;
+      eraseFree(prev);
+    }
+  }
+  insertFree(offset, length);
+}
+
+ShmArenaStats ShmArena::getStats() {
+  lock_guard<mutex> lock(mMutex);
+  ShmArenaStats stats;
+  stats.name = mName;
+  stats.size = mSize;
+  stats.usedBytes = mUsedBytes;
+  stats.freeBytes = mSize - mUsedBytes;
+  stats.largestFree = mFreeBySize.empty() ? 0 : mFreeBySize.rbegin()->first;
+  stats.freeBlocks = mFreeByOffset.size();
+  stats.allocations = mAllocations;
+  stats.failedAllocations = mFailedAllocations;
+  return stats;
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <map>
+#include <mutex>
+#include <string>
+
+using namespace std;
+
+struct ShmArenaStats {
+  string name;
+  size_t size = 0;
+  size_t usedBytes = 0;
+  size_t freeBytes = 0;
+  size_t largestFree = 0; // largest allocation that can currently succeed
+  size_t freeBlocks = 0;
+  size_t allocations = 0;
+  uint64_t failedAllocations = 0;
+};
+
+// A large shm segment that buffers are carved out of, so clients map it once
+// instead of calling shm_open and mmap for every buffer.
+//
+// Allocations are page aligned and served best-fit from the free ranges,
+// which are coalesced with their neighbours when freed. Unlike a buddy
+// allocator this doesn't round a 25 MB frame up to 32 MB. To keep small
+// metadata buffers from splitting the space large frames need, they are cut
+// from the end of the chosen range while large buffers are cut from its
+// start, so the two populations grow from opposite ends of the arena.
+class ShmArena {
+private:
+  string mName;
+  size_t mSize;
+  bool mCreated;
+  map<size_t, size_t> mFreeByOffset;   // offset -> length
+  multimap<size_t, size_t> mFreeBySize; // length -> offset
+  size_t mUsedBytes;
+  size_t mAllocations;
+  uint64_t mFailedAllocations;
+  mutex mMutex;
+
+  // Note: functions below are not thread safe
+  void insertFree(size_t offset, size_t length);
+  void eraseFree(map<size_t, size_t>::iterator it);
+
+public:
+  static const size_t ALIGNMENT = 4096;
+  static const size_t SMALL_ALLOCATION = 64 << 10;
+
+  ShmArena(const string &name, size_t size);
+  virtual ~ShmArena();
+
+  bool create();
+  bool allocate(size_t size, size_t &offset, size_t &length);
+  void free(size_t offset, size_t length);
+  ShmArenaStats getStats();
+
+  inline const string &getName() const { return mName; }
+  inline size_t getSize() const { return mSize; }
+};
@@ -1,72 +1,579 @@
 #include "shm_manager.h"
+#include "arena_handle.h"
+#include "fd_channel.h"
 #include "spdlog/spdlog.h"
 #include <fcntl.h>
 #include <iostream>
+#include <random>
 #include <sys/mman.h>
 #include <unistd.h>
 
 ShmManager *ShmManager::instance = nullptr;
 
-ShmBuffer::ShmBuffer(string name)
-    : mName(name), mAllocated(false), mSize(0), mRefCount(0) {}
+ShmBuffer::ShmBuffer(string name, bool memfd)
+    : mName(name), mAllocated(false), mSize(0), mCapacity(0), mRefCount(0),
+      mGeneration(0), mOffset(0), mMemfd(memfd), mFd(-1), mPageFlags(0),
+      mAddr(nullptr), mCharged(0) {}
 
 ShmBuffer::~ShmBuffer() {
   if (mAllocated)
     deallocate();
 }
 
-bool ShmBuffer::allocate(size_t size) {
+// The segment is truncated to capacity (if larger than size) so that it can
+// later be recycled for any request in the same size class.
+//
+// Huge page buffers are backed by hugetlb memfds when memfd is enabled. A
+// shared hugetlb mapping reserves the file's pages, so the server maps the
+// buffer to find out if enough huge pages are free and falls back to
+// madvise(MADV_HUGEPAGE) otherwise. Named segments always use madvise.
+bool ShmBuffer::allocate(size_t size, size_t capacity, uint32_t pageFlags) {
   if (mAllocated) {
     spdlog::error("shm buffer with name:{} already allocated", mName);    
     return false;
   }
 
-  int fd = shm_open(mName.c_str(), O_CREAT | O_RDWR,
-                    S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+  capacity = std::max(size, capacity);
+  if (pageFlags & PAGES_HUGE)
+    capacity = hugePageAlign(capacity);
+
+  int fd = -1;
+  bool hugetlb = false;
+  if (mMemfd && (pageFlags & PAGES_HUGE)) {
+    fd = memfd_create(mName.c_str(), MFD_CLOEXEC | MFD_HUGETLB);
+    if (fd >= 0 && ftruncate(fd, capacity) >= 0) {
+      mAddr = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      hugetlb = mAddr != MAP_FAILED;
+    }
+    if (!hugetlb) {
+      spdlog::warn("huge pages unavailable for shm buffer:{}, using "
+                   "madvise instead", mName);
+      if (fd >= 0)
+        close(fd);
+      fd = -1;
+      mAddr = nullptr;
+    }
+  }
+
+  if (fd < 0)
+    fd = mMemfd ? memfd_create(mName.c_str(), MFD_CLOEXEC)
+                : shm_open(mName.c_str(), O_CREAT | O_RDWR,
+                           S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
   if (fd >= 0) {
-    if (ftruncate(fd, size) >= 0) {
+    if (hugetlb || ftruncate(fd, capacity) >= 0) {
       mAllocated = true;
       mSize = size;
+      mCapacity = capacity;
+      mPageFlags = pageFlags;
     } else
       spdlog::error("failed to allocate shm bufffer");
 
-    close(fd);
+    // keep the pages resident for as long as the segment exists
+    if (mAllocated && !mAddr && (pageFlags & (PAGES_PREFAULT | PAGES_LOCK))) {
+      mAddr = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      if (mAddr == MAP_FAILED)
+        mAddr = nullptr;
+    }
+    uint32_t mapFlags = hugetlb ? pageFlags & ~PAGES_HUGE : pageFlags;
+    if (mAddr && !applyPageFlags(mAddr, capacity, mapFlags))
+      spdlog::warn("failed to lock shm buffer:{}, check RLIMIT_MEMLOCK",
+                   mName);
+
+    // a memfd has no name, the descriptor is the only reference to it
+    if (mMemfd && mAllocated)
+      mFd = fd;
+    else
+      close(fd);
   }
   return mAllocated;
 }
 
+// The range [offset, offset + capacity) must have been reserved in the arena
+bool ShmBuffer::allocate(shared_ptr<ShmArena> arena, size_t offset,
+                         size_t size, size_t capacity) {
+  if (mAllocated) {
+    spdlog::error("shm buffer with name:{} already allocated", mName);
+    return false;
+  }
+
+  mArena = arena;
+  mOffset = offset;
+  mSize = size;
+  mCapacity = capacity;
+  mAllocated = true;
+  return true;
+}
+
 void ShmBuffer::deallocate() {
   if (mAllocated) {
-    shm_unlink(mName.c_str());
+    if (mAddr) {
+      munmap(mAddr, mCapacity);
+      mAddr = nullptr;
+    }
+    if (mArena) {
+      mArena->free(mOffset, mCapacity);
+      mArena.reset();
+    } else if (mMemfd) {
+      close(mFd);
+      mFd = -1;
+    } else
+      shm_unlink(mName.c_str());
     mAllocated = false;
   }
 }
 
+void ShmBuffer::recycle(size_t size) {
+  mSize = size;
+  mRefCount = 0;
+  mGeneration++;
+}
+
+ShmManager::ShmManager()
+    : mPoolBytes(0), mPoolMaxBytes(0), mPoolMaxIdle(0), mNameCount(0),
+      mEpoch((uint64_t)random_device()() << 32 | 1), mUseMemfd(false),
+      mBudgets(false) {}
+
+// Size classes are page aligned and spaced 1/8 of a power of two apart, which
+// bounds the wasted tail of a recycled segment to 12.5% of its size. Huge
+// page buffers are additionally rounded up to a whole number of huge pages.
+size_t ShmManager::sizeClass(size_t size, uint32_t pageFlags) {
+  const size_t page = 4096;
+  if (size <= page)
+    return (pageFlags & PAGES_HUGE) ? HUGE_PAGE_SIZE : page;
+
+  size_t msb = size_t(1) << (63 - __builtin_clzll(size));
+  size_t step = std::max(page, msb / 8);
+  size_t capacity = (size + step - 1) / step * step;
+  return (pageFlags & PAGES_HUGE) ? hugePageAlign(capacity) : capacity;
+}
+
+void ShmManager::configurePool(size_t maxBytes, unsigned int maxIdleMs) {
+  vector<shared_ptr<ShmBuffer>> expired;
+  {
+    lock_guard<mutex> lock(mPoolMutex);
+    mPoolMaxBytes = maxBytes;
+    mPoolMaxIdle = chrono::milliseconds(maxIdleMs);
+    trimPool(expired);
+  }
+  spdlog::info("shm buffer pool max_bytes:{} max_idle_ms:{}", maxBytes,
+               maxIdleMs);
+}
+
+// Note: must be called before the server starts handling requests
+bool ShmManager::configureArenas(size_t arenaSize, unsigned int count) {
+  mArenas.clear();
+  for (unsigned int i = 0; i < count && arenaSize > 0; ++i) {
+    auto arena =
+        make_shared<ShmArena>("/shmsvr_arena_" + to_string(i), arenaSize);
+    if (!arena->create()) {
+      mArenas.clear();
+      return false;
+    }
+    mArenas.push_back(arena);
+  }
+
+  if (!mArenas.empty())
+    spdlog::info("shm arenas count:{} size:{}", mArenas.size(),
+                 mArenas.front()->getSize());
+  return true;
+}
+
+// Note: must be called before the server starts handling requests
+void ShmManager::configureMemfd(bool enabled) {
+  mUseMemfd = enabled;
+  spdlog::info("shm buffers backed by {}", enabled ? "memfd" : "/dev/shm");
+}
+
+// Note: must be called before the server starts handling requests
+void ShmManager::configureBudget(const string &topic,
+                                 const ShmBudget &budget) {
+  lock_guard<mutex> lock(mBudgetMutex);
+  BudgetUsage &usage = topic.empty() ? mGlobalBudget : mTopicBudgets[topic];
+  usage.budget = budget;
+  mBudgets = true;
+  spdlog::info("shm budget topic:{} max_bytes:{} policy:{} wait_ms:{}",
+               topic.empty() ? "*" : topic, budget.maxBytes,
+               (uint32_t)budget.policy, budget.waitMs);
+}
+
+void ShmManager::setEvictor(function<unsigned int(const string &)> evictor) {
+  lock_guard<mutex> lock(mBudgetMutex);
+  mEvictor = evictor;
+}
+
+// The global budget comes first, then one entry per topic budget
+vector<ShmBudgetStats> ShmManager::getBudgetStats() {
+  vector<ShmBudgetStats> stats;
+  if (!mBudgets)
+    return stats;
+  auto add = [&stats](const string &topic, const BudgetUsage &usage) {
+    ShmBudgetStats s;
+    s.topic = topic;
+    s.liveBytes = usage.liveBytes;
+    s.maxBytes = usage.budget.maxBytes;
+    s.rejected = usage.rejected;
+    s.waited = usage.waited;
+    s.evictedMessages = usage.evictedMessages;
+    stats.push_back(s);
+  };
+  lock_guard<mutex> lock(mBudgetMutex);
+  add("", mGlobalBudget);
+  for (auto &it : mTopicBudgets)
+    add(it.first, it.second);
+  return stats;
+}
+
+vector<ShmArenaStats> ShmManager::getArenaStats() {
+  vector<ShmArenaStats> stats;
+  for (auto &arena : mArenas)
+    stats.push_back(arena->getStats());
+  return stats;
+}
+
+ShmBufferStats ShmManager::getBufferStats() {
+  ShmBufferStats stats;
+  for (auto &s : mShards) {
+    shared_lock<shared_mutex> lock(s.mMutex);
+    stats.liveBuffers += s.mBuffers.size();
+    for (auto &it : s.mBuffers)
+      stats.liveBytes += it.second->getCapacity();
+  }
+  lock_guard<mutex> lock(mPoolMutex);
+  for (auto &it : mPool)
+    stats.pooledBuffers += it.second.size();
+  stats.pooledBytes = mPoolBytes;
+  return stats;
+}
+
+string ShmManager::nextName() {
+  if (mUseMemfd)
+    return makeMemfdHandle(mNameCount++);
+  return "/shmsvr_" + to_string(mNameCount++);
+}
+
+// Drop idle buffers that exceed the pool limits. Buffers are returned through
+// expired so that shm_unlink is called after the pool lock is released.
+void ShmManager::trimPool(vector<shared_ptr<ShmBuffer>> &expired) {
+  auto now = chrono::steady_clock::now();
+  for (auto it = mPool.begin(); it != mPool.end();) {
+    auto &idle = it->second;
+    // the front of each size class holds the least recently released buffer
+    while (!idle.empty() && now - idle.front().releasedAt > mPoolMaxIdle) {
+      mPoolBytes -= idle.front().buffer->getCapacity();
+      expired.push_back(idle.front().buffer);
+      idle.pop_front();
+    }
+    it = idle.empty() ? mPool.erase(it) : next(it);
+  }
+
+  // evict the oldest buffers across all size classes until under budget
+  while (mPoolBytes > mPoolMaxBytes) {
+    auto oldest = mPool.begin();
+    for (auto it = mPool.begin(); it != mPool.end(); ++it) {
+      if (it->second.front().releasedAt < oldest->second.front().releasedAt)
+        oldest = it;
+    }
+    mPoolBytes -= oldest->first.first;
+    expired.push_back(oldest->second.front().buffer);
+    oldest->second.pop_front();
+    if (oldest->second.empty())
+      mPool.erase(oldest);
+  }
+}
+
+void ShmManager::recycle(shared_ptr<ShmBuffer> shm_buf,
+                         vector<shared_ptr<ShmBuffer>> &expired) {
+  // arena ranges are cheap to reserve again and aren't pooled
+  size_t capacity = shm_buf->getCapacity();
+  uint32_t pageFlags = shm_buf->getPageFlags();
+  if (shm_buf->inArena() || capacity != sizeClass(capacity, pageFlags) ||
+      capacity > mPoolMaxBytes) {
+    expired.push_back(shm_buf);
+    return;
+  }
+
+  mPool[make_pair(capacity, pageFlags)].push_back(
+      {shm_buf, chrono::steady_clock::now()});
+  mPoolBytes += capacity;
+  trimPool(expired);
+}
+
+ShmManager::BudgetUsage *ShmManager::overBudget(size_t bytes,
+                                                BudgetUsage *topicUsage) {
+  if (topicUsage && topicUsage->budget.maxBytes &&
+      topicUsage->liveBytes + bytes > topicUsage->budget.maxBytes)
+    return topicUsage;
+  if (mGlobalBudget.budget.maxBytes &&
+      mGlobalBudget.liveBytes + bytes > mGlobalBudget.budget.maxBytes)
+    return &mGlobalBudget;
+  return nullptr;
+}
+
+// Applies the policy of whichever budget has no room until both do. The
+// evictor runs without the lock, the releases it triggers discharge their
+// buffers, and is called again for as long as each call frees some bytes. A
+// message whose buffer is still held elsewhere frees nothing when dropped, so
+// evicting stops there instead of emptying the topic.
+// Waits share a single deadline, the one of the first budget that waited.
+bool ShmManager::reserve(size_t bytes, const string &topic) {
+  unique_lock<mutex> lock(mBudgetMutex);
+  auto it = topic.empty() ? mTopicBudgets.end() : mTopicBudgets.find(topic);
+  BudgetUsage *topicUsage = it == mTopicBudgets.end() ? nullptr : &it->second;
+  bool waiting = false;
+  chrono::steady_clock::time_point deadline;
+  BudgetUsage *usage;
+  while ((usage = overBudget(bytes, topicUsage))) {
+    const ShmBudget &budget = usage->budget;
+    if (bytes <= budget.maxBytes) {
+      if (budget.policy == BUDGET_EVICT && mEvictor) {
+        auto evictor = mEvictor;
+        size_t liveBytes = usage->liveBytes;
+        lock.unlock();
+        unsigned int evicted = evictor(usage == topicUsage ? topic : "");
+        lock.lock();
+        usage->evictedMessages += evicted;
+        if (evicted > 0 && usage->liveBytes < liveBytes)
+          continue;
+      } else if (budget.policy == BUDGET_WAIT && budget.waitMs > 0) {
+        if (!waiting) {
+          waiting = true;
+          usage->waited++;
+          deadline = chrono::steady_clock::now() +
+                     chrono::milliseconds(budget.waitMs);
+        }
+        if (mBudgetCV.wait_until(lock, deadline) == cv_status::no_timeout)
+          continue;
+        if (!overBudget(bytes, topicUsage))
+          break;
+      }
+    }
+    usage->rejected++;
+    return false;
+  }
+
+  mGlobalBudget.liveBytes += bytes;
+  if (topicUsage)
+    topicUsage->liveBytes += bytes;
+  return true;
+}
+
+void ShmManager::unreserve(size_t bytes, const string &topic) {
+  {
+    lock_guard<mutex> lock(mBudgetMutex);
+    mGlobalBudget.liveBytes -= bytes;
+    auto it = topic.empty() ? mTopicBudgets.end() : mTopicBudgets.find(topic);
+    if (it != mTopicBudgets.end())
+      it->second.liveBytes -= bytes;
+  }
+  mBudgetCV.notify_all();
+}
+
+// Buffers leave the budgets when they leave the shards, before they are
+// pooled or freed
+void ShmManager::discharge(shared_ptr<ShmBuffer> shm_buf) {
+  size_t charged;
+  string topic;
+  {
+    lock_guard<mutex> lock(mBudgetMutex);
+    charged = shm_buf->getCharged();
+    topic = shm_buf->getTopic();
+    shm_buf->setCharged(0);
+    shm_buf->setTopic("");
+  }
+  if (charged)
+    unreserve(charged, topic);
+}
+
+// Returns null if no arena has room for the buffer
+shared_ptr<ShmBuffer> ShmManager::createArenaBuffer(size_t size) {
+  size_t offset, length;
+  for (auto &arena : mArenas) {
+    if (!arena->allocate(size, offset, length))
+      continue;
+
+    auto shm_buf = make_shared<ShmBuffer>(
+        makeArenaHandle(arena->getName(), offset, length));
+    shm_buf->allocate(arena, offset, size, length);
+    spdlog::debug("allocated shm buffer {}", shm_buf->getName());
+    return shm_buf;
+  }
+  return shared_ptr<ShmBuffer>();
+}
+
+// Buffers with page flags are never carved out of an arena. The buffer is
+// not added to the shards yet.
+shared_ptr<ShmBuffer> ShmManager::allocateBuffer(size_t size,
+                                                 uint32_t pageFlags) {
+  if (!mArenas.empty() && !pageFlags) {
+    shared_ptr<ShmBuffer> shm_buf = createArenaBuffer(size);
+    if (shm_buf)
+      return shm_buf;
+    spdlog::debug("shm arenas full, allocating a segment of size:{}", size);
+  }
+
+  size_t capacity = sizeClass(size, pageFlags);
+  shared_ptr<ShmBuffer> shm_buf;
+  vector<shared_ptr<ShmBuffer>> expired;
+  {
+    lock_guard<mutex> lock(mPoolMutex);
+    trimPool(expired);
+    auto it = mPool.find(make_pair(capacity, pageFlags));
+    if (it != mPool.end()) {
+      // reuse the most recently released buffer, its pages are the warmest
+      shm_buf = it->second.back().buffer;
+      it->second.pop_back();
+      if (it->second.empty())
+        mPool.erase(it);
+      mPoolBytes -= capacity;
+    }
+  }
+
+  if (shm_buf) {
+    shm_buf->recycle(size);
+    spdlog::debug("recycled shm buffer {}", shm_buf->getName());
+    return shm_buf;
+  }
+
+  string name = nextName();
+  spdlog::debug("allocating shm buffer {}", name);
+  shm_buf = make_shared<ShmBuffer>(name, mUseMemfd);
+  if (!shm_buf->allocate(size, capacity, pageFlags))
+    return shared_ptr<ShmBuffer>();
+  return shm_buf;
+}
+
+// The size class is reserved before the buffer is allocated, so concurrent
+// creates can't take a budget over its limit together. Topics without a
+// budget of their own are only charged to the global budget.
+shared_ptr<ShmBuffer> ShmManager::createBuffer(size_t size,
+                                               uint32_t pageFlags,
+                                               const string &topic,
+                                               bool *overBudget) {
+  if (overBudget)
+    *overBudget = false;
+  size_t charge = 0;
+  string budgetTopic;
+  if (mBudgets) {
+    charge = sizeClass(size, pageFlags);
+    if (mTopicBudgets.count(topic))
+      budgetTopic = topic;
+    if (!reserve(charge, budgetTopic)) {
+      spdlog::debug("shm budget exceeded for size:{} topic:{}", size, topic);
+      if (overBudget)
+        *overBudget = true;
+      return shared_ptr<ShmBuffer>();
+    }
+  }
+
+  shared_ptr<ShmBuffer> shm_buf = allocateBuffer(size, pageFlags);
+  if (!shm_buf) {
+    if (charge)
+      unreserve(charge, budgetTopic);
+    return shm_buf;
+  }
+  shm_buf->setCharged(charge);
+  shm_buf->setTopic(budgetTopic);
+  add(shm_buf);
+  return shm_buf;
+}
+
+void ShmManager::attribute(shared_ptr<ShmBuffer> shm_buf,
+                           const string &topic) {
+  auto it = mTopicBudgets.find(topic);
+  if (it == mTopicBudgets.end())
+    return;
+  lock_guard<mutex> lock(mBudgetMutex);
+  if (!shm_buf->getCharged() || !shm_buf->getTopic().empty())
+    return;
+  shm_buf->setTopic(topic);
+  it->second.liveBytes += shm_buf->getCharged();
+}
+
 shared_ptr<ShmBuffer> ShmManager::getBuffer(const string &name) {
-  lock_guard<mutex> lock(mMutex);
-  auto it = mBuffers.find(name);
-  return it == mBuffers.end() ? shared_ptr<ShmBuffer>() : it->second;
+  BufferShard &s = shard(name);
+  shared_lock<shared_mutex> lock(s.mMutex);
+  auto it = s.mBuffers.find(name);
+  return it == s.mBuffers.end() ? shared_ptr<ShmBuffer>() : it->second;
+}
+
+// Unknown names yield a null entry
+void ShmManager::getBuffers(const vector<string> &names,
+                            vector<shared_ptr<ShmBuffer>> &buffers) {
+  buffers.clear();
+  buffers.reserve(names.size());
+  for (auto &name : names)
+    buffers.push_back(getBuffer(name));
 }
 
 void ShmManager::add(shared_ptr<ShmBuffer> shm_buf) {
-  lock_guard<mutex> lock(mMutex);
-  mBuffers[shm_buf->getName()] = shm_buf;
+  BufferShard &s = shard(shm_buf->getName());
+  unique_lock<shared_mutex> lock(s.mMutex);
+  s.mBuffers[shm_buf->getName()] = shm_buf;
+}
+
+// Called after a release took the buffer's count to zero or below. Concurrent
+// releases may all get here, and the buffer may even have been recycled and
+// handed out again in the meantime, so the removal is confirmed under the
+// exclusive shard lock against the generation seen when the count dropped.
+void ShmManager::releaseBuffer(shared_ptr<ShmBuffer> shm_buf,
+                               uint64_t generation,
+                               vector<shared_ptr<ShmBuffer>> &expired) {
+  {
+    BufferShard &s = shard(shm_buf->getName());
+    unique_lock<shared_mutex> lock(s.mMutex);
+    auto it = s.mBuffers.find(shm_buf->getName());
+    if (it == s.mBuffers.end() || it->second != shm_buf ||
+        shm_buf->getGeneration() != generation || shm_buf->getRefCount() > 0)
+      return;
+    s.mBuffers.erase(it);
+  }
+  if (mBudgets)
+    discharge(shm_buf);
+
+  lock_guard<mutex> lock(mPoolMutex);
+  recycle(shm_buf, expired);
 }
 
 void ShmManager::release(const string &name, int n) {
-  lock_guard<mutex> lock(mMutex);
-  auto it = mBuffers.find(name);
-  if (it != mBuffers.end()) {
-    it->second->decRefCount(n);
-    if (it->second->getRefCount() == 0)
-      mBuffers.erase(name);
+  shared_ptr<ShmBuffer> shm_buf = getBuffer(name);
+  if (!shm_buf)
+    return;
+
+  uint64_t generation = shm_buf->getGeneration();
+  vector<shared_ptr<ShmBuffer>> expired;
+  if (shm_buf->decRefCount(n))
+    releaseBuffer(shm_buf, generation, expired);
+}
+
+void ShmManager::release(const vector<string> &names, int n) {
+  vector<shared_ptr<ShmBuffer>> expired;
+  for (auto &name : names) {
+    shared_ptr<ShmBuffer> shm_buf = getBuffer(name);
+    if (!shm_buf)
+      continue;
+    uint64_t generation = shm_buf->getGeneration();
+    if (shm_buf->decRefCount(n))
+      releaseBuffer(shm_buf, generation, expired);
   }
 }
 
 void ShmManager::releaseAll() {
-  lock_guard<mutex> lock(mMutex);
-  for (auto &it : mBuffers)
-    it.second->setRefCount(0);
+  for (auto &s : mShards) {
+    unique_lock<shared_mutex> lock(s.mMutex);
+    for (auto &it : s.mBuffers)
+      it.second->setRefCount(0);
+    s.mBuffers.clear();
+  }
+
+  {
+    lock_guard<mutex> lock(mBudgetMutex);
+    mGlobalBudget.liveBytes = 0;
+    for (auto &it : mTopicBudgets)
+      it.second.liveBytes = 0;
+  }
 
-  mBuffers.clear();
+  lock_guard<mutex> lock(mPoolMutex);
+  mPool.clear();
+  mPoolBytes = 0;
+  mArenas.clear();
 }
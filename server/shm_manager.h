@@ -1,9 +1,20 @@
 #pragma once
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
 #include <memory>
 #include <mutex>
+#include <shared_mutex>
 #include <string>
 #include <unordered_map>
+#include <vector>
+
+#include "page_mode.h"
+#include "shm_arena.h"
 
 using namespace std;
 
@@ -11,31 +22,164 @@ class ShmBuffer {
 private:
   string mName;
   bool mAllocated;
-  size_t mSize;
-  int mRefCount;
+  size_t mSize;     // size requested by the current owner
+  size_t mCapacity; // size of the underlying shm segment
+  atomic<int> mRefCount;
+  atomic<uint64_t> mGeneration; // incremented every time the segment is recycled
+  shared_ptr<ShmArena> mArena; // set if the buffer lives inside an arena
+  size_t mOffset;
+  bool mMemfd; // backed by an anonymous memfd instead of a /dev/shm name
+  int mFd;     // memfd descriptor, handed to clients by FdServer
+  uint32_t mPageFlags; // PAGES_* options, see page_mode.h
+  void *mAddr; // server side mapping that holds huge/locked/prefaulted pages
+  string mTopic;   // topic budget charged, guarded by the manager's budgets
+  size_t mCharged; // bytes charged to the budgets, 0 if not charged
 
 public:
-  ShmBuffer(string name);
+  ShmBuffer(string name, bool memfd = false);
   virtual ~ShmBuffer();
 
-  bool allocate(size_t size);
+  bool allocate(size_t size, size_t capacity = 0, uint32_t pageFlags = 0);
+  bool allocate(shared_ptr<ShmArena> arena, size_t offset, size_t size,
+                size_t capacity);
   void deallocate();
+  void recycle(size_t size);
 
   inline string getName() { return mName; }
   inline int getRefCount() { return mRefCount; }
   inline void incRefCount() { mRefCount++; }
-  inline void decRefCount(int n = 1) { mRefCount = std::max(0, mRefCount - n); }
+  // Returns true if the count is now zero or below. Only the manager's
+  // release decides, under the shard lock, whether the buffer is freed.
+  inline bool decRefCount(int n = 1) { return mRefCount.fetch_sub(n) <= n; }
   inline void setRefCount(int count) { mRefCount = count; }
   inline size_t getSize() { return mSize; }
+  inline size_t getCapacity() { return mCapacity; }
+  inline uint64_t getGeneration() { return mGeneration; }
+  inline bool inArena() { return mArena != nullptr; }
+  inline string getArenaName() { return mArena ? mArena->getName() : ""; }
+  inline size_t getOffset() { return mOffset; }
+  inline int getFd() { return mFd; }
+  inline uint32_t getPageFlags() { return mPageFlags; }
+  inline const string &getTopic() { return mTopic; }
+  inline void setTopic(const string &topic) { mTopic = topic; }
+  inline size_t getCharged() { return mCharged; }
+  inline void setCharged(size_t charged) { mCharged = charged; }
+};
+
+// What createBuffer does when a buffer would take a budget over its limit
+enum BudgetPolicy : uint32_t {
+  BUDGET_FAIL = 0,  // reject the buffer
+  BUDGET_WAIT = 1,  // wait up to waitMs for buffers to be released
+  BUDGET_EVICT = 2, // drop the oldest queued messages, then reject
+};
+
+struct ShmBudget {
+  size_t maxBytes = 0; // 0 is unlimited
+  BudgetPolicy policy = BUDGET_FAIL;
+  unsigned int waitMs = 0;
+};
+
+struct ShmBudgetStats {
+  string topic; // empty for the global budget
+  size_t liveBytes = 0;
+  size_t maxBytes = 0;
+  uint64_t rejected = 0;
+  uint64_t waited = 0;          // creates that had to wait, rejected or not
+  uint64_t evictedMessages = 0; // dropped to make room
+};
+
+struct ShmBufferStats {
+  size_t liveBuffers = 0;
+  size_t liveBytes = 0; // capacity of the buffers in use
+  size_t pooledBuffers = 0;
+  size_t pooledBytes = 0;
 };
 
+// Released buffers are kept in a pool grouped by size class so that steady
+// state publishing reuses warm segments instead of calling shm_open,
+// ftruncate and shm_unlink for every message. When arenas are configured
+// buffers are carved out of them instead and only fall back to standalone
+// segments when every arena is full. Standalone segments are either named
+// /dev/shm objects or, with memfd enabled, anonymous memfds whose descriptors
+// clients receive from FdServer.
+//
+// Live buffers are spread over shards by name. Lookups take their shard in
+// shared mode and a release is a single atomic decrement, only the release
+// that takes a buffer to zero locks its shard exclusively to remove it. The
+// pool has a lock of its own, and freed segments are unmapped and unlinked
+// after every lock is released.
+//
+// Budgets bound the bytes held by live buffers, globally and per topic. A
+// buffer is charged its size class when it is created, to the global budget
+// and to the budget of the topic it is created for, and discharged when it
+// is released for good. Buffers created without a topic are charged to the
+// topic they are first published to, which can take that topic over its
+// budget until they are released. Pooled buffers are not charged.
 class ShmManager {
 private:
+  static const size_t SHARD_COUNT = 16;
+
+  struct PooledBuffer {
+    shared_ptr<ShmBuffer> buffer;
+    chrono::steady_clock::time_point releasedAt;
+  };
+
+  struct BufferShard {
+    shared_mutex mMutex;
+    unordered_map<string, shared_ptr<ShmBuffer>> mBuffers;
+  };
+
+  struct BudgetUsage {
+    ShmBudget budget;
+    size_t liveBytes = 0;
+    uint64_t rejected = 0;
+    uint64_t waited = 0;
+    uint64_t evictedMessages = 0;
+  };
+
   static ShmManager *instance;
-  unordered_map<string, shared_ptr<ShmBuffer>> mBuffers;
-  mutex mMutex;
+  BufferShard mShards[SHARD_COUNT];
+  // (size class, page flags) -> idle buffers
+  map<pair<size_t, uint32_t>, deque<PooledBuffer>> mPool;
+  size_t mPoolBytes;
+  size_t mPoolMaxBytes;
+  chrono::milliseconds mPoolMaxIdle;
+  atomic<unsigned int> mNameCount;
+  uint64_t mEpoch; // tells apart the segments of two runs named alike
+  bool mUseMemfd;
+  vector<shared_ptr<ShmArena>> mArenas; // fixed once the server is running
+  mutex mPoolMutex;
+  bool mBudgets; // false if no budget is configured, nothing is charged then
+  BudgetUsage mGlobalBudget;
+  unordered_map<string, BudgetUsage> mTopicBudgets; // fixed once running
+  // drops the oldest queued messages of a topic, or of every topic if the
+  // name is empty, and returns how many were dropped
+  function<unsigned int(const string &)> mEvictor;
+  mutex mBudgetMutex;
+  condition_variable mBudgetCV;
 
-  ShmManager() {}
+  ShmManager();
+
+  inline BufferShard &shard(const string &name) {
+    return mShards[hash<string>()(name) % SHARD_COUNT];
+  }
+  string nextName();
+  shared_ptr<ShmBuffer> createArenaBuffer(size_t size);
+  shared_ptr<ShmBuffer> allocateBuffer(size_t size, uint32_t pageFlags);
+  void releaseBuffer(shared_ptr<ShmBuffer> shm_buf, uint64_t generation,
+                     vector<shared_ptr<ShmBuffer>> &expired);
+  bool reserve(size_t bytes, const string &topic);
+  void unreserve(size_t bytes, const string &topic);
+  void discharge(shared_ptr<ShmBuffer> shm_buf);
+
+  // Note: requires mBudgetMutex. Returns the budget bytes would take over
+  // its limit, the topic's first, or null.
+  BudgetUsage *overBudget(size_t bytes, BudgetUsage *topicUsage);
+
+  // Note: functions below require mPoolMutex
+  void trimPool(vector<shared_ptr<ShmBuffer>> &expired);
+  void recycle(shared_ptr<ShmBuffer> shm_buf,
+               vector<shared_ptr<ShmBuffer>> &expired);
 
 public:
   static ShmManager *getInstance() {
@@ -44,9 +188,34 @@ public:
     return instance;
   }
 
+  static size_t sizeClass(size_t size, uint32_t pageFlags = 0);
+  // A buffer name refers to one segment for as long as the manager lives,
+  // recycling keeps the segment. Names restart with the next server, whose
+  // epoch differs, so clients may keep a mapping while the epoch is the same.
+  uint64_t getEpoch() const { return mEpoch; }
+
+  void configurePool(size_t maxBytes, unsigned int maxIdleMs);
+  bool configureArenas(size_t arenaSize, unsigned int count);
+  void configureMemfd(bool enabled);
+  // An empty topic configures the global budget
+  void configureBudget(const string &topic, const ShmBudget &budget);
+  void setEvictor(function<unsigned int(const string &)> evictor);
+  vector<ShmArenaStats> getArenaStats();
+  ShmBufferStats getBufferStats();
+  vector<ShmBudgetStats> getBudgetStats();
+  // Returns null if the buffer couldn't be allocated or, with overBudget
+  // set to true, if a budget had no room for it
+  shared_ptr<ShmBuffer> createBuffer(size_t size, uint32_t pageFlags = 0,
+                                     const string &topic = "",
+                                     bool *overBudget = nullptr);
+  // Charges a buffer created without a topic to the topic it is published to
+  void attribute(shared_ptr<ShmBuffer> shm_buf, const string &topic);
   shared_ptr<ShmBuffer> getBuffer(const string &name);
+  void getBuffers(const vector<string> &names,
+                  vector<shared_ptr<ShmBuffer>> &buffers);
   void add(shared_ptr<ShmBuffer> shm_buf);
   void release(const string &name, int n = 1);
+  void release(const vector<string> &names, int n = 1);
   void releaseAll();
 
   ~ShmManager() { delete instance; }
@@ -1,4 +1,5 @@
 
+#include <grpcpp/alarm.h>
 #include <grpcpp/grpcpp.h>
 
 #include <atomic>
@@ -11,7 +12,10 @@
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <thread>
+#include <type_traits>
 #include <unordered_map>
+#include <vector>
 
 #include <fcntl.h> /* For O_* constants */
 #include <sys/mman.h>
@@ -23,49 +27,99 @@
 #include <nlohmann/json.hpp>
 #include <shm_server.grpc.pb.h>
 
+#include "async_call.h"
+#include "blocking_pool.h"
+#include "consumer_group.h"
+#include "fd_channel.h"
+#include "fd_server.h"
+#include "group_call.h"
+#include "lease_manager.h"
+#include "metrics_server.h"
+#include "ring_manager.h"
 #include "shm_manager.h"
+#include "stream_call.h"
+#include "sync_call.h"
 #include "topic_manager.h"
+#include "tracer.h"
 
 using namespace std;
 using json = nlohmann::json;
 using grpc::Server;
 using grpc::ServerBuilder;
+using grpc::ServerCompletionQueue;
 using grpc::ServerContext;
 using grpc::Status;
 
-class ShmServiceImpl final : public Shm::Service {
-private:
-  mutex mMutex;
+// The message is shared by every subscriber queue, its strings are moved out
+// of the request. Requests belong to their UnaryCall, which hands them to the
+// handler mutable and doesn't read them again once the handler returns.
+inline TopicQueueItem takeMessage(PublishRequest *request,
+                                  const string &topic_name) {
+  uint64_t trace = 0;
+  Tracer *tracer = Tracer::getInstance();
+  if (tracer->enabled())
+    trace = tracer->published(request->buffer_name(), topic_name,
+                              vector<string>(request->parent_buffers().begin(),
+                                             request->parent_buffers().end()));
+  return makeTopicQueueItem(std::move(*request->mutable_buffer_name()),
+                            std::move(*request->mutable_metadata()),
+                            request->timestamp(), trace);
+}
 
+// Handlers for the unary RPCs, driven by UnaryCall on the worker threads.
+// Pull and PullBatch are handled by PullCall so that waiting pulls don't hold
+// a thread.
+class ShmServiceImpl {
 public:
   Status CreateBuffer(ServerContext *context,
                       const CreateBufferRequest *request,
-                      CreateBufferReply *reply) override {
+                      CreateBufferReply *reply) {
     reply->set_result(-1);
-    // create buffer name
-    static std::atomic<unsigned int> count(0);
-    string name = "/shmsvr_" + to_string(count++);
-    spdlog::debug("allocating shm buffer {}", name);
-
-    shared_ptr<ShmBuffer> buffer = make_shared<ShmBuffer>(name);
-    if (!buffer->allocate(request->size())) {
+    bool overBudget;
+    shared_ptr<ShmBuffer> buffer = ShmManager::getInstance()->createBuffer(
+        request->size(), request->page_flags(), request->topic_name(),
+        &overBudget);
+    if (overBudget)
+      return Status(grpc::StatusCode::RESOURCE_EXHAUSTED,
+                    "shm budget exceeded");
+    if (!buffer) {
       spdlog::error("shm buffer allocation failed for request size:{}",
                     request->size());
       return Status::CANCELLED;
     }
-    ShmManager::getInstance()->add(buffer);
-    reply->set_name(name);
+    Tracer::getInstance()->created(buffer->getName());
+    reply->set_name(buffer->getName());
+    reply->set_server_epoch(ShmManager::getInstance()->getEpoch());
+    if (buffer->inArena()) {
+      reply->set_arena_name(buffer->getArenaName());
+      reply->set_offset(buffer->getOffset());
+      reply->set_length(buffer->getCapacity());
+    }
+    uint64_t memfd_id;
+    if (parseMemfdHandle(buffer->getName(), memfd_id))
+      reply->set_memfd_id(memfd_id);
+    reply->set_page_flags(buffer->getPageFlags());
     reply->set_result(0);
     return Status::OK;
   }
 
   Status GetBuffer(ServerContext *context, const GetBufferRequest *request,
-                   GetBufferReply *reply) override {
+                   GetBufferReply *reply) {
     reply->set_result(-1);
     shared_ptr<ShmBuffer> buffer =
         ShmManager::getInstance()->getBuffer(request->name());
     if (buffer) {
       reply->set_size((uint32_t)buffer->getSize());
+      reply->set_server_epoch(ShmManager::getInstance()->getEpoch());
+      if (buffer->inArena()) {
+        reply->set_arena_name(buffer->getArenaName());
+        reply->set_offset(buffer->getOffset());
+        reply->set_length(buffer->getCapacity());
+      }
+      uint64_t memfd_id;
+      if (parseMemfdHandle(buffer->getName(), memfd_id))
+        reply->set_memfd_id(memfd_id);
+      reply->set_page_flags(buffer->getPageFlags());
       reply->set_result(0);
     } else {
       spdlog::error("failed to get buffer:{}", request->name());
@@ -75,55 +129,256 @@ public:
 
   Status ReleaseBuffer(ServerContext *context,
                        const ReleaseBufferRequest *request,
-                       StandardReply *reply) override {
+                       StandardReply *reply) {
     string name = request->name();
+    // the buffer was reclaimed when the session expired
+    if (request->session() &&
+        !LeaseManager::getInstance()->release(request->session(), name)) {
+      spdlog::warn("not releasing buffer:{} of expired session:{}", name,
+                   request->session());
+      return Status(grpc::StatusCode::FAILED_PRECONDITION,
+                    "session expired");
+    }
+    if (request->group_member() || !request->group_name().empty()) {
+      // a buffer reassigned from a member that timed out is not released
+      // twice
+      GroupManager *gm = GroupManager::getInstance();
+      GroupMemberPtr member =
+          request->group_member()
+              ? gm->find(request->group_member())
+              : gm->find(request->topic_name(), request->group_name(),
+                         request->subscriber_name());
+      if (member && !member->group->release(member->name, name)) {
+        spdlog::warn("buffer:{} was reassigned from member:{} of group:{}",
+                     name, member->name, member->group->getName());
+        reply->set_result(-1);
+        return Status::OK;
+      }
+      if (member)
+        Tracer::getInstance()->released(name,
+                                        member->group->memberName());
+      ShmManager::getInstance()->release(name);
+      reply->set_result(0);
+      return Status::OK;
+    }
+
+    // a streamed buffer was released by its stream when the stream ended
+    if (!request->topic_name().empty() && !request->subscriber_name().empty() &&
+        !StreamRegistry::getInstance()->release(
+            request->topic_name(), request->subscriber_name(), name)) {
+      spdlog::warn("not releasing buffer:{} of ended stream for "
+                   "subscriber:{} topic:{}",
+                   name, request->subscriber_name(), request->topic_name());
+      return Status(grpc::StatusCode::FAILED_PRECONDITION, "stream ended");
+    }
+    // before the release, which may let the name be reused
+    Tracer::getInstance()->released(name, request->subscriber_name());
     ShmManager::getInstance()->release(name);
     reply->set_result(0);
     return Status::OK;
   }
 
+  Status GetArenaStats(ServerContext *context, const Empty *request,
+                       ArenaStatsReply *reply) {
+    for (auto &stats : ShmManager::getInstance()->getArenaStats()) {
+      ArenaStats *arena = reply->add_arenas();
+      arena->set_name(stats.name);
+      arena->set_size(stats.size);
+      arena->set_used_bytes(stats.usedBytes);
+      arena->set_free_bytes(stats.freeBytes);
+      arena->set_largest_free(stats.largestFree);
+      arena->set_free_blocks(stats.freeBlocks);
+      arena->set_allocations(stats.allocations);
+      arena->set_failed_allocations(stats.failedAllocations);
+    }
+    reply->set_result(0);
+    return Status::OK;
+  }
+
+  Status GetStats(ServerContext *context, const Empty *request,
+                  StatsReply *reply) {
+    vector<TopicUsageStats> topics;
+    TopicManager::getInstance()->getStats(topics);
+    for (auto &stats : topics) {
+      TopicStats *topic = reply->add_topics();
+      topic->set_name(stats.name);
+      topic->set_dropmsgs(stats.dropMsgs);
+      topic->set_published(stats.published);
+      topic->set_publish_rate(stats.publishRate);
+      for (auto &q : stats.queues) {
+        QueueStats *queue = topic->add_queues();
+        queue->set_owner(q.owner);
+        queue->set_size(q.size);
+        queue->set_maxsize(q.maxSize);
+        queue->set_flow_policy(q.flowPolicy);
+        queue->set_pushed(q.pushed);
+        queue->set_pulled(q.pulled);
+        queue->set_dropped(q.dropped);
+        queue->set_skipped(q.skipped);
+        queue->set_blocked_posts(q.blockedPosts);
+        queue->set_blocked_us(q.blockedUs);
+        for (uint64_t count : q.pullWait)
+          queue->add_pull_wait(count);
+        queue->set_pull_wait_sum_us(q.pullWaitSumUs);
+        for (auto &sub : q.subscribers) {
+          SubscriberStats *subscriber = queue->add_subscribers();
+          subscriber->set_name(sub.name);
+          subscriber->set_depth(sub.depth);
+          subscriber->set_lag_ms(sub.lagMs);
+        }
+      }
+    }
+
+    ShmManager *sm = ShmManager::getInstance();
+    ShmBufferStats buffers = sm->getBufferStats();
+    reply->mutable_buffers()->set_live_buffers(buffers.liveBuffers);
+    reply->mutable_buffers()->set_live_bytes(buffers.liveBytes);
+    reply->mutable_buffers()->set_pooled_buffers(buffers.pooledBuffers);
+    reply->mutable_buffers()->set_pooled_bytes(buffers.pooledBytes);
+    for (auto &stats : sm->getArenaStats()) {
+      ArenaStats *arena = reply->add_arenas();
+      arena->set_name(stats.name);
+      arena->set_size(stats.size);
+      arena->set_used_bytes(stats.usedBytes);
+      arena->set_free_bytes(stats.freeBytes);
+      arena->set_largest_free(stats.largestFree);
+      arena->set_free_blocks(stats.freeBlocks);
+      arena->set_allocations(stats.allocations);
+      arena->set_failed_allocations(stats.failedAllocations);
+    }
+    for (uint64_t bound : LatencyHistogram::BOUNDS_US)
+      reply->add_pull_wait_bounds_us(bound);
+    SessionStats leases = LeaseManager::getInstance()->getStats();
+    reply->mutable_leases()->set_sessions(leases.sessions);
+    reply->mutable_leases()->set_leased_buffers(leases.leasedBuffers);
+    reply->mutable_leases()->set_opened_sessions(leases.opened);
+    reply->mutable_leases()->set_closed_sessions(leases.closed);
+    reply->mutable_leases()->set_expired_sessions(leases.expired);
+    reply->mutable_leases()->set_reclaimed_buffers(leases.reclaimedBuffers);
+    for (auto &stats : ShmManager::getInstance()->getBudgetStats()) {
+      BudgetStats *budget = reply->add_budgets();
+      budget->set_topic_name(stats.topic);
+      budget->set_live_bytes(stats.liveBytes);
+      budget->set_max_bytes(stats.maxBytes);
+      budget->set_rejected(stats.rejected);
+      budget->set_waited(stats.waited);
+      budget->set_evicted_messages(stats.evictedMessages);
+    }
+    reply->set_result(0);
+    return Status::OK;
+  }
+
+  Status GetLatency(ServerContext *context, const Empty *request,
+                    LatencyReply *reply) {
+    for (auto &stats : Tracer::getInstance()->getLatency()) {
+      LatencyStats *stage = reply->add_stages();
+      stage->set_stage(stats.stage);
+      stage->set_topic_name(stats.topic);
+      stage->set_subscriber_name(stats.subscriber);
+      stage->set_count(stats.count);
+      stage->set_p50_us(stats.p50Us);
+      stage->set_p99_us(stats.p99Us);
+      stage->set_max_us(stats.maxUs);
+    }
+    reply->set_result(Tracer::getInstance()->enabled() ? 0 : -1);
+    return Status::OK;
+  }
+
+  Status GetTrace(ServerContext *context, const Empty *request,
+                  TraceReply *reply) {
+    reply->set_trace(Tracer::getInstance()->chromeTrace());
+    reply->set_result(Tracer::getInstance()->enabled() ? 0 : -1);
+    return Status::OK;
+  }
+
   Status RegisterTopic(ServerContext *context,
                        const RegisterTopicRequest *request,
-                       StandardReply *reply) override {
+                       RegisterTopicReply *reply) {
     reply->set_result(0);
     string name = request->name();
     bool dropMsgs = request->dropmsgs();
-    TopicManager::getInstance()->addTopic(name, dropMsgs);
+    reply->set_topic_handle(
+        TopicManager::getInstance()->addTopic(name, dropMsgs));
+    if (request->ring()) {
+      string ring_name = RingManager::getInstance()->createPublisherRing(
+          name, request->ring_size(), request->ring_metadata_size());
+      if (ring_name.empty())
+        reply->set_result(-1);
+      reply->set_ring_name(ring_name);
+    }
     return Status::OK;
   }
 
-  Status Publish(ServerContext *context, const PublishRequest *request,
-                 StandardReply *reply) override {
+  Status RemoveTopic(ServerContext *context, const RemoveTopicRequest *request,
+                     StandardReply *reply) {
+    reply->set_result(
+        TopicManager::getInstance()->removeTopic(request->name()) ? 0 : -1);
+    return Status::OK;
+  }
+
+  // A publish blocks on a full queue of a topic that doesn't drop messages
+  bool publishMayBlock(const PublishRequest &request) {
+    TopicManager *tm = TopicManager::getInstance();
+    shared_ptr<Topic> topic = request.topic_handle()
+                                  ? tm->findTopic(request.topic_handle())
+                                  : tm->findTopic(request.topic_name());
+    return topic && !topic->dropsMessages();
+  }
+
+  bool publishBatchMayBlock(const PublishBatchRequest &request) {
+    for (auto &entry : request.entries())
+      if (publishMayBlock(entry))
+        return true;
+    return false;
+  }
+
+  // A subscriber waits for the one it depends on to subscribe
+  bool subscribeMayBlock(const SubscribeRequest &request) {
+    return request.dependencies_size() > 0;
+  }
+
+  Status Publish(ServerContext *context, PublishRequest *request,
+                 StandardReply *reply) {
     reply->set_result(-1);
-    string buffer_name = request->buffer_name();
-    shared_ptr<ShmBuffer> shm_buf =
-        ShmManager::getInstance()->getBuffer(buffer_name);
-    if (!shm_buf) {
-      spdlog::error("failed to publish buffer:{}", buffer_name);
-      return Status::OK; // status reply is okay, but the buffer doesn't exists
-    }
-    unsigned int sub_count =
-        TopicManager::getInstance()->getSubscriberCount(request->topic_name());
-    shm_buf->setRefCount(sub_count);
-    TopicQueueItem msg(buffer_name, request->metadata(), request->timestamp());
-    if (TopicManager::getInstance()->publish(request->topic_name(), msg)) {
-      spdlog::debug("published buffer:{} to topic:{}", buffer_name,
-                    request->topic_name());
+    TopicManager *tm = TopicManager::getInstance();
+    bool published;
+    if (request->topic_handle()) {
+      shared_ptr<Topic> topic = tm->findTopic(request->topic_handle());
+      if (!topic)
+        return Status(grpc::StatusCode::NOT_FOUND, "unknown topic handle");
+      published = tm->publishBuffer(
+          topic, takeMessage(request, topic->getName()));
+    } else
+      published = tm->publishBuffer(
+          request->topic_name(),
+          takeMessage(request, request->topic_name()));
+    if (published)
       reply->set_result(0);
-      // TODO: This should probably be handled by a client object. We don't want
-      // this function
-      //      to assume a buffer needs to get released.
-    } else {
-      spdlog::error("failed to publish buffer:{} to topic:{}", buffer_name,
-                    request->topic_name());
-      ShmManager::getInstance()->release(buffer_name, sub_count);
+    // TODO: This should probably be handled by a client object. We don't want
+    // publishBuffer to assume a buffer needs to get released.
+    return Status::OK;
+  }
+
+  Status PublishBatch(ServerContext *context, PublishBatchRequest *request,
+                      PublishBatchReply *reply) {
+    vector<PublishEntry> entries(request->entries_size());
+    for (int i = 0; i < request->entries_size(); ++i) {
+      PublishRequest *entry = request->mutable_entries(i);
+      entries[i].topic_name = entry->topic_name();
+      entries[i].item = takeMessage(entry, entries[i].topic_name);
     }
+
+    unsigned int published =
+        TopicManager::getInstance()->publishBatch(entries);
+    for (auto &entry : entries)
+      reply->add_results(entry.posted ? 0 : -1);
+    reply->set_result(published == entries.size() ? 0 : -1);
     return Status::OK;
   }
 
   Status GetSubscriberCount(ServerContext *context,
                             const SubscriberCountRequest *request,
-                            SubscriberCountReply *reply) override {
+                            SubscriberCountReply *reply) {
     unsigned int sub_count =
         TopicManager::getInstance()->getSubscriberCount(request->topic_name());
     reply->set_num_subs(sub_count);
@@ -131,13 +386,21 @@ public:
     return Status::OK;
   }
 
-  //    //TODO: NEXT - figure out how to return repeated
-  //    Status GetTopics(ServerContext* context, Empty* e, TopicList* tl)
-  //    override {
-  //    }
+  Status GetTopics(ServerContext *context, const Empty *request,
+                   TopicList *reply) {
+    for (auto &topic : TopicManager::getInstance()->getTopics()) {
+      TopicInfo *info = reply->add_topics();
+      info->set_name(topic->getName());
+      info->set_dropmsgs(topic->dropsMessages());
+      for (auto &name : topic->getSubscribers())
+        info->add_subscribers(name);
+    }
+    reply->set_result(0);
+    return Status::OK;
+  }
 
   Status Subscribe(ServerContext *context, const SubscribeRequest *request,
-                   StandardReply *reply) override {
+                   SubscribeReply *reply) {
     reply->set_result(0);
     std::vector<string> dep;
     dep.reserve(request->dependencies_size());
@@ -146,73 +409,473 @@ public:
     for (int i = 0; i < request->dependencies_size(); ++i)
       dep.emplace_back(request->dependencies(i));
 
-    if (!TopicManager::getInstance()->subscribe(request->topic_name(),
-                                                request->subscriber_name(), dep,
-                                                request->maxqueuesize())) {
+    uint64_t subscription;
+    if (!TopicManager::getInstance()->subscribe(
+            request->topic_name(), request->subscriber_name(), dep,
+            request->maxqueuesize(), &subscription, flowControl(*request))) {
       spdlog::error("failed to subscribe, subscriber:{} topic:{}",
                     request->subscriber_name(), request->topic_name());
       reply->set_result(-1);
+      return Status::OK;
+    }
+
+    reply->set_subscription(subscription);
+    if (request->ring()) {
+      string ring_name = RingManager::getInstance()->createSubscriberRing(
+          request->topic_name(), request->subscriber_name(),
+          request->ring_size(), request->ring_metadata_size());
+      if (ring_name.empty())
+        reply->set_result(-1);
+      reply->set_ring_name(ring_name);
+      reply->set_server_epoch(ShmManager::getInstance()->getEpoch());
     }
     return Status::OK;
   }
 
-  Status Pull(ServerContext *context, const PullRequest *request,
-              PullReply *reply) override {
-    string topic = request->topic_name();
-    string subscriber = request->subscriber_name();
-    int timeout = request->timeout();
-    TopicQueueItem item;
+  Status GrantCredits(ServerContext *context,
+                      const GrantCreditsRequest *request,
+                      StandardReply *reply) {
+    TopicManager *tm = TopicManager::getInstance();
+    SubscriptionPtr sub =
+        request->subscription()
+            ? tm->findSubscription(request->subscription())
+            : tm->findSubscription(request->topic_name(),
+                                   request->subscriber_name());
+    if (!sub && request->subscription())
+      return Status(grpc::StatusCode::NOT_FOUND, "unknown subscription");
     reply->set_result(-1);
+    if (sub) {
+      sub->queue->grant_credits(request->credits());
+      reply->set_result(0);
+    }
+    return Status::OK;
+  }
+
+  Status SubscribeSync(ServerContext *context,
+                       const SubscribeSyncRequest *request,
+                       SubscribeReply *reply) {
+    vector<string> topics(request->topic_names().begin(),
+                          request->topic_names().end());
+    spdlog::info("SubscribeSync request from:{} topics size:{}",
+                 request->subscriber_name(), topics.size());
+    uint64_t subscription = SyncManager::getInstance()->subscribe(
+        request->subscriber_name(), topics, request->tolerance(),
+        request->latest(), request->maxqueuesize());
+    reply->set_result(subscription ? 0 : -1);
+    reply->set_subscription(subscription);
+    return Status::OK;
+  }
+
+  Status JoinGroup(ServerContext *context, const JoinGroupRequest *request,
+                   SubscribeReply *reply) {
+    spdlog::info("JoinGroup request from:{} group:{} topic:{}",
+                 request->member_name(), request->group_name(),
+                 request->topic_name());
+    uint64_t member = GroupManager::getInstance()->join(
+        request->topic_name(), request->group_name(), request->member_name(),
+        request->maxqueuesize(), request->lease_ms());
+    reply->set_result(member ? 0 : -1);
+    reply->set_subscription(member);
+    return Status::OK;
+  }
+
+  Status OpenSession(ServerContext *context, const OpenSessionRequest *request,
+                     OpenSessionReply *reply) {
+    unsigned int lease_ms = request->lease_ms();
+    reply->set_session(
+        LeaseManager::getInstance()->open(request->client_name(), lease_ms));
+    reply->set_lease_ms(lease_ms);
+    reply->set_result(0);
+    return Status::OK;
+  }
+
+  Status Heartbeat(ServerContext *context, const SessionRequest *request,
+                   StandardReply *reply) {
+    if (!LeaseManager::getInstance()->renew(request->session()))
+      return Status(grpc::StatusCode::NOT_FOUND, "unknown session");
+    reply->set_result(0);
+    return Status::OK;
+  }
+
+  Status CloseSession(ServerContext *context, const SessionRequest *request,
+                      StandardReply *reply) {
+    if (!LeaseManager::getInstance()->close(request->session()))
+      return Status(grpc::StatusCode::NOT_FOUND, "unknown session");
+    reply->set_result(0);
+    return Status::OK;
+  }
+};
+
+// Pull and PullBatch differ only in how many items they take and how the
+// reply is filled.
+inline unsigned int maxPullItems(const PullRequest &request) { return 1; }
+inline unsigned int maxPullItems(const PullBatchRequest &request) {
+  return max(request.max_items(), 1u);
+}
+
+inline void setPullReply(PullReply &reply, vector<TopicQueueItem> &items) {
+  reply.set_buffer_name(items[0]->buffer_name);
+  reply.set_metadata(items[0]->metadata);
+  reply.set_timestamp(items[0]->timestamp);
+  reply.set_server_epoch(ShmManager::getInstance()->getEpoch());
+}
+
+inline void setPullReply(PullBatchReply &reply,
+                         vector<TopicQueueItem> &items) {
+  for (auto &item : items) {
+    PullReply *entry = reply.add_items();
+    entry->set_result(0);
+    entry->set_buffer_name(item->buffer_name);
+    entry->set_metadata(item->metadata);
+    entry->set_timestamp(item->timestamp);
+    entry->set_server_epoch(ShmManager::getInstance()->getEpoch());
+  }
+}
+
+// A Pull that waits for data is parked as a PullWaiter on the subscriber's
+// queue and completed by the thread that posts the next item, so it costs
+// no thread while waiting. An alarm on the completion queue implements the
+// timeout and the done notification handles client cancellation. The
+// subscription is resolved once, from its handle if the request has one.
+template <typename REQUEST_T, typename REPLY_T>
+class PullCall : public AsyncCall {
+public:
+  typedef void (Shm::AsyncService::*RequestFn)(
+      ServerContext *, REQUEST_T *, ServerAsyncResponseWriter<REPLY_T> *,
+      grpc::CompletionQueue *, ServerCompletionQueue *, void *);
+
+private:
+  enum { REQUEST, ALARM, DONE, FINISH };
+
+  Shm::AsyncService *mService;
+  ServerCompletionQueue *mCQ;
+  RequestFn mRequestFn;
+  ServerContext mContext;
+  REQUEST_T mRequest;
+  REPLY_T mReply;
+  ServerAsyncResponseWriter<REPLY_T> mResponder;
+  grpc::Alarm mAlarm;
+  SubscriptionPtr mSubscription;
+  PullWaiterPtr mWaiter;
+  vector<TopicQueueItem> mLeased; // delivered with a session
+  mutex mMutex;
+  unsigned int mPending; // outstanding completion queue events
+  unsigned int mDelivered;
+  bool mFinished;
+  bool mAlarmSet;
+  CallEvent mRequestEvent, mAlarmEvent, mDoneEvent, mFinishEvent;
+
+  // Note: caller must hold mMutex
+  void finish(vector<TopicQueueItem> *items,
+              const Status &status = Status::OK) {
+    mFinished = true;
+    mReply.set_result(-1);
+    // the session expired while the pull waited, nobody would release them
+    if (items && !items->empty() && mRequest.session() &&
+        !LeaseManager::getInstance()->lease(mRequest.session(), *items)) {
+      vector<string> names;
+      for (auto &item : *items)
+        names.push_back(item->buffer_name);
+      ShmManager::getInstance()->release(names);
+      mPending++;
+      mResponder.Finish(mReply,
+                        Status(grpc::StatusCode::FAILED_PRECONDITION,
+                               "session expired"),
+                        &mFinishEvent);
+      return;
+    }
+    if (items && !items->empty() && !items->front()->buffer_name.empty()) {
+      mDelivered = items->size();
+      if (mRequest.session())
+        mLeased = *items;
+      mReply.set_result(0);
+      setPullReply(mReply, *items);
+      for (auto &item : *items)
+        Tracer::getInstance()->pulled(item, mSubscription->subscriber_name);
+      spdlog::debug("pulling {} buffers from topic:{} by subscriber:{}",
+                    items->size(), mSubscription->topic_name,
+                    mSubscription->subscriber_name);
+    } else if (items)
+      spdlog::error("buffer_name is empty");
+
+    mPending++;
+    mResponder.Finish(mReply, status, &mFinishEvent);
+  }
+
+  // The call lock is never held while calling into the topic queue, the
+  // waiter callback may run on a posting thread that holds topic locks.
+  void start() {
+    if (mRequest.session() &&
+        !LeaseManager::getInstance()->renew(mRequest.session())) {
+      lock_guard<mutex> lock(mMutex);
+      finish(nullptr, Status(grpc::StatusCode::FAILED_PRECONDITION,
+                             "session expired"));
+      return;
+    }
+    TopicManager *tm = TopicManager::getInstance();
+    SubscriptionPtr sub =
+        mRequest.subscription()
+            ? tm->findSubscription(mRequest.subscription())
+            : tm->findSubscription(mRequest.topic_name(),
+                                   mRequest.subscriber_name());
+    if (!sub) {
+      spdlog::error("failed to pull item from topic:{} subscriber:{}",
+                    mRequest.topic_name(), mRequest.subscriber_name());
+      lock_guard<mutex> lock(mMutex);
+      if (mRequest.subscription())
+        finish(nullptr, Status(grpc::StatusCode::NOT_FOUND,
+                               "unknown subscription"));
+      else
+        finish(nullptr);
+      return;
+    }
+
+    PullWaiterPtr waiter = make_shared<PullWaiter>();
+    waiter->subscriber_name = sub->subscriber_name;
+    waiter->slot = sub->slot;
+    waiter->max_items = maxPullItems(mRequest);
+    waiter->callback = [this](vector<TopicQueueItem> &items) {
+      onItems(items);
+    };
+    {
+      lock_guard<mutex> lock(mMutex);
+      mSubscription = sub;
+      mWaiter = waiter;
+    }
+
     // Clear processed queue items for this set of subscribers.
     // This is done here to support client cancellation.
-    TopicManager::getInstance()->clearOldPosts(topic, subscriber);
-    bool gotItem =
-        TopicManager::getInstance()->pull(topic, subscriber, item, timeout);
-    if (!gotItem) {
-      spdlog::error("failed to pull item from topic:{} subscriber:{}", topic,
-                    subscriber);
-      return Status::OK;
+    sub->queue->clear_old();
+    vector<TopicQueueItem> items;
+    bool subscribed = sub->queue->pull_async(waiter, items);
+
+    lock_guard<mutex> lock(mMutex);
+    if (!subscribed) {
+      spdlog::error("failed to pull item from topic:{} subscriber:{}",
+                    sub->topic_name, sub->subscriber_name);
+      finish(nullptr);
+    } else if (!items.empty())
+      finish(&items);
+    else if (!mFinished && mRequest.timeout() >= 0) {
+      mPending++;
+      mAlarmSet = true;
+      mAlarm.Set(mCQ,
+                 chrono::system_clock::now() +
+                     chrono::milliseconds(mRequest.timeout()),
+                 &mAlarmEvent);
     }
+  }
+
+  // Invoked once by the posting thread if the waiter was not cancelled
+  void onItems(vector<TopicQueueItem> &items) {
+    lock_guard<mutex> lock(mMutex);
+    finish(&items);
+    if (mAlarmSet)
+      mAlarm.Cancel();
+  }
+
+  // The triggering event is still counted in mPending, which keeps the call
+  // alive while the waiter is cancelled without holding mMutex.
+  void expire(bool cancel) {
+    bool finished;
+    SubscriptionPtr sub;
+    PullWaiterPtr waiter;
+    {
+      lock_guard<mutex> lock(mMutex);
+      finished = mFinished;
+      sub = mSubscription;
+      waiter = mWaiter;
+    }
+
+    bool cancelled = cancel && !finished && sub &&
+                     sub->queue->cancel_waiter(waiter);
+    lock_guard<mutex> lock(mMutex);
+    if (cancelled)
+      finish(nullptr);
+  }
+
+public:
+  PullCall(Shm::AsyncService *service, ServerCompletionQueue *cq,
+           RequestFn requestFn)
+      : mService(service), mCQ(cq), mRequestFn(requestFn),
+        mResponder(&mContext), mPending(1), mDelivered(0), mFinished(false),
+        mAlarmSet(false),
+        mRequestEvent{this, REQUEST}, mAlarmEvent{this, ALARM},
+        mDoneEvent{this, DONE}, mFinishEvent{this, FINISH} {
+    mContext.AsyncNotifyWhenDone(&mDoneEvent);
+    (mService->*mRequestFn)(&mContext, &mRequest, &mResponder, mCQ, mCQ,
+                            &mRequestEvent);
+  }
+
+  void proceed(int event, bool ok) override {
+    switch (event) {
+    case REQUEST:
+      if (!ok) {
+        delete this; // server is shutting down
+        return;
+      }
+      new PullCall(mService, mCQ, mRequestFn);
+      mPending++; // done event
+      start();
+      break;
+    case ALARM:
+      expire(ok); // ok is false if the alarm was cancelled
+      break;
+    case DONE:
+      if (mContext.IsCancelled())
+        spdlog::warn("context canceled, canceling pull request for topic:{} "
+                     "from subscriber:{}",
+                     mRequest.topic_name(), mRequest.subscriber_name());
+      expire(mContext.IsCancelled());
+      break;
+    case FINISH:
+      // the reply never reached the subscriber, make the items available
+      // again unless the session's buffers were reclaimed in the meantime
+      if (!ok && mDelivered &&
+          (mLeased.empty() || LeaseManager::getInstance()->unlease(
+                                  mRequest.session(), mLeased)))
+        mSubscription->queue->decrement_index(mSubscription->slot,
+                                              mDelivered);
+      break;
+    }
+
     unique_lock<mutex> lock(mMutex);
-    if (context->IsCancelled()) {
-      spdlog::warn("context canceled, canceling pull request for topic:{} from "
-                   "subscriber:{}",
-                   topic, subscriber);
-      TopicManager::getInstance()->cancelPull(topic, subscriber);
-      return Status::CANCELLED;
+    if (--mPending == 0) {
+      lock.unlock();
+      delete this;
     }
-    if (!item.buffer_name.empty()) {
-      reply->set_result(0);
-      reply->set_buffer_name(item.buffer_name);
-      reply->set_metadata(item.metadata);
-      reply->set_timestamp(item.timestamp);
-      spdlog::debug("pulling buffer:{} from topic:{} by subscriber:{}",
-                    item.buffer_name, topic, subscriber);
-    } else
-      spdlog::error("buffer_name is empty");
-    return Status::OK;
   }
 };
 
-void RunServer(std::string port) {
-  spdlog::info("launching shm_server on port:{}", port);
+// Handlers take the request const unless they consume it, as Publish does
+template <typename HANDLER_REQUEST_T, typename REPLY_T,
+          typename REQUEST_T = remove_const_t<HANDLER_REQUEST_T>>
+void AddUnaryCall(
+    Shm::AsyncService *service, ServerCompletionQueue *cq,
+    ShmServiceImpl *impl,
+    typename UnaryCall<REQUEST_T, REPLY_T>::RequestFn requestFn,
+    Status (ShmServiceImpl::*handler)(ServerContext *, HANDLER_REQUEST_T *,
+                                      REPLY_T *),
+    bool (ShmServiceImpl::*mayBlock)(const REQUEST_T &) = nullptr) {
+  auto handlerFn = [impl, handler](ServerContext *context,
+                                   REQUEST_T *request, REPLY_T *reply) {
+    return (impl->*handler)(context, request, reply);
+  };
+  typename UnaryCall<REQUEST_T, REPLY_T>::MayBlockFn mayBlockFn;
+  if (mayBlock)
+    mayBlockFn = [impl, mayBlock](const REQUEST_T &request) {
+      return (impl->*mayBlock)(request);
+    };
+  new UnaryCall<REQUEST_T, REPLY_T>(service, cq, requestFn, handlerFn,
+                                    mayBlockFn);
+}
+
+void RunServer(std::string port, unsigned int num_cqs,
+               unsigned int num_workers) {
+  spdlog::info("launching shm_server on port:{} completion_queues:{} "
+               "workers:{}",
+               port, num_cqs, num_workers);
   std::string server_address("0.0.0.0:" + port);
-  ShmServiceImpl service;
+  ShmServiceImpl impl;
+  Shm::AsyncService service;
 
   ServerBuilder builder;
   // Listen on the given address without any authentication mechanism.
   builder.AddListeningPort(server_address, grpc::InsecureServerCredentials());
   // Register "service" as the instance through which we'll communicate with
-  // clients. In this case it corresponds to an *synchronous* service.
+  // clients. In this case it corresponds to an *asynchronous* service.
   builder.RegisterService(&service);
+  vector<unique_ptr<ServerCompletionQueue>> cqs;
+  for (unsigned int i = 0; i < num_cqs; ++i)
+    cqs.emplace_back(builder.AddCompletionQueue());
   // Finally assemble the server.
   std::unique_ptr<Server> server(builder.BuildAndStart());
+
+  // Arm one call of every method on each completion queue. Each call arms
+  // its successor when a request arrives.
+  typedef Shm::AsyncService S;
+  for (auto &cq : cqs) {
+    AddUnaryCall(&service, cq.get(), &impl, &S::RequestCreateBuffer,
+                 &ShmServiceImpl::CreateBuffer);
+    AddUnaryCall(&service, cq.get(), &impl, &S::RequestGetBuffer,
+                 &ShmServiceImpl::GetBuffer);
+    AddUnaryCall(&service, cq.get(), &impl, &S::RequestReleaseBuffer,
+                 &ShmServiceImpl::ReleaseBuffer);
+    AddUnaryCall(&service, cq.get(), &impl, &S::RequestGetArenaStats,
+                 &ShmServiceImpl::GetArenaStats);
+    AddUnaryCall(&service, cq.get(), &impl, &S::RequestGetStats,
+                 &ShmServiceImpl::GetStats);
+    AddUnaryCall(&service, cq.get(), &impl, &S::RequestGetTopics,
+                 &ShmServiceImpl::GetTopics);
+    AddUnaryCall(&service, cq.get(), &impl, &S::RequestGetLatency,
+                 &ShmServiceImpl::GetLatency);
+    AddUnaryCall(&service, cq.get(), &impl, &S::RequestGetTrace,
+                 &ShmServiceImpl::GetTrace);
+    AddUnaryCall(&service, cq.get(), &impl, &S::RequestRegisterTopic,
+                 &ShmServiceImpl::RegisterTopic);
+    AddUnaryCall(&service, cq.get(), &impl, &S::RequestRemoveTopic,
+                 &ShmServiceImpl::RemoveTopic);
+    AddUnaryCall(&service, cq.get(), &impl, &S::RequestPublish,
+                 &ShmServiceImpl::Publish, &ShmServiceImpl::publishMayBlock);
+    AddUnaryCall(&service, cq.get(), &impl, &S::RequestPublishBatch,
+                 &ShmServiceImpl::PublishBatch,
+                 &ShmServiceImpl::publishBatchMayBlock);
+    AddUnaryCall(&service, cq.get(), &impl, &S::RequestGetSubscriberCount,
+                 &ShmServiceImpl::GetSubscriberCount);
+    AddUnaryCall(&service, cq.get(), &impl, &S::RequestSubscribe,
+                 &ShmServiceImpl::Subscribe,
+                 &ShmServiceImpl::subscribeMayBlock);
+    new PullCall<PullRequest, PullReply>(&service, cq.get(), &S::RequestPull);
+    new PullCall<PullBatchRequest, PullBatchReply>(&service, cq.get(),
+                                                   &S::RequestPullBatch);
+    AddUnaryCall(&service, cq.get(), &impl, &S::RequestGrantCredits,
+                 &ShmServiceImpl::GrantCredits);
+    AddUnaryCall(&service, cq.get(), &impl, &S::RequestSubscribeSync,
+                 &ShmServiceImpl::SubscribeSync);
+    AddUnaryCall(&service, cq.get(), &impl, &S::RequestJoinGroup,
+                 &ShmServiceImpl::JoinGroup);
+    AddUnaryCall(&service, cq.get(), &impl, &S::RequestOpenSession,
+                 &ShmServiceImpl::OpenSession);
+    AddUnaryCall(&service, cq.get(), &impl, &S::RequestHeartbeat,
+                 &ShmServiceImpl::Heartbeat);
+    AddUnaryCall(&service, cq.get(), &impl, &S::RequestCloseSession,
+                 &ShmServiceImpl::CloseSession);
+    new StreamCall(&service, cq.get());
+    new SyncPullCall(&service, cq.get());
+    new GroupPullCall(&service, cq.get());
+  }
+
+  // Workers are spread over the completion queues. Handlers that may block
+  // (Publish on a topic that doesn't drop messages, Subscribe waiting for a
+  // dependency) run on the BlockingPool and pulls are parked, so no worker
+  // waits on another client.
+  vector<thread> workers;
+  for (unsigned int i = 0; i < max(num_workers, num_cqs); ++i) {
+    ServerCompletionQueue *cq = cqs[i % num_cqs].get();
+    workers.emplace_back([cq]() {
+      void *tag;
+      bool ok;
+      while (cq->Next(&tag, &ok)) {
+        CallEvent *event = static_cast<CallEvent *>(tag);
+        event->call->proceed(event->type, ok);
+      }
+    });
+  }
+
   // Wait for the server to shutdown. Note that some other thread must be
   // responsible for shutting down the server for this call to ever return.
   server->Wait();
+  for (auto &cq : cqs)
+    cq->Shutdown();
+  for (auto &worker : workers)
+    worker.join();
 }
 
 void SignalHandler(int signum) {
+  FdServer::getInstance()->stop();
+  MetricsServer::getInstance()->stop();
+  LeaseManager::getInstance()->stop();
+  RingManager::getInstance()->closeAll();
   ShmManager::getInstance()->releaseAll();
   exit(signum);
 }
@@ -233,11 +896,46 @@ bool get_json_param(const json &j, const std::string &p_name, PARAM_T &var) {
   }
 }
 
+// A budget is {"max_bytes": N, "policy": "fail" | "wait" | "evict",
+// "wait_ms": N}
+ShmBudget get_json_budget(const json &j) {
+  ShmBudget budget;
+  std::string policy = "fail";
+  get_json_param(j, std::string("max_bytes"), budget.maxBytes);
+  get_json_param(j, std::string("policy"), policy);
+  get_json_param(j, std::string("wait_ms"), budget.waitMs);
+  if (policy == "fail")
+    budget.policy = BUDGET_FAIL;
+  else if (policy == "wait")
+    budget.policy = BUDGET_WAIT;
+  else if (policy == "evict")
+    budget.policy = BUDGET_EVICT;
+  else
+    throw std::invalid_argument("Unknown shm budget policy \"" + policy +
+                                "\".");
+  return budget;
+}
+
 int main(int argc, char **argv) {
   std::signal(SIGINT, SignalHandler); // release memory if server is terminated
 
   json server_params;
   std::string log_level = "error", port = "50051";
+  size_t pool_max_bytes = 256 << 20;
+  unsigned int pool_max_idle_ms = 5000;
+  size_t arena_size = 0; // arenas are disabled by default
+  unsigned int arena_count = 1;
+  bool memfd_enabled = false;
+  std::string fd_socket = FD_SOCKET_DEFAULT_PATH;
+  bool tracing_enabled = false;
+  size_t tracing_max_traces = 4096, tracing_samples = 1024;
+  bool metrics_enabled = false;
+  std::string metrics_address = "127.0.0.1";
+  unsigned short metrics_port = 9464;
+  unsigned int lease_default_ms = 10000, lease_check_interval_ms = 1000;
+  std::vector<std::pair<std::string, ShmBudget>> budgets; // "" is global
+  unsigned int num_cqs = 1, num_workers = 4;
+  unsigned int blocking_idle_ms = 10000;
   // Read the config file if provided to initialize the server
   if (argc > 1) {
     if (not file_exists(argv[1]))
@@ -255,6 +953,60 @@ int main(int argc, char **argv) {
     // read arguments from config file
     get_json_param(server_params, std::string("log_level"), log_level);
     get_json_param(server_params, std::string("port"), port);
+    get_json_param(server_params, std::string("completion_queues"), num_cqs);
+    get_json_param(server_params, std::string("workers"), num_workers);
+    get_json_param(server_params, std::string("blocking_idle_ms"),
+                   blocking_idle_ms);
+
+    json pool_params;
+    if (get_json_param(server_params, std::string("buffer_pool"), pool_params)) {
+      get_json_param(pool_params, std::string("max_bytes"), pool_max_bytes);
+      get_json_param(pool_params, std::string("max_idle_ms"), pool_max_idle_ms);
+    }
+
+    json arena_params;
+    if (get_json_param(server_params, std::string("arena"), arena_params)) {
+      get_json_param(arena_params, std::string("size"), arena_size);
+      get_json_param(arena_params, std::string("count"), arena_count);
+    }
+
+    json memfd_params;
+    if (get_json_param(server_params, std::string("memfd"), memfd_params)) {
+      get_json_param(memfd_params, std::string("enabled"), memfd_enabled);
+      get_json_param(memfd_params, std::string("socket"), fd_socket);
+    }
+
+    json tracing_params;
+    if (get_json_param(server_params, std::string("tracing"), tracing_params)) {
+      get_json_param(tracing_params, std::string("enabled"), tracing_enabled);
+      get_json_param(tracing_params, std::string("max_traces"),
+                     tracing_max_traces);
+      get_json_param(tracing_params, std::string("samples"), tracing_samples);
+    }
+
+    json metrics_params;
+    if (get_json_param(server_params, std::string("metrics"), metrics_params)) {
+      get_json_param(metrics_params, std::string("enabled"), metrics_enabled);
+      get_json_param(metrics_params, std::string("address"), metrics_address);
+      get_json_param(metrics_params, std::string("port"), metrics_port);
+    }
+
+    json lease_params;
+    if (get_json_param(server_params, std::string("leases"), lease_params)) {
+      get_json_param(lease_params, std::string("default_ms"),
+                     lease_default_ms);
+      get_json_param(lease_params, std::string("check_interval_ms"),
+                     lease_check_interval_ms);
+    }
+
+    json budget_params;
+    if (get_json_param(server_params, std::string("budgets"), budget_params)) {
+      budgets.emplace_back("", get_json_budget(budget_params));
+      json topic_params;
+      if (get_json_param(budget_params, std::string("topics"), topic_params))
+        for (auto &it : topic_params.items())
+          budgets.emplace_back(it.key(), get_json_budget(it.value()));
+    }
   }
 
   // set the log level from the config
@@ -264,7 +1016,29 @@ int main(int argc, char **argv) {
     spdlog::set_level(spdlog::level::info);
   else
     spdlog::set_level(spdlog::level::debug);
-  
-  RunServer(port);
+
+  ShmManager::getInstance()->configurePool(pool_max_bytes, pool_max_idle_ms);
+  if (!ShmManager::getInstance()->configureArenas(arena_size, arena_count))
+    throw std::runtime_error("Failed to create shm arenas.");
+  if (memfd_enabled) {
+    if (!FdServer::getInstance()->start(fd_socket))
+      throw std::runtime_error("Failed to listen on fd socket.");
+    ShmManager::getInstance()->configureMemfd(true);
+  }
+  Tracer::getInstance()->configure(tracing_enabled, tracing_max_traces,
+                                   tracing_samples);
+  if (metrics_enabled &&
+      !MetricsServer::getInstance()->start(metrics_address, metrics_port))
+    throw std::runtime_error("Failed to listen for metrics.");
+  for (auto &budget : budgets)
+    ShmManager::getInstance()->configureBudget(budget.first, budget.second);
+  ShmManager::getInstance()->setEvictor([](const std::string &topic_name) {
+    return TopicManager::getInstance()->evict(topic_name);
+  });
+  LeaseManager::getInstance()->configure(lease_default_ms,
+                                         lease_check_interval_ms);
+  LeaseManager::getInstance()->start();
+  BlockingPool::getInstance()->configure(blocking_idle_ms);
+  RunServer(port, max(num_cqs, 1u), num_workers);
   return 0;
 }
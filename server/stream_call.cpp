@@ -0,0 +1,250 @@
+#include "stream_call.h"
+#include "shm_manager.h"
+#include "spdlog/spdlog.h"
+#include "tracer.h"
+
+StreamRegistry *StreamRegistry::instance = nullptr;
+
+StreamCall::StreamCall(Shm::AsyncService *service, ServerCompletionQueue *cq)
+    : mService(service), mCQ(cq), mWriter(&mContext), mPending(1),
+      mBusy(false), mCancelled(false), mFinishCalled(false),
+      mRegistered(false), mRequestEvent{this, REQUEST},
+      mWriteEvent{this, WRITE}, mDoneEvent{this, DONE},
+      mFinishEvent{this, FINISH} {
+  mContext.AsyncNotifyWhenDone(&mDoneEvent);
+  mService->RequestStream(&mContext, &mRequest, &mWriter, mCQ, mCQ,
+                          &mRequestEvent);
+}
+
+void StreamCall::start() {
+  std::vector<string> dep(mRequest.dependencies().begin(),
+                          mRequest.dependencies().end());
+  spdlog::info("Stream request from:{} dependencies size:{}",
+               mRequest.subscriber_name(), dep.size());
+  TopicManager *tm = TopicManager::getInstance();
+  uint64_t handle;
+  SubscriptionPtr sub;
+  if (tm->subscribe(mRequest.topic_name(), mRequest.subscriber_name(), dep,
+                    mRequest.maxqueuesize(), &handle, flowControl(mRequest)))
+    sub = tm->findSubscription(handle);
+  if (!sub) {
+    spdlog::error("failed to stream, subscriber:{} topic:{}",
+                  mRequest.subscriber_name(), mRequest.topic_name());
+    lock_guard<mutex> lock(mMutex);
+    finish(Status(grpc::StatusCode::FAILED_PRECONDITION,
+                  "failed to subscribe"));
+    return;
+  }
+
+  StreamRegistry::getInstance()->add(mRequest.topic_name(),
+                                     mRequest.subscriber_name(), this);
+  {
+    lock_guard<mutex> lock(mMutex);
+    mSubscription = sub;
+    mRegistered = true;
+  }
+  next();
+}
+
+// Pull the next item for the subscriber. As in PullCall, the call lock is
+// not held while calling into the topic queue.
+void StreamCall::next() {
+  PullWaiterPtr waiter = make_shared<PullWaiter>();
+  waiter->subscriber_name = mRequest.subscriber_name();
+  waiter->slot = mSubscription->slot;
+  waiter->callback = [this](vector<TopicQueueItem> &items) {
+    if (!items.empty()) {
+      write(items.front());
+      return;
+    }
+    // the topic was removed
+    lock_guard<mutex> lock(mMutex);
+    finish(Status(grpc::StatusCode::NOT_FOUND, "topic removed"));
+  };
+  {
+    lock_guard<mutex> lock(mMutex);
+    if (mBusy || mCancelled || mFinishCalled || windowFull())
+      return;
+    mBusy = true;
+    mWaiter = waiter;
+  }
+
+  mSubscription->queue->clear_old();
+  vector<TopicQueueItem> items;
+  if (!mSubscription->queue->pull_async(waiter, items)) {
+    lock_guard<mutex> lock(mMutex);
+    finish(Status(grpc::StatusCode::NOT_FOUND, "subscriber not found"));
+  } else if (!items.empty())
+    write(items.front());
+}
+
+void StreamCall::write(TopicQueueItem &item) {
+  unique_lock<mutex> lock(mMutex);
+  if (mCancelled) {
+    // the subscriber left while the item was on its way
+    lock.unlock();
+    mSubscription->queue->decrement_index(mSubscription->slot);
+    lock.lock();
+    finish(Status::CANCELLED);
+    return;
+  }
+
+  mReply.set_result(0);
+  mReply.set_buffer_name(item->buffer_name);
+  mReply.set_metadata(item->metadata);
+  mReply.set_timestamp(item->timestamp);
+  mReply.set_server_epoch(ShmManager::getInstance()->getEpoch());
+  Tracer::getInstance()->pulled(item, mSubscription->subscriber_name);
+  mInFlight.insert(item->buffer_name);
+  mPending++;
+  mWriter.Write(mReply, &mWriteEvent);
+}
+
+// Note: caller must hold mMutex
+void StreamCall::finish(const Status &status) {
+  if (mFinishCalled)
+    return;
+  mFinishCalled = true;
+  mPending++;
+  mWriter.Finish(status, &mFinishEvent);
+}
+
+// The client went away. Finish is deferred while a write is outstanding.
+void StreamCall::cancel() {
+  bool waiting;
+  PullWaiterPtr waiter;
+  {
+    lock_guard<mutex> lock(mMutex);
+    mCancelled = true;
+    waiting = mBusy && mWaiter;
+    waiter = mWaiter;
+  }
+
+  if (waiting && !mSubscription->queue->cancel_waiter(waiter))
+    return; // the waiter fired, write() will finish the stream
+
+  lock_guard<mutex> lock(mMutex);
+  if (!waiting && mBusy)
+    return; // a write is outstanding, its completion finishes the stream
+  finish(Status::CANCELLED);
+}
+
+// Releases what the subscriber still holds once the call is over. The
+// buffers leave mInFlight, so their release by the subscriber is refused.
+void StreamCall::reclaim() {
+  vector<string> reclaimed;
+  {
+    lock_guard<mutex> lock(mMutex);
+    reclaimed.assign(mInFlight.begin(), mInFlight.end());
+    mInFlight.clear();
+  }
+  if (reclaimed.empty())
+    return;
+  spdlog::info("releasing {} buffers streamed to subscriber:{} topic:{}",
+               reclaimed.size(), mRequest.subscriber_name(),
+               mRequest.topic_name());
+  ShmManager::getInstance()->release(reclaimed);
+}
+
+bool StreamCall::released(const string &buffer_name) {
+  {
+    lock_guard<mutex> lock(mMutex);
+    auto it = mInFlight.find(buffer_name);
+    if (it == mInFlight.end())
+      return false;
+    mInFlight.erase(it);
+  }
+  next();
+  return true;
+}
+
+void StreamCall::proceed(int event, bool ok) {
+  switch (event) {
+  case REQUEST:
+    if (!ok) {
+      delete this; // server is shutting down
+      return;
+    }
+    new StreamCall(mService, mCQ);
+    mPending++; // done event
+    start();
+    break;
+  case WRITE: {
+    bool cancelled, requeue = false;
+    {
+      lock_guard<mutex> lock(mMutex);
+      mBusy = false;
+      mWaiter.reset();
+      if (!ok) {
+        // the reply never reached the subscriber, the item goes back to the
+        // queue unless reclaim() released it already
+        auto it = mInFlight.find(mReply.buffer_name());
+        requeue = it != mInFlight.end();
+        if (requeue)
+          mInFlight.erase(it);
+        mCancelled = true;
+      }
+      cancelled = mCancelled;
+    }
+    if (requeue)
+      mSubscription->queue->decrement_index(mSubscription->slot);
+    if (cancelled) {
+      lock_guard<mutex> lock(mMutex);
+      finish(Status::CANCELLED);
+    } else
+      next();
+    break;
+  }
+  case DONE:
+    if (mContext.IsCancelled()) {
+      spdlog::info("stream for subscriber:{} topic:{} closed",
+                   mRequest.subscriber_name(), mRequest.topic_name());
+      cancel();
+    }
+    reclaim();
+    break;
+  case FINISH:
+    break;
+  }
+
+  unique_lock<mutex> lock(mMutex);
+  if (--mPending == 0) {
+    bool registered = mRegistered;
+    lock.unlock();
+    if (registered)
+      StreamRegistry::getInstance()->remove(mRequest.topic_name(),
+                                            mRequest.subscriber_name(), this);
+    delete this;
+  }
+}
+
+void StreamRegistry::add(const string &topic_name,
+                         const string &subscriber_name, StreamCall *call) {
+  lock_guard<mutex> lock(mMutex);
+  mStreams.emplace(key(topic_name, subscriber_name), call);
+}
+
+void StreamRegistry::remove(const string &topic_name,
+                            const string &subscriber_name, StreamCall *call) {
+  lock_guard<mutex> lock(mMutex);
+  auto range = mStreams.equal_range(key(topic_name, subscriber_name));
+  for (auto it = range.first; it != range.second; ++it) {
+    if (it->second == call) {
+      mStreams.erase(it);
+      return;
+    }
+  }
+}
+
+// Calls are only deleted after they are removed, so holding the registry
+// lock keeps the stream alive while it is credited.
+bool StreamRegistry::release(const string &topic_name,
+                             const string &subscriber_name,
+                             const string &buffer_name) {
+  lock_guard<mutex> lock(mMutex);
+  auto range = mStreams.equal_range(key(topic_name, subscriber_name));
+  for (auto it = range.first; it != range.second; ++it)
+    if (it->second->released(buffer_name))
+      return true;
+  return false;
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <grpcpp/grpcpp.h>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "async_call.h"
+#include "topic_manager.h"
+
+using grpc::ServerAsyncWriter;
+
+// Server side of the Stream RPC. The call subscribes like Subscribe and then
+// writes every item posted for the subscriber as soon as it is available.
+// Flow control follows the subscriber's maxqueuesize: at most that many
+// streamed buffers may be unreleased at a time. Beyond that, items wait in
+// the subscriber's TopicQueue where the usual drop/block semantics apply.
+// Streamed buffers still unreleased when the call ends are released by the
+// call, the subscriber can't release them afterwards.
+class StreamCall : public AsyncCall {
+private:
+  enum { REQUEST, WRITE, DONE, FINISH };
+
+  Shm::AsyncService *mService;
+  ServerCompletionQueue *mCQ;
+  ServerContext mContext;
+  SubscribeRequest mRequest;
+  PullReply mReply;
+  ServerAsyncWriter<PullReply> mWriter;
+  SubscriptionPtr mSubscription; // set once subscribed
+  PullWaiterPtr mWaiter;
+  mutex mMutex;
+  unsigned int mPending;  // outstanding completion queue events
+  unordered_multiset<string> mInFlight; // streamed buffers not yet released
+  bool mBusy;             // a pull or write is in progress
+  bool mCancelled;
+  bool mFinishCalled;
+  bool mRegistered;
+  CallEvent mRequestEvent, mWriteEvent, mDoneEvent, mFinishEvent;
+
+  inline bool windowFull() const {
+    return mRequest.maxqueuesize() > 0 &&
+           mInFlight.size() >= mRequest.maxqueuesize();
+  }
+
+  void start();
+  void next();
+  void write(TopicQueueItem &item);
+  void finish(const Status &status);
+  void cancel();
+  void reclaim();
+
+public:
+  StreamCall(Shm::AsyncService *service, ServerCompletionQueue *cq);
+
+  void proceed(int event, bool ok) override;
+  // Returns false if the buffer is not in flight on this stream
+  bool released(const string &buffer_name);
+};
+
+// Tracks the active streams so that ReleaseBuffer can return flow control
+// credit to the stream that delivered the buffer.
+class StreamRegistry {
+private:
+  static StreamRegistry *instance;
+  unordered_multimap<string, StreamCall *> mStreams;
+  mutex mMutex;
+
+  StreamRegistry() {}
+
+  static string key(const string &topic_name, const string &subscriber_name) {
+    return topic_name + "/" + subscriber_name;
+  }
+
+public:
+  static StreamRegistry *getInstance() {
+    if (!instance)
+      instance = new StreamRegistry();
+    return instance;
+  }
+
+  void add(const string &topic_name, const string &subscriber_name,
+           StreamCall *call);
+  void remove(const string &topic_name, const string &subscriber_name,
+              StreamCall *call);
+  // Returns false if no stream of the subscriber has the buffer in flight,
+  // it was then reclaimed when its stream ended and must not be released
+  bool release(const string &topic_name, const string &subscriber_name,
+               const string &buffer_name);
+
+  ~StreamRegistry() { delete instance; }
+};
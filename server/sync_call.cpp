@@ -0,0 +1,178 @@
+#include "sync_call.h"
+#include "lease_manager.h"
+#include "shm_manager.h"
+#include "spdlog/spdlog.h"
+#include "tracer.h"
+
+SyncPullCall::SyncPullCall(Shm::AsyncService *service,
+                           ServerCompletionQueue *cq)
+    : mService(service), mCQ(cq), mResponder(&mContext), mPending(1),
+      mFinished(false), mAlarmSet(false), mRequestEvent{this, REQUEST},
+      mAlarmEvent{this, ALARM}, mDoneEvent{this, DONE},
+      mFinishEvent{this, FINISH} {
+  mContext.AsyncNotifyWhenDone(&mDoneEvent);
+  mService->RequestPullSync(&mContext, &mRequest, &mResponder, mCQ, mCQ,
+                            &mRequestEvent);
+}
+
+// Note: caller must hold mMutex
+void SyncPullCall::finish(vector<TopicQueueItem> *items,
+                          const Status &status) {
+  mFinished = true;
+  mReply.set_result(-1);
+  // the session expired while the pull waited, nobody would release them
+  if (items && !items->empty() && mRequest.session() &&
+      !LeaseManager::getInstance()->lease(mRequest.session(), *items)) {
+    vector<string> names;
+    for (auto &item : *items)
+      names.push_back(item->buffer_name);
+    ShmManager::getInstance()->release(names);
+    mPending++;
+    mResponder.Finish(
+        mReply,
+        Status(grpc::StatusCode::FAILED_PRECONDITION, "session expired"),
+        &mFinishEvent);
+    return;
+  }
+  if (items && !items->empty()) {
+    mTuple = *items;
+    mReply.set_result(0);
+    for (auto &item : mTuple) {
+      PullReply *entry = mReply.add_items();
+      entry->set_result(0);
+      entry->set_buffer_name(item->buffer_name);
+      entry->set_metadata(item->metadata);
+      entry->set_timestamp(item->timestamp);
+      entry->set_server_epoch(ShmManager::getInstance()->getEpoch());
+      Tracer::getInstance()->pulled(item, mGroup->getName());
+    }
+    spdlog::debug("pulling {} synchronized buffers by subscriber:{}",
+                  mTuple.size(), mGroup->getName());
+  }
+
+  mPending++;
+  mResponder.Finish(mReply, status, &mFinishEvent);
+}
+
+// The call lock is never held while calling into the sync group, the waiter
+// callback may run on a posting thread.
+void SyncPullCall::start() {
+  if (mRequest.session() &&
+      !LeaseManager::getInstance()->renew(mRequest.session())) {
+    lock_guard<mutex> lock(mMutex);
+    finish(nullptr,
+           Status(grpc::StatusCode::FAILED_PRECONDITION, "session expired"));
+    return;
+  }
+  SyncManager *sm = SyncManager::getInstance();
+  SyncGroupPtr group = mRequest.subscription()
+                           ? sm->find(mRequest.subscription())
+                           : sm->find(mRequest.subscriber_name());
+  if (!group) {
+    spdlog::error("failed to pull sync subscriber:{}",
+                  mRequest.subscriber_name());
+    lock_guard<mutex> lock(mMutex);
+    if (mRequest.subscription())
+      finish(nullptr,
+             Status(grpc::StatusCode::NOT_FOUND, "unknown subscription"));
+    else
+      finish(nullptr);
+    return;
+  }
+
+  PullWaiterPtr waiter = make_shared<PullWaiter>();
+  waiter->subscriber_name = group->getName();
+  waiter->callback = [this](vector<TopicQueueItem> &items) {
+    onItems(items);
+  };
+  {
+    lock_guard<mutex> lock(mMutex);
+    mGroup = group;
+    mWaiter = waiter;
+  }
+
+  vector<TopicQueueItem> items;
+  bool subscribed = group->pull_async(waiter, items);
+
+  lock_guard<mutex> lock(mMutex);
+  if (!subscribed) {
+    spdlog::error("sync subscriber:{} is closed", group->getName());
+    finish(nullptr,
+           Status(grpc::StatusCode::NOT_FOUND, "sync subscriber closed"));
+  } else if (!items.empty())
+    finish(&items);
+  else if (!mFinished && mRequest.timeout() >= 0) {
+    mPending++;
+    mAlarmSet = true;
+    mAlarm.Set(mCQ,
+               chrono::system_clock::now() +
+                   chrono::milliseconds(mRequest.timeout()),
+               &mAlarmEvent);
+  }
+}
+
+// Invoked once by the matching thread if the waiter was not cancelled
+void SyncPullCall::onItems(vector<TopicQueueItem> &items) {
+  lock_guard<mutex> lock(mMutex);
+  finish(&items);
+  if (mAlarmSet)
+    mAlarm.Cancel();
+}
+
+// The triggering event is still counted in mPending, which keeps the call
+// alive while the waiter is cancelled without holding mMutex.
+void SyncPullCall::expire(bool cancel) {
+  bool finished;
+  SyncGroupPtr group;
+  PullWaiterPtr waiter;
+  {
+    lock_guard<mutex> lock(mMutex);
+    finished = mFinished;
+    group = mGroup;
+    waiter = mWaiter;
+  }
+
+  bool cancelled = cancel && !finished && group &&
+                   group->cancel_waiter(waiter);
+  lock_guard<mutex> lock(mMutex);
+  if (cancelled)
+    finish(nullptr);
+}
+
+void SyncPullCall::proceed(int event, bool ok) {
+  switch (event) {
+  case REQUEST:
+    if (!ok) {
+      delete this; // server is shutting down
+      return;
+    }
+    new SyncPullCall(mService, mCQ);
+    mPending++; // done event
+    start();
+    break;
+  case ALARM:
+    expire(ok); // ok is false if the alarm was cancelled
+    break;
+  case DONE:
+    if (mContext.IsCancelled())
+      spdlog::warn("context canceled, canceling sync pull request from "
+                   "subscriber:{}",
+                   mRequest.subscriber_name());
+    expire(mContext.IsCancelled());
+    break;
+  case FINISH:
+    // the reply never reached the subscriber, make the tuple available again
+    // unless the session's buffers were reclaimed in the meantime
+    if (!ok && !mTuple.empty() &&
+        (!mRequest.session() ||
+         LeaseManager::getInstance()->unlease(mRequest.session(), mTuple)))
+      mGroup->requeue(mTuple);
+    break;
+  }
+
+  unique_lock<mutex> lock(mMutex);
+  if (--mPending == 0) {
+    lock.unlock();
+    delete this;
+  }
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <grpcpp/alarm.h>
+#include <grpcpp/grpcpp.h>
+#include <mutex>
+
+#include "async_call.h"
+#include "sync_group.h"
+
+// Server side of the PullSync RPC. Like PullCall, a pull without a matched
+// tuple is parked on the sync group and completed by the thread that matches
+// the next tuple, an alarm implements the timeout. A tuple whose reply never
+// reaches the subscriber is returned to the group.
+class SyncPullCall : public AsyncCall {
+private:
+  enum { REQUEST, ALARM, DONE, FINISH };
+
+  Shm::AsyncService *mService;
+  ServerCompletionQueue *mCQ;
+  ServerContext mContext;
+  PullSyncRequest mRequest;
+  PullBatchReply mReply;
+  ServerAsyncResponseWriter<PullBatchReply> mResponder;
+  grpc::Alarm mAlarm;
+  SyncGroupPtr mGroup;
+  PullWaiterPtr mWaiter;
+  vector<TopicQueueItem> mTuple; // delivered items
+  mutex mMutex;
+  unsigned int mPending; // outstanding completion queue events
+  bool mFinished;
+  bool mAlarmSet;
+  CallEvent mRequestEvent, mAlarmEvent, mDoneEvent, mFinishEvent;
+
+  void start();
+  void finish(vector<TopicQueueItem> *items, const Status &status = Status::OK);
+  void onItems(vector<TopicQueueItem> &items);
+  void expire(bool cancel);
+
+public:
+  SyncPullCall(Shm::AsyncService *service, ServerCompletionQueue *cq);
+
+  void proceed(int event, bool ok) override;
+};
@@ -0,0 +1,357 @@
+#include "sync_group.h"
+#include "shm_manager.h"
+#include "spdlog/spdlog.h"
+
+#include <algorithm>
+#include <limits>
+
+SyncManager *SyncManager::instance = nullptr;
+
+SyncGroup::SyncGroup(const string &name, const vector<string> &topics,
+                     uint64_t tolerance, bool latest,
+                     unsigned int maxQueueSize)
+    : mName(name), mTopics(topics), mTolerance(tolerance), mLatest(latest),
+      mMaxQueueSize(maxQueueSize), mClosed(false) {}
+
+// The member waiters only hold a weak reference, a group that was replaced
+// after it closed is not kept alive by a queue. If a topic can't be
+// subscribed the topics subscribed before it are unsubscribed again.
+bool SyncGroup::start() {
+  TopicManager *tm = TopicManager::getInstance();
+  vector<string> dependencies;
+  vector<Member> members(mTopics.size());
+  weak_ptr<SyncGroup> self = shared_from_this();
+  for (size_t i = 0; i < mTopics.size(); ++i) {
+    uint64_t handle;
+    if (tm->subscribe(mTopics[i], memberName(), dependencies, mMaxQueueSize,
+                      &handle))
+      members[i].sub = tm->findSubscription(handle);
+    if (!members[i].sub) {
+      spdlog::error("sync subscriber:{} failed to subscribe to topic:{}",
+                    mName, mTopics[i]);
+      for (size_t j = 0; j < i; ++j)
+        tm->unsubscribe(members[j].sub);
+      return false;
+    }
+
+    PullWaiterPtr waiter = make_shared<PullWaiter>();
+    waiter->subscriber_name = memberName();
+    waiter->slot = members[i].sub->slot;
+    waiter->max_items = numeric_limits<unsigned int>::max();
+    waiter->callback = [self, i](vector<TopicQueueItem> &items) {
+      if (SyncGroupPtr group = self.lock())
+        group->on_items(i, items);
+      else
+        for (auto &item : items)
+          ShmManager::getInstance()->release(item->buffer_name);
+    };
+    members[i].waiter = waiter;
+  }
+
+  ReadyWaiters ready;
+  vector<string> dropped;
+  bool started = true;
+  {
+    lock_guard<mutex> lock(mMutex);
+    mMembers = std::move(members);
+    for (auto &m : mMembers)
+      drain(m, ready, dropped);
+    if (mClosed)
+      started = false;
+    else
+      match(dropped);
+  }
+  for (auto &it : ready)
+    it.first->callback(it.second);
+  if (!dropped.empty())
+    ShmManager::getInstance()->release(dropped);
+  leave();
+  return started;
+}
+
+void SyncGroup::receive(Member &m, vector<TopicQueueItem> &items,
+                        vector<string> &dropped) {
+  for (auto &item : items) {
+    m.last = max(m.last, item->timestamp);
+    m.pending.push_back(std::move(item));
+    if (mMaxQueueSize > 0 && m.pending.size() > mMaxQueueSize) {
+      dropped.push_back(m.pending.front()->buffer_name);
+      m.pending.pop_front();
+    }
+  }
+}
+
+// Takes what is queued for the member until its queue is empty, which parks
+// the member's waiter for the next post. Closes the group if the member's
+// topic was removed.
+void SyncGroup::drain(Member &m, ReadyWaiters &ready,
+                      vector<string> &dropped) {
+  vector<TopicQueueItem> items;
+  while (!mClosed) {
+    m.sub->queue->clear_old();
+    items.clear();
+    if (!m.sub->queue->pull_async(m.waiter, items)) {
+      close_locked(ready, dropped);
+      return;
+    }
+    if (items.empty())
+      return;
+    receive(m, items, dropped);
+  }
+}
+
+// Forms tuples from the oldest pending item of every member. An item older
+// than the newest front item, or than the newest item a member has already
+// consumed, by more than the tolerance can never be matched and is dropped.
+void SyncGroup::match(vector<string> &dropped) {
+  while (true) {
+    uint64_t newest = 0;
+    bool complete = true;
+    for (auto &m : mMembers) {
+      if (m.pending.empty()) {
+        complete = false;
+        newest = max(newest, m.last);
+      } else
+        newest = max(newest, m.pending.front()->timestamp);
+    }
+
+    bool stale = false;
+    for (auto &m : mMembers) {
+      if (!m.pending.empty() &&
+          newest - m.pending.front()->timestamp > mTolerance) {
+        dropped.push_back(m.pending.front()->buffer_name);
+        m.pending.pop_front();
+        stale = true;
+      }
+    }
+    if (stale)
+      continue;
+    if (!complete)
+      return;
+
+    vector<TopicQueueItem> tuple;
+    tuple.reserve(mMembers.size());
+    for (auto &m : mMembers) {
+      tuple.push_back(std::move(m.pending.front()));
+      m.pending.pop_front();
+    }
+    while (!mMatched.empty() &&
+           (mLatest ||
+            (mMaxQueueSize > 0 && mMatched.size() >= mMaxQueueSize))) {
+      for (auto &item : mMatched.front())
+        dropped.push_back(item->buffer_name);
+      mMatched.pop_front();
+    }
+    mMatched.push_back(std::move(tuple));
+  }
+}
+
+void SyncGroup::take_ready_waiters(ReadyWaiters &ready) {
+  while (!mWaiters.empty() && !mMatched.empty()) {
+    ready.emplace_back(mWaiters.front(), std::move(mMatched.front()));
+    mWaiters.pop_front();
+    mMatched.pop_front();
+  }
+}
+
+// Parked pulls complete without data and every item the group holds is
+// released. A member waiter that can't be cancelled is being completed, its
+// callback releases the items it brings. The members are unsubscribed by
+// leave().
+void SyncGroup::close_locked(ReadyWaiters &ready, vector<string> &dropped) {
+  if (mClosed)
+    return;
+  spdlog::info("closing sync subscriber:{}", mName);
+  mClosed = true;
+  for (auto &waiter : mWaiters)
+    ready.emplace_back(waiter, vector<TopicQueueItem>());
+  mWaiters.clear();
+  for (auto &m : mMembers) {
+    m.sub->queue->cancel_waiter(m.waiter);
+    for (auto &item : m.pending)
+      dropped.push_back(item->buffer_name);
+    m.pending.clear();
+    mLeaving.push_back(m.sub);
+  }
+  for (auto &tuple : mMatched)
+    for (auto &item : tuple)
+      dropped.push_back(item->buffer_name);
+  mMatched.clear();
+}
+
+// Unsubscribes the members once the group is closed. Closing a member's
+// queue can complete a pull that calls back into the group, so this runs
+// without the group lock. The member whose topic was removed is already
+// gone, the others would otherwise keep queueing items that nothing reads.
+void SyncGroup::leave() {
+  vector<SubscriptionPtr> leaving;
+  {
+    lock_guard<mutex> lock(mMutex);
+    leaving.swap(mLeaving);
+  }
+  for (auto &sub : leaving)
+    TopicManager::getInstance()->unsubscribe(sub);
+}
+
+// Invoked by the thread that posted to the member's topic, outside the queue
+// lock. No items means the topic was removed.
+void SyncGroup::on_items(size_t member, vector<TopicQueueItem> &items) {
+  ReadyWaiters ready;
+  vector<string> dropped;
+  {
+    lock_guard<mutex> lock(mMutex);
+    if (mClosed) {
+      for (auto &item : items)
+        dropped.push_back(item->buffer_name);
+    } else if (items.empty()) {
+      close_locked(ready, dropped);
+    } else {
+      Member &m = mMembers[member];
+      receive(m, items, dropped);
+      drain(m, ready, dropped);
+      if (!mClosed) {
+        match(dropped);
+        take_ready_waiters(ready);
+      }
+    }
+  }
+
+  for (auto &it : ready)
+    it.first->callback(it.second);
+  if (!dropped.empty())
+    ShmManager::getInstance()->release(dropped);
+  leave();
+}
+
+// Non-blocking pull of the oldest matched tuple. If there is none the waiter
+// is parked until a tuple is matched. Returns false once the group is closed.
+bool SyncGroup::pull_async(PullWaiterPtr waiter,
+                           vector<TopicQueueItem> &items) {
+  lock_guard<mutex> lock(mMutex);
+  if (mClosed)
+    return false;
+  if (mMatched.empty()) {
+    mWaiters.push_back(waiter);
+    return true;
+  }
+  items = std::move(mMatched.front());
+  mMatched.pop_front();
+  return true;
+}
+
+// Returns true if the waiter was still parked, in which case its callback
+// will never be invoked.
+bool SyncGroup::cancel_waiter(const PullWaiterPtr &waiter) {
+  lock_guard<mutex> lock(mMutex);
+  auto it = find(mWaiters.begin(), mWaiters.end(), waiter);
+  if (it == mWaiters.end())
+    return false;
+  mWaiters.erase(it);
+  return true;
+}
+
+// With the latest policy a newer tuple replaces the one being returned
+void SyncGroup::requeue(vector<TopicQueueItem> &tuple) {
+  ReadyWaiters ready;
+  vector<string> dropped;
+  {
+    lock_guard<mutex> lock(mMutex);
+    if (mClosed || (mLatest && !mMatched.empty())) {
+      for (auto &item : tuple)
+        dropped.push_back(item->buffer_name);
+    } else {
+      mMatched.push_front(std::move(tuple));
+      take_ready_waiters(ready);
+    }
+  }
+
+  for (auto &it : ready)
+    it.first->callback(it.second);
+  if (!dropped.empty())
+    ShmManager::getInstance()->release(dropped);
+}
+
+void SyncGroup::close() {
+  ReadyWaiters ready;
+  vector<string> dropped;
+  {
+    lock_guard<mutex> lock(mMutex);
+    close_locked(ready, dropped);
+  }
+
+  for (auto &it : ready)
+    it.first->callback(it.second);
+  if (!dropped.empty())
+    ShmManager::getInstance()->release(dropped);
+  leave();
+}
+
+bool SyncGroup::closed() {
+  lock_guard<mutex> lock(mMutex);
+  return mClosed;
+}
+
+// Every topic must exist. The group holds up to maxQueueSize items per topic
+// and as many tuples, an unbounded group is refused. Groups are started
+// under the manager lock so a concurrent subscribe of the same name waits for
+// this one.
+uint64_t SyncManager::subscribe(const string &name,
+                                const vector<string> &topics,
+                                uint64_t tolerance, bool latest,
+                                unsigned int maxQueueSize) {
+  vector<string> sorted(topics);
+  sort(sorted.begin(), sorted.end());
+  if (topics.empty() ||
+      adjacent_find(sorted.begin(), sorted.end()) != sorted.end()) {
+    spdlog::error("sync subscriber:{} needs distinct topics", name);
+    return 0;
+  }
+  if (maxQueueSize == 0) {
+    spdlog::error("sync subscriber:{} needs a max queue size", name);
+    return 0;
+  }
+  TopicManager *tm = TopicManager::getInstance();
+  for (auto &topic : topics) {
+    if (!tm->hasTopic(topic)) {
+      spdlog::error("sync subscriber:{} cannot be added, topic:{} doesn't "
+                    "exist",
+                    name, topic);
+      return 0;
+    }
+  }
+
+  lock_guard<mutex> lock(mMutex);
+  auto it = mGroups.find(name);
+  if (it != mGroups.end() && !it->second.group->closed()) {
+    if (it->second.group->getTopics() == topics)
+      return it->second.handle;
+    spdlog::error("sync subscriber:{} already exists with other topics",
+                  name);
+    return 0;
+  }
+
+  spdlog::info("adding sync subscriber:{} for {} topics", name,
+               topics.size());
+  SyncGroupPtr group =
+      make_shared<SyncGroup>(name, topics, tolerance, latest, maxQueueSize);
+  if (!group->start()) {
+    group->close();
+    return 0;
+  }
+  if (it != mGroups.end())
+    mHandles.remove(it->second.handle);
+  GroupEntry &entry = mGroups[name];
+  entry.group = group;
+  entry.handle = mHandles.add(group);
+  return entry.handle;
+}
+
+SyncGroupPtr SyncManager::find(uint64_t handle) {
+  return mHandles.find(handle);
+}
+
+SyncGroupPtr SyncManager::find(const string &name) {
+  lock_guard<mutex> lock(mMutex);
+  auto it = mGroups.find(name);
+  return it == mGroups.end() ? SyncGroupPtr() : it->second.group;
+}
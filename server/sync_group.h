@@ -0,0 +1,107 @@
+#pragma once
+
+#include <deque>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "handle_table.h"
+#include "topic_manager.h"
+
+// Joins several topics by timestamp on the server. The group subscribes to
+// every topic and takes their items as they are posted. Once every topic has
+// an item within tolerance of the others, those items form a tuple that a
+// single pull returns, in the order of the topics. Items that can no longer
+// be part of a tuple, because another topic has already moved past them, are
+// released right away. Timestamps are expected to increase on each topic.
+// A closed group unsubscribes from the topics that are left.
+class SyncGroup : public enable_shared_from_this<SyncGroup> {
+private:
+  struct Member {
+    SubscriptionPtr sub;
+    PullWaiterPtr waiter; // parked on the member's queue
+    deque<TopicQueueItem> pending;
+    uint64_t last = 0; // timestamp of the newest item received
+  };
+
+  string mName;
+  vector<string> mTopics;
+  uint64_t mTolerance;
+  bool mLatest;
+  unsigned int mMaxQueueSize;
+  mutex mMutex;
+  vector<Member> mMembers;
+  deque<vector<TopicQueueItem>> mMatched;
+  list<PullWaiterPtr> mWaiters;
+  bool mClosed;
+  vector<SubscriptionPtr> mLeaving; // set by close_locked for leave()
+
+  // Note: functions under private require mMutex
+  void receive(Member &m, vector<TopicQueueItem> &items,
+               vector<string> &dropped);
+  void drain(Member &m, ReadyWaiters &ready, vector<string> &dropped);
+  void match(vector<string> &dropped);
+  void take_ready_waiters(ReadyWaiters &ready);
+  void close_locked(ReadyWaiters &ready, vector<string> &dropped);
+  void on_items(size_t member, vector<TopicQueueItem> &items);
+  // Requires that mMutex is not held
+  void leave();
+
+public:
+  SyncGroup(const string &name, const vector<string> &topics,
+            uint64_t tolerance, bool latest, unsigned int maxQueueSize);
+  virtual ~SyncGroup() {}
+
+  // Subscribes the members under the subscriber name memberName()
+  bool start();
+  // Like TopicQueue::pull_async, items receive one tuple
+  bool pull_async(PullWaiterPtr waiter, vector<TopicQueueItem> &items);
+  bool cancel_waiter(const PullWaiterPtr &waiter);
+  // Returns a tuple that never reached the subscriber to the front
+  void requeue(vector<TopicQueueItem> &tuple);
+  void close();
+  bool closed();
+
+  const string &getName() const { return mName; }
+  const vector<string> &getTopics() const { return mTopics; }
+  string memberName() const { return "sync:" + mName; }
+};
+
+typedef shared_ptr<SyncGroup> SyncGroupPtr;
+
+// Sync groups by subscriber name. Subscribing again with the same topics
+// returns the same group and handle. A group is closed when one of its topics
+// is removed, after which it can be subscribed again.
+class SyncManager {
+private:
+  struct GroupEntry {
+    SyncGroupPtr group;
+    uint64_t handle;
+  };
+
+  static SyncManager *instance;
+  mutex mMutex;
+  unordered_map<string, GroupEntry> mGroups;
+  HandleTable<SyncGroup> mHandles;
+
+  SyncManager() {}
+
+public:
+  static SyncManager *getInstance() {
+    if (!instance)
+      instance = new SyncManager();
+    return instance;
+  }
+
+  // Returns the group's handle, 0 if it could not be subscribed
+  uint64_t subscribe(const string &name, const vector<string> &topics,
+                     uint64_t tolerance, bool latest,
+                     unsigned int maxQueueSize);
+  SyncGroupPtr find(uint64_t handle);
+  SyncGroupPtr find(const string &name);
+
+  ~SyncManager() { delete instance; }
+};
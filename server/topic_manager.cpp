@@ -1,46 +1,235 @@
 #include "topic_manager.h"
+#include "shm_manager.h"
 #include "spdlog/spdlog.h"
 #include <iostream>
 
 TopicManager *TopicManager::instance = nullptr;
 
-TopicManager::TopicManager() { mActiveTopics.reserve(10); }
+TopicManager::TopicManager() {}
 
-bool TopicManager::addTopic(string &name, bool dropMsgs) {
-  if (mActiveTopics.find(name) == mActiveTopics.end()) {
-    spdlog::info("adding topic:{}", name);
-    mActiveTopics[name] = make_shared<Topic>(name, dropMsgs);
-  } else
-    spdlog::debug("topic:{} already exists");
+shared_ptr<Topic> TopicManager::findTopic(const string &topic_name) {
+  TopicShard &s = shard(topic_name);
+  shared_lock<shared_mutex> lock(s.mMutex);
+  auto it = s.mTopics.find(topic_name);
+  return it == s.mTopics.end() ? shared_ptr<Topic>() : it->second.topic;
+}
+
+shared_ptr<Topic> TopicManager::findTopic(uint64_t handle) {
+  return mTopicHandles.find(handle);
+}
+
+uint64_t TopicManager::addTopic(string &name, bool dropMsgs) {
+  TopicShard &s = shard(name);
+  unique_lock<shared_mutex> lock(s.mMutex);
+  auto it = s.mTopics.find(name);
+  if (it != s.mTopics.end()) {
+    spdlog::debug("topic:{} already exists", name);
+    return it->second.handle;
+  }
+
+  spdlog::info("adding topic:{}", name);
+  TopicEntry &entry = s.mTopics[name];
+  entry.topic = make_shared<Topic>(name, dropMsgs);
+  entry.handle = mTopicHandles.add(entry.topic);
+  return entry.handle;
+}
+
+// Pulls parked on the topic are completed without data, later calls on the
+// topic fail as if it had never been registered. Its handles no longer
+// resolve.
+bool TopicManager::removeTopic(const string &name) {
+  TopicEntry entry;
+  {
+    TopicShard &s = shard(name);
+    unique_lock<shared_mutex> lock(s.mMutex);
+    auto it = s.mTopics.find(name);
+    if (it == s.mTopics.end())
+      return false;
+    entry = std::move(it->second);
+    s.mTopics.erase(it);
+  }
+
+  spdlog::info("removing topic:{}", name);
+  mTopicHandles.remove(entry.handle);
+  for (auto &it : entry.subscriptions)
+    mSubscriptions.remove(it.second);
+  entry.topic->close();
   return true;
 }
 
-bool TopicManager::publish(string topic_name, TopicQueueItem &item) {
-  auto it = mActiveTopics.find(topic_name);
-  if (it == mActiveTopics.end()) {
+bool TopicManager::hasTopic(const string &name) {
+  return findTopic(name) != nullptr;
+}
+
+bool TopicManager::publish(string topic_name, const TopicQueueItem &item) {
+  shared_ptr<Topic> topic = findTopic(topic_name);
+  if (!topic) {
     spdlog::error("topic:{} has not been registered", topic_name);
     return false;
-  } else if (it->second->size() <= 0) {
+  } else if (topic->size() <= 0) {
     spdlog::warn("topic:{} registered but no subscribers", topic_name);
     return false;
   }
-  it->second->post(item);
+  topic->post(item);
   return true;
 }
 
+// Publish a shm buffer to all subscribers of a topic. The buffer's reference
+// count is set to the subscriber count and released again if the post fails.
+bool TopicManager::publishBuffer(const string &topic_name,
+                                 const TopicQueueItem &item) {
+  shared_ptr<Topic> topic = findTopic(topic_name);
+  if (!topic)
+    spdlog::error("topic:{} has not been registered", topic_name);
+  return publishBuffer(topic, item);
+}
+
+// topic may be null, the buffer is released as for any failed post
+bool TopicManager::publishBuffer(const shared_ptr<Topic> &topic,
+                                 const TopicQueueItem &item) {
+  shared_ptr<ShmBuffer> shm_buf =
+      ShmManager::getInstance()->getBuffer(item->buffer_name);
+  if (!shm_buf) {
+    spdlog::error("failed to publish buffer:{}", item->buffer_name);
+    return false;
+  }
+  unsigned int sub_count = topic ? topic->size() : 0;
+  shm_buf->setRefCount(sub_count);
+  if (sub_count > 0) {
+    ShmManager::getInstance()->attribute(shm_buf, topic->getName());
+    topic->post(item);
+    spdlog::debug("published buffer:{} to topic:{}", item->buffer_name,
+                  topic->getName());
+    return true;
+  }
+
+  if (topic)
+    spdlog::warn("topic:{} registered but no subscribers", topic->getName());
+  spdlog::error("failed to publish buffer:{}", item->buffer_name);
+  ShmManager::getInstance()->release(item->buffer_name, sub_count);
+  return false;
+}
+
+// Publish several shm buffers, possibly to different topics. The buffer
+// lookups take the ShmManager lock once and each topic receives its items
+// with a single post, so the topic and queue locks are taken once per batch.
+// Returns the number of entries that were posted.
+unsigned int TopicManager::publishBatch(vector<PublishEntry> &entries) {
+  vector<string> names;
+  names.reserve(entries.size());
+  for (auto &entry : entries)
+    names.push_back(entry.item->buffer_name);
+  vector<shared_ptr<ShmBuffer>> buffers;
+  ShmManager::getInstance()->getBuffers(names, buffers);
+
+  // group the entries by topic, keeping the publish order within a topic
+  unordered_map<string, vector<size_t>> topics;
+  for (size_t i = 0; i < entries.size(); ++i) {
+    if (buffers[i])
+      topics[entries[i].topic_name].push_back(i);
+    else
+      spdlog::error("failed to publish buffer:{}", names[i]);
+  }
+
+  unsigned int published = 0;
+  vector<string> failed;
+  for (auto &topic : topics) {
+    shared_ptr<Topic> t = findTopic(topic.first);
+    unsigned int sub_count = t ? t->size() : 0;
+    if (sub_count == 0) {
+      spdlog::error("failed to publish {} buffers to topic:{}",
+                    topic.second.size(), topic.first);
+      for (size_t i : topic.second) {
+        buffers[i]->setRefCount(1);
+        failed.push_back(names[i]);
+      }
+      continue;
+    }
+
+    vector<TopicQueueItem> items;
+    items.reserve(topic.second.size());
+    for (size_t i : topic.second) {
+      buffers[i]->setRefCount(sub_count);
+      ShmManager::getInstance()->attribute(buffers[i], topic.first);
+      items.push_back(std::move(entries[i].item));
+      entries[i].posted = true;
+    }
+    t->postBatch(items);
+    published += items.size();
+    spdlog::debug("published {} buffers to topic:{}", items.size(),
+                  topic.first);
+  }
+
+  if (!failed.empty())
+    ShmManager::getInstance()->release(failed);
+  return published;
+}
+
+// The handle is removed first, a subscribe of the same name that races with
+// this gets the closing queue and fails its pulls as after removeTopic.
+// Returns false if the subscription was already removed or replaced.
+bool TopicManager::unsubscribe(const SubscriptionPtr &sub) {
+  shared_ptr<Topic> topic;
+  {
+    TopicShard &s = shard(sub->topic_name);
+    unique_lock<shared_mutex> lock(s.mMutex);
+    auto it = s.mTopics.find(sub->topic_name);
+    if (it == s.mTopics.end())
+      return false;
+    auto &subscriptions = it->second.subscriptions;
+    auto sub_it = subscriptions.find(sub->subscriber_name);
+    if (sub_it == subscriptions.end() ||
+        mSubscriptions.find(sub_it->second) != sub)
+      return false;
+    mSubscriptions.remove(sub_it->second);
+    subscriptions.erase(sub_it);
+    topic = it->second.topic;
+  }
+  return topic->unsubscribe(sub->subscriber_name, sub->queue);
+}
+
 unsigned int TopicManager::getSubscriberCount(string topic_name) {
-  auto it = mActiveTopics.find(topic_name);
-  if (it != mActiveTopics.end())
-    return it->second->size();
-  else
-    return 0;
+  shared_ptr<Topic> topic = findTopic(topic_name);
+  return topic ? topic->size() : 0;
+}
+
+vector<shared_ptr<Topic>> TopicManager::getTopics() {
+  vector<shared_ptr<Topic>> topics;
+  for (auto &s : mShards) {
+    shared_lock lock(s.mMutex);
+    for (auto &it : s.mTopics)
+      topics.push_back(it.second.topic);
+  }
+  return topics;
 }
 
+// Topics are collected first, their queues are read without a shard lock
+void TopicManager::getStats(vector<TopicUsageStats> &stats) {
+  for (auto &topic : getTopics()) {
+    stats.emplace_back();
+    topic->getStats(stats.back());
+  }
+}
+
+unsigned int TopicManager::evict(const string &topic_name) {
+  if (!topic_name.empty()) {
+    shared_ptr<Topic> topic = findTopic(topic_name);
+    return topic ? topic->evict() : 0;
+  }
+
+  unsigned int evicted = 0;
+  for (auto &topic : getTopics())
+    evicted += topic->evict();
+  return evicted;
+}
+
+// Every subscription also gets a handle, resubscribing returns the same one
 bool TopicManager::subscribe(string topic_name, string subscriber_name,
                              std::vector<string> &dependencies,
-                             unsigned int maxQueueSize) {
-  auto it = mActiveTopics.find(topic_name);
-  if (it == mActiveTopics.end()) {
+                             unsigned int maxQueueSize, uint64_t *handle,
+                             const FlowControl &flow) {
+  shared_ptr<Topic> topic = findTopic(topic_name);
+  if (!topic) {
     spdlog::error(
         "subscriber:{} cannot be added to topic:{}, topic doesn't exist",
         subscriber_name, topic_name);
@@ -48,37 +237,101 @@ bool TopicManager::subscribe(string topic_name, string subscriber_name,
   }
   spdlog::info("adding subscriber:{} added to topic:{}", subscriber_name,
                topic_name);
-  return it->second->subscribe(subscriber_name, dependencies, maxQueueSize);
+  if (!topic->subscribe(subscriber_name, dependencies, maxQueueSize, flow))
+    return false;
+
+  SubscriptionPtr sub = make_shared<Subscription>();
+  sub->topic_name = topic_name;
+  sub->subscriber_name = subscriber_name;
+  sub->queue = topic->queue(subscriber_name);
+  sub->slot = sub->queue ? sub->queue->slot(subscriber_name) : NO_SLOT;
+  if (sub->slot == NO_SLOT)
+    return false;
+
+  TopicShard &s = shard(topic_name);
+  unique_lock<shared_mutex> lock(s.mMutex);
+  auto it = s.mTopics.find(topic_name);
+  if (it == s.mTopics.end() || it->second.topic != topic)
+    return false; // removed while subscribing
+  uint64_t &sub_handle = it->second.subscriptions[subscriber_name];
+  if (!sub_handle)
+    sub_handle = mSubscriptions.add(sub);
+  if (handle)
+    *handle = sub_handle;
+  return true;
+}
+
+SubscriptionPtr TopicManager::findSubscription(uint64_t handle) {
+  return mSubscriptions.find(handle);
+}
+
+SubscriptionPtr TopicManager::findSubscription(const string &topic_name,
+                                               const string &subscriber_name) {
+  uint64_t handle;
+  {
+    TopicShard &s = shard(topic_name);
+    shared_lock<shared_mutex> lock(s.mMutex);
+    auto it = s.mTopics.find(topic_name);
+    if (it == s.mTopics.end())
+      return SubscriptionPtr();
+    auto sub_it = it->second.subscriptions.find(subscriber_name);
+    if (sub_it == it->second.subscriptions.end())
+      return SubscriptionPtr();
+    handle = sub_it->second;
+  }
+  return mSubscriptions.find(handle);
 }
 
 bool TopicManager::pull(string topic_name, string subscriber_name,
                         TopicQueueItem &item, int timeout) {
-  auto it = mActiveTopics.find(topic_name);
-  if (it == mActiveTopics.end()) {
+  shared_ptr<Topic> topic = findTopic(topic_name);
+  if (!topic) {
     spdlog::error("pull failed (subscriber:{}), topic:{} doesn't exist",
                   subscriber_name, topic_name);
     return false;
   }
   spdlog::debug("subscriber:{} pulling from topic:{}", subscriber_name,
                 topic_name);
-  return it->second->pull(subscriber_name, item, timeout);
+  return topic->pull(subscriber_name, item, timeout);
+}
+
+bool TopicManager::pullAsync(const string &topic_name, PullWaiterPtr waiter,
+                             vector<TopicQueueItem> &items) {
+  shared_ptr<Topic> topic = findTopic(topic_name);
+  if (!topic) {
+    spdlog::error("pull failed (subscriber:{}), topic:{} doesn't exist",
+                  waiter->subscriber_name, topic_name);
+    return false;
+  }
+  spdlog::debug("subscriber:{} pulling from topic:{}", waiter->subscriber_name,
+                topic_name);
+  return topic->pullAsync(waiter, items);
+}
+
+bool TopicManager::cancelWaiter(const string &topic_name,
+                                const PullWaiterPtr &waiter) {
+  shared_ptr<Topic> topic = findTopic(topic_name);
+  if (!topic)
+    return false;
+  return topic->cancelWaiter(waiter);
 }
 
-bool TopicManager::cancelPull(string topic_name, string subscriber_name) {
-  auto it = mActiveTopics.find(topic_name);
-  if (it == mActiveTopics.end()) {
+bool TopicManager::cancelPull(string topic_name, string subscriber_name,
+                              unsigned int count) {
+  shared_ptr<Topic> topic = findTopic(topic_name);
+  if (!topic) {
     spdlog::debug("topic:{} doesn't exist in active topics", topic_name);
     return false;
   }
-  return it->second->decIdx(subscriber_name);
+  return topic->decIdx(subscriber_name, count);
 }
 
 bool TopicManager::clearOldPosts(string topic_name, string subscriber) {
-  auto it = mActiveTopics.find(topic_name);
-  if (it == mActiveTopics.end()) {
+  shared_ptr<Topic> topic = findTopic(topic_name);
+  if (!topic) {
     spdlog::debug("topic:{} doesn't exist in active topics", topic_name);
     return false;
   }
-  it->second->clearProcessedPosts(subscriber);
+  topic->clearProcessedPosts(subscriber);
   return true;
 }
@@ -1,7 +1,9 @@
 #pragma once
 
+#include <shared_mutex>
 #include <unordered_map>
 
+#include "handle_table.h"
 #include "topic_queue.h"
 
 // There should never be a need to have a queue size greater than 3 for
@@ -9,13 +11,57 @@
 // TODO: what happens if 3 topics in the pipeline have different queue sizes?
 //#define DEFAULT_QUEUE_SIZE  3
 
+// One message of a batch publish. posted is set if the item was moved into
+// the topic.
+struct PublishEntry {
+  string topic_name;
+  TopicQueueItem item;
+  bool posted = false;
+};
+
+// A subscriber's queue and slot, resolved once when it subscribes. Pulls
+// that carry the subscription handle use these directly instead of looking
+// up the topic, the dependency and the subscriber by name.
+struct Subscription {
+  string topic_name;
+  string subscriber_name;
+  shared_ptr<TopicQueue> queue;
+  unsigned int slot;
+};
+
+typedef shared_ptr<Subscription> SubscriptionPtr;
+
+// Topics are spread over shards by name. Lookups on the publish/pull path
+// take a shard lock in shared mode, only addTopic and removeTopic take one
+// exclusively, and the returned shared_ptr keeps a removed topic alive for
+// calls that are still using it. Topics and subscriptions also get numeric
+// handles from addTopic and subscribe, which resolve without hashing a name.
 class TopicManager {
 private:
+  static const size_t SHARD_COUNT = 16;
+
+  struct TopicEntry {
+    shared_ptr<Topic> topic;
+    uint64_t handle;
+    unordered_map<string, uint64_t> subscriptions; // by subscriber name
+  };
+
+  struct TopicShard {
+    shared_mutex mMutex;
+    unordered_map<string, TopicEntry> mTopics;
+  };
+
   static TopicManager *instance;
-  unordered_map<string, shared_ptr<Topic>> mActiveTopics;
+  TopicShard mShards[SHARD_COUNT];
+  HandleTable<Topic> mTopicHandles;
+  HandleTable<Subscription> mSubscriptions;
 
   TopicManager();
 
+  inline TopicShard &shard(const string &topic_name) {
+    return mShards[hash<string>()(topic_name) % SHARD_COUNT];
+  }
+
 public:
   static TopicManager *getInstance() {
     if (!instance)
@@ -23,15 +69,42 @@ public:
     return instance;
   }
 
-  bool addTopic(string &name, bool dropMsgs=false);
-  bool publish(string topic_name, TopicQueueItem &item);
+  // Returns the topic's handle, which is never 0
+  uint64_t addTopic(string &name, bool dropMsgs=false);
+  bool removeTopic(const string &name);
+  bool hasTopic(const string &name);
+  shared_ptr<Topic> findTopic(const string &topic_name);
+  shared_ptr<Topic> findTopic(uint64_t handle);
+  bool publish(string topic_name, const TopicQueueItem &item);
+  bool publishBuffer(const string &topic_name, const TopicQueueItem &item);
+  bool publishBuffer(const shared_ptr<Topic> &topic,
+                     const TopicQueueItem &item);
+  unsigned int publishBatch(vector<PublishEntry> &entries);
   bool subscribe(string topic_name, string subscriber_name,
-                 std::vector<string> &dependencies, unsigned int maxQueueSize);
+                 std::vector<string> &dependencies, unsigned int maxQueueSize,
+                 uint64_t *handle = nullptr,
+                 const FlowControl &flow = FlowControl());
+  // Removes a subscription that reads its own queue, see Topic::unsubscribe.
+  // Its handle no longer resolves.
+  bool unsubscribe(const SubscriptionPtr &sub);
+  SubscriptionPtr findSubscription(uint64_t handle);
+  SubscriptionPtr findSubscription(const string &topic_name,
+                                   const string &subscriber_name);
   bool pull(string topic_name, string subscriber_name, TopicQueueItem &item,
             int timeout = -1);
-  bool cancelPull(string topic_name, string subscriber_name);
+  bool pullAsync(const string &topic_name, PullWaiterPtr waiter,
+                 vector<TopicQueueItem> &items);
+  bool cancelWaiter(const string &topic_name, const PullWaiterPtr &waiter);
+  bool cancelPull(string topic_name, string subscriber_name,
+                  unsigned int count = 1);
   bool clearOldPosts(string topic_name, string subscriber_name);
   unsigned int getSubscriberCount(string topic_name);
+  vector<shared_ptr<Topic>> getTopics();
+  void getStats(vector<TopicUsageStats> &stats);
+  // Evicts the oldest unread message of every queue of the topic, or of
+  // every topic if topic_name is empty, for ShmManager's budgets. Returns
+  // the number of messages evicted.
+  unsigned int evict(const string &topic_name);
 
   ~TopicManager() { delete instance; }
 };
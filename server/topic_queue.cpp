@@ -6,133 +6,529 @@
 using namespace std::chrono;
 using namespace std::chrono_literals;
 
-TopicQueueItem::TopicQueueItem(const string &name, const string &metadata,
-                               const uint64_t ts)
-    : buffer_name(name), metadata(metadata), timestamp(ts) {}
+// Unlimited queues start with room for 16 items and grow as needed
+TopicQueue::TopicQueue(unsigned int maxQueueSize, const FlowControl &flow)
+    : mRing(maxQueueSize ? maxQueueSize : 16), mTail(0), mHead(0),
+      mMaxSize(maxQueueSize), mFlow(flow), mCredits(flow.credits),
+      mCursorCounts(mRing.size() + 1, 0), mMinCursor(0), mMaxCursor(0),
+      mClosed(false), mPushed(0), mPulled(0), mDropped(0), mSkipped(0),
+      mBlockedPosts(0), mBlockedUs(0) {}
+
+// Double the ring of an unlimited queue. Cursors lie in [mTail, mHead], so
+// the counts need one more entry than the ring has slots.
+// Note: caller must hold mMutex
+void TopicQueue::grow() {
+  vector<TopicQueueItem> ring(mRing.size() * 2);
+  for (uint64_t seq = mTail; seq < mHead; ++seq)
+    ring[seq % ring.size()] = std::move(at(seq));
+  mRing.swap(ring);
+
+  mCursorCounts.assign(mRing.size() + 1, 0);
+  for (uint64_t cursor : mCursors)
+    cursorCount(cursor)++;
+}
+
+// Move a subscriber's cursor and update the slowest and fastest cursors.
+// Cursors mostly move forward one item at a time, so the scans below only
+// step over values no subscriber holds any more and are bounded by the ring.
+// Note: caller must hold mMutex
+void TopicQueue::move_cursor(unsigned int sub, uint64_t seq) {
+  uint64_t old = mCursors[sub];
+  if (old == seq)
+    return;
+
+  mCursors[sub] = seq;
+  cursorCount(seq)++;
+  if (--cursorCount(old) > 0) {
+    mMinCursor = min(mMinCursor, seq);
+    mMaxCursor = max(mMaxCursor, seq);
+    return;
+  }
+
+  if (seq < mMinCursor)
+    mMinCursor = seq;
+  else if (old == mMinCursor)
+    while (cursorCount(mMinCursor) == 0)
+      mMinCursor++;
+
+  if (seq > mMaxCursor)
+    mMaxCursor = seq;
+  else if (old == mMaxCursor)
+    while (cursorCount(mMaxCursor) == 0)
+      mMaxCursor--;
+}
+
+// Reset the slots before the slowest cursor
+// Note: caller must hold mMutex
+void TopicQueue::reclaim() {
+  uint64_t tail = mCursors.empty() ? mHead : mMinCursor;
+  for (; mTail < tail; ++mTail)
+    at(mTail).reset();
+}
+
+// Move a subscriber past the items before seq without reading them. Their
+// buffers are added to skipped, the caller releases them once for the
+// subscriber.
+// Note: caller must hold mMutex
+void TopicQueue::skip(unsigned int sub, uint64_t seq, vector<string> &skipped) {
+  if (seq <= mCursors[sub])
+    return;
+  mSkipped += seq - mCursors[sub];
+  for (uint64_t s = mCursors[sub]; s < seq; ++s)
+    skipped.push_back(at(s)->buffer_name);
+  move_cursor(sub, seq);
+}
+
+// Skip the subscriber's unread items that are older than the max age
+// Note: caller must hold mMutex
+void TopicQueue::expire(unsigned int sub, vector<string> &skipped) {
+  if (mFlow.policy != FLOW_MAX_AGE)
+    return;
+  auto oldest = steady_clock::now() - mFlow.max_age_ms * 1ms;
+  uint64_t seq = mCursors[sub];
+  while (seq < mHead && at(seq)->posted < oldest)
+    ++seq;
+  skip(sub, seq, skipped);
+}
+
+// Apply the flow policy before an item is inserted. Returns false if the
+// item must not be queued.
+// Note: caller must hold mMutex
+bool TopicQueue::admit(vector<string> &skipped) {
+  switch (mFlow.policy) {
+  case FLOW_CREDIT:
+    if (mCredits == 0) {
+      mSkipped++;
+      return false;
+    }
+    mCredits--;
+    break;
+  case FLOW_LATEST:
+    for (unsigned int sub = 0; sub < mCursors.size(); ++sub)
+      skip(sub, mHead, skipped);
+    reclaim();
+    break;
+  case FLOW_MAX_AGE:
+    for (unsigned int sub = 0; sub < mCursors.size(); ++sub)
+      expire(sub, skipped);
+    reclaim();
+    break;
+  }
+  return true;
+}
+
+// Append an item, replacing the oldest data not processed by a subscriber if
+// the queue is full. Returns the item that was dropped to make room, whose
+// buffer the caller releases once the queue lock is released.
+// Note: caller must hold mMutex
+TopicQueueItem TopicQueue::insert(const TopicQueueItem &item) {
+  if (!isFull()) {
+    if (size() == mRing.size())
+      grow();
+    at(mHead++) = item;
+    mPushed++;
+    return TopicQueueItem();
+  }
 
-TopicQueue::TopicQueue(unsigned int maxQueueSize)
-    : mMaxSize(maxQueueSize) {}
+  // Remove the oldest queue element not currently being processed by
+  // a subscriber. This keeps the topic up to date.
+  // Oldest free topic is at the max subscriber index + 1
+  uint64_t maxCursor = mCursors.empty() ? mTail : mMaxCursor;
+  uint64_t remove = maxCursor + 1;
+  mDropped++;
+  if (remove >= mHead)
+    return item; // every item is in use, drop the new one
+  mPushed++;
+
+  // Close the gap from the shorter side, as deque::erase would. Cursors
+  // all lie at or below the removed item, so shifting the older items up
+  // moves every cursor up with them, the one step that visits every
+  // subscriber.
+  TopicQueueItem removed = std::move(at(remove));
+  if (remove - mTail <= mHead - remove) {
+    for (uint64_t seq = remove; seq > mTail; --seq)
+      at(seq) = std::move(at(seq - 1));
+    at(mTail++).reset();
+    for (uint64_t &cursor : mCursors)
+      cursorCount(cursor++)--;
+    for (uint64_t cursor : mCursors)
+      cursorCount(cursor)++;
+    mMinCursor++;
+    mMaxCursor++;
+    at(mHead++) = item;
+  } else {
+    for (uint64_t seq = remove; seq + 1 < mHead; ++seq)
+      at(seq) = std::move(at(seq + 1));
+    at(mHead - 1) = item;
+  }
+  return removed;
+}
 
 // If the queue is full, replace the oldest data not processed by a subscriber
-void TopicQueue::push_replace_oldest(TopicQueueItem &item, bool drop) {
+void TopicQueue::push_replace_oldest(const TopicQueueItem &item, bool drop) {
     // If dropping msgs, block for each queue if it is full. This will
     // throttle the topic to the speed of the slowest subscriber, but
     // is necessary to avoid consuming all system memory. Therefore the
-    // developer should be sure blocking is necessary.
+    // developer should be sure blocking is necessary. Only the FLOW_QUEUE
+    // policy blocks.
+    ReadyWaiters ready;
+    vector<string> skipped;
     unique_lock lock(mMutex);
-    while (!drop && isFull())
-      mCV.wait(lock);
-
-    if (!isFull()) {
-      mQueue.push_back(item);
-      mCV.notify_all();
-      return;
-    }
-
-    // Remove the oldest queue element not currently being processed by
-    // a subscriber. This keeps the topic up to date.
-    // Oldest free topic is at the max subscriber index + 1
-    unsigned int maxIdx = 0;
-    for (auto it = mIndexMap.begin(); it != mIndexMap.end(); it++) {
-      if (it->second > maxIdx)
-        maxIdx = it->second;
+    drop = drop || mFlow.policy != FLOW_QUEUE;
+    if (!drop && isFull() && !mClosed) {
+      auto start = steady_clock::now();
+      while (!drop && isFull() && !mClosed)
+        mCV.wait(lock);
+      mBlockedPosts++;
+      mBlockedUs += duration_cast<microseconds>(steady_clock::now() - start)
+                        .count();
     }
-
-    unsigned int removeIdx = maxIdx + 1;
-    if (removeIdx >= size()) {
-      ShmManager::getInstance()->release(item.buffer_name, mIndexMap.size());
+    if (mClosed || !admit(skipped)) {
+      unsigned int sub_count = mCursors.size();
+      lock.unlock();
+      ShmManager::getInstance()->release(item->buffer_name, sub_count);
       return;
     }
 
-    TopicQueueItem removeItem = mQueue[removeIdx];
-    mQueue.erase(mQueue.begin() + removeIdx);
-    mQueue.push_back(item);
+    TopicQueueItem removed = insert(item);
+    unsigned int sub_count = mCursors.size();
     mCV.notify_all();
-    ShmManager::getInstance()->release(removeItem.buffer_name, mIndexMap.size());
+    take_ready_waiters(ready);
+    lock.unlock();
+    complete_waiters(ready);
+    if (removed)
+      ShmManager::getInstance()->release(removed->buffer_name, sub_count);
+    if (!skipped.empty())
+      ShmManager::getInstance()->release(skipped);
 }
 
-bool TopicQueue::pull(string subscriber_name, TopicQueueItem &item, int timeout) {
+// Push several items under one acquisition of the queue lock. Parked pulls
+// are completed and dropped buffers released once for the whole batch.
+void TopicQueue::push_batch(vector<TopicQueueItem> &items, bool drop) {
+  ReadyWaiters ready;
+  vector<string> removed, skipped;
   unique_lock lock(mMutex);
+  drop = drop || mFlow.policy != FLOW_QUEUE;
+  for (auto &item : items) {
+    auto start = steady_clock::now();
+    bool blocked = false;
+    while (!drop && isFull() && !mClosed) {
+      blocked = true;
+      // subscribers must see what was already pushed before we block on them
+      mCV.notify_all();
+      take_ready_waiters(ready);
+      if (ready.empty()) {
+        mCV.wait(lock);
+        continue;
+      }
+      lock.unlock();
+      complete_waiters(ready);
+      ready.clear();
+      lock.lock();
+    }
+    if (blocked) {
+      mBlockedPosts++;
+      mBlockedUs += duration_cast<microseconds>(steady_clock::now() - start)
+                        .count();
+    }
+
+    TopicQueueItem dropped = mClosed || !admit(skipped) ? item : insert(item);
+    if (dropped)
+      removed.push_back(dropped->buffer_name);
+  }
+
+  unsigned int sub_count = mCursors.size();
+  mCV.notify_all();
+  take_ready_waiters(ready);
+  lock.unlock();
+  complete_waiters(ready);
+  if (!removed.empty())
+    ShmManager::getInstance()->release(removed, sub_count);
+  if (!skipped.empty())
+    ShmManager::getInstance()->release(skipped);
+}
+
+// Copy up to max_items unread items for a subscriber, advancing its cursor
+// Note: caller must hold mMutex
+void TopicQueue::take_items(unsigned int sub, unsigned int max_items,
+                            vector<TopicQueueItem> &items) {
+  uint64_t cursor = mCursors[sub];
+  for (unsigned int n = 0; n < max(max_items, 1u) && cursor < mHead; ++n)
+    items.push_back(at(cursor++));
+  mPulled += cursor - mCursors[sub];
+  move_cursor(sub, cursor);
+}
+
+// Hand queued items to parked pulls whose subscriber has unread data
+void TopicQueue::take_ready_waiters(ReadyWaiters &ready) {
+  if (mWaiters.empty())
+    return;
+  auto now = steady_clock::now();
+  for (auto it = mWaiters.begin(); it != mWaiters.end();) {
+    unsigned int sub = (*it)->slot;
+    if (mCursors[sub] < mHead) {
+      mPullWait.record(now - (*it)->parked);
+      ready.emplace_back(*it, vector<TopicQueueItem>());
+      take_items(sub, (*it)->max_items, ready.back().second);
+      it = mWaiters.erase(it);
+    } else
+      ++it;
+  }
+}
+
+// Parked pulls are completed after the queue lock is released
+void TopicQueue::complete_waiters(ReadyWaiters &ready) {
+  for (auto &it : ready)
+    it.first->callback(it.second);
+}
+
+// Returns NO_SLOT if the subscriber is unknown. Slots stay valid for the
+// lifetime of the queue.
+unsigned int TopicQueue::slot(const string &subscriber_name) const {
+  lock_guard lock(mMutex);
   auto it = mIndexMap.find(subscriber_name);
-  if (it == mIndexMap.end()) {
+  return it == mIndexMap.end() ? NO_SLOT : it->second;
+}
+
+bool TopicQueue::pull(string subscriber_name, TopicQueueItem &item, int timeout) {
+  unsigned int sub = slot(subscriber_name);
+  if (sub == NO_SLOT) {
     // spdlog::error("Subscriber ID {} is not assigned to topic {}", id, mName);
     return false;
   }
-  int idx = it->second++; // Note: idx is incremented
+  return pull(sub, item, timeout);
+}
 
-  // If the current subscriber has processed all available queue messages,
-  // it should wait for other subscribers to free up old messages and/or
-  // the publisher to post new data
-  while (idx >= size()) { // it->second retrieves current subscriber index
-    // spdlog::debug("Subscriber {} is waiting for new data", id);
-    if (timeout < 0) {
+bool TopicQueue::pull(unsigned int sub, TopicQueueItem &item, int timeout) {
+  vector<string> skipped;
+  bool pulled = false;
+  {
+    unique_lock lock(mMutex);
+    if (sub >= mCursors.size())
+      return false;
+    auto start = steady_clock::now();
+    auto deadline = system_clock::now() + timeout * 1ms;
+
+    // If the current subscriber has processed all available queue messages,
+    // it should wait for other subscribers to free up old messages and/or
+    // the publisher to post new data
+    while (true) {
+      expire(sub, skipped);
+      if (mCursors[sub] < mHead) {
+        item = at(mCursors[sub]);
+        move_cursor(sub, mCursors[sub] + 1);
+        mPulled++;
+        mPullWait.record(steady_clock::now() - start);
+        pulled = true;
+        break;
+      }
+      if (mClosed)
+        break;
+      // spdlog::debug("Subscriber {} is waiting for new data", id);
+      if (timeout < 0)
         mCV.wait(lock);
+      else if (mCV.wait_until(lock, deadline) == std::cv_status::timeout &&
+               mCursors[sub] >= mHead)
+        break; // return false if timeout
     }
-    else {
-        mCV.wait(lock);
-      auto status = mCV.wait_until(
-              lock, system_clock::now() + timeout * 1ms);
-        mCV.wait(lock);
-      if (status == std::cv_status::timeout)
-        return false; // return false if timeout
+  }
+
+  if (!skipped.empty())
+    ShmManager::getInstance()->release(skipped);
+  return pulled;
+}
+
+// Non-blocking pull. Up to waiter->max_items available items are returned
+// in items. If there are none the waiter is parked until the next post.
+// Returns false if the subscriber is unknown.
+bool TopicQueue::pull_async(PullWaiterPtr waiter,
+                            vector<TopicQueueItem> &items) {
+  vector<string> skipped;
+  {
+    lock_guard lock(mMutex);
+    if (waiter->slot == NO_SLOT) {
+      auto it = mIndexMap.find(waiter->subscriber_name);
+      if (it != mIndexMap.end())
+        waiter->slot = it->second;
     }
+    if (waiter->slot >= mCursors.size() || mClosed)
+      return false;
+
+    expire(waiter->slot, skipped);
+    take_items(waiter->slot, waiter->max_items, items);
+    if (items.empty()) {
+      waiter->parked = steady_clock::now();
+      mWaiters.push_back(waiter);
+    } else
+      mPullWait.record(steady_clock::duration::zero());
   }
 
-  item = mQueue[idx];
+  if (!skipped.empty())
+    ShmManager::getInstance()->release(skipped);
   return true;
 }
 
-bool TopicQueue::decrement_index(string subscriber_name) {
+// Returns true if the waiter was still parked, in which case its callback
+// will never be invoked.
+bool TopicQueue::cancel_waiter(const PullWaiterPtr &waiter) {
   lock_guard lock(mMutex);
-  auto it = mIndexMap.find(subscriber_name);
-  if (it == mIndexMap.end()) {
-    return false;
+  for (auto it = mWaiters.begin(); it != mWaiters.end(); ++it) {
+    if (*it == waiter) {
+      mWaiters.erase(it);
+      return true;
+    }
   }
+  return false;
+}
+
+// Make the last count items pulled by the subscriber available again, as far
+// as they haven't been reclaimed
+bool TopicQueue::decrement_index(string subscriber_name, unsigned int count) {
+  unsigned int sub = slot(subscriber_name);
+  return sub != NO_SLOT && decrement_index(sub, count);
+}
+
+bool TopicQueue::decrement_index(unsigned int sub, unsigned int count) {
+  lock_guard lock(mMutex);
+  if (sub >= mCursors.size())
+    return false;
 
-  it->second--;
+  uint64_t cursor = mCursors[sub];
+  move_cursor(sub, cursor - min<uint64_t>(cursor - mTail, count));
   return true;
 }
 
+// Reclaim the items every subscriber has moved past
 unsigned int TopicQueue::clear_old() {
   lock_guard lock(mMutex);
-  unsigned int minIdx = mMaxSize;
-  for (auto it = mIndexMap.begin(); it != mIndexMap.end(); it++) {
-    if (it->second < minIdx)
-      minIdx = it->second;
+  uint64_t tail = mTail;
+  reclaim();
+  unsigned int popped_count = mTail - tail;
+  if (popped_count > 0)
+    mCV.notify_all();
+  return popped_count;
+}
+
+// Drop the oldest item that no subscriber has reached yet, the one a full
+// queue replaces first, to free its buffer. Returns false if there is none.
+bool TopicQueue::evict_oldest() {
+  TopicQueueItem removed;
+  unsigned int sub_count;
+  {
+    lock_guard lock(mMutex);
+    uint64_t maxCursor = mCursors.empty() ? mTail : mMaxCursor;
+    uint64_t remove = maxCursor + 1;
+    if (remove >= mHead)
+      return false;
+    removed = std::move(at(remove));
+    for (uint64_t seq = remove; seq + 1 < mHead; ++seq)
+      at(seq) = std::move(at(seq + 1));
+    at(--mHead).reset();
+    mDropped++;
+    sub_count = mCursors.size();
+    mCV.notify_all();
   }
+  ShmManager::getInstance()->release(removed->buffer_name, sub_count);
+  return true;
+}
 
-  unsigned int popped_count = 0;
-  for (int i = 0; i < minIdx; ++i) {
-    if (mQueue.empty())
-      break;
+// Credit of a FLOW_CREDIT queue, ignored by the other policies
+void TopicQueue::grant_credits(unsigned int credits) {
+  lock_guard lock(mMutex);
+  mCredits += credits;
+}
 
-    mQueue.pop_front();
-    popped_count++;
-    mCV.notify_one();
+// New subscribers, and subscribers that subscribe again, start at the oldest
+// item in the queue
+void TopicQueue::init_index(string subscriber_name) {
+  lock_guard lock(mMutex);
+  auto it = mIndexMap.find(subscriber_name);
+  if (it != mIndexMap.end()) {
+    move_cursor(it->second, mTail);
+    return;
   }
 
-  // Need to decrement subscriber indices after removing old elements
-  if (popped_count > 0) {
-    for (auto it = mIndexMap.begin(); it != mIndexMap.end(); it++)
-      it->second = (it->second > popped_count) ? it->second - popped_count : 0;
+  if (mCursors.empty())
+    mMinCursor = mMaxCursor = mTail;
+  mIndexMap[subscriber_name] = mCursors.size();
+  mCursors.push_back(mTail);
+  cursorCount(mTail)++;
+  mMinCursor = mTail;
+}
+
+// Wake everything waiting on the queue and complete parked pulls without
+// data. References held for subscribers that will never read an item are
+// released, items already pulled are released by their subscriber.
+void TopicQueue::close() {
+  ReadyWaiters ready;
+  vector<pair<string, unsigned int>> unread;
+  {
+    lock_guard lock(mMutex);
+    if (mClosed)
+      return;
+    mClosed = true;
+    for (auto &waiter : mWaiters)
+      ready.emplace_back(waiter, vector<TopicQueueItem>());
+    mWaiters.clear();
+
+    for (uint64_t seq = mTail; seq < mHead; ++seq) {
+      unsigned int readers = 0;
+      for (uint64_t cursor : mCursors)
+        readers += cursor <= seq;
+      if (readers > 0)
+        unread.emplace_back(at(seq)->buffer_name, readers);
+      at(seq).reset();
+    }
+    mTail = mHead;
+    mCV.notify_all();
   }
 
-  return popped_count;
+  complete_waiters(ready);
+  for (auto &it : unread)
+    ShmManager::getInstance()->release(it.first, it.second);
 }
 
-void TopicQueue::init_index(string subscriber_name) {
+void TopicQueue::getStats(TopicQueueStats &stats) {
   lock_guard lock(mMutex);
-  mIndexMap[subscriber_name] = 0;
+  auto now = steady_clock::now();
+  stats.size = size();
+  stats.maxSize = mMaxSize;
+  stats.flowPolicy = mFlow.policy;
+  stats.pushed = mPushed;
+  stats.pulled = mPulled;
+  stats.dropped = mDropped;
+  stats.skipped = mSkipped;
+  stats.blockedPosts = mBlockedPosts;
+  stats.blockedUs = mBlockedUs;
+  mPullWait.snapshot(stats.pullWait, stats.pullWaitSumUs);
+  for (auto &it : mIndexMap) {
+    TopicQueueStats::Subscriber sub;
+    sub.name = it.first;
+    uint64_t cursor = mCursors[it.second];
+    sub.depth = mHead - cursor;
+    if (cursor < mHead)
+      sub.lagMs = duration<double, milli>(now - at(cursor)->posted).count();
+    stats.subscribers.push_back(std::move(sub));
+  }
 }
 
-Topic::Topic(string name, bool dropMsgs) : mName(name), mDropMsgs(dropMsgs) {}
+Topic::Topic(string name, bool dropMsgs)
+    : mName(name), mDropMsgs(dropMsgs), mClosed(false) {}
+
+// Note: caller must hold mMutex
+shared_ptr<TopicQueue> Topic::findQueue(const string &subscriber_name) const {
+  auto dep_it = dependencyMap.find(subscriber_name);
+  auto q_it = mQueueMap.find(dep_it != dependencyMap.end() ? dep_it->second
+                                                           : subscriber_name);
+  return q_it == mQueueMap.end() ? shared_ptr<TopicQueue>() : q_it->second;
+}
 
 // If the subscriber is not already subscribed to the topic
 // the given subscriber name is set to the oldest position in the queue.
 // This subscriber method allows multiple subscribers of the same name.
 bool Topic::subscribe(string &subscriber_name,
                       std::vector<string> &dependencies,
-                      unsigned int maxQueueSize) {
+                      unsigned int maxQueueSize, const FlowControl &flow) {
   unique_lock<shared_mutex> lock(mMutex);
   if (dependencies.size() > 0) {
     if (dependencyMap.find(subscriber_name) != dependencyMap.end())
@@ -152,13 +548,17 @@ bool Topic::subscribe(string &subscriber_name,
 
       if (foundDependency)
         break;
+      if (mClosed)
+        return false;
 
       mCV_sub.wait(lock);
     }
     dependencyMap[subscriber_name] = foundName; // point to a parent queue
     mQueueMap[foundName]->init_index(subscriber_name);
+  } else if (mClosed) {
+    return false;
   } else if (mQueueMap.find(subscriber_name) == mQueueMap.end()) {
-    mQueueMap[subscriber_name] = make_shared<TopicQueue>(maxQueueSize);
+    mQueueMap[subscriber_name] = make_shared<TopicQueue>(maxQueueSize, flow);
     mQueueMap[subscriber_name]->init_index(subscriber_name);
     mCV_sub.notify_all();
   }
@@ -166,12 +566,67 @@ bool Topic::subscribe(string &subscriber_name,
   return true;
 }
 
-void Topic::post(TopicQueueItem &item) {
-  shared_lock lock(mMutex); // need read access to mQueueMap
-  for (auto q_it = mQueueMap.begin(); q_it != mQueueMap.end(); ++q_it) {
-    shared_ptr<TopicQueue> q = q_it->second;
-    q->push_replace_oldest(item, mDropMsgs);
+// Removes a subscriber that reads its own queue, as long as that is still
+// queue, and closes the queue. Closing releases what the queue held for the
+// subscriber and wakes its pulls and any post blocked on it, so the lock is
+// only taken exclusively once nothing waits in the queue. A queue that other
+// subscribers depend on is kept, dependents that subscribed while it closed
+// are removed with it.
+bool Topic::unsubscribe(const string &subscriber_name,
+                        const shared_ptr<TopicQueue> &queue) {
+  {
+    shared_lock lock(mMutex);
+    auto it = mQueueMap.find(subscriber_name);
+    if (it == mQueueMap.end() || it->second != queue)
+      return false;
+    for (auto &dep : dependencyMap) {
+      if (dep.second == subscriber_name) {
+        spdlog::error("subscriber:{} of topic:{} has dependents and can't be "
+                      "removed",
+                      subscriber_name, mName);
+        return false;
+      }
+    }
+  }
+
+  spdlog::info("removing subscriber:{} from topic:{}", subscriber_name, mName);
+  queue->close();
+  unique_lock<shared_mutex> lock(mMutex);
+  auto it = mQueueMap.find(subscriber_name);
+  if (it != mQueueMap.end() && it->second == queue)
+    mQueueMap.erase(it);
+  for (auto dep = dependencyMap.begin(); dep != dependencyMap.end();) {
+    if (dep->second == subscriber_name)
+      dep = dependencyMap.erase(dep);
+    else
+      ++dep;
   }
+  return true;
+}
+
+// Returns the queues of the subscribers that read their own queue
+vector<shared_ptr<TopicQueue>> Topic::queues() const {
+  vector<shared_ptr<TopicQueue>> queues;
+  shared_lock lock(mMutex);
+  queues.reserve(mQueueMap.size());
+  for (auto &it : mQueueMap)
+    queues.push_back(it.second);
+  return queues;
+}
+
+// The push may block on a full queue of a topic that doesn't drop messages,
+// so the topic lock is not held across it. A queue closed meanwhile releases
+// the item instead of queueing it.
+void Topic::post(const TopicQueueItem &item) {
+  mPublished.add();
+  for (auto &q : queues())
+    q->push_replace_oldest(item, mDropMsgs);
+}
+
+void Topic::postBatch(vector<TopicQueueItem> &items) {
+  mPublished.add(items.size());
+  for (auto &q : queues())
+    q->push_batch(items, mDropMsgs);
 }
 
 // this should set item according to the subscriber id's index, increment the
@@ -179,28 +634,34 @@ void Topic::post(TopicQueueItem &item) {
 // current index is greater than the number of queue elements, block until data
 // is available by default. If block false immediately return when there is no
 // available data
+//
+// The topic lock is only held to find the queue, a pull blocked in the queue
+// must not keep close() from taking it.
 bool Topic::pull(string &subscriber_name, TopicQueueItem &item, int timeout) {
-  shared_lock lock(mMutex); // need read access to mQueueMap and dependencyMap
   shared_ptr<TopicQueue> q;
-  if (dependencyMap.find(subscriber_name) != dependencyMap.end())
-    q = mQueueMap[dependencyMap[subscriber_name]];
-  else if (mQueueMap.find(subscriber_name) != mQueueMap.end())
-    q = mQueueMap[subscriber_name];
-  else
-    return false;
+  {
+    shared_lock lock(mMutex);
+    q = findQueue(subscriber_name);
+  }
+  return q ? q->pull(subscriber_name, item, timeout) : false;
+}
 
-  return q->pull(subscriber_name, item, timeout);
+bool Topic::pullAsync(PullWaiterPtr waiter, vector<TopicQueueItem> &items) {
+  shared_lock lock(mMutex);
+  shared_ptr<TopicQueue> q = findQueue(waiter->subscriber_name);
+  return q ? q->pull_async(waiter, items) : false;
 }
 
-bool Topic::decIdx(string &subscriber_name) {
+bool Topic::cancelWaiter(const PullWaiterPtr &waiter) {
   shared_lock lock(mMutex);
-  shared_ptr<TopicQueue> q;
-  if (dependencyMap.find(subscriber_name) != dependencyMap.end())
-    q = mQueueMap[dependencyMap[subscriber_name]];
-  else
-    q = mQueueMap[subscriber_name];
+  shared_ptr<TopicQueue> q = findQueue(waiter->subscriber_name);
+  return q ? q->cancel_waiter(waiter) : false;
+}
 
-  return q->decrement_index(subscriber_name);
+bool Topic::decIdx(string &subscriber_name, unsigned int count) {
+  shared_lock lock(mMutex);
+  shared_ptr<TopicQueue> q = findQueue(subscriber_name);
+  return q ? q->decrement_index(subscriber_name, count) : false;
 }
 
 // Check if low index queue items have been processed by all subscribers. Pop
@@ -219,6 +680,72 @@ unsigned int Topic::clearProcessedPosts(string &subscriber_name) {
   return q->clear_old();
 }
 
+// Returns the queue the subscriber reads from, which is the queue of the
+// subscriber it depends on if it was subscribed with dependencies
+shared_ptr<TopicQueue> Topic::queue(const string &subscriber_name) const {
+  shared_lock lock(mMutex);
+  return findQueue(subscriber_name);
+}
+
+// Called once the topic is removed from the TopicManager. The queues are
+// closed first, which wakes posts and pulls blocked in them, then the topic
+// is marked closed so no subscriber is added. Queues subscribed in between
+// are closed last.
+void Topic::close() {
+  for (auto &q : queues())
+    q->close();
+
+  vector<shared_ptr<TopicQueue>> added;
+  {
+    unique_lock<shared_mutex> lock(mMutex);
+    mClosed = true;
+    mCV_sub.notify_all();
+    for (auto &it : mQueueMap)
+      added.push_back(it.second);
+  }
+  for (auto &q : added)
+    q->close();
+}
+
+// Evicts the oldest unread item of every queue, see TopicQueue::evict_oldest.
+// Topics that don't drop messages keep them.
+unsigned int Topic::evict() {
+  if (!mDropMsgs)
+    return 0;
+  unsigned int evicted = 0;
+  for (auto &q : queues())
+    evicted += q->evict_oldest();
+  return evicted;
+}
+
+// Subscribers that read their own queue and those that depend on another
+vector<string> Topic::getSubscribers() const {
+  shared_lock lock(mMutex);
+  vector<string> names;
+  for (auto &it : mQueueMap)
+    names.push_back(it.first);
+  for (auto &it : dependencyMap)
+    names.push_back(it.first);
+  return names;
+}
+
+void Topic::getStats(TopicUsageStats &stats) {
+  stats.name = mName;
+  stats.dropMsgs = mDropMsgs;
+  stats.published = mPublished.count();
+  stats.publishRate = mPublished.rate();
+  vector<pair<string, shared_ptr<TopicQueue>>> queues;
+  {
+    shared_lock lock(mMutex);
+    queues.assign(mQueueMap.begin(), mQueueMap.end());
+  }
+  for (auto &it : queues) {
+    stats.queues.emplace_back();
+    stats.queues.back().owner = it.first;
+    it.second->getStats(stats.queues.back());
+  }
+}
+
 // Questions:
 // 1. Do we need a smaller index limit than max queue size?
 // Ans: No, but we do need to consider updating the queue when the
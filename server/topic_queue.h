@@ -1,47 +1,169 @@
 #pragma once
 
+#include <chrono>
+#include <climits>
 #include <condition_variable>
-#include <deque>
+#include <functional>
+#include <list>
+#include <memory>
 #include <mutex>
 #include <shared_mutex>
 #include <unordered_map>
 #include <vector>
 #include <string>
 
+#include "flow_policy.h"
+#include "metrics.h"
 //#include "spdlog/spdlog.h"
 
 using namespace std;
 
-struct TopicQueueItem {
-  string buffer_name;
-  string metadata;
-  uint64_t timestamp;
-  TopicQueueItem(const string &name, const string &metadata, const uint64_t ts);
-  TopicQueueItem() = default;
+// A published message. It is immutable once created, so every subscriber
+// queue of a topic shares the same message and a post copies a pointer
+// rather than the metadata. posted is when the server received it.
+struct TopicMessage {
+  const string buffer_name;
+  const string metadata;
+  const uint64_t timestamp;
+  const chrono::steady_clock::time_point posted;
+  const uint64_t trace_id; // see tracer.h, 0 if not traced
+  TopicMessage(string name, string metadata, uint64_t ts, uint64_t trace = 0)
+      : buffer_name(std::move(name)), metadata(std::move(metadata)),
+        timestamp(ts), posted(chrono::steady_clock::now()), trace_id(trace) {}
 };
 
+typedef shared_ptr<const TopicMessage> TopicQueueItem;
+
+inline TopicQueueItem makeTopicQueueItem(string name, string metadata,
+                                         uint64_t ts, uint64_t trace = 0) {
+  return make_shared<const TopicMessage>(std::move(name), std::move(metadata),
+                                         ts, trace);
+}
+
+// A subscriber's index into the cursors of its queue, see TopicQueue::slot
+const unsigned int NO_SLOT = UINT_MAX;
+
+// A pull that is parked without a thread. The callback is invoked by the
+// thread that posts the next items for the subscriber, outside the queue
+// lock, with between 1 and max_items items.
+struct PullWaiter {
+  string subscriber_name;
+  unsigned int slot = NO_SLOT; // resolved from subscriber_name if not set
+  unsigned int max_items = 1;
+  function<void(vector<TopicQueueItem> &items)> callback;
+  chrono::steady_clock::time_point parked; // set by the queue
+};
+
+typedef shared_ptr<PullWaiter> PullWaiterPtr;
+typedef vector<pair<PullWaiterPtr, vector<TopicQueueItem>>> ReadyWaiters;
+
+// A snapshot of a queue for GetStats. A subscriber's depth is the number of
+// items it hasn't read, its lag the age of the oldest of them. dropped counts
+// items replaced by newer ones or not queued because every item was in use,
+// skipped those skipped by the flow policy.
+struct TopicQueueStats {
+  struct Subscriber {
+    string name;
+    unsigned int depth = 0;
+    double lagMs = 0;
+  };
+
+  string owner; // the subscriber that created the queue
+  unsigned int size = 0;
+  unsigned int maxSize = 0;
+  unsigned int flowPolicy = FLOW_QUEUE;
+  uint64_t pushed = 0;
+  uint64_t pulled = 0;
+  uint64_t dropped = 0;
+  uint64_t skipped = 0;
+  uint64_t blockedPosts = 0; // posts that waited for room
+  uint64_t blockedUs = 0;
+  vector<uint64_t> pullWait; // LatencyHistogram buckets
+  uint64_t pullWaitSumUs = 0;
+  vector<Subscriber> subscribers;
+};
+
+struct TopicUsageStats {
+  string name;
+  bool dropMsgs = true;
+  uint64_t published = 0;
+  double publishRate = 0; // per second
+  vector<TopicQueueStats> queues;
+};
+
+// Items live in a ring indexed by monotonically increasing sequence numbers
+// and each subscriber has a cursor, the sequence of the next item it reads.
+// Items before the slowest cursor are reclaimed by clear_old. The slowest and
+// fastest cursors are tracked incrementally with a count of subscribers per
+// cursor value, so pushing, pulling and reclaiming don't scan the subscribers.
+// Dropping an item from a full queue is not constant time: it closes the gap
+// by moving the items on its shorter side, and when those are the older
+// items every cursor moves with them, O(queue length + subscribers).
+// Unlimited queues (maxQueueSize 0) grow the ring instead of dropping items.
+// The flow policy may skip items, which moves the cursors past them.
 class TopicQueue {
 private:
-  deque<TopicQueueItem> mQueue;
+  vector<TopicQueueItem> mRing;
+  uint64_t mTail; // oldest item still held
+  uint64_t mHead; // sequence of the next item posted
   mutable mutex mMutex;
   condition_variable mCV;
   const unsigned int mMaxSize;
-  unordered_map<string, unsigned int> mIndexMap;
+  const FlowControl mFlow;
+  unsigned int mCredits;
+  unordered_map<string, unsigned int> mIndexMap; // subscriber -> mCursors slot
+  vector<uint64_t> mCursors;
+  vector<unsigned int> mCursorCounts; // by cursor % (ring size + 1)
+  uint64_t mMinCursor;
+  uint64_t mMaxCursor;
+  list<PullWaiterPtr> mWaiters;
+  bool mClosed;
+  // counters for getStats, updated under mMutex
+  uint64_t mPushed, mPulled, mDropped, mSkipped, mBlockedPosts, mBlockedUs;
+  LatencyHistogram mPullWait; // from a pull to its first item
 
   // Note: functions under private are not thread safe
-  inline unsigned int size() const {return mQueue.size();}
+  inline unsigned int size() const {return mHead - mTail;}
   inline bool isUnlimited() const {return mMaxSize == 0;}
   inline bool isFull() const {return !isUnlimited() && size() >= mMaxSize;}
+  inline TopicQueueItem &at(uint64_t seq) {return mRing[seq % mRing.size()];}
+  inline unsigned int &cursorCount(uint64_t seq) {
+    return mCursorCounts[seq % mCursorCounts.size()];
+  }
+  void grow();
+  void reclaim();
+  void move_cursor(unsigned int sub, uint64_t seq);
+  void skip(unsigned int sub, uint64_t seq, vector<string> &skipped);
+  void expire(unsigned int sub, vector<string> &skipped);
+  bool admit(vector<string> &skipped);
+  TopicQueueItem insert(const TopicQueueItem &item);
+  void take_items(unsigned int sub, unsigned int max_items,
+                  vector<TopicQueueItem> &items);
+  void take_ready_waiters(ReadyWaiters &ready);
+  static void complete_waiters(ReadyWaiters &ready);
 
 public:
-  TopicQueue(const unsigned int maxQueueSize);
+  TopicQueue(const unsigned int maxQueueSize,
+             const FlowControl &flow = FlowControl());
   virtual ~TopicQueue() {}
 
-  void push_replace_oldest(TopicQueueItem &item, bool drop=true);
+  void push_replace_oldest(const TopicQueueItem &item, bool drop=true);
+  void push_batch(vector<TopicQueueItem> &items, bool drop=true);
+  // Subscribers are identified by name or by the slot returned from
+  // slot(), which skips the name lookup on every call
+  unsigned int slot(const string &subscriber_name) const;
   bool pull(string subscriber_name, TopicQueueItem &item, int timeout = -1);
-  bool decrement_index(string subscriber_name);
+  bool pull(unsigned int slot, TopicQueueItem &item, int timeout = -1);
+  bool pull_async(PullWaiterPtr waiter, vector<TopicQueueItem> &items);
+  bool cancel_waiter(const PullWaiterPtr &waiter);
+  bool decrement_index(string subscriber_name, unsigned int count = 1);
+  bool decrement_index(unsigned int slot, unsigned int count = 1);
   unsigned int clear_old();
+  bool evict_oldest();
+  void grant_credits(unsigned int credits);
   void init_index(string subscriber_name);
+  void close();
+  void getStats(TopicQueueStats &stats);
 };
 
 class Topic {
@@ -52,17 +174,39 @@ private:
   condition_variable_any mCV_sub;
   unordered_map<string, shared_ptr<TopicQueue>> mQueueMap;
   unordered_map<string, string> dependencyMap;
+  bool mClosed;
+  RateMeter mPublished;
+
+  shared_ptr<TopicQueue> findQueue(const string &subscriber_name) const;
+  vector<shared_ptr<TopicQueue>> queues() const;
 
 public:
   Topic(string name, bool dropMsgs=true);
   virtual ~Topic() {}
 
-  void post(TopicQueueItem &item);
+  void post(const TopicQueueItem &item);
+  void postBatch(vector<TopicQueueItem> &items);
   bool subscribe(string &subsriber_name, vector<string> &dependencies,
-                 unsigned int maxQueueSize);
+                 unsigned int maxQueueSize,
+                 const FlowControl &flow = FlowControl());
+  bool unsubscribe(const string &subscriber_name,
+                   const shared_ptr<TopicQueue> &queue);
   bool pull(string &subsriber_name, TopicQueueItem &item, int timeout = -1);
-  bool decIdx(string &subsriber_name);
+  bool pullAsync(PullWaiterPtr waiter, vector<TopicQueueItem> &items);
+  bool cancelWaiter(const PullWaiterPtr &waiter);
+  bool decIdx(string &subsriber_name, unsigned int count = 1);
   unsigned int clearProcessedPosts(string &subscriber_name);
+  shared_ptr<TopicQueue> queue(const string &subscriber_name) const;
+  void close();
+  // Returns the number of items evicted to free shared memory
+  unsigned int evict();
+  vector<string> getSubscribers() const;
+  void getStats(TopicUsageStats &stats);
 
-  unsigned int size() const { return mQueueMap.size() + dependencyMap.size(); }
+  const string &getName() const { return mName; }
+  bool dropsMessages() const { return mDropMsgs; }
+  unsigned int size() const {
+    shared_lock lock(mMutex);
+    return mQueueMap.size() + dependencyMap.size();
+  }
 };
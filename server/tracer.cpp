@@ -0,0 +1,198 @@
+#include "tracer.h"
+#include "spdlog/spdlog.h"
+
+#include <nlohmann/json.hpp>
+
+using json = nlohmann::json;
+
+Tracer *Tracer::instance = nullptr;
+
+Tracer::Tracer()
+    : mEnabled(false), mMaxTraces(4096), mSamples(1024),
+      mStart(chrono::steady_clock::now()), mNextId(1) {}
+
+void Tracer::configure(bool enabled, size_t maxTraces, size_t samples) {
+  {
+    lock_guard<mutex> lock(mMutex);
+    mMaxTraces = max<size_t>(maxTraces, 1);
+    mSamples = max<size_t>(samples, 1);
+  }
+  mEnabled = enabled;
+  spdlog::info("tracing {}", enabled ? "enabled" : "disabled");
+}
+
+// Ids are consecutive, so a trace is found by its distance from the oldest
+// Note: caller must hold mMutex
+Tracer::Trace *Tracer::find(uint64_t id) {
+  if (mTraces.empty() || id < mTraces.front().id || id > mTraces.back().id)
+    return nullptr;
+  return &mTraces[id - mTraces.front().id];
+}
+
+// Note: caller must hold mMutex
+void Tracer::record(const string &stage, const string &topic,
+                    const string &subscriber, TimePoint from, TimePoint to) {
+  auto it = mStages.find(make_tuple(stage, topic, subscriber));
+  if (it == mStages.end())
+    it = mStages
+             .emplace(make_tuple(stage, topic, subscriber),
+                      LatencyWindow(mSamples))
+             .first;
+  it->second.record(
+      chrono::duration_cast<chrono::microseconds>(to - from).count());
+}
+
+void Tracer::created(const string &buffer_name) {
+  if (!enabled())
+    return;
+  lock_guard<mutex> lock(mMutex);
+  // buffers that are never published would pile up
+  if (mCreated.size() >= mMaxTraces)
+    mCreated.clear();
+  mCreated[buffer_name] = chrono::steady_clock::now();
+}
+
+uint64_t Tracer::published(const string &buffer_name,
+                           const string &topic_name,
+                           const vector<string> &parents) {
+  if (!enabled())
+    return 0;
+  auto now = chrono::steady_clock::now();
+  lock_guard<mutex> lock(mMutex);
+  Trace trace;
+  trace.id = mNextId++;
+  trace.buffer = buffer_name;
+  trace.topic = topic_name;
+  trace.published = now;
+  trace.root = now;
+  auto created = mCreated.find(buffer_name);
+  if (created != mCreated.end()) {
+    trace.created = created->second;
+    mCreated.erase(created);
+    record("fill", topic_name, "", trace.created, now);
+  }
+  for (auto &parent_name : parents) {
+    auto live = mLive.find(parent_name);
+    Trace *parent = live != mLive.end() ? find(live->second) : nullptr;
+    if (!parent)
+      continue;
+    trace.parents.push_back(parent->id);
+    trace.root = min(trace.root, parent->root);
+  }
+
+  mLive[buffer_name] = trace.id;
+  mTraces.push_back(std::move(trace));
+  while (mTraces.size() > mMaxTraces) {
+    auto live = mLive.find(mTraces.front().buffer);
+    if (live != mLive.end() && live->second == mTraces.front().id)
+      mLive.erase(live);
+    mTraces.pop_front();
+  }
+  return mNextId - 1;
+}
+
+void Tracer::pulled(const TopicQueueItem &item,
+                    const string &subscriber_name) {
+  if (!item->trace_id || !enabled())
+    return;
+  auto now = chrono::steady_clock::now();
+  lock_guard<mutex> lock(mMutex);
+  Trace *trace = find(item->trace_id);
+  if (!trace)
+    return;
+  trace->pulls.push_back(Pull{subscriber_name, now, TimePoint()});
+  record("queue", trace->topic, subscriber_name, trace->published, now);
+}
+
+void Tracer::released(const string &buffer_name,
+                      const string &subscriber_name) {
+  if (!enabled())
+    return;
+  auto now = chrono::steady_clock::now();
+  lock_guard<mutex> lock(mMutex);
+  auto live = mLive.find(buffer_name);
+  Trace *trace = live != mLive.end() ? find(live->second) : nullptr;
+  if (!trace)
+    return;
+  for (auto &pull : trace->pulls) {
+    if (pull.released != TimePoint() ||
+        (!subscriber_name.empty() && pull.subscriber != subscriber_name))
+      continue;
+    pull.released = now;
+    record("process", trace->topic, pull.subscriber, pull.pulled, now);
+    record("end_to_end", trace->topic, pull.subscriber, trace->root, now);
+    return;
+  }
+}
+
+vector<StageLatency> Tracer::getLatency() {
+  vector<StageLatency> stages;
+  lock_guard<mutex> lock(mMutex);
+  for (auto &it : mStages) {
+    StageLatency stage;
+    tie(stage.stage, stage.topic, stage.subscriber) = it.first;
+    stage.count = it.second.count();
+    stage.p50Us = it.second.percentile(0.5);
+    stage.p99Us = it.second.percentile(0.99);
+    stage.maxUs = it.second.largest();
+    stages.push_back(std::move(stage));
+  }
+  return stages;
+}
+
+// Chrome trace event format. Each topic is shown as a process, stages are
+// async slices since the slices of consecutive buffers overlap. A buffer's
+// slices share its trace id, its parents are listed in the args.
+string Tracer::chromeTrace() {
+  json events = json::array();
+  unordered_map<string, int> topics;
+  auto pid = [&](const string &topic) {
+    auto it = topics.find(topic);
+    if (it != topics.end())
+      return it->second;
+    int pid = topics.size() + 1;
+    topics[topic] = pid;
+    events.push_back({{"name", "process_name"},
+                      {"ph", "M"},
+                      {"pid", pid},
+                      {"args", {{"name", topic}}}});
+    return pid;
+  };
+  auto us = [&](TimePoint t) {
+    return chrono::duration<double, micro>(t - mStart).count();
+  };
+  auto slice = [&](const string &name, int pid, uint64_t id, TimePoint from,
+                   TimePoint to, const json &args) {
+    events.push_back({{"name", name},
+                      {"cat", "tensorbus"},
+                      {"ph", "b"},
+                      {"id", id},
+                      {"pid", pid},
+                      {"ts", us(from)},
+                      {"args", args}});
+    events.push_back({{"name", name},
+                      {"cat", "tensorbus"},
+                      {"ph", "e"},
+                      {"id", id},
+                      {"pid", pid},
+                      {"ts", us(to)}});
+  };
+
+  lock_guard<mutex> lock(mMutex);
+  for (auto &trace : mTraces) {
+    json args = {{"trace", trace.id},
+                 {"buffer", trace.buffer},
+                 {"parents", trace.parents}};
+    int topic = pid(trace.topic);
+    if (trace.created != TimePoint())
+      slice("fill", topic, trace.id, trace.created, trace.published, args);
+    for (auto &pull : trace.pulls) {
+      slice("queue " + pull.subscriber, topic, trace.id, trace.published,
+            pull.pulled, args);
+      if (pull.released != TimePoint())
+        slice("process " + pull.subscriber, topic, trace.id, pull.pulled,
+              pull.released, args);
+    }
+  }
+  return json({{"traceEvents", events}, {"displayTimeUnit", "ms"}}).dump();
+}
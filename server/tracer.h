@@ -0,0 +1,108 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+#include "metrics.h"
+#include "topic_queue.h"
+
+using namespace std;
+
+struct StageLatency {
+  string stage;
+  string topic;
+  string subscriber; // empty for the fill stage
+  uint64_t count = 0;
+  uint64_t p50Us = 0;
+  uint64_t p99Us = 0;
+  uint64_t maxUs = 0;
+};
+
+// Records when each published buffer was created, published, pulled and
+// released, and which buffers a derived buffer was published from. Every
+// published message gets a trace id, carried by its TopicMessage. The stages
+// are:
+//   fill        CreateBuffer to Publish, per topic
+//   queue       Publish to Pull, per subscriber
+//   process     Pull to ReleaseBuffer, per subscriber
+//   end_to_end  Publish of the first buffer of the lineage to ReleaseBuffer,
+//               per subscriber
+// A release is matched to the earliest pull of the buffer by the releasing
+// subscriber that wasn't released yet. A release that doesn't name the
+// subscriber, as for leases that ran out, takes the earliest unreleased pull
+// of any subscriber. The last max_traces traces are kept for the
+// Chrome trace dump, which Perfetto and chrome://tracing open.
+//
+// Tracing is off by default. When it is off every hook returns after
+// reading a flag, when it is on the hooks take one lock.
+class Tracer {
+private:
+  typedef chrono::steady_clock::time_point TimePoint;
+
+  struct Pull {
+    string subscriber;
+    TimePoint pulled;
+    TimePoint released;
+  };
+
+  struct Trace {
+    uint64_t id;
+    string buffer;
+    string topic;
+    vector<uint64_t> parents;
+    TimePoint created; // unset if the buffer wasn't created while tracing
+    TimePoint published;
+    TimePoint root; // publish time of the first buffer of the lineage
+    vector<Pull> pulls;
+  };
+
+  static Tracer *instance;
+  atomic<bool> mEnabled;
+  size_t mMaxTraces;
+  size_t mSamples;
+  TimePoint mStart;
+  mutex mMutex;
+  uint64_t mNextId;
+  unordered_map<string, TimePoint> mCreated; // created, not yet published
+  deque<Trace> mTraces;                      // ordered by id
+  unordered_map<string, uint64_t> mLive;     // latest trace of each buffer
+  map<tuple<string, string, string>, LatencyWindow> mStages;
+
+  Tracer();
+
+  // Note: functions below require mMutex
+  Trace *find(uint64_t id);
+  void record(const string &stage, const string &topic,
+              const string &subscriber, TimePoint from, TimePoint to);
+
+public:
+  static Tracer *getInstance() {
+    if (!instance)
+      instance = new Tracer();
+    return instance;
+  }
+
+  void configure(bool enabled, size_t maxTraces, size_t samples);
+  inline bool enabled() const { return mEnabled.load(memory_order_relaxed); }
+
+  void created(const string &buffer_name);
+  // Returns the trace id for the message, 0 if tracing is off. parents are
+  // the buffers the message was derived from, they must not have been
+  // released by the publisher yet.
+  uint64_t published(const string &buffer_name, const string &topic_name,
+                     const vector<string> &parents = vector<string>());
+  void pulled(const TopicQueueItem &item, const string &subscriber_name);
+  void released(const string &buffer_name, const string &subscriber_name);
+
+  vector<StageLatency> getLatency();
+  string chromeTrace();
+
+  ~Tracer() { delete instance; }
+};
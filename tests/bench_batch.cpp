@@ -0,0 +1,95 @@
+#include "shm_client.h"
+
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <thread>
+
+// Compares per-message Publish/Pull against PublishBatch/PullBatch. Run with
+// shm_server listening on localhost:50051.
+//   bench_batch [num_msgs] [batch_size]
+
+const int32_t msg_size = 64;
+
+void publisher(ShmClient *client, const std::string &topic, int num_msgs,
+               unsigned int batch_size) {
+  std::vector<PublishMessage> batch;
+  for (int i = 0; i < num_msgs; ++i) {
+    PublishMessage msg;
+    msg.topic_name = topic;
+    msg.timestamp = i;
+    client->CreateBuffer(msg.buffer_name, msg_size);
+    if (batch_size <= 1) {
+      client->Publish(topic, msg.buffer_name, msg.timestamp);
+      continue;
+    }
+
+    batch.push_back(msg);
+    if (batch.size() == batch_size || i == num_msgs - 1) {
+      client->PublishBatch(batch);
+      batch.clear();
+    }
+  }
+}
+
+int subscriber(ShmClient *client, const std::string &topic,
+               const std::string &subscriber_name, int num_msgs,
+               unsigned int batch_size) {
+  int received = 0;
+  std::vector<StreamMessage> msgs;
+  while (received < num_msgs) {
+    if (batch_size <= 1) {
+      std::string buffer_name;
+      uint64_t ts;
+      if (client->Pull(topic, subscriber_name, buffer_name, ts, 1000) < 0)
+        break;
+      client->ReleaseBuffer(buffer_name);
+      received++;
+      continue;
+    }
+
+    if (client->PullBatch(topic, subscriber_name, msgs, batch_size, 1000) < 0)
+      break;
+    for (auto &msg : msgs)
+      client->ReleaseBuffer(msg.buffer_name);
+    received += msgs.size();
+  }
+  return received;
+}
+
+double run(const std::string &topic, int num_msgs, unsigned int batch_size) {
+  ShmClient pub_client("localhost", "50051");
+  ShmClient sub_client("localhost", "50051");
+  const std::string subscriber_name = topic + "_subscriber";
+
+  // don't drop messages, the publisher waits for the subscriber instead
+  pub_client.RegisterTopic(topic, false);
+  sub_client.Subscribe(topic, subscriber_name, 2 * batch_size + 1);
+
+  auto start = std::chrono::steady_clock::now();
+  int received = 0;
+  std::thread subscriber_thread([&]() {
+    received = subscriber(&sub_client, topic, subscriber_name, num_msgs,
+                          batch_size);
+  });
+  publisher(&pub_client, topic, num_msgs, batch_size);
+  subscriber_thread.join();
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+
+  if (received != num_msgs)
+    std::cerr << topic << ": received " << received << " of " << num_msgs
+              << " messages" << std::endl;
+  return received / elapsed.count();
+}
+
+int main(int argc, char *argv[]) {
+  int num_msgs = argc > 1 ? std::stoi(argv[1]) : 5000;
+  unsigned int batch_size = argc > 2 ? std::stoul(argv[2]) : 16;
+
+  double single = run("bench_batch_single", num_msgs, 1);
+  double batched = run("bench_batch_batched", num_msgs, batch_size);
+  std::cout << "single:  " << single << " msgs/s" << std::endl;
+  std::cout << "batch " << batch_size << ": " << batched << " msgs/s ("
+            << batched / single << "x)" << std::endl;
+}
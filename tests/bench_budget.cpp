@@ -0,0 +1,104 @@
+#include "shm_manager.h"
+#include "spdlog/spdlog.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Threads create and release buffers under a global budget, which must never
+// be exceeded, and the cost of createBuffer with and without budgets is
+// reported. Runs in process, no server is needed; the policies themselves are
+// checked by budget_test.
+//   bench_budget [threads] [ops]
+
+const size_t buffer_size = 4096;
+
+ShmBudgetStats budget_stats(const std::string &topic) {
+  for (auto &stats : ShmManager::getInstance()->getBudgetStats())
+    if (stats.topic == topic)
+      return stats;
+  return ShmBudgetStats();
+}
+
+struct Churn {
+  double create_ns;
+  size_t max_held;
+  uint64_t rejected;
+};
+
+// Every thread keeps up to 4 buffers and releases the oldest when it has
+// them all. Buffers are counted as held once created until just before they
+// are released, so the count never exceeds what the budget charged.
+Churn churn(unsigned int threads, unsigned int ops) {
+  ShmManager *sm = ShmManager::getInstance();
+  std::atomic<size_t> held{0}, max_held{0};
+  std::atomic<uint64_t> rejected{0};
+  double create_ns = 0;
+  std::mutex create_mutex;
+  std::vector<std::thread> workers;
+  for (unsigned int t = 0; t < threads; ++t)
+    workers.emplace_back([&]() {
+      std::vector<std::string> names;
+      double elapsed_ns = 0;
+      for (unsigned int i = 0; i < ops; ++i) {
+        if (names.size() == 4) {
+          held -= buffer_size;
+          sm->release(names.front());
+          names.erase(names.begin());
+        }
+        auto start = std::chrono::steady_clock::now();
+        auto buffer = sm->createBuffer(buffer_size);
+        elapsed_ns += std::chrono::duration<double, std::nano>(
+                          std::chrono::steady_clock::now() - start)
+                          .count();
+        if (!buffer) {
+          rejected++;
+          continue;
+        }
+        size_t now = held += buffer_size;
+        size_t seen = max_held;
+        while (now > seen && !max_held.compare_exchange_weak(seen, now))
+          ;
+        names.push_back(buffer->getName());
+      }
+      held -= names.size() * buffer_size;
+      sm->release(names);
+      std::lock_guard<std::mutex> lock(create_mutex);
+      create_ns += elapsed_ns;
+    });
+  for (auto &worker : workers)
+    worker.join();
+  return {create_ns / ((double)threads * ops), max_held, rejected};
+}
+
+int main(int argc, char **argv) {
+  unsigned int threads = argc > 1 ? std::stoi(argv[1]) : 8;
+  unsigned int ops = argc > 2 ? std::stoi(argv[2]) : 100000;
+  spdlog::set_level(spdlog::level::err);
+  ShmManager::getInstance()->configurePool(64 << 20, 5000);
+
+  Churn unlimited = churn(threads, ops);
+  unsigned int errors = 0;
+
+  // half of what the threads would hold together
+  size_t max_bytes = threads * 2 * buffer_size;
+  ShmBudget budget;
+  budget.maxBytes = max_bytes;
+  ShmManager::getInstance()->configureBudget("", budget);
+  Churn limited = churn(threads, ops);
+  ShmBudgetStats stats = budget_stats("");
+  printf("%u threads: create %.0f ns without budgets, %.0f ns under a budget "
+         "of %zu bytes, held at most %zu bytes, %llu rejected\n",
+         threads, unlimited.create_ns, limited.create_ns, max_bytes,
+         limited.max_held, (unsigned long long)limited.rejected);
+  if (limited.max_held > max_bytes || stats.liveBytes != 0)
+    errors++;
+
+  ShmManager::getInstance()->releaseAll();
+  printf("%u errors\n", errors);
+  return errors ? 1 : 0;
+}
@@ -0,0 +1,171 @@
+#include "spdlog/spdlog.h"
+#include "topic_queue.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Microbenchmarks of the queue engine, driving Topic and TopicQueue directly
+// from many threads. The time per op is the time a call takes as seen by the
+// calling thread, Mops/s the throughput of all threads together.
+//   post       publishers post to a topic whose only queue is never read, so
+//              every post replaces the oldest item
+//   pull       subscribers of one queue each read all of it
+//   clear_old  the same subscribers then call clear_old as often, the first
+//              call reclaims the queue and the others find nothing to do, as
+//              most of the calls the Pull handler makes
+//   fanout     one publisher posts to a topic that doesn't drop, each
+//              subscriber pulls and clears old items on its own thread
+// Runs in process, no server is needed.
+//   bench_core [max_threads] [ops]
+
+const unsigned int queue_size = 64;
+
+// Runs fn(thread_index) on threads threads, which start together, and
+// returns the seconds until the last one is done
+template <typename Fn> double timed(unsigned int threads, Fn fn) {
+  std::atomic<unsigned int> ready(0);
+  std::atomic<bool> go(false);
+  std::vector<std::thread> workers;
+  for (unsigned int t = 0; t < threads; ++t)
+    workers.emplace_back([&, t]() {
+      ready++;
+      while (!go)
+        std::this_thread::yield();
+      fn(t);
+    });
+  while (ready < threads)
+    std::this_thread::yield();
+  auto start = std::chrono::steady_clock::now();
+  go = true;
+  for (auto &worker : workers)
+    worker.join();
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                       start)
+      .count();
+}
+
+// Items are immutable, posting the same ones again costs the same as new ones
+std::vector<TopicQueueItem> make_items(const std::string &prefix) {
+  std::vector<TopicQueueItem> items;
+  for (unsigned int i = 0; i < queue_size; ++i)
+    items.push_back(makeTopicQueueItem(prefix + std::to_string(i), "", i));
+  return items;
+}
+
+void report(const char *name, unsigned int threads, uint64_t ops,
+            double seconds) {
+  printf("%-10s %8u %12.1f %12.2f\n", name, threads,
+         seconds * 1e9 * threads / ops, ops / seconds / 1e6);
+}
+
+void bench_post(unsigned int threads, unsigned int ops) {
+  Topic topic("bench_post", true);
+  std::string name = "sub";
+  std::vector<std::string> dependencies;
+  topic.subscribe(name, dependencies, queue_size);
+  std::vector<std::vector<TopicQueueItem>> items;
+  for (unsigned int t = 0; t < threads; ++t)
+    items.push_back(make_items("post" + std::to_string(t) + "_"));
+
+  double seconds = timed(threads, [&](unsigned int t) {
+    for (unsigned int i = 0; i < ops; ++i)
+      topic.post(items[t][i % queue_size]);
+  });
+  report("post", threads, (uint64_t)threads * ops, seconds);
+}
+
+void bench_pull(unsigned int threads, unsigned int ops) {
+  TopicQueue queue(ops);
+  std::vector<unsigned int> slots;
+  for (unsigned int t = 0; t < threads; ++t) {
+    std::string name = "sub" + std::to_string(t);
+    queue.init_index(name);
+    slots.push_back(queue.slot(name));
+  }
+  std::vector<TopicQueueItem> items = make_items("pull");
+  for (unsigned int i = 0; i < ops; ++i)
+    queue.push_replace_oldest(items[i % queue_size]);
+
+  std::atomic<uint64_t> pulled(0);
+  double seconds = timed(threads, [&](unsigned int t) {
+    TopicQueueItem item;
+    uint64_t count = 0;
+    for (unsigned int i = 0; i < ops; ++i)
+      count += queue.pull(slots[t], item, 0);
+    pulled += count;
+  });
+  if (pulled != (uint64_t)threads * ops)
+    printf("pull: expected %llu items, got %llu\n",
+           (unsigned long long)threads * ops, (unsigned long long)pulled);
+  report("pull", threads, (uint64_t)threads * ops, seconds);
+
+  seconds = timed(threads, [&](unsigned int) {
+    for (unsigned int i = 0; i < ops; ++i)
+      queue.clear_old();
+  });
+  report("clear_old", threads, (uint64_t)threads * ops, seconds);
+}
+
+void bench_fanout(unsigned int subscribers, unsigned int ops) {
+  Topic topic("bench_fanout", false);
+  std::vector<std::string> dependencies;
+  std::vector<std::shared_ptr<TopicQueue>> queues;
+  std::vector<unsigned int> slots;
+  for (unsigned int s = 0; s < subscribers; ++s) {
+    std::string name = "sub" + std::to_string(s);
+    topic.subscribe(name, dependencies, queue_size);
+    queues.push_back(topic.queue(name));
+    slots.push_back(queues.back()->slot(name));
+  }
+  std::vector<TopicQueueItem> items = make_items("fanout");
+
+  // thread 0 publishes, the others are the subscribers
+  std::atomic<uint64_t> delivered(0);
+  double seconds = timed(subscribers + 1, [&](unsigned int t) {
+    if (t == 0) {
+      for (unsigned int i = 0; i < ops; ++i)
+        topic.post(items[i % queue_size]);
+      return;
+    }
+    TopicQueue &queue = *queues[t - 1];
+    TopicQueueItem item;
+    unsigned int count = 0;
+    while (count < ops) {
+      queue.clear_old();
+      if (queue.pull(slots[t - 1], item, 1000))
+        count++;
+      else
+        break; // the publisher is stuck, reported below
+    }
+    delivered += count;
+  });
+  if (delivered != (uint64_t)subscribers * ops)
+    printf("fanout: expected %llu deliveries, got %llu\n",
+           (unsigned long long)subscribers * ops,
+           (unsigned long long)delivered);
+  printf("%12u %12.1f %14.1f %14.2f\n", subscribers, seconds * 1e9 / ops,
+         seconds * 1e9 / delivered, delivered / seconds / 1e6);
+}
+
+int main(int argc, char **argv) {
+  unsigned int max_threads = argc > 1 ? std::stoi(argv[1])
+                                      : std::thread::hardware_concurrency();
+  unsigned int ops = argc > 2 ? std::stoi(argv[2]) : 100000;
+  spdlog::set_level(spdlog::level::err);
+
+  printf("%-10s %8s %12s %12s\n", "bench", "threads", "ns/op", "Mops/s");
+  for (unsigned int threads = 1; threads <= max_threads; threads *= 2)
+    bench_post(threads, ops);
+  for (unsigned int threads = 1; threads <= max_threads; threads *= 2)
+    bench_pull(threads, ops);
+
+  printf("\n%12s %12s %14s %14s\n", "subscribers", "ns/post", "ns/delivery",
+         "Mdelivered/s");
+  for (unsigned int subscribers = 1; subscribers <= 64; subscribers *= 2)
+    bench_fanout(subscribers, ops / 10);
+  return 0;
+}
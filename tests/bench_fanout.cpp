@@ -0,0 +1,73 @@
+#include "spdlog/spdlog.h"
+#include "topic_queue.h"
+
+#include <chrono>
+#include <cstdio>
+#include <malloc.h>
+#include <string>
+#include <vector>
+
+// Measures the cost of fanning one message out to many subscribers. Each
+// round posts queue_size messages with metadata_bytes of metadata to a topic
+// and every subscriber pulls all of them. Reports the time per post and the
+// heap held by the topic once its queues are full. Runs in process, no server
+// is needed.
+//   bench_fanout [metadata_bytes] [max_subscribers] [rounds]
+
+const unsigned int queue_size = 64;
+
+struct Result {
+  double post_us;
+  double heap_kb;
+  uint64_t checksum;
+};
+
+Result run(unsigned int num_subscribers, size_t metadata_bytes, int rounds) {
+  size_t heap_before = mallinfo2().uordblks;
+  Topic topic("bench_topic");
+  std::vector<std::string> names;
+  std::vector<std::string> dependencies;
+  for (unsigned int i = 0; i < num_subscribers; ++i) {
+    names.push_back("subscriber_" + std::to_string(i));
+    topic.subscribe(names.back(), dependencies, queue_size);
+  }
+
+  Result result = {0, 0, 0};
+  std::string metadata(metadata_bytes, 'm');
+  TopicQueueItem pulled;
+  uint64_t ts = 0;
+  double post_s = 0;
+  for (int round = 0; round < rounds; ++round) {
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned int n = 0; n < queue_size; ++n)
+      topic.post(makeTopicQueueItem("bench_buffer", metadata, ++ts));
+    post_s += std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                            start)
+                  .count();
+    result.heap_kb += (mallinfo2().uordblks - heap_before) / 1024.0;
+    for (auto &name : names) {
+      while (topic.pull(name, pulled, 0))
+        result.checksum += pulled->timestamp;
+      topic.clearProcessedPosts(name);
+    }
+  }
+  result.post_us = post_s * 1e6 / ((double)rounds * queue_size);
+  result.heap_kb /= rounds;
+  return result;
+}
+
+int main(int argc, char **argv) {
+  size_t metadata_bytes = argc > 1 ? std::stoul(argv[1]) : 4096;
+  unsigned int max_subscribers = argc > 2 ? std::stoi(argv[2]) : 64;
+  int rounds = argc > 3 ? std::stoi(argv[3]) : 200;
+  spdlog::set_level(spdlog::level::warn);
+
+  printf("%u messages of %zu bytes of metadata per round\n", queue_size,
+         metadata_bytes);
+  printf("%12s %14s %14s\n", "subscribers", "us/post", "queued KB");
+  for (unsigned int subs = 1; subs <= max_subscribers; subs *= 4) {
+    Result result = run(subs, metadata_bytes, rounds);
+    printf("%12u %14.2f %14.1f\n", subs, result.post_us, result.heap_kb);
+  }
+  return 0;
+}
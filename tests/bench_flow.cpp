@@ -0,0 +1,114 @@
+#include "spdlog/spdlog.h"
+#include "topic_manager.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+// A camera publishes frames to a topic that doesn't drop messages. A fast
+// subscriber keeps up, a preview subscriber takes a while per frame and uses
+// the flow policy under test. Reports the frame rate the camera achieves and
+// how old the frames are when the preview pulls them. Runs in process, no
+// server is needed.
+//   bench_flow [fps] [preview_ms] [ms_per_run]
+
+struct Result {
+  double fps;
+  uint64_t previewed;
+  double mean_age_ms;
+  double max_age_ms;
+};
+
+Result run(const FlowControl &flow, unsigned int fps, unsigned int preview_ms,
+           unsigned int duration_ms) {
+  TopicManager *tm = TopicManager::getInstance();
+  std::string topic_name = "bench_camera";
+  tm->addTopic(topic_name, false);
+  std::vector<std::string> dependencies;
+  uint64_t fast_handle, preview_handle;
+  tm->subscribe(topic_name, "fast", dependencies, 4, &fast_handle);
+  tm->subscribe(topic_name, "preview", dependencies, 4, &preview_handle, flow);
+  SubscriptionPtr fast = tm->findSubscription(fast_handle);
+  SubscriptionPtr preview = tm->findSubscription(preview_handle);
+  std::shared_ptr<Topic> topic = tm->findTopic(topic_name);
+
+  std::atomic<bool> stop(false);
+  std::thread fast_thread([&]() {
+    TopicQueueItem item;
+    while (!stop) {
+      fast->queue->clear_old();
+      fast->queue->pull(fast->slot, item, 10);
+    }
+  });
+
+  Result result = {0, 0, 0, 0};
+  std::thread preview_thread([&]() {
+    TopicQueueItem item;
+    double total_ms = 0;
+    while (!stop) {
+      preview->queue->clear_old();
+      if (!preview->queue->pull(preview->slot, item, 10))
+        continue;
+      double age_ms = std::chrono::duration<double, std::milli>(
+                          std::chrono::steady_clock::now() - item->posted)
+                          .count();
+      total_ms += age_ms;
+      result.max_age_ms = std::max(result.max_age_ms, age_ms);
+      result.previewed++;
+      std::this_thread::sleep_for(std::chrono::milliseconds(preview_ms));
+      preview->queue->grant_credits(1); // ignored unless FLOW_CREDIT
+    }
+    result.mean_age_ms = result.previewed ? total_ms / result.previewed : 0;
+  });
+
+  auto start = std::chrono::steady_clock::now();
+  auto end = start + std::chrono::milliseconds(duration_ms);
+  auto interval = std::chrono::microseconds(1000000 / fps);
+  uint64_t frames = 0;
+  for (auto next = start; next < end; next += interval) {
+    std::this_thread::sleep_until(next);
+    topic->post(makeTopicQueueItem("", "", frames++));
+  }
+  result.fps = frames / std::chrono::duration<double>(
+                            std::chrono::steady_clock::now() - start)
+                            .count();
+
+  stop = true;
+  tm->removeTopic(topic_name);
+  fast_thread.join();
+  preview_thread.join();
+  return result;
+}
+
+int main(int argc, char **argv) {
+  unsigned int fps = argc > 1 ? std::stoi(argv[1]) : 500;
+  unsigned int preview_ms = argc > 2 ? std::stoi(argv[2]) : 10;
+  unsigned int duration_ms = argc > 3 ? std::stoi(argv[3]) : 2000;
+  spdlog::set_level(spdlog::level::warn);
+
+  std::vector<std::pair<const char *, FlowControl>> policies(4);
+  policies[0].first = "queue";
+  policies[1].first = "credit";
+  policies[1].second.policy = FLOW_CREDIT;
+  policies[1].second.credits = 1;
+  policies[2].first = "latest";
+  policies[2].second.policy = FLOW_LATEST;
+  policies[3].first = "max_age";
+  policies[3].second.policy = FLOW_MAX_AGE;
+  policies[3].second.max_age_ms = 2 * preview_ms;
+
+  printf("camera at %u fps, preview takes %u ms per frame\n", fps,
+         preview_ms);
+  printf("%10s %12s %12s %14s %14s\n", "policy", "camera fps", "previewed",
+         "mean age ms", "max age ms");
+  for (auto &policy : policies) {
+    Result result = run(policy.second, fps, preview_ms, duration_ms);
+    printf("%10s %12.1f %12llu %14.2f %14.2f\n", policy.first, result.fps,
+           (unsigned long long)result.previewed, result.mean_age_ms,
+           result.max_age_ms);
+  }
+  return 0;
+}
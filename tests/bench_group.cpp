@@ -0,0 +1,240 @@
+#include "consumer_group.h"
+#include "spdlog/spdlog.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// A camera publishes frames as fast as a topic that doesn't drop messages
+// lets it and detector instances take a fixed time per frame. Instances that
+// subscribe under their own names each detect every frame, members of a
+// consumer group share the frames. Reports the distinct frames detected per
+// second. A last run stops one member while it holds frames and checks that
+// its lease hands them to the others. Runs in process, no server is needed.
+//   bench_group [detect_ms] [ms_per_run]
+
+const std::string topic_name = "bench_frames";
+const size_t MAX_FRAMES = 1 << 20;
+
+struct Result {
+  double fps = 0;     // distinct frames detected per second
+  uint64_t posted = 0;
+  uint64_t detected = 0;
+  uint64_t duplicates = 0;
+};
+
+// Pull one item for a member, waiting up to timeout ms
+TopicQueueItem pullGroup(const ConsumerGroupPtr &group,
+                         const std::string &member, int timeout) {
+  struct State {
+    std::mutex m;
+    std::condition_variable cv;
+    TopicQueueItem item;
+    bool done = false;
+  };
+  auto state = std::make_shared<State>();
+  PullWaiterPtr waiter = std::make_shared<PullWaiter>();
+  waiter->subscriber_name = member;
+  waiter->callback = [state](std::vector<TopicQueueItem> &items) {
+    std::lock_guard<std::mutex> lock(state->m);
+    if (!items.empty())
+      state->item = items[0];
+    state->done = true;
+    state->cv.notify_all();
+  };
+
+  std::vector<TopicQueueItem> items;
+  if (!group->pull_async(member, waiter, items))
+    return TopicQueueItem();
+  if (!items.empty())
+    return items[0];
+  std::unique_lock<std::mutex> lock(state->m);
+  if (!state->cv.wait_for(lock, std::chrono::milliseconds(timeout),
+                          [&] { return state->done; })) {
+    lock.unlock();
+    if (group->cancel_waiter(waiter))
+      return TopicQueueItem();
+    lock.lock();
+    state->cv.wait(lock, [&] { return state->done; });
+  }
+  return state->item;
+}
+
+void detect(std::vector<std::atomic<unsigned int>> &counts,
+            const TopicQueueItem &item, unsigned int detect_ms) {
+  std::this_thread::sleep_for(std::chrono::milliseconds(detect_ms));
+  counts[item->timestamp % MAX_FRAMES]++;
+}
+
+// Posts frames until stop is set or frames have been posted
+uint64_t camera(const std::shared_ptr<Topic> &topic, std::atomic<bool> &stop,
+                uint64_t frames) {
+  uint64_t posted = 0;
+  while (!stop && posted < frames) {
+    topic->post(makeTopicQueueItem("frame" + std::to_string(posted), "",
+                                   posted));
+    posted++;
+  }
+  return posted;
+}
+
+Result summarize(std::vector<std::atomic<unsigned int>> &counts,
+                 uint64_t posted, double seconds) {
+  Result result;
+  result.posted = posted;
+  for (auto &count : counts) {
+    if (count > 0) {
+      result.detected++;
+      result.duplicates += count - 1;
+    }
+  }
+  result.fps = result.detected / seconds;
+  return result;
+}
+
+Result run(bool group, unsigned int instances, unsigned int detect_ms,
+           unsigned int duration_ms) {
+  TopicManager *tm = TopicManager::getInstance();
+  std::string name = topic_name;
+  tm->addTopic(name, false);
+  std::shared_ptr<Topic> topic = tm->findTopic(topic_name);
+  std::vector<std::atomic<unsigned int>> counts(MAX_FRAMES);
+  std::atomic<bool> stop(false);
+  std::vector<std::thread> detectors;
+
+  if (group) {
+    GroupManager *gm = GroupManager::getInstance();
+    for (unsigned int i = 0; i < instances; ++i) {
+      std::string member = "detector" + std::to_string(i);
+      GroupMemberPtr m = gm->find(gm->join(topic_name, "detectors", member,
+                                           4, 1000));
+      detectors.emplace_back([&, m]() {
+        while (!stop) {
+          TopicQueueItem item = pullGroup(m->group, m->name, 10);
+          if (!item)
+            continue;
+          detect(counts, item, detect_ms);
+          m->group->release(m->name, item->buffer_name);
+        }
+      });
+    }
+  } else {
+    std::vector<std::string> dependencies;
+    for (unsigned int i = 0; i < instances; ++i) {
+      uint64_t handle;
+      tm->subscribe(topic_name, "detector" + std::to_string(i), dependencies,
+                    4, &handle);
+      SubscriptionPtr sub = tm->findSubscription(handle);
+      detectors.emplace_back([&, sub]() {
+        TopicQueueItem item;
+        while (!stop) {
+          sub->queue->clear_old();
+          if (sub->queue->pull(sub->slot, item, 10))
+            detect(counts, item, detect_ms);
+        }
+      });
+    }
+  }
+
+  // the detectors keep pulling until the camera, which may be blocked on a
+  // full queue, has stopped
+  auto start = std::chrono::steady_clock::now();
+  std::atomic<bool> timeout(false);
+  std::thread timer([&]() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(duration_ms));
+    timeout = true;
+  });
+  uint64_t posted = camera(topic, timeout, MAX_FRAMES);
+  timer.join();
+  double seconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+  stop = true;
+  tm->removeTopic(topic_name);
+  for (auto &t : detectors)
+    t.join();
+  return summarize(counts, posted, seconds);
+}
+
+// detector2 takes frames and stops without releasing them
+Result failover(unsigned int detect_ms, uint64_t frames,
+                unsigned int lease_ms, uint64_t &stranded) {
+  TopicManager *tm = TopicManager::getInstance();
+  std::string name = topic_name;
+  tm->addTopic(name, false);
+  std::shared_ptr<Topic> topic = tm->findTopic(topic_name);
+  std::vector<std::atomic<unsigned int>> counts(MAX_FRAMES);
+  std::atomic<bool> stop(false);
+  std::atomic<uint64_t> detected(0);
+  GroupManager *gm = GroupManager::getInstance();
+
+  std::vector<std::thread> detectors;
+  for (unsigned int i = 0; i < 2; ++i) {
+    std::string member = "detector" + std::to_string(i);
+    GroupMemberPtr m =
+        gm->find(gm->join(topic_name, "failover", member, 4, lease_ms));
+    detectors.emplace_back([&, m]() {
+      while (!stop) {
+        TopicQueueItem item = pullGroup(m->group, m->name, 10);
+        if (!item)
+          continue;
+        detect(counts, item, detect_ms);
+        if (m->group->release(m->name, item->buffer_name))
+          detected++;
+      }
+    });
+  }
+  GroupMemberPtr crashed =
+      gm->find(gm->join(topic_name, "failover", "detector2", 4, lease_ms));
+
+  auto start = std::chrono::steady_clock::now();
+  uint64_t posted = 0;
+  std::thread camera_thread([&]() { posted = camera(topic, stop, frames); });
+  for (stranded = 0; stranded < 3;)
+    stranded += pullGroup(crashed->group, crashed->name, 1000) ? 1 : 0;
+  camera_thread.join();
+  while (detected < posted &&
+         std::chrono::steady_clock::now() - start < std::chrono::seconds(10))
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  double seconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+  stop = true;
+  tm->removeTopic(topic_name);
+  for (auto &t : detectors)
+    t.join();
+  return summarize(counts, posted, seconds);
+}
+
+int main(int argc, char **argv) {
+  unsigned int detect_ms = argc > 1 ? std::stoi(argv[1]) : 2;
+  unsigned int duration_ms = argc > 2 ? std::stoi(argv[2]) : 2000;
+  spdlog::set_level(spdlog::level::err);
+
+  printf("detection takes %u ms per frame\n", detect_ms);
+  printf("%8s %10s %10s %10s %12s\n", "", "instances", "posted", "frames/s",
+         "duplicates");
+  for (bool group : {false, true}) {
+    for (unsigned int instances : {1, 2, 4}) {
+      Result result = run(group, instances, detect_ms, duration_ms);
+      printf("%8s %10u %10llu %10.1f %12llu\n", group ? "group" : "names",
+             instances, (unsigned long long)result.posted, result.fps,
+             (unsigned long long)result.duplicates);
+    }
+  }
+
+  uint64_t stranded;
+  Result result = failover(detect_ms, 500, 50, stranded);
+  printf("failover: %llu frames held by a stopped member, %llu of %llu "
+         "frames detected, %llu duplicates\n",
+         (unsigned long long)stranded, (unsigned long long)result.detected,
+         (unsigned long long)result.posted,
+         (unsigned long long)result.duplicates);
+  return 0;
+}
@@ -0,0 +1,119 @@
+#include "lease_manager.h"
+#include "shm_manager.h"
+#include "spdlog/spdlog.h"
+
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Measures what leasing costs a pull and its release, with every thread
+// pulling under a session of its own. Then two subscribers pull the same
+// buffers, one releases them and the other stops as if it had crashed, and
+// the buffers must be reclaimed once its lease runs out. Runs in process, no
+// server is needed.
+//   bench_lease [max_threads] [ops] [buffers]
+
+double lease_ns(unsigned int threads, unsigned int ops) {
+  LeaseManager *lm = LeaseManager::getInstance();
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> workers;
+  for (unsigned int t = 0; t < threads; ++t)
+    workers.emplace_back([lm, t, ops]() {
+      unsigned int lease_ms = 60000;
+      uint64_t session = lm->open("bench" + std::to_string(t), lease_ms);
+      std::vector<TopicQueueItem> items(1);
+      for (unsigned int i = 0; i < ops; ++i) {
+        items[0] = makeTopicQueueItem("buffer" + std::to_string(i % 64), "",
+                                      i);
+        lm->lease(session, items);
+        lm->release(session, items[0]->buffer_name);
+      }
+      lm->close(session);
+    });
+  for (auto &worker : workers)
+    worker.join();
+  double elapsed = std::chrono::duration<double, std::nano>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+  return elapsed / ((double)threads * ops);
+}
+
+// Returns the number of errors
+unsigned int crash(unsigned int buffers) {
+  unsigned int errors = 0;
+  ShmManager *sm = ShmManager::getInstance();
+  LeaseManager *lm = LeaseManager::getInstance();
+  lm->configure(10000, 10);
+  lm->start();
+
+  unsigned int lease_ms = 10000;
+  uint64_t alive = lm->open("alive", lease_ms);
+  lease_ms = 100;
+  uint64_t crashed = lm->open("crashed", lease_ms);
+  std::vector<TopicQueueItem> items;
+  for (unsigned int i = 0; i < buffers; ++i) {
+    std::shared_ptr<ShmBuffer> buffer = sm->createBuffer(4096);
+    if (!buffer) {
+      errors++;
+      continue;
+    }
+    buffer->setRefCount(2); // as published to two subscribers
+    items.push_back(makeTopicQueueItem(buffer->getName(), "", i));
+  }
+  lm->lease(alive, items);
+  lm->lease(crashed, items);
+  for (auto &item : items)
+    if (lm->release(alive, item->buffer_name))
+      sm->release(item->buffer_name);
+
+  SessionStats before = lm->getStats();
+  ShmBufferStats live = sm->getBufferStats();
+  printf("before expiry: %zu live buffers, %llu leased\n", live.liveBuffers,
+         (unsigned long long)before.leasedBuffers);
+  if (live.liveBuffers != items.size() ||
+      before.leasedBuffers != items.size())
+    errors++;
+
+  auto start = std::chrono::steady_clock::now();
+  while (sm->getBufferStats().liveBuffers > 0 &&
+         std::chrono::steady_clock::now() - start < std::chrono::seconds(2))
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  double reclaim_ms = std::chrono::duration<double, std::milli>(
+                          std::chrono::steady_clock::now() - start)
+                          .count();
+
+  SessionStats after = lm->getStats();
+  live = sm->getBufferStats();
+  printf("after expiry:  %zu live buffers, %llu leased, %llu reclaimed "
+         "after %.0f ms, %llu sessions expired\n",
+         live.liveBuffers, (unsigned long long)after.leasedBuffers,
+         (unsigned long long)after.reclaimedBuffers, reclaim_ms,
+         (unsigned long long)after.expired);
+  if (live.liveBuffers != 0 || after.leasedBuffers != 0 ||
+      after.reclaimedBuffers != items.size() || after.expired != 1)
+    errors++;
+  // a late release of the crashed subscriber must not release again
+  if (!items.empty() && lm->release(crashed, items[0]->buffer_name))
+    errors++;
+  lm->close(alive);
+  lm->stop();
+  return errors;
+}
+
+int main(int argc, char **argv) {
+  unsigned int max_threads = argc > 1 ? std::stoi(argv[1]) : 8;
+  unsigned int ops = argc > 2 ? std::stoi(argv[2]) : 200000;
+  unsigned int buffers = argc > 3 ? std::stoi(argv[3]) : 256;
+  spdlog::set_level(spdlog::level::err);
+
+  printf("%8s %16s\n", "threads", "lease+release ns");
+  for (unsigned int threads = 1; threads <= max_threads; threads *= 2)
+    printf("%8u %16.0f\n", threads, lease_ns(threads, ops));
+
+  unsigned int errors = crash(buffers);
+  ShmManager::getInstance()->releaseAll();
+  printf("%u errors\n", errors);
+  return errors ? 1 : 0;
+}
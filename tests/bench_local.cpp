@@ -0,0 +1,113 @@
+#include "shm_local.h"
+#include "spdlog/spdlog.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Publish to pull through the embedded broker, with the publisher and the
+// subscribers as threads of this process. The topic doesn't drop, every
+// subscriber receives every message and checks its payload. Reports messages
+// per second and the publish to pull latency for each payload size, and how
+// many blocks the broker allocated rather than reused. Runs in process, no
+// server is needed.
+//   bench_local [subscribers] [messages] [max_payload_bytes]
+
+uint64_t now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+struct Result {
+  double msgs_per_s;
+  double p50_us;
+  double p99_us;
+  unsigned int errors;
+};
+
+Result run(ShmLocalBroker &broker, unsigned int subscribers,
+           unsigned int messages, size_t payload) {
+  std::string topic = "bench_local_" + std::to_string(payload);
+  broker.RegisterTopic(topic, false);
+  for (unsigned int s = 0; s < subscribers; ++s)
+    broker.Subscribe(topic, "sub" + std::to_string(s), 4);
+
+  std::vector<std::vector<double>> latencies(subscribers);
+  std::atomic<unsigned int> errors(0);
+  std::vector<std::thread> threads;
+  for (unsigned int s = 0; s < subscribers; ++s)
+    threads.emplace_back([&, s]() {
+      std::string name = "sub" + std::to_string(s);
+      std::string buffer_name;
+      uint64_t timestamp;
+      for (unsigned int i = 0; i < messages; ++i) {
+        if (broker.Pull(topic, name, buffer_name, timestamp, 1000) < 0) {
+          errors++;
+          return;
+        }
+        latencies[s].push_back((now_ns() - timestamp) / 1e3);
+        unsigned char *data = (unsigned char *)broker.MapBuffer(buffer_name);
+        if (!data || data[0] != (unsigned char)i ||
+            data[payload - 1] != (unsigned char)i)
+          errors++;
+        broker.ReleaseBuffer(buffer_name);
+      }
+    });
+
+  auto start = std::chrono::steady_clock::now();
+  for (unsigned int i = 0; i < messages; ++i) {
+    std::string buffer_name;
+    broker.CreateBuffer(buffer_name, payload);
+    memset(broker.MapBuffer(buffer_name), (unsigned char)i, payload);
+    if (broker.Publish(topic, buffer_name, now_ns()) < 0)
+      errors++;
+  }
+  for (auto &thread : threads)
+    thread.join();
+  double seconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+
+  std::vector<double> all;
+  for (auto &l : latencies)
+    all.insert(all.end(), l.begin(), l.end());
+  std::sort(all.begin(), all.end());
+  Result result = {messages / seconds, 0, 0, errors};
+  if (!all.empty()) {
+    result.p50_us = all[all.size() / 2];
+    result.p99_us = all[all.size() * 99 / 100];
+  }
+  return result;
+}
+
+int main(int argc, char **argv) {
+  unsigned int subscribers = argc > 1 ? std::stoi(argv[1]) : 2;
+  unsigned int messages = argc > 2 ? std::stoi(argv[2]) : 20000;
+  size_t max_payload = argc > 3 ? std::stoul(argv[3]) : size_t(8) << 20;
+  spdlog::set_level(spdlog::level::err);
+
+  ShmLocalBroker broker;
+  printf("%u subscribers, %u messages per payload size\n", subscribers,
+         messages);
+  printf("%12s %12s %10s %10s %12s %8s\n", "payload", "msgs/s", "p50_us",
+         "p99_us", "allocated", "errors");
+  uint64_t allocations = 0;
+  unsigned int errors = 0;
+  for (size_t payload = 4; payload <= max_payload; payload *= 16) {
+    Result result = run(broker, subscribers, messages, payload);
+    LocalBrokerStats stats = broker.GetStats();
+    printf("%12zu %12.0f %10.1f %10.1f %12llu %8u\n", payload,
+           result.msgs_per_s, result.p50_us, result.p99_us,
+           (unsigned long long)(stats.allocations - allocations),
+           result.errors);
+    allocations = stats.allocations;
+    errors += result.errors;
+  }
+  return errors ? 1 : 0;
+}
@@ -0,0 +1,155 @@
+#include "spdlog/spdlog.h"
+#include "tbus_log.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Writes a tbus-record log of two topics from two threads, reads it back and
+// checks every record, then cuts the index off and checks that the log is
+// still read by scanning its chunks, and that a corrupt index fails the open.
+// Reports the write and read rates for each payload size and exits nonzero on
+// any error. Runs without a server.
+//   bench_log [path] [messages] [max_payload_bytes]
+
+struct Result {
+  double write_mb_s;
+  double read_mb_s;
+  uint64_t errors;
+};
+
+double seconds_since(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                       start)
+      .count();
+}
+
+// Every byte of message i of a topic is i + topic
+void fill(std::vector<char> &payload, uint32_t topic, unsigned int i) {
+  memset(payload.data(), (char)(i + topic), payload.size());
+}
+
+uint64_t check(LogReader &reader, unsigned int messages, size_t payload) {
+  uint64_t errors = 0;
+  unsigned int count[2] = {0, 0};
+  LogRecord record;
+  while (reader.next(record)) {
+    if (record.topic > 1 || record.payloadSize != payload) {
+      errors++;
+      continue;
+    }
+    unsigned int i = count[record.topic]++;
+    char expected = (char)(i + record.topic);
+    std::string metadata(record.metadata, record.metadataSize);
+    if (record.timestamp != i || metadata != "meta" + std::to_string(i) ||
+        std::count(record.payload, record.payload + payload, expected) !=
+            (ptrdiff_t)payload)
+      errors++;
+  }
+  if (count[0] != messages || count[1] != messages)
+    errors++;
+  return errors;
+}
+
+// Points the last chunk of the index past the end of the file, returns
+// nonzero if the file can't be changed
+int corrupt_index(const std::string &path) {
+  int fd = open(path.c_str(), O_RDWR);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    if (fd >= 0)
+      close(fd);
+    return -1;
+  }
+  uint64_t offset = st.st_size;
+  off_t entry = st.st_size - sizeof(LogFooter) - sizeof(LogChunkInfo);
+  ssize_t written = pwrite(fd, &offset, sizeof(offset),
+                           entry + offsetof(LogChunkInfo, offset));
+  close(fd);
+  return written == sizeof(offset) ? 0 : -1;
+}
+
+Result run(const std::string &path, unsigned int messages, size_t payload) {
+  Result result = {0, 0, 0};
+  LogWriter writer;
+  if (!writer.open(path)) {
+    result.errors++;
+    return result;
+  }
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  for (uint32_t t = 0; t < 2; ++t)
+    threads.emplace_back([&, t]() {
+      uint32_t topic = writer.topic("topic" + std::to_string(t));
+      std::vector<char> data(payload);
+      for (unsigned int i = 0; i < messages; ++i) {
+        fill(data, topic, i);
+        writer.append(topic, data.data(), payload, "meta" + std::to_string(i),
+                      i, i);
+      }
+    });
+  for (auto &thread : threads)
+    thread.join();
+  if (!writer.close())
+    result.errors++;
+  double bytes = 2.0 * messages * payload;
+  result.write_mb_s = bytes / seconds_since(start) / 1e6;
+
+  LogReader reader;
+  start = std::chrono::steady_clock::now();
+  if (!reader.open(path) || !reader.indexed() ||
+      reader.topics().size() != 2 || reader.messages() != 2 * messages)
+    result.errors++;
+  result.errors += check(reader, messages, payload);
+  result.read_mb_s = bytes / seconds_since(start) / 1e6;
+  size_t index_offset = reader.chunks().empty()
+                            ? 0
+                            : reader.chunks().back().offset +
+                                  reader.chunks().back().size;
+  reader.close();
+
+  // an index entry that points past the end of the file fails the open
+  if (corrupt_index(path) || reader.open(path))
+    result.errors++;
+  reader.close();
+
+  // as if the recorder had died before writing the index
+  if (index_offset == 0 || truncate(path.c_str(), index_offset) < 0 ||
+      !reader.open(path) || reader.indexed() ||
+      reader.topics().size() != 2)
+    result.errors++;
+  else
+    result.errors += check(reader, messages, payload);
+  reader.close();
+  unlink(path.c_str());
+  return result;
+}
+
+int main(int argc, char **argv) {
+  std::string path = argc > 1 ? argv[1] : "/tmp/bench_log.tbus";
+  unsigned int messages = argc > 2 ? std::stoi(argv[2]) : 2000;
+  size_t max_payload = argc > 3 ? std::stoul(argv[3]) : size_t(16) << 20;
+  spdlog::set_level(spdlog::level::err);
+
+  printf("%12s %12s %12s %8s\n", "payload", "write MB/s", "read MB/s",
+         "errors");
+  uint64_t errors = 0;
+  for (size_t payload = 16; payload <= max_payload; payload *= 16) {
+    // keep each run around 1 GB at most
+    unsigned int count = std::min<size_t>(messages, (size_t(1) << 29) / payload);
+    Result result = run(path, count, payload);
+    printf("%12zu %12.0f %12.0f %8llu\n", payload, result.write_mb_s,
+           result.read_mb_s, (unsigned long long)result.errors);
+    errors += result.errors;
+  }
+  return errors ? 1 : 0;
+}
@@ -0,0 +1,86 @@
+#include "shm_client.h"
+
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Compares page modes for large frames. For every mode a frame is created
+// with the given page flags and mapped by the subscriber with the same flags,
+// then the subscriber reads the first byte and scans the whole frame. Run
+// with shm_server listening on localhost:50051. Huge pages need memfd enabled
+// in the server config and free hugetlb pages, otherwise the server falls
+// back to madvise.
+//   bench_pages [num_frames] [frame_size]
+
+struct PageMode {
+  const char *name;
+  uint32_t flags;
+};
+
+struct Result {
+  double first_byte_us = 0; // map + first read
+  double scan_ms = 0;       // read one word per cache line
+};
+
+Result run(ShmClient &client, uint32_t flags, int num_frames,
+           size_t frame_size) {
+  Result result;
+  size_t map_size = hugePageAlign(frame_size);
+  volatile uint64_t sum = 0;
+  for (int i = 0; i < num_frames; ++i) {
+    std::string buffer_name;
+    uint64_t epoch;
+    if (client.CreateBuffer(buffer_name, frame_size, epoch, flags) < 0) {
+      std::cerr << "CreateBuffer failed" << std::endl;
+      break;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    char *frame = (char *)MapBuffer(buffer_name, map_size, flags);
+    if (frame == MAP_FAILED || !frame) {
+      std::cerr << "MapBuffer failed for " << buffer_name << std::endl;
+      client.ReleaseBuffer(buffer_name);
+      break;
+    }
+    sum += frame[0];
+    auto first_byte = std::chrono::steady_clock::now();
+    for (size_t offset = 0; offset < frame_size; offset += 64)
+      sum += *(uint64_t *)(frame + offset);
+    auto scanned = std::chrono::steady_clock::now();
+
+    result.first_byte_us +=
+        std::chrono::duration<double, std::micro>(first_byte - start).count();
+    result.scan_ms +=
+        std::chrono::duration<double, std::milli>(scanned - first_byte)
+            .count();
+    UnmapBuffer(frame, map_size);
+    client.ReleaseBuffer(buffer_name);
+  }
+
+  result.first_byte_us /= num_frames;
+  result.scan_ms /= num_frames;
+  return result;
+}
+
+int main(int argc, char *argv[]) {
+  int num_frames = argc > 1 ? std::stoi(argv[1]) : 50;
+  size_t frame_size = argc > 2 ? std::stoul(argv[2]) : 3840 * 2160 * 3;
+
+  const std::vector<PageMode> modes = {
+      {"default", 0},
+      {"prefault", PAGES_PREFAULT},
+      {"huge", PAGES_HUGE},
+      {"huge+prefault", PAGES_HUGE | PAGES_PREFAULT},
+      {"huge+prefault+lock", PAGES_HUGE | PAGES_PREFAULT | PAGES_LOCK},
+  };
+
+  ShmClient client("localhost", "50051");
+  std::printf("%-20s %18s %12s\n", "mode", "first byte (us)", "scan (ms)");
+  for (auto &mode : modes) {
+    Result result = run(client, mode.flags, num_frames, frame_size);
+    std::printf("%-20s %18.1f %12.2f\n", mode.name, result.first_byte_us,
+                result.scan_ms);
+  }
+}
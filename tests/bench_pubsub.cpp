@@ -0,0 +1,336 @@
+#include "shm_client.h"
+#include "spdlog/spdlog.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Throughput and publish-to-pull latency of the full path: a publisher
+// creates a buffer, writes the payload and publishes it, subscribers pull,
+// map and check it and release it. Launches shm_server on its own port and
+// sweeps one parameter at a time from a baseline (or every combination with
+// --full) over payload size, subscriber count, queue depth, drop mode and
+// publisher rate. The results are written as JSON.
+//   bench_pubsub [--server PATH | --no-launch] [--port PORT] [--ms MS]
+//                [--full] [--out FILE]
+// Latency is measured from just before Publish to the return of Pull, both
+// on CLOCK_MONOTONIC, and includes the time a message waits in the queue.
+
+#ifndef SHM_SERVER_PATH
+#define SHM_SERVER_PATH "shm_server"
+#endif
+
+struct Params {
+  size_t payload = 64 << 10;
+  unsigned int subscribers = 1;
+  unsigned int depth = 4;
+  bool drop = false;
+  unsigned int rate = 0; // messages per second, 0 publishes flat out
+};
+
+struct Result {
+  Params params;
+  uint64_t published = 0;
+  uint64_t received = 0; // by all subscribers
+  uint64_t errors = 0;   // bad payloads and failed calls
+  double seconds = 0;
+  double msgs_per_s = 0; // received per subscriber
+  double mb_per_s = 0;
+  uint64_t p50_us = 0, p99_us = 0, p999_us = 0, max_us = 0;
+};
+
+uint64_t now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+uint64_t percentile(std::vector<uint64_t> &samples, double p) {
+  if (samples.empty())
+    return 0;
+  size_t n = std::min(samples.size() - 1, (size_t)(p * samples.size()));
+  std::nth_element(samples.begin(), samples.begin() + n, samples.end());
+  return samples[n];
+}
+
+uint64_t publisher(ShmClient &client, const std::string &topic,
+                   const Params &params, unsigned int duration_ms,
+                   std::atomic<uint64_t> &errors) {
+  auto start = std::chrono::steady_clock::now();
+  auto end = start + std::chrono::milliseconds(duration_ms);
+  auto next = start;
+  uint64_t published = 0;
+  while (std::chrono::steady_clock::now() < end) {
+    if (params.rate) {
+      std::this_thread::sleep_until(next);
+      next += std::chrono::nanoseconds(1000000000ull / params.rate);
+    }
+
+    std::string buffer_name;
+    if (client.CreateBuffer(buffer_name, params.payload) < 0) {
+      errors++;
+      continue;
+    }
+    char *data = (char *)client.MapBuffer(buffer_name, params.payload);
+    if (!data) {
+      errors++;
+      client.ReleaseBuffer(buffer_name);
+      continue;
+    }
+    memset(data, (char)published, params.payload);
+    client.UnmapBuffer(buffer_name);
+    if (client.Publish(topic, buffer_name, now_ns()) < 0)
+      errors++;
+    else
+      published++;
+  }
+  return published;
+}
+
+// Pulls until the publisher is done and nothing arrived for a while
+void subscriber(ShmClient &client, const std::string &topic,
+                const std::string &name, const Params &params,
+                std::atomic<bool> &published, std::vector<uint64_t> &latency,
+                std::atomic<uint64_t> &errors) {
+  while (true) {
+    std::string buffer_name;
+    uint64_t ts;
+    if (client.Pull(topic, name, buffer_name, ts, 200) < 0) {
+      if (published)
+        return;
+      continue;
+    }
+    latency.push_back((now_ns() - ts) / 1000);
+
+    char *data = (char *)client.MapBuffer(buffer_name, params.payload);
+    if (!data || data[0] != data[params.payload - 1])
+      errors++;
+    client.UnmapBuffer(buffer_name);
+    client.ReleaseBuffer(buffer_name);
+  }
+}
+
+Result run(const std::string &address, const std::string &port,
+           const Params &params, unsigned int duration_ms, unsigned int id) {
+  std::string topic = "bench_pubsub_" + std::to_string(id);
+  ShmClient pub_client(address, port);
+  pub_client.RegisterTopic(topic, params.drop);
+  std::vector<std::unique_ptr<ShmClient>> clients;
+  for (unsigned int i = 0; i < params.subscribers; ++i) {
+    clients.emplace_back(new ShmClient(address, port));
+    clients.back()->Subscribe(topic, "sub" + std::to_string(i), params.depth);
+  }
+
+  std::atomic<bool> published(false);
+  std::atomic<uint64_t> errors(0);
+  std::vector<std::vector<uint64_t>> latency(params.subscribers);
+  std::vector<std::thread> threads;
+  for (unsigned int i = 0; i < params.subscribers; ++i)
+    threads.emplace_back([&, i]() {
+      subscriber(*clients[i], topic, "sub" + std::to_string(i), params,
+                 published, latency[i], errors);
+    });
+
+  auto start = std::chrono::steady_clock::now();
+  Result result;
+  result.params = params;
+  result.published = publisher(pub_client, topic, params, duration_ms, errors);
+  published = true;
+  for (auto &t : threads)
+    t.join();
+  // the subscribers' final pull timeout is not part of the run
+  result.seconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start)
+                       .count() -
+                   0.2;
+
+  std::vector<uint64_t> samples;
+  for (auto &l : latency)
+    samples.insert(samples.end(), l.begin(), l.end());
+  result.received = samples.size();
+  result.errors = errors;
+  result.msgs_per_s =
+      (double)result.received / params.subscribers / result.seconds;
+  result.mb_per_s = result.msgs_per_s * params.payload / (1 << 20);
+  result.p50_us = percentile(samples, 0.5);
+  result.p99_us = percentile(samples, 0.99);
+  result.p999_us = percentile(samples, 0.999);
+  if (!samples.empty())
+    result.max_us = *std::max_element(samples.begin(), samples.end());
+  return result;
+}
+
+// The baseline varied one parameter at a time, or every combination
+std::vector<Params> sweep(bool full) {
+  const std::vector<size_t> payloads = {4,       4 << 10,  64 << 10,
+                                        1 << 20, 8 << 20, 32 << 20};
+  const std::vector<unsigned int> subscribers = {1, 2, 4};
+  const std::vector<unsigned int> depths = {1, 4, 16};
+  const std::vector<bool> drops = {false, true};
+  const std::vector<unsigned int> rates = {0, 30, 1000};
+
+  std::vector<Params> runs;
+  Params base;
+  if (full) {
+    for (size_t payload : payloads)
+      for (unsigned int subs : subscribers)
+        for (unsigned int depth : depths)
+          for (bool drop : drops)
+            for (unsigned int rate : rates)
+              runs.push_back(Params{payload, subs, depth, drop, rate});
+    return runs;
+  }
+
+  runs.push_back(base);
+  for (size_t payload : payloads)
+    if (payload != base.payload)
+      runs.push_back(Params{payload, base.subscribers, base.depth, base.drop,
+                            base.rate});
+  for (unsigned int subs : subscribers)
+    if (subs != base.subscribers)
+      runs.push_back(
+          Params{base.payload, subs, base.depth, base.drop, base.rate});
+  for (unsigned int depth : depths)
+    if (depth != base.depth)
+      runs.push_back(Params{base.payload, base.subscribers, depth, base.drop,
+                            base.rate});
+  for (bool drop : drops)
+    if (drop != base.drop)
+      runs.push_back(Params{base.payload, base.subscribers, base.depth, drop,
+                            base.rate});
+  for (unsigned int rate : rates)
+    if (rate != base.rate)
+      runs.push_back(Params{base.payload, base.subscribers, base.depth,
+                            base.drop, rate});
+  return runs;
+}
+
+void writeJson(FILE *out, const std::vector<Result> &results,
+               unsigned int duration_ms) {
+  fprintf(out, "{\n  \"duration_ms\": %u,\n  \"runs\": [\n", duration_ms);
+  for (size_t i = 0; i < results.size(); ++i) {
+    const Result &r = results[i];
+    fprintf(out,
+            "    {\"payload_bytes\": %zu, \"subscribers\": %u, "
+            "\"queue_depth\": %u, \"drop\": %s, \"rate\": %u, "
+            "\"published\": %llu, \"received\": %llu, \"errors\": %llu, "
+            "\"msgs_per_s\": %.1f, \"mb_per_s\": %.1f, "
+            "\"latency_us\": {\"p50\": %llu, \"p99\": %llu, \"p999\": %llu, "
+            "\"max\": %llu}}%s\n",
+            r.params.payload, r.params.subscribers, r.params.depth,
+            r.params.drop ? "true" : "false", r.params.rate,
+            (unsigned long long)r.published, (unsigned long long)r.received,
+            (unsigned long long)r.errors, r.msgs_per_s, r.mb_per_s,
+            (unsigned long long)r.p50_us, (unsigned long long)r.p99_us,
+            (unsigned long long)r.p999_us, (unsigned long long)r.max_us,
+            i + 1 < results.size() ? "," : "");
+  }
+  fprintf(out, "  ]\n}\n");
+}
+
+// Starts the server with a config for the port, returns its pid
+pid_t launch(const std::string &server, const std::string &port,
+             const std::string &config) {
+  std::ofstream(config) << "{\"log_level\": \"error\", \"port\": \"" << port
+                        << "\"}\n";
+  pid_t pid = fork();
+  if (pid == 0) {
+    execl(server.c_str(), server.c_str(), config.c_str(), (char *)nullptr);
+    perror("failed to launch shm_server");
+    _exit(1);
+  }
+  return pid;
+}
+
+bool waitForServer(const std::string &address, const std::string &port) {
+  ShmClient client(address, port);
+  std::vector<TopicInfo> topics;
+  for (int i = 0; i < 100; ++i) {
+    if (client.GetTopics(topics) == 0)
+      return true;
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  }
+  return false;
+}
+
+int main(int argc, char **argv) {
+  std::string server = SHM_SERVER_PATH, port = "50071", out_path;
+  std::string address = "localhost";
+  unsigned int duration_ms = 1000;
+  bool launch_server = true, full = false;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--server" && i + 1 < argc)
+      server = argv[++i];
+    else if (arg == "--no-launch")
+      launch_server = false;
+    else if (arg == "--port" && i + 1 < argc)
+      port = argv[++i];
+    else if (arg == "--ms" && i + 1 < argc)
+      duration_ms = std::stoi(argv[++i]);
+    else if (arg == "--full")
+      full = true;
+    else if (arg == "--out" && i + 1 < argc)
+      out_path = argv[++i];
+    else {
+      fprintf(stderr, "usage: %s [--server PATH | --no-launch] [--port PORT] "
+                      "[--ms MS] [--full] [--out FILE]\n",
+              argv[0]);
+      return 1;
+    }
+  }
+  spdlog::set_level(spdlog::level::err);
+
+  std::string config =
+      "/tmp/bench_pubsub_" + std::to_string(getpid()) + ".json";
+  pid_t pid = launch_server ? launch(server, port, config) : 0;
+  if (!waitForServer(address, port)) {
+    fprintf(stderr, "shm_server is not reachable on port %s\n", port.c_str());
+    if (pid > 0)
+      kill(pid, SIGKILL);
+    unlink(config.c_str());
+    return 1;
+  }
+
+  std::vector<Result> results;
+  fprintf(stderr, "%10s %4s %5s %4s %5s %10s %10s %8s %8s %8s\n", "payload",
+          "subs", "depth", "drop", "rate", "msgs/s", "MB/s", "p50_us",
+          "p99_us", "p999_us");
+  unsigned int id = 0;
+  for (const Params &params : sweep(full)) {
+    Result r = run(address, port, params, duration_ms, id++);
+    fprintf(stderr, "%10zu %4u %5u %4s %5u %10.1f %10.1f %8llu %8llu %8llu\n",
+            params.payload, params.subscribers, params.depth,
+            params.drop ? "yes" : "no", params.rate, r.msgs_per_s, r.mb_per_s,
+            (unsigned long long)r.p50_us, (unsigned long long)r.p99_us,
+            (unsigned long long)r.p999_us);
+    results.push_back(r);
+  }
+
+  // SIGINT lets the server release its shared memory
+  if (pid > 0) {
+    kill(pid, SIGINT);
+    waitpid(pid, nullptr, 0);
+    unlink(config.c_str());
+  }
+
+  FILE *out = out_path.empty() ? stdout : fopen(out_path.c_str(), "w");
+  if (!out) {
+    perror("failed to open output");
+    return 1;
+  }
+  writeJson(out, results, duration_ms);
+  if (out != stdout)
+    fclose(out);
+  return 0;
+}
@@ -0,0 +1,163 @@
+#include "metrics_server.h"
+#include "spdlog/spdlog.h"
+#include "topic_manager.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// A publisher posts as fast as it can to a topic that doesn't drop messages,
+// read by a fast subscriber and a slow one that blocks the publisher. Reports
+// the post rate without and with a scraper reading the stats every
+// scrape_ms, the stats of the last run and the size of the metrics page
+// served over HTTP. Runs in process, no server is needed.
+//   bench_stats [scrape_ms] [ms_per_run] [metrics_port]
+
+struct Result {
+  double posts_per_s;
+  uint64_t scrapes;
+};
+
+// Fetches the metrics page, returns the reply including its headers
+std::string fetch(unsigned short port) {
+  int sock = socket(AF_INET, SOCK_STREAM, 0);
+  sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+  std::string reply;
+  if (connect(sock, (sockaddr *)&addr, sizeof(addr)) == 0) {
+    const char *request = "GET /metrics HTTP/1.0\r\n\r\n";
+    send(sock, request, strlen(request), 0);
+    char buf[4096];
+    ssize_t n;
+    while ((n = recv(sock, buf, sizeof(buf), 0)) > 0)
+      reply.append(buf, n);
+  }
+  close(sock);
+  return reply;
+}
+
+Result run(unsigned int scrape_ms, unsigned int duration_ms) {
+  TopicManager *tm = TopicManager::getInstance();
+  std::string topic_name = "bench_stats";
+  tm->removeTopic(topic_name); // start the counters from zero
+  tm->addTopic(topic_name, false);
+  std::vector<std::string> dependencies;
+  uint64_t fast_handle, slow_handle;
+  tm->subscribe(topic_name, "fast", dependencies, 8, &fast_handle);
+  tm->subscribe(topic_name, "slow", dependencies, 8, &slow_handle);
+  SubscriptionPtr fast = tm->findSubscription(fast_handle);
+  SubscriptionPtr slow = tm->findSubscription(slow_handle);
+  std::shared_ptr<Topic> topic = tm->findTopic(topic_name);
+
+  std::atomic<bool> stop(false);
+  std::thread fast_thread([&]() {
+    TopicQueueItem item;
+    while (!stop) {
+      fast->queue->clear_old();
+      fast->queue->pull(fast->slot, item, 10);
+    }
+  });
+  std::thread slow_thread([&]() {
+    TopicQueueItem item;
+    while (!stop) {
+      slow->queue->clear_old();
+      if (slow->queue->pull(slow->slot, item, 10))
+        std::this_thread::sleep_for(std::chrono::microseconds(20));
+    }
+  });
+
+  Result result = {0, 0};
+  std::thread scraper;
+  if (scrape_ms)
+    scraper = std::thread([&]() {
+      while (!stop) {
+        MetricsServer::render();
+        result.scrapes++;
+        std::this_thread::sleep_for(std::chrono::milliseconds(scrape_ms));
+      }
+    });
+
+  auto start = std::chrono::steady_clock::now();
+  auto end = start + std::chrono::milliseconds(duration_ms);
+  uint64_t posted = 0;
+  while (std::chrono::steady_clock::now() < end) {
+    topic->post(makeTopicQueueItem("msg" + std::to_string(posted), "",
+                                   posted));
+    posted++;
+  }
+  double seconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+  result.posts_per_s = posted / seconds;
+
+  stop = true;
+  fast_thread.join();
+  slow_thread.join();
+  if (scraper.joinable())
+    scraper.join();
+  return result;
+}
+
+void print(const TopicUsageStats &stats) {
+  printf("topic %s: %llu published, %.0f/s\n", stats.name.c_str(),
+         (unsigned long long)stats.published, stats.publishRate);
+  for (auto &q : stats.queues) {
+    printf("  queue %s: pushed %llu pulled %llu dropped %llu blocked %llu "
+           "posts for %.1f ms\n",
+           q.owner.c_str(), (unsigned long long)q.pushed,
+           (unsigned long long)q.pulled, (unsigned long long)q.dropped,
+           (unsigned long long)q.blockedPosts, q.blockedUs / 1e3);
+    printf("  pull wait:");
+    for (size_t i = 0; i < q.pullWait.size(); ++i) {
+      if (i < q.pullWait.size() - 1)
+        printf(" <=%lluus:%llu",
+               (unsigned long long)LatencyHistogram::BOUNDS_US[i],
+               (unsigned long long)q.pullWait[i]);
+      else
+        printf(" more:%llu\n", (unsigned long long)q.pullWait[i]);
+    }
+  }
+}
+
+int main(int argc, char **argv) {
+  unsigned int scrape_ms = argc > 1 ? std::stoi(argv[1]) : 1;
+  unsigned int duration_ms = argc > 2 ? std::stoi(argv[2]) : 1000;
+  unsigned short port = argc > 3 ? std::stoi(argv[3]) : 9464;
+  spdlog::set_level(spdlog::level::err);
+
+  printf("%10s %12s %10s\n", "scrape_ms", "posts/s", "scrapes");
+  Result result = run(0, duration_ms);
+  printf("%10s %12.0f %10llu\n", "off", result.posts_per_s,
+         (unsigned long long)result.scrapes);
+  result = run(scrape_ms, duration_ms);
+  printf("%10u %12.0f %10llu\n", scrape_ms, result.posts_per_s,
+         (unsigned long long)result.scrapes);
+
+  std::vector<TopicUsageStats> stats;
+  TopicManager::getInstance()->getStats(stats);
+  for (auto &topic : stats)
+    print(topic);
+
+  bool served = false;
+  if (MetricsServer::getInstance()->start("127.0.0.1", port)) {
+    std::string page = fetch(port);
+    served = page.compare(0, 15, "HTTP/1.0 200 OK") == 0;
+    printf("metrics page: %zu bytes, %s\n", page.size(),
+           served ? "ok" : "bad reply");
+    MetricsServer::getInstance()->stop();
+  } else
+    printf("metrics server failed to start on port %u\n", port);
+  TopicManager::getInstance()->removeTopic("bench_stats");
+  return served ? 0 : 1;
+}
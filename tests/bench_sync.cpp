@@ -0,0 +1,168 @@
+#include "spdlog/spdlog.h"
+#include "sync_group.h"
+#include "topic_manager.h"
+
+#include <chrono>
+#include <cstdio>
+#include <deque>
+#include <string>
+#include <vector>
+
+// Compares matching image, bounding box and name messages by timestamp in
+// the subscriber, which pulls every topic, with a sync group that matches
+// them on the server and returns only complete tuples. The detector skips
+// some frames and names are published for every other frame, a little late.
+// Runs in process, no server is needed.
+//   bench_sync [frames] [tolerance]
+
+const std::vector<std::string> topics = {"bench_image", "bench_bbox",
+                                         "bench_name"};
+
+struct Result {
+  uint64_t tuples = 0;
+  uint64_t checksum = 0;
+  uint64_t wakeups = 0;   // pulls that returned data
+  uint64_t delivered = 0; // buffers handed to the subscriber
+  double us = 0;
+};
+
+void publish(TopicManager *tm, unsigned int frame) {
+  uint64_t ts = frame * 33;
+  tm->findTopic(topics[0])->post(makeTopicQueueItem("", "", ts));
+  if (frame % 10 < 7)
+    tm->findTopic(topics[1])->post(makeTopicQueueItem("", "", ts + 1));
+  if (frame % 2 == 0)
+    tm->findTopic(topics[2])->post(makeTopicQueueItem("", "", ts + 3));
+}
+
+// The subscriber pulls every topic and applies the same matching rule as
+// the sync group
+Result runClient(TopicManager *tm, unsigned int frames, uint64_t tolerance) {
+  std::vector<SubscriptionPtr> subs;
+  for (auto &topic : topics)
+    subs.push_back(tm->findSubscription(topic, "bench_client"));
+  std::vector<std::deque<TopicQueueItem>> pending(topics.size());
+  std::vector<uint64_t> last(topics.size(), 0);
+
+  Result result;
+  PullWaiterPtr waiter = std::make_shared<PullWaiter>();
+  waiter->subscriber_name = "bench_client";
+  std::vector<TopicQueueItem> items;
+  auto start = std::chrono::steady_clock::now();
+  for (unsigned int frame = 0; frame < frames; ++frame) {
+    publish(tm, frame);
+    for (size_t i = 0; i < subs.size(); ++i) {
+      waiter->slot = subs[i]->slot;
+      while (true) {
+        subs[i]->queue->clear_old();
+        items.clear();
+        subs[i]->queue->pull_async(waiter, items);
+        if (items.empty()) {
+          subs[i]->queue->cancel_waiter(waiter);
+          break;
+        }
+        result.wakeups++;
+        result.delivered++;
+        last[i] = items[0]->timestamp;
+        pending[i].push_back(items[0]);
+      }
+    }
+
+    while (true) {
+      uint64_t newest = 0;
+      bool complete = true;
+      for (size_t i = 0; i < pending.size(); ++i) {
+        if (pending[i].empty()) {
+          complete = false;
+          newest = std::max(newest, last[i]);
+        } else
+          newest = std::max(newest, pending[i].front()->timestamp);
+      }
+      bool stale = false;
+      for (auto &p : pending) {
+        if (!p.empty() && newest - p.front()->timestamp > tolerance) {
+          p.pop_front();
+          stale = true;
+        }
+      }
+      if (stale)
+        continue;
+      if (!complete)
+        break;
+      result.tuples++;
+      for (auto &p : pending) {
+        result.checksum += p.front()->timestamp;
+        p.pop_front();
+      }
+    }
+  }
+  result.us = std::chrono::duration<double, std::micro>(
+                  std::chrono::steady_clock::now() - start)
+                  .count();
+  return result;
+}
+
+Result runSync(TopicManager *tm, SyncGroupPtr group, unsigned int frames) {
+  Result result;
+  PullWaiterPtr waiter = std::make_shared<PullWaiter>();
+  waiter->subscriber_name = group->getName();
+  std::vector<TopicQueueItem> tuple;
+  auto start = std::chrono::steady_clock::now();
+  for (unsigned int frame = 0; frame < frames; ++frame) {
+    publish(tm, frame);
+    while (true) {
+      tuple.clear();
+      group->pull_async(waiter, tuple);
+      if (tuple.empty()) {
+        group->cancel_waiter(waiter);
+        break;
+      }
+      result.wakeups++;
+      result.tuples++;
+      result.delivered += tuple.size();
+      for (auto &it : tuple)
+        result.checksum += it->timestamp;
+    }
+  }
+  result.us = std::chrono::duration<double, std::micro>(
+                  std::chrono::steady_clock::now() - start)
+                  .count();
+  return result;
+}
+
+int main(int argc, char **argv) {
+  unsigned int frames = argc > 1 ? std::stoi(argv[1]) : 100000;
+  uint64_t tolerance = argc > 2 ? std::stoull(argv[2]) : 5;
+  spdlog::set_level(spdlog::level::warn);
+
+  TopicManager *tm = TopicManager::getInstance();
+  std::vector<std::string> dependencies;
+  for (auto topic : topics) {
+    tm->addTopic(topic, true);
+    tm->subscribe(topic, "bench_client", dependencies, 8);
+  }
+  Result client = runClient(tm, frames, tolerance);
+
+  for (auto topic : topics)
+    tm->removeTopic(topic);
+  for (auto topic : topics)
+    tm->addTopic(topic, true);
+  SyncManager *sm = SyncManager::getInstance();
+  SyncGroupPtr group =
+      sm->find(sm->subscribe("bench_sync", topics, tolerance, false, 8));
+  Result sync = runSync(tm, group, frames);
+
+  printf("%u frames, tolerance %llu\n", frames,
+         (unsigned long long)tolerance);
+  printf("%8s %10s %12s %12s %12s\n", "", "tuples", "wakeups", "buffers",
+         "us/tuple");
+  printf("%8s %10llu %12llu %12llu %12.3f\n", "client",
+         (unsigned long long)client.tuples, (unsigned long long)client.wakeups,
+         (unsigned long long)client.delivered, client.us / client.tuples);
+  printf("%8s %10llu %12llu %12llu %12.3f\n", "sync",
+         (unsigned long long)sync.tuples, (unsigned long long)sync.wakeups,
+         (unsigned long long)sync.delivered, sync.us / sync.tuples);
+  bool match = client.tuples == sync.tuples && client.checksum == sync.checksum;
+  printf("match: %s\n", match ? "yes" : "no");
+  return match ? 0 : 1;
+}
@@ -0,0 +1,171 @@
+#include "shm_manager.h"
+#include "spdlog/spdlog.h"
+#include "topic_queue.h"
+
+#include <chrono>
+#include <cstdio>
+#include <deque>
+#include <list>
+#include <string>
+#include <vector>
+
+// Compares the TopicQueue ring against the deque and string index map it
+// replaced. Every round posts a burst of items to a bounded queue, each
+// subscriber takes a batch of what is available (as PullBatch and Stream do,
+// without the parked pull being completed) and old items are reclaimed,
+// so the queue keeps dropping items as a slow subscriber would make it.
+// Both queues must hand out the same items. Runs in process, no server is
+// needed.
+//   bench_topic_queue [num_subscribers] [queue_size] [rounds]
+
+// The previous implementation, reduced to the calls the benchmark makes
+class LegacyTopicQueue {
+private:
+  deque<TopicQueueItem> mQueue;
+  mutex mMutex;
+  condition_variable mCV;
+  const unsigned int mMaxSize;
+  unordered_map<string, unsigned int> mIndexMap;
+  list<PullWaiterPtr> mWaiters;
+
+  bool isFull() const { return mMaxSize && mQueue.size() >= mMaxSize; }
+
+public:
+  LegacyTopicQueue(unsigned int maxQueueSize) : mMaxSize(maxQueueSize) {}
+
+  void push_replace_oldest(const TopicQueueItem &item) {
+    unique_lock lock(mMutex);
+    string removed;
+    if (isFull()) {
+      unsigned int maxIdx = 0;
+      for (auto &it : mIndexMap)
+        maxIdx = max(maxIdx, it.second);
+      unsigned int removeIdx = maxIdx + 1;
+      if (removeIdx >= mQueue.size()) {
+        removed = item->buffer_name;
+      } else {
+        removed = mQueue[removeIdx]->buffer_name;
+        mQueue.erase(mQueue.begin() + removeIdx);
+        mQueue.push_back(item);
+      }
+    } else
+      mQueue.push_back(item);
+    unsigned int sub_count = mIndexMap.size();
+    mCV.notify_all();
+    lock.unlock();
+    if (!removed.empty())
+      ShmManager::getInstance()->release(removed, sub_count);
+  }
+
+  bool pull_async(PullWaiterPtr waiter, vector<TopicQueueItem> &items) {
+    lock_guard lock(mMutex);
+    auto it = mIndexMap.find(waiter->subscriber_name);
+    if (it == mIndexMap.end())
+      return false;
+
+    unsigned int &idx = it->second;
+    for (unsigned int n = 0; n < max(waiter->max_items, 1u) && idx < mQueue.size(); ++n)
+      items.push_back(mQueue[idx++]);
+    if (items.empty())
+      mWaiters.push_back(waiter);
+    return true;
+  }
+
+  bool cancel_waiter(const PullWaiterPtr &waiter) {
+    lock_guard lock(mMutex);
+    for (auto it = mWaiters.begin(); it != mWaiters.end(); ++it) {
+      if (*it == waiter) {
+        mWaiters.erase(it);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  unsigned int clear_old() {
+    lock_guard lock(mMutex);
+    unsigned int minIdx = mMaxSize;
+    for (auto &it : mIndexMap)
+      minIdx = min(minIdx, it.second);
+
+    unsigned int popped_count = 0;
+    for (; popped_count < minIdx && !mQueue.empty(); ++popped_count) {
+      mQueue.pop_front();
+      mCV.notify_one();
+    }
+    for (auto &it : mIndexMap)
+      it.second -= min(it.second, popped_count);
+    return popped_count;
+  }
+
+  void init_index(string subscriber_name) {
+    lock_guard lock(mMutex);
+    mIndexMap[subscriber_name] = 0;
+  }
+};
+
+struct Result {
+  double ops_per_s = 0;
+  uint64_t checksum = 0; // sum of the timestamps pulled
+};
+
+template <typename Queue>
+Result run(unsigned int num_subscribers, unsigned int queue_size, int rounds) {
+  Queue queue(queue_size);
+  vector<PullWaiterPtr> subscribers;
+  for (unsigned int i = 0; i < num_subscribers; ++i) {
+    subscribers.push_back(make_shared<PullWaiter>());
+    subscribers.back()->subscriber_name = "bench_subscriber_" + to_string(i);
+    subscribers.back()->max_items = i + 1;
+    queue.init_index(subscribers.back()->subscriber_name);
+  }
+
+  Result result;
+  uint64_t ops = 0;
+  uint64_t ts = 0;
+  vector<TopicQueueItem> pulled;
+  auto start = chrono::steady_clock::now();
+  for (int round = 0; round < rounds; ++round) {
+    for (unsigned int n = 0; n < queue_size; ++n, ++ops) {
+      queue.push_replace_oldest(
+          makeTopicQueueItem("bench_buffer", "", ++ts));
+    }
+    // subscriber i takes up to i + 1 items, the first one falls behind
+    for (auto &subscriber : subscribers) {
+      pulled.clear();
+      queue.pull_async(subscriber, pulled);
+      if (pulled.empty())
+        queue.cancel_waiter(subscriber);
+      for (auto &it : pulled)
+        result.checksum += it->timestamp;
+      ops += max<size_t>(pulled.size(), 1);
+    }
+    queue.clear_old();
+    ++ops;
+  }
+  auto elapsed = chrono::steady_clock::now() - start;
+
+  result.ops_per_s = ops / chrono::duration<double>(elapsed).count();
+  return result;
+}
+
+int main(int argc, char *argv[]) {
+  unsigned int max_subscribers = argc > 1 ? stoul(argv[1]) : 16;
+  unsigned int queue_size = argc > 2 ? stoul(argv[2]) : 64;
+  int rounds = argc > 3 ? stoi(argv[3]) : 20000;
+  spdlog::set_level(spdlog::level::off);
+
+  printf("%12s %16s %16s %8s\n", "subscribers", "deque ops/s", "ring ops/s",
+         "match");
+  unsigned int mismatches = 0;
+  for (unsigned int subs = 1; subs <= max(max_subscribers, 1u); subs *= 2) {
+    Result legacy = run<LegacyTopicQueue>(subs, queue_size, rounds);
+    Result ring = run<TopicQueue>(subs, queue_size, rounds);
+    bool match = legacy.checksum == ring.checksum;
+    printf("%12u %16.0f %16.0f %8s\n", subs, legacy.ops_per_s, ring.ops_per_s,
+           match ? "yes" : "NO");
+    if (!match)
+      mismatches++;
+  }
+  return mismatches ? 1 : 0;
+}
@@ -0,0 +1,99 @@
+#include "spdlog/spdlog.h"
+#include "topic_manager.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Measures TopicManager lookups under contention. Worker threads publish to
+// and pull from many topics while another thread keeps adding and removing
+// topics, as happens when publishers register while subscribers are already
+// pulling. The same calls are made once by name and once through the topic
+// and subscription handles. Runs in process, no server is needed.
+//   bench_topics [num_topics] [max_threads] [ms_per_run]
+
+const std::string subscriber = "bench_subscriber";
+
+struct BenchTopic {
+  std::string name;
+  uint64_t handle;
+  uint64_t subscription;
+};
+
+double run(const std::vector<BenchTopic> &topics, unsigned int num_threads,
+           int duration_ms, bool by_handle) {
+  TopicManager *tm = TopicManager::getInstance();
+  std::atomic<bool> stop(false);
+  std::atomic<uint64_t> ops(0);
+
+  std::vector<std::thread> workers;
+  for (unsigned int t = 0; t < num_threads; ++t) {
+    workers.emplace_back([&, t]() {
+      uint64_t n = 0;
+      TopicQueueItem item = makeTopicQueueItem("", "", 0), pulled;
+      for (size_t i = t; !stop; i += 7) {
+        const BenchTopic &topic = topics[i % topics.size()];
+        if (by_handle) {
+          // as Publish and Pull do with handles
+          std::shared_ptr<Topic> tp = tm->findTopic(topic.handle);
+          tp->post(item);
+          tp->size();
+          SubscriptionPtr sub = tm->findSubscription(topic.subscription);
+          sub->queue->clear_old();
+          sub->queue->pull(sub->slot, pulled, 0);
+        } else {
+          tm->publish(topic.name, item);
+          tm->getSubscriberCount(topic.name);
+          tm->clearOldPosts(topic.name, subscriber);
+          tm->pull(topic.name, subscriber, pulled, 0);
+        }
+        n += 4;
+      }
+      ops += n;
+    });
+  }
+
+  std::thread churn([&]() {
+    for (unsigned int i = 0; !stop; ++i) {
+      std::string name = "bench_churn_" + std::to_string(i % 64);
+      if (!tm->removeTopic(name))
+        tm->addTopic(name, true);
+    }
+  });
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(duration_ms));
+  stop = true;
+  for (auto &worker : workers)
+    worker.join();
+  churn.join();
+  return ops * 1000.0 / duration_ms;
+}
+
+int main(int argc, char *argv[]) {
+  int num_topics = argc > 1 ? std::stoi(argv[1]) : 256;
+  unsigned int max_threads =
+      argc > 2 ? std::stoul(argv[2]) : std::thread::hardware_concurrency();
+  int duration_ms = argc > 3 ? std::stoi(argv[3]) : 1000;
+  spdlog::set_level(spdlog::level::off);
+
+  std::vector<BenchTopic> topics(num_topics);
+  std::vector<std::string> no_dependencies;
+  for (int i = 0; i < num_topics; ++i) {
+    topics[i].name = "bench_topic_" + std::to_string(i);
+    topics[i].handle =
+        TopicManager::getInstance()->addTopic(topics[i].name, true);
+    TopicManager::getInstance()->subscribe(topics[i].name, subscriber,
+                                           no_dependencies, 3,
+                                           &topics[i].subscription);
+  }
+
+  std::printf("%8s %16s %16s\n", "threads", "by name/s", "by handle/s");
+  for (unsigned int threads = 1; threads <= std::max(max_threads, 1u);
+       threads *= 2)
+    std::printf("%8u %16.0f %16.0f\n", threads,
+                run(topics, threads, duration_ms, false),
+                run(topics, threads, duration_ms, true));
+}
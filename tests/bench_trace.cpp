@@ -0,0 +1,148 @@
+#include "spdlog/spdlog.h"
+#include "topic_manager.h"
+#include "tracer.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// A camera -> detector -> recognizer pipeline driven through the tracer
+// hooks the RPC handlers call. The detector is the slow stage, the table of
+// per stage latencies should point at it. Also reports the cost of the hooks
+// on a publish and pull loop with tracing off and on, and writes the Chrome
+// trace of the pipeline if a path is given. Runs in process, no server is
+// needed.
+//   bench_trace [detect_ms] [recognize_ms] [frames] [trace.json]
+
+Tracer *tracer = Tracer::getInstance();
+TopicManager *topics = TopicManager::getInstance();
+
+// What the Publish handler does
+void publish(const std::shared_ptr<Topic> &topic, const std::string &buffer,
+             uint64_t timestamp, const std::vector<std::string> &parents = {}) {
+  uint64_t trace = tracer->published(buffer, topic->getName(), parents);
+  topic->post(makeTopicQueueItem(buffer, "", timestamp, trace));
+}
+
+// What Pull and ReleaseBuffer do
+bool pull(const SubscriptionPtr &sub, TopicQueueItem &item) {
+  sub->queue->clear_old();
+  if (!sub->queue->pull(sub->slot, item, 10))
+    return false;
+  tracer->pulled(item, sub->subscriber_name);
+  return true;
+}
+
+SubscriptionPtr subscribe(const std::string &topic_name,
+                          const std::string &subscriber_name) {
+  std::vector<std::string> dependencies;
+  uint64_t handle;
+  topics->subscribe(topic_name, subscriber_name, dependencies, 4, &handle);
+  return topics->findSubscription(handle);
+}
+
+void pipeline(unsigned int detect_ms, unsigned int recognize_ms,
+              unsigned int frames) {
+  std::string images = "images", faces = "faces";
+  topics->addTopic(images, false);
+  topics->addTopic(faces, false);
+  SubscriptionPtr detector = subscribe(images, "detector");
+  SubscriptionPtr recognizer = subscribe(faces, "recognizer");
+  std::shared_ptr<Topic> image_topic = topics->findTopic(images);
+  std::shared_ptr<Topic> face_topic = topics->findTopic(faces);
+
+  std::atomic<bool> stop(false);
+  std::thread detect_thread([&]() {
+    TopicQueueItem item;
+    while (!stop) {
+      if (!pull(detector, item))
+        continue;
+      std::this_thread::sleep_for(std::chrono::milliseconds(detect_ms));
+      std::string face = "face" + std::to_string(item->timestamp);
+      tracer->created(face);
+      // derived buffers are published before their input is released
+      publish(face_topic, face, item->timestamp, {item->buffer_name});
+      tracer->released(item->buffer_name, detector->subscriber_name);
+    }
+  });
+  std::atomic<unsigned int> recognized(0);
+  std::thread recognize_thread([&]() {
+    TopicQueueItem item;
+    while (!stop) {
+      if (!pull(recognizer, item))
+        continue;
+      std::this_thread::sleep_for(std::chrono::milliseconds(recognize_ms));
+      tracer->released(item->buffer_name, recognizer->subscriber_name);
+      recognized++;
+    }
+  });
+
+  for (unsigned int frame = 0; frame < frames; ++frame) {
+    std::string image = "image" + std::to_string(frame);
+    tracer->created(image);
+    std::this_thread::sleep_for(std::chrono::microseconds(200));
+    publish(image_topic, image, frame);
+  }
+  while (recognized < frames)
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  stop = true;
+  detect_thread.join();
+  recognize_thread.join();
+  topics->removeTopic(images);
+  topics->removeTopic(faces);
+}
+
+// Publishes and pulls as fast as possible, returns messages per second
+double overhead(unsigned int messages) {
+  std::string name = "bench_trace";
+  topics->addTopic(name, true);
+  SubscriptionPtr sub = subscribe(name, "sub");
+  std::shared_ptr<Topic> topic = topics->findTopic(name);
+  TopicQueueItem item;
+  auto start = std::chrono::steady_clock::now();
+  for (unsigned int i = 0; i < messages; ++i) {
+    std::string buffer = "msg" + std::to_string(i);
+    tracer->created(buffer);
+    publish(topic, buffer, i);
+    pull(sub, item);
+    tracer->released(buffer, sub->subscriber_name);
+  }
+  double seconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+  topics->removeTopic(name);
+  return messages / seconds;
+}
+
+int main(int argc, char **argv) {
+  unsigned int detect_ms = argc > 1 ? std::stoi(argv[1]) : 8;
+  unsigned int recognize_ms = argc > 2 ? std::stoi(argv[2]) : 2;
+  unsigned int frames = argc > 3 ? std::stoi(argv[3]) : 200;
+  spdlog::set_level(spdlog::level::err);
+
+  double off = overhead(200000);
+  tracer->configure(true, 4096, 1024);
+  double on = overhead(200000);
+  printf("publish+pull: %.0f msgs/s tracing off, %.0f msgs/s on\n", off, on);
+
+  pipeline(detect_ms, recognize_ms, frames);
+  printf("%-11s %-8s %-11s %8s %10s %10s %10s\n", "stage", "topic",
+         "subscriber", "count", "p50_us", "p99_us", "max_us");
+  for (auto &s : tracer->getLatency()) {
+    if (s.topic == "bench_trace")
+      continue;
+    printf("%-11s %-8s %-11s %8llu %10llu %10llu %10llu\n", s.stage.c_str(),
+           s.topic.c_str(), s.subscriber.c_str(),
+           (unsigned long long)s.count, (unsigned long long)s.p50Us,
+           (unsigned long long)s.p99Us, (unsigned long long)s.maxUs);
+  }
+  if (argc > 4) {
+    std::ofstream(argv[4]) << tracer->chromeTrace();
+    printf("trace written to %s\n", argv[4]);
+  }
+  return 0;
+}
@@ -0,0 +1,77 @@
+#include "blocking_pool.h"
+#include "check.h"
+#include "shm_manager.h"
+#include "spdlog/spdlog.h"
+#include "topic_manager.h"
+
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <string>
+#include <thread>
+#include <vector>
+
+// The pool that runs the server's blocking handlers: publishes blocked on a
+// full queue don't keep later tasks from running, a thread is reused once
+// its task is done and idle threads exit.
+
+bool publish(TopicManager *tm, const std::string &topic, uint64_t ts) {
+  auto buffer = ShmManager::getInstance()->createBuffer(4096);
+  return buffer && tm->publishBuffer(topic, makeTopicQueueItem(
+                                                buffer->getName(), "", ts));
+}
+
+template <typename T> bool ready(std::future<T> &f, int ms) {
+  return f.wait_for(std::chrono::milliseconds(ms)) ==
+         std::future_status::ready;
+}
+
+int main() {
+  spdlog::set_level(spdlog::level::off);
+  BlockingPool *pool = BlockingPool::getInstance();
+  pool->configure(100);
+  TopicManager *tm = TopicManager::getInstance();
+  std::string topic = "blocking_pool_test";
+  std::vector<std::string> dependencies;
+  tm->addTopic(topic, false);
+  check(tm->subscribe(topic, "subscriber", dependencies, 1), "subscribe");
+  check(publish(tm, topic, 1), "publish to fill the queue");
+
+  // two publishes block on the full queue, a third task still runs
+  std::vector<std::promise<bool>> published(2);
+  for (uint64_t i = 0; i < 2; ++i)
+    pool->run([&, i]() { published[i].set_value(publish(tm, topic, i + 2)); });
+  std::promise<void> ran;
+  pool->run([&]() { ran.set_value(); });
+  std::future<void> ran_future = ran.get_future();
+  check(ready(ran_future, 1000), "a task runs while others are blocked");
+  check(pool->threads() == 3, "a thread for each blocked task");
+
+  // pulls unblock the publishers
+  std::future<bool> first = published[0].get_future();
+  std::future<bool> second = published[1].get_future();
+  TopicQueueItem item;
+  for (int i = 0; i < 3; ++i) {
+    tm->clearOldPosts(topic, "subscriber");
+    check(tm->pull(topic, "subscriber", item, 1000), "pull");
+    if (item)
+      ShmManager::getInstance()->release(item->buffer_name);
+  }
+  check(ready(first, 1000) && first.get() && ready(second, 1000) &&
+            second.get(),
+        "blocked publishes complete");
+
+  // idle threads take new tasks, then exit
+  std::promise<void> reused;
+  pool->run([&]() { reused.set_value(); });
+  std::future<void> reused_future = reused.get_future();
+  check(ready(reused_future, 1000) && pool->threads() == 3,
+        "an idle thread is reused");
+  for (int i = 0; i < 50 && pool->threads() > 0; ++i)
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  check(pool->threads() == 0, "idle threads exit");
+
+  tm->removeTopic(topic);
+  ShmManager::getInstance()->releaseAll();
+  return report();
+}
@@ -0,0 +1,208 @@
+#include "check.h"
+#include "shm_manager.h"
+#include "spdlog/spdlog.h"
+#include "topic_manager.h"
+
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Each shm budget policy: a budget that fails rejects the buffer that
+// doesn't fit, one that waits gets it once another thread releases a buffer
+// and one that evicts drops the oldest queued message of its topic, but stops
+// when dropping messages frees no memory.
+
+const size_t buffer_size = 4096;
+
+double now_ms() {
+  return std::chrono::duration<double, std::milli>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+ShmBudgetStats budget_stats(const std::string &topic) {
+  for (auto &stats : ShmManager::getInstance()->getBudgetStats())
+    if (stats.topic == topic)
+      return stats;
+  return ShmBudgetStats();
+}
+
+// Pulls what is queued without waiting and returns the timestamps
+std::vector<uint64_t> pull_all(TopicManager *tm, const std::string &topic) {
+  std::vector<uint64_t> pulled;
+  TopicQueueItem item;
+  while (tm->pull(topic, "subscriber", item, 0)) {
+    pulled.push_back(item->timestamp);
+    ShmManager::getInstance()->release(item->buffer_name);
+  }
+  return pulled;
+}
+
+void check_fail() {
+  ShmManager *sm = ShmManager::getInstance();
+  ShmBudget budget;
+  budget.maxBytes = 8 * buffer_size;
+  sm->configureBudget("", budget);
+
+  std::vector<std::string> names;
+  bool over;
+  for (unsigned int i = 0; i < 8; ++i) {
+    auto buffer = sm->createBuffer(buffer_size, 0, "", &over);
+    check(buffer != nullptr, "fail: create within the budget");
+    if (buffer)
+      names.push_back(buffer->getName());
+  }
+  check(!sm->createBuffer(buffer_size, 0, "", &over) && over,
+        "fail: create over the budget is rejected");
+  sm->release(names.back());
+  names.pop_back();
+  auto buffer = sm->createBuffer(buffer_size, 0, "", &over);
+  check(buffer != nullptr, "fail: a release makes room");
+  if (buffer)
+    names.push_back(buffer->getName());
+
+  ShmBudgetStats stats = budget_stats("");
+  check(stats.liveBytes == budget.maxBytes && stats.rejected == 1,
+        "fail: stats");
+  sm->release(names);
+  check(budget_stats("").liveBytes == 0, "fail: releases discharge");
+  sm->configureBudget("", ShmBudget());
+}
+
+void check_wait() {
+  ShmManager *sm = ShmManager::getInstance();
+  const std::string topic = "budget_wait";
+  ShmBudget budget;
+  budget.maxBytes = 4 * buffer_size;
+  budget.policy = BUDGET_WAIT;
+  budget.waitMs = 200;
+  sm->configureBudget(topic, budget);
+
+  std::vector<std::string> names;
+  for (unsigned int i = 0; i < 4; ++i) {
+    auto buffer = sm->createBuffer(buffer_size, 0, topic);
+    check(buffer != nullptr, "wait: create within the budget");
+    if (buffer)
+      names.push_back(buffer->getName());
+  }
+
+  // nobody releases, the create gives up after wait_ms
+  double start = now_ms();
+  bool over;
+  check(!sm->createBuffer(buffer_size, 0, topic, &over) && over,
+        "wait: create over the budget is rejected");
+  check(now_ms() - start >= budget.waitMs, "wait: gives up after wait_ms");
+
+  std::string released = names.back();
+  names.pop_back();
+  std::thread releaser([sm, released]() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    sm->release(released);
+  });
+  start = now_ms();
+  auto buffer = sm->createBuffer(buffer_size, 0, topic);
+  double waited_ms = now_ms() - start;
+  releaser.join();
+  check(buffer != nullptr && waited_ms < budget.waitMs,
+        "wait: gets the released room");
+  if (buffer)
+    names.push_back(buffer->getName());
+
+  ShmBudgetStats stats = budget_stats(topic);
+  check(stats.waited == 2 && stats.rejected == 1, "wait: stats");
+  sm->release(names);
+}
+
+// Fills the topic's budget with published messages, then publishes one more
+std::shared_ptr<ShmBuffer> fill_and_publish(TopicManager *tm,
+                                            const std::string &topic,
+                                            bool hold) {
+  ShmManager *sm = ShmManager::getInstance();
+  for (uint64_t ts = 1; ts <= 8; ++ts) {
+    auto buffer = sm->createBuffer(buffer_size, 0, topic);
+    check(buffer && tm->publishBuffer(topic, makeTopicQueueItem(
+                                                 buffer->getName(), "", ts)),
+          "evict: publish within the budget");
+    // as if another topic or a client also held the buffer
+    if (buffer && hold)
+      buffer->incRefCount();
+  }
+  auto buffer = sm->createBuffer(buffer_size, 0, topic);
+  if (buffer)
+    check(tm->publishBuffer(
+              topic, makeTopicQueueItem(buffer->getName(), "", 9)),
+          "evict: publish over the budget");
+  return buffer;
+}
+
+void check_evict() {
+  ShmManager *sm = ShmManager::getInstance();
+  TopicManager *tm = TopicManager::getInstance();
+  sm->setEvictor([tm](const std::string &topic_name) {
+    return tm->evict(topic_name);
+  });
+
+  std::vector<std::string> dependencies;
+  ShmBudget budget;
+  budget.maxBytes = 8 * buffer_size;
+  budget.policy = BUDGET_EVICT;
+
+  // a dropping topic loses the oldest message past its subscriber's cursor,
+  // as a full queue would
+  std::string topic = "budget_evict";
+  sm->configureBudget(topic, budget);
+  tm->addTopic(topic, true);
+  tm->subscribe(topic, "subscriber", dependencies, 64);
+  check(fill_and_publish(tm, topic, false) != nullptr,
+        "evict: eviction makes room");
+  std::vector<uint64_t> pulled = pull_all(tm, topic);
+  check(pulled == std::vector<uint64_t>({1, 3, 4, 5, 6, 7, 8, 9}),
+        "evict: the oldest unread message is dropped");
+  ShmBudgetStats stats = budget_stats(topic);
+  check(stats.evictedMessages == 1 && stats.rejected == 0 &&
+            stats.liveBytes == 0,
+        "evict: stats");
+  tm->removeTopic(topic);
+
+  // a topic that doesn't drop messages keeps them all
+  topic = "budget_keep";
+  sm->configureBudget(topic, budget);
+  tm->addTopic(topic, false);
+  tm->subscribe(topic, "subscriber", dependencies, 64);
+  check(fill_and_publish(tm, topic, false) == nullptr,
+        "keep: create over the budget is rejected");
+  check(pull_all(tm, topic).size() == 8, "keep: no message is dropped");
+  stats = budget_stats(topic);
+  check(stats.evictedMessages == 0 && stats.rejected == 1 &&
+            stats.liveBytes == 0,
+        "keep: stats");
+  tm->removeTopic(topic);
+
+  // dropping a message whose buffer is held elsewhere frees nothing, so
+  // eviction stops after one instead of emptying the queue
+  topic = "budget_held";
+  sm->configureBudget(topic, budget);
+  tm->addTopic(topic, true);
+  tm->subscribe(topic, "subscriber", dependencies, 64);
+  check(fill_and_publish(tm, topic, true) == nullptr,
+        "held: create over the budget is rejected");
+  stats = budget_stats(topic);
+  check(stats.evictedMessages == 1 && stats.rejected == 1,
+        "held: eviction stops without progress");
+  pulled = pull_all(tm, topic);
+  check(pulled == std::vector<uint64_t>({1, 3, 4, 5, 6, 7, 8}),
+        "held: only one message is dropped");
+  tm->removeTopic(topic);
+  sm->setEvictor(nullptr);
+}
+
+int main() {
+  spdlog::set_level(spdlog::level::off);
+  check_fail();
+  check_wait();
+  check_evict();
+  ShmManager::getInstance()->releaseAll();
+
+  return report();
+}
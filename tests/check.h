@@ -0,0 +1,22 @@
+#pragma once
+
+#include <cstdio>
+
+// Pass/fail harness of the tests run by ctest. check() reports every
+// expectation that doesn't hold and main returns report(), which prints
+// "Passed" if none failed.
+
+inline int failures = 0;
+
+inline void check(bool passed, const char *what) {
+  if (!passed) {
+    std::fprintf(stderr, "FAILED: %s\n", what);
+    failures++;
+  }
+}
+
+inline int report() {
+  if (failures == 0)
+    std::printf("Passed\n");
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,135 @@
+#include "check.h"
+#include "consumer_group.h"
+#include "shm_manager.h"
+#include "spdlog/spdlog.h"
+#include "topic_manager.h"
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+// Consumer groups: every message goes to exactly one member, the member that
+// has waited longest gets the next one, a member that joins again gives up
+// what it didn't release, and removing the topic closes the group and
+// completes its parked pulls.
+
+bool publish(TopicManager *tm, const std::string &topic, uint64_t ts) {
+  auto buffer = ShmManager::getInstance()->createBuffer(4096);
+  return buffer && tm->publishBuffer(topic, makeTopicQueueItem(
+                                                buffer->getName(), "", ts));
+}
+
+size_t live_buffers() {
+  return ShmManager::getInstance()->getBufferStats().liveBuffers;
+}
+
+// A pull that is parked if nothing is available, its items are kept
+struct Pull {
+  PullWaiterPtr waiter = std::make_shared<PullWaiter>();
+  std::vector<TopicQueueItem> items;
+  bool completed = false;
+  bool accepted = false;
+
+  Pull(GroupMemberPtr member) {
+    waiter->callback = [this](std::vector<TopicQueueItem> &ready) {
+      items = ready;
+      completed = true;
+    };
+    accepted = member->group->pull_async(member->name, waiter, items);
+    completed = !items.empty();
+  }
+
+  uint64_t timestamp() const {
+    return items.empty() ? 0 : items.front()->timestamp;
+  }
+};
+
+// Releases the member's item as a ReleaseBuffer of the member would
+bool release(GroupMemberPtr member, const TopicQueueItem &item) {
+  if (!member->group->release(member->name, item->buffer_name))
+    return false;
+  ShmManager::getInstance()->release(item->buffer_name);
+  return true;
+}
+
+int main() {
+  spdlog::set_level(spdlog::level::off);
+  TopicManager *tm = TopicManager::getInstance();
+  GroupManager *gm = GroupManager::getInstance();
+  std::string topic = "group_test";
+  tm->addTopic(topic, false);
+
+  GroupMemberPtr first = gm->find(gm->join(topic, "workers", "first", 8, 0));
+  GroupMemberPtr second = gm->find(gm->join(topic, "workers", "second", 8, 0));
+  check(first && second && first->group == second->group,
+        "members join the same group");
+  if (!first || !second)
+    return 1;
+  check(tm->getSubscriberCount(topic) == 1, "the group subscribes once");
+
+  // every message goes to one member
+  for (uint64_t ts = 1; ts <= 6; ++ts)
+    check(publish(tm, topic, ts), "publish");
+  std::vector<uint64_t> pulled;
+  for (int i = 0; i < 6; ++i) {
+    GroupMemberPtr member = i % 2 ? second : first;
+    Pull pull(member);
+    check(pull.completed && pull.items.size() == 1, "pull one item");
+    if (!pull.completed)
+      break;
+    pulled.push_back(pull.timestamp());
+    check(release(member, pull.items.front()), "member releases its item");
+    check(!release(member, pull.items.front()), "second release is ignored");
+  }
+  std::sort(pulled.begin(), pulled.end());
+  check(pulled == std::vector<uint64_t>({1, 2, 3, 4, 5, 6}),
+        "each message is pulled once");
+  check(live_buffers() == 0, "released buffers are freed");
+
+  // the member that waited longest gets the next message
+  Pull first_waits(first), second_waits(second);
+  check(first_waits.accepted && !first_waits.completed &&
+            second_waits.accepted && !second_waits.completed,
+        "pulls park without messages");
+  check(publish(tm, topic, 7), "publish to waiting members");
+  check(first_waits.completed && first_waits.timestamp() == 7 &&
+            !second_waits.completed,
+        "the first waiter gets the message");
+  check(publish(tm, topic, 8), "publish to the next waiter");
+  check(second_waits.completed && second_waits.timestamp() == 8,
+        "the second waiter gets the next message");
+  check(release(second, second_waits.items.front()), "release");
+
+  // joining again hands the unreleased message to another member
+  gm->join(topic, "workers", "first", 8, 0);
+  Pull reassigned(second);
+  check(reassigned.completed && reassigned.timestamp() == 7,
+        "a member that joins again gives up its messages");
+  check(!release(first, first_waits.items.front()),
+        "the former holder's release is ignored");
+  check(release(second, reassigned.items.front()),
+        "the new holder releases it");
+  check(live_buffers() == 0, "reassigned buffer is freed once");
+
+  // removing the topic closes the group
+  Pull parked(first);
+  tm->removeTopic(topic);
+  check(parked.completed && parked.items.empty(),
+        "parked pull completes without data");
+  check(first->group->closed(), "group is closed");
+  Pull after(first);
+  check(!after.accepted, "pull of a closed group fails");
+  check(live_buffers() == 0, "no buffer is left");
+
+  tm->addTopic(topic, false);
+  uint64_t handle = gm->join(topic, "workers", "first", 8, 0);
+  GroupMemberPtr again = gm->find(handle);
+  check(again && again->group != first->group && !again->group->closed(),
+        "joining after removal creates a new group");
+  check(gm->join(topic, "workers", "first", 8, 0) == handle,
+        "joining again keeps the handle");
+  tm->removeTopic(topic);
+  ShmManager::getInstance()->releaseAll();
+
+  return report();
+}
@@ -0,0 +1,149 @@
+#include "check.h"
+#include "shm_manager.h"
+#include "spdlog/spdlog.h"
+#include "topic_manager.h"
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Each flow policy: which items a subscriber pulls, that skipped items are
+// released, and that only FLOW_QUEUE blocks the publisher of a topic that
+// doesn't drop messages.
+
+bool publish(TopicManager *tm, const std::string &topic, uint64_t ts) {
+  auto buffer = ShmManager::getInstance()->createBuffer(4096);
+  return buffer && tm->publishBuffer(topic, makeTopicQueueItem(
+                                                buffer->getName(), "", ts));
+}
+
+size_t live_buffers() {
+  return ShmManager::getInstance()->getBufferStats().liveBuffers;
+}
+
+// Pulls what is queued without waiting and returns the timestamps
+std::vector<uint64_t> pull_all(SubscriptionPtr sub) {
+  std::vector<uint64_t> pulled;
+  TopicQueueItem item;
+  sub->queue->clear_old();
+  while (sub->queue->pull(sub->slot, item, 0)) {
+    pulled.push_back(item->timestamp);
+    ShmManager::getInstance()->release(item->buffer_name);
+    sub->queue->clear_old();
+  }
+  return pulled;
+}
+
+SubscriptionPtr subscribe(TopicManager *tm, std::string topic, bool drop,
+                          const FlowControl &flow) {
+  tm->addTopic(topic, drop);
+  std::vector<std::string> dependencies;
+  uint64_t handle = 0;
+  tm->subscribe(topic, "subscriber", dependencies, 2, &handle, flow);
+  return tm->findSubscription(handle);
+}
+
+// A full queue blocks the publisher until the subscriber reads
+void check_queue(TopicManager *tm) {
+  std::string topic = "flow_queue";
+  SubscriptionPtr sub = subscribe(tm, topic, false, FlowControl());
+  check(sub != nullptr, "queue: subscribe");
+  if (!sub)
+    return;
+  check(publish(tm, topic, 1) && publish(tm, topic, 2), "queue: publish");
+
+  std::atomic<bool> posted(false);
+  std::thread publisher([&]() {
+    publish(tm, topic, 3);
+    posted = true;
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  check(!posted, "queue: full queue blocks the publisher");
+
+  // reading one item makes room for the blocked post
+  TopicQueueItem item;
+  check(sub->queue->pull(sub->slot, item, 0) && item->timestamp == 1,
+        "queue: pull the oldest item");
+  ShmManager::getInstance()->release(item->buffer_name);
+  sub->queue->clear_old();
+  publisher.join();
+  check(pull_all(sub) == std::vector<uint64_t>({2, 3}),
+        "queue: no item is dropped");
+  tm->removeTopic(topic);
+  check(live_buffers() == 0, "queue: buffers are released");
+}
+
+// Items posted without credit are skipped
+void check_credit(TopicManager *tm) {
+  std::string topic = "flow_credit";
+  FlowControl flow;
+  flow.policy = FLOW_CREDIT;
+  flow.credits = 1;
+  SubscriptionPtr sub = subscribe(tm, topic, false, flow);
+  check(sub != nullptr, "credit: subscribe");
+  if (!sub)
+    return;
+  for (uint64_t ts = 1; ts <= 3; ++ts)
+    check(publish(tm, topic, ts), "credit: publish");
+  check(pull_all(sub) == std::vector<uint64_t>({1}),
+        "credit: only the credited item is queued");
+  check(live_buffers() == 0, "credit: skipped items are released");
+
+  sub->queue->grant_credits(2);
+  for (uint64_t ts = 4; ts <= 6; ++ts)
+    check(publish(tm, topic, ts), "credit: publish after a grant");
+  check(pull_all(sub) == std::vector<uint64_t>({4, 5}),
+        "credit: granted items are queued");
+  tm->removeTopic(topic);
+  check(live_buffers() == 0, "credit: buffers are released");
+}
+
+// Only the newest unread item is kept, the publisher never blocks
+void check_latest(TopicManager *tm) {
+  std::string topic = "flow_latest";
+  FlowControl flow;
+  flow.policy = FLOW_LATEST;
+  SubscriptionPtr sub = subscribe(tm, topic, false, flow);
+  check(sub != nullptr, "latest: subscribe");
+  if (!sub)
+    return;
+  for (uint64_t ts = 1; ts <= 5; ++ts)
+    check(publish(tm, topic, ts), "latest: publish doesn't block");
+  check(pull_all(sub) == std::vector<uint64_t>({5}),
+        "latest: only the newest item is pulled");
+  check(live_buffers() == 0, "latest: older items are released");
+  tm->removeTopic(topic);
+}
+
+// Items older than max_age_ms are skipped when the subscriber pulls
+void check_max_age(TopicManager *tm) {
+  std::string topic = "flow_max_age";
+  FlowControl flow;
+  flow.policy = FLOW_MAX_AGE;
+  flow.max_age_ms = 20;
+  SubscriptionPtr sub = subscribe(tm, topic, true, flow);
+  check(sub != nullptr, "max_age: subscribe");
+  if (!sub)
+    return;
+  check(publish(tm, topic, 1), "max_age: publish");
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  check(publish(tm, topic, 2), "max_age: publish");
+  check(pull_all(sub) == std::vector<uint64_t>({2}),
+        "max_age: the expired item is skipped");
+  check(live_buffers() == 0, "max_age: the expired item is released");
+  tm->removeTopic(topic);
+}
+
+int main() {
+  spdlog::set_level(spdlog::level::off);
+  TopicManager *tm = TopicManager::getInstance();
+  check_queue(tm);
+  check_credit(tm);
+  check_latest(tm);
+  check_max_age(tm);
+  ShmManager::getInstance()->releaseAll();
+
+  return report();
+}
@@ -0,0 +1,84 @@
+#include "check.h"
+#include "handle_table.h"
+#include "shm_manager.h"
+#include "spdlog/spdlog.h"
+#include "topic_manager.h"
+
+#include <string>
+#include <vector>
+
+// Stale handles: a handle whose slot was freed and reused resolves to nothing
+// rather than to the new object, for the HandleTable itself and for the topic
+// and subscription handles of a topic that was removed and added again. A
+// queue rejects slots it never handed out.
+
+void check_table() {
+  HandleTable<int> table;
+  check(!table.find(0), "0 is not a handle");
+
+  uint64_t first = table.add(std::make_shared<int>(1));
+  check(first != 0 && table.find(first) && *table.find(first) == 1,
+        "added handle resolves");
+  check(table.remove(first), "remove");
+  check(!table.find(first), "removed handle is gone");
+  check(!table.remove(first), "second remove fails");
+
+  // the freed slot is reused under another generation
+  uint64_t second = table.add(std::make_shared<int>(2));
+  check((uint32_t)second == (uint32_t)first, "slot is reused");
+  check(second != first, "reused slot gets a new handle");
+  check(!table.find(first), "stale handle doesn't resolve to the new value");
+  check(!table.remove(first), "stale handle doesn't remove the new value");
+  check(table.find(second) && *table.find(second) == 2,
+        "new handle resolves");
+  check(!table.find(second + 1), "unknown slot doesn't resolve");
+}
+
+void check_topic_handles() {
+  TopicManager *tm = TopicManager::getInstance();
+  std::string topic = "handles_test";
+  std::vector<std::string> dependencies;
+
+  uint64_t old_topic = tm->addTopic(topic, true);
+  uint64_t old_sub = 0;
+  check(tm->subscribe(topic, "subscriber", dependencies, 8, &old_sub),
+        "subscribe");
+  check(tm->findTopic(old_topic) && tm->findSubscription(old_sub),
+        "handles resolve");
+  check(tm->removeTopic(topic), "removeTopic");
+
+  uint64_t new_topic = tm->addTopic(topic, true);
+  uint64_t new_sub = 0;
+  check(tm->subscribe(topic, "subscriber", dependencies, 8, &new_sub),
+        "subscribe again");
+  check(new_topic != old_topic && new_sub != old_sub,
+        "the new topic gets new handles");
+  check(!tm->findTopic(old_topic), "stale topic handle is rejected");
+  check(!tm->findSubscription(old_sub),
+        "stale subscription handle is rejected");
+  auto sub = tm->findSubscription(new_sub);
+  check(tm->findTopic(new_topic) && sub, "new handles resolve");
+
+  // the new subscription's slot reads from the new topic's queue
+  auto buffer = ShmManager::getInstance()->createBuffer(4096);
+  check(buffer && tm->publishBuffer(topic, makeTopicQueueItem(
+                                               buffer->getName(), "", 1)),
+        "publish");
+  TopicQueueItem item;
+  check(sub && sub->queue->pull(sub->slot, item, 0) && item->timestamp == 1,
+        "pull through the new subscription");
+  check(sub && !sub->queue->pull(sub->slot + 1, item, 0),
+        "unknown slot is rejected");
+  check(sub && sub->queue->slot("nobody") == NO_SLOT,
+        "unknown subscriber has no slot");
+  tm->removeTopic(topic);
+}
+
+int main() {
+  spdlog::set_level(spdlog::level::off);
+  check_table();
+  check_topic_handles();
+  ShmManager::getInstance()->releaseAll();
+
+  return report();
+}
@@ -0,0 +1,89 @@
+#include "check.h"
+#include "lease_manager.h"
+#include "shm_manager.h"
+#include "spdlog/spdlog.h"
+
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Session leases: closing a session releases the buffers it still holds,
+// releases and unleases made with the session forget them, heartbeats keep a
+// session open past its lease and a session that isn't renewed expires and
+// gives its buffers back.
+
+size_t live_buffers() {
+  return ShmManager::getInstance()->getBufferStats().liveBuffers;
+}
+
+// A buffer as a pull with the session would deliver it
+TopicQueueItem pull(LeaseManager *lm, uint64_t session) {
+  auto buffer = ShmManager::getInstance()->createBuffer(4096);
+  if (!buffer)
+    return nullptr;
+  TopicQueueItem item = makeTopicQueueItem(buffer->getName(), "", 1);
+  check(lm->lease(session, {item}), "lease a pulled buffer");
+  return item;
+}
+
+void sleep_ms(int ms) {
+  std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+int main() {
+  spdlog::set_level(spdlog::level::off);
+  LeaseManager *lm = LeaseManager::getInstance();
+  lm->configure(200, 5);
+  lm->start();
+
+  unsigned int leaseMs = 0;
+  uint64_t session = lm->open("closed", leaseMs);
+  check(session != 0 && leaseMs == 200, "a session gets the default lease");
+  check(pull(lm, session) != nullptr, "pull");
+  check(lm->getStats().leasedBuffers == 1, "the pull is leased");
+  check(lm->close(session), "close");
+  check(live_buffers() == 0, "closing releases what the session holds");
+  check(lm->getStats().reclaimedBuffers == 1, "the buffer is reclaimed");
+  check(!lm->close(session) && !lm->renew(session),
+        "a closed session is gone");
+  check(!lm->release(session, "any"), "release with a closed session fails");
+
+  // buffers released or unleased with the session are not reclaimed
+  leaseMs = 1000;
+  session = lm->open("released", leaseMs);
+  TopicQueueItem released = pull(lm, session);
+  TopicQueueItem unleased = pull(lm, session);
+  check(released && unleased, "pull twice");
+  if (!released || !unleased)
+    return 1;
+  check(lm->release(session, released->buffer_name), "release");
+  ShmManager::getInstance()->release(released->buffer_name);
+  check(lm->unlease(session, {unleased}), "unlease");
+  check(lm->getStats().leasedBuffers == 0, "nothing is leased any more");
+  check(lm->close(session), "close");
+  check(lm->getStats().reclaimedBuffers == 1, "nothing else is reclaimed");
+  check(live_buffers() == 1, "the unleased buffer is kept");
+  ShmManager::getInstance()->release(unleased->buffer_name);
+
+  // heartbeats keep the session open, without them it expires
+  leaseMs = 0;
+  session = lm->open("expired", leaseMs);
+  check(pull(lm, session) != nullptr, "pull");
+  for (int i = 0; i < 10; ++i) {
+    sleep_ms(leaseMs / 3);
+    check(lm->renew(session), "a renewed session stays open");
+  }
+  check(live_buffers() == 1, "a renewed session keeps its buffers");
+  sleep_ms(leaseMs * 4);
+  check(!lm->renew(session), "a session that isn't renewed expires");
+  SessionStats stats = lm->getStats();
+  check(stats.expired == 1 && stats.sessions == 0 &&
+            stats.reclaimedBuffers == 2,
+        "expiry is counted");
+  check(live_buffers() == 0, "expiry releases what the session holds");
+
+  lm->stop();
+  ShmManager::getInstance()->releaseAll();
+  return report();
+}
@@ -0,0 +1,98 @@
+#include "check.h"
+#include "shm_client.h"
+
+#include <cstring>
+#include <fcntl.h>
+#include <string>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// When ShmMapCache reuses a mapping: a segment is mapped once and every later
+// map of it, recycled or not, hits without opening the segment again. Only
+// another server epoch, as after a restart that reused the name for a new
+// segment, misses and maps the segment again.
+
+const std::string segment_name = "/tbus_map_cache_test";
+const size_t segment_size = 4096;
+
+bool create_segment(int value) {
+  shm_unlink(segment_name.c_str());
+  int fd = shm_open(segment_name.c_str(), O_CREAT | O_EXCL | O_RDWR,
+                    S_IRUSR | S_IWUSR);
+  if (fd < 0)
+    return false;
+  bool created = ftruncate(fd, segment_size) == 0;
+  void *addr = created ? mmap(NULL, segment_size, PROT_READ | PROT_WRITE,
+                              MAP_SHARED, fd, 0)
+                       : MAP_FAILED;
+  close(fd);
+  if (addr == MAP_FAILED)
+    return false;
+  *(int *)addr = value;
+  munmap(addr, segment_size);
+  return true;
+}
+
+// Returns the value at the start of the mapping, or -1
+int map_value(ShmMapCache &cache, uint64_t epoch) {
+  int *addr = (int *)cache.map(segment_name, segment_size, epoch);
+  if (!addr)
+    return -1;
+  int value = *addr;
+  cache.unmap(segment_name);
+  return value;
+}
+
+// Writes value through a mapping of its own, as the segment's next owner
+bool write_value(int value) {
+  int fd = shm_open(segment_name.c_str(), O_RDWR, 0);
+  if (fd < 0)
+    return false;
+  void *addr =
+      mmap(NULL, segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED)
+    return false;
+  *(int *)addr = value;
+  munmap(addr, segment_size);
+  return true;
+}
+
+int main() {
+  ShmMapCache cache;
+  int opens = 0;
+  cache.setOpen([&opens](const std::string &name) {
+    opens++;
+    return shm_open(name.c_str(), O_RDWR, 0);
+  });
+
+  check(create_segment(1), "create segment");
+  check(map_value(cache, 5) == 1, "first map reads the segment");
+  check(map_value(cache, 5) == 1, "same epoch reads the segment");
+  check(map_value(cache, 0) == 1, "unknown epoch reads the segment");
+  MapCacheStats stats = cache.getStats();
+  check(stats.misses == 1 && stats.hits == 2, "later maps hit");
+  check(opens == 1, "hits don't open the segment");
+
+  // the server recycles the segment for the next message
+  check(write_value(2), "recycle segment");
+  check(map_value(cache, 5) == 2, "recycled segment reads the new message");
+  check(cache.getStats().hits == 3 && opens == 1,
+        "recycled segment hits without opening it");
+
+  // another segment under the same name, as after a server restart
+  check(create_segment(7), "recreate segment");
+  check(map_value(cache, 6) == 7, "new epoch reads the new segment");
+  stats = cache.getStats();
+  check(stats.misses == 2 && stats.entries == 1 && opens == 2,
+        "new epoch misses and replaces the mapping");
+  check(map_value(cache, 6) == 7 && cache.getStats().hits == 4,
+        "new epoch hits after it is mapped");
+
+  cache.invalidate(segment_name);
+  check(map_value(cache, 6) == 7 && opens == 3,
+        "an invalidated segment is mapped again");
+
+  shm_unlink(segment_name.c_str());
+  return report();
+}
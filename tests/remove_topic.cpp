@@ -0,0 +1,98 @@
+#include "check.h"
+#include "shm_manager.h"
+#include "spdlog/spdlog.h"
+#include "topic_manager.h"
+
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+// TopicManager::removeTopic: the topic and its handles are gone, the buffers
+// of unread messages are released, blocked pulls and publishes wake up, and
+// the name can be registered again.
+
+bool publish(TopicManager *tm, const std::string &topic, uint64_t ts) {
+  auto buffer = ShmManager::getInstance()->createBuffer(4096);
+  return buffer && tm->publishBuffer(topic, makeTopicQueueItem(
+                                                buffer->getName(), "", ts));
+}
+
+int main() {
+  spdlog::set_level(spdlog::level::off);
+  TopicManager *tm = TopicManager::getInstance();
+  ShmManager *sm = ShmManager::getInstance();
+  std::string topic = "remove_topic_test";
+  std::vector<std::string> dependencies;
+
+  uint64_t topic_handle = tm->addTopic(topic, true);
+  uint64_t sub_handle = 0;
+  check(tm->subscribe(topic, "subscriber", dependencies, 8, &sub_handle),
+        "subscribe");
+  for (uint64_t ts = 1; ts <= 3; ++ts)
+    check(publish(tm, topic, ts), "publish");
+  check(sm->getBufferStats().liveBuffers == 3, "unread buffers are live");
+
+  // a pull with no timeout, blocked once the queue is drained
+  TopicQueueItem item;
+  while (tm->pull(topic, "subscriber", item, 0))
+    sm->release(item->buffer_name);
+  for (uint64_t ts = 4; ts <= 5; ++ts)
+    check(publish(tm, topic, ts), "publish after drain");
+  std::thread other([tm, topic]() {
+    std::vector<std::string> none;
+    tm->subscribe(topic, "blocked", none, 8);
+  });
+  other.join();
+  bool blocked_pulled = true;
+  std::thread blocked([&]() {
+    TopicQueueItem blocked_item;
+    tm->clearOldPosts(topic, "blocked");
+    blocked_pulled = tm->pull(topic, "blocked", blocked_item, -1);
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+  check(tm->removeTopic(topic), "removeTopic");
+  blocked.join();
+  check(!blocked_pulled, "blocked pull fails");
+  check(!tm->hasTopic(topic), "topic is gone");
+  check(!tm->findTopic(topic_handle), "topic handle is gone");
+  check(!tm->findSubscription(sub_handle), "subscription handle is gone");
+  check(sm->getBufferStats().liveBuffers == 0,
+        "unread buffers are released");
+  check(!tm->removeTopic(topic), "second removeTopic fails");
+  check(!publish(tm, topic, 6), "publish to a removed topic fails");
+  check(sm->getBufferStats().liveBuffers == 0,
+        "buffer published to a removed topic is released");
+
+  // a publisher blocked on the full queue of a topic that doesn't drop
+  // messages must not keep the topic from being removed
+  std::string keep_topic = "remove_topic_keep";
+  tm->addTopic(keep_topic, false);
+  check(tm->subscribe(keep_topic, "subscriber", dependencies, 1),
+        "subscribe to a topic that keeps messages");
+  check(publish(tm, keep_topic, 1), "publish to fill the queue");
+  bool published = false;
+  std::thread publisher(
+      [&]() { published = publish(tm, keep_topic, 2); });
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  check(tm->removeTopic(keep_topic), "removeTopic with a blocked publisher");
+  publisher.join();
+  check(published, "blocked publish returns");
+  check(sm->getBufferStats().liveBuffers == 0,
+        "the blocked publisher's buffer is released");
+
+  // the name starts over with no subscribers
+  uint64_t new_handle = tm->addTopic(topic, true);
+  check(new_handle != 0 && new_handle != topic_handle, "new topic handle");
+  check(tm->getSubscriberCount(topic) == 0, "new topic has no subscribers");
+  check(tm->subscribe(topic, "subscriber", dependencies, 8),
+        "subscribe again");
+  check(publish(tm, topic, 7), "publish again");
+  check(tm->pull(topic, "subscriber", item, 0) && item->timestamp == 7,
+        "pull again");
+  tm->removeTopic(topic);
+  sm->releaseAll();
+
+  return report();
+}
@@ -0,0 +1,84 @@
+#include "check.h"
+#include "descriptor_ring.h"
+#include "ring_manager.h"
+#include "shm_manager.h"
+#include "spdlog/spdlog.h"
+#include "topic_manager.h"
+
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+// A subscriber that dies while it holds a descriptor ring: a child process
+// opens the ring, takes one descriptor and exits without closing it. The
+// server must then release every buffer it didn't hand to the child and
+// unsubscribe it, so the topic's queue neither pins buffers nor blocks its
+// publishers.
+
+// Runs in the child, forked before the server starts any thread
+void subscriber(int pipe_fd) {
+  char name[256];
+  ssize_t n = read(pipe_fd, name, sizeof(name) - 1);
+  if (n <= 0)
+    _exit(1);
+  name[n] = 0;
+  DescriptorRing ring;
+  std::string buffer_name, metadata;
+  uint64_t timestamp;
+  uint32_t flags;
+  if (!ring.open(name) ||
+      !ring.pop(buffer_name, metadata, timestamp, flags, 5000))
+    _exit(1);
+  _exit(0); // dies holding the ring and the buffer
+}
+
+bool publish(TopicManager *tm, const std::string &topic, uint64_t ts) {
+  auto buffer = ShmManager::getInstance()->createBuffer(4096);
+  return buffer && tm->publishBuffer(topic, makeTopicQueueItem(
+                                                buffer->getName(), "", ts));
+}
+
+int main() {
+  int fds[2];
+  if (pipe(fds) < 0)
+    return 1;
+  pid_t child = fork();
+  if (child == 0)
+    subscriber(fds[0]);
+
+  spdlog::set_level(spdlog::level::off);
+  TopicManager *tm = TopicManager::getInstance();
+  std::string topic = "ring_test";
+  std::vector<std::string> dependencies;
+  tm->addTopic(topic, false);
+  check(tm->subscribe(topic, "subscriber", dependencies, 4), "subscribe");
+  std::string ring_name = RingManager::getInstance()->createSubscriberRing(
+      topic, "subscriber", 1, 0);
+  check(!ring_name.empty(), "create ring");
+  check(write(fds[1], ring_name.c_str(), ring_name.size()) ==
+            (ssize_t)ring_name.size(),
+        "hand the ring to the child");
+  for (uint64_t ts = 1; ts <= 4; ++ts)
+    check(publish(tm, topic, ts), "publish");
+
+  int status = 0;
+  waitpid(child, &status, 0);
+  check(WIFEXITED(status) && WEXITSTATUS(status) == 0,
+        "child takes a descriptor");
+
+  // the fill thread checks on the child every time it waits
+  for (int i = 0; i < 50 && tm->getSubscriberCount(topic) > 0; ++i)
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  check(tm->getSubscriberCount(topic) == 0, "dead subscriber is removed");
+  check(ShmManager::getInstance()->getBufferStats().liveBuffers == 1,
+        "only the child's buffer is left");
+  check(!publish(tm, topic, 5), "publish without subscribers doesn't block");
+
+  tm->removeTopic(topic);
+  ShmManager::getInstance()->releaseAll();
+  return report();
+}
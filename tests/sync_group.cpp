@@ -0,0 +1,88 @@
+#include "check.h"
+#include "shm_manager.h"
+#include "spdlog/spdlog.h"
+#include "sync_group.h"
+#include "topic_manager.h"
+
+#include <string>
+#include <vector>
+
+// What a sync group holds on to: an unbounded group is refused, items
+// waiting for a match are bounded by the max queue size, and a group that
+// closes, because it is closed or one of its topics is removed, unsubscribes
+// from the other topics and releases every buffer it held.
+
+bool publish(TopicManager *tm, const std::string &topic, uint64_t ts) {
+  auto buffer = ShmManager::getInstance()->createBuffer(4096);
+  return buffer && tm->publishBuffer(topic, makeTopicQueueItem(
+                                                buffer->getName(), "", ts));
+}
+
+size_t live_buffers() {
+  return ShmManager::getInstance()->getBufferStats().liveBuffers;
+}
+
+// Returns the number of items of the tuple the group has ready, 0 if none
+size_t pull_tuple(SyncGroupPtr group) {
+  PullWaiterPtr waiter = std::make_shared<PullWaiter>();
+  waiter->subscriber_name = group->getName();
+  std::vector<TopicQueueItem> tuple;
+  if (!group->pull_async(waiter, tuple))
+    return 0;
+  if (tuple.empty())
+    group->cancel_waiter(waiter);
+  for (auto &item : tuple)
+    ShmManager::getInstance()->release(item->buffer_name);
+  return tuple.size();
+}
+
+int main() {
+  spdlog::set_level(spdlog::level::off);
+  TopicManager *tm = TopicManager::getInstance();
+  SyncManager *sm = SyncManager::getInstance();
+  std::vector<std::string> topics = {"sync_test_a", "sync_test_b"};
+  for (auto topic : topics)
+    tm->addTopic(topic, false);
+
+  check(sm->subscribe("unbounded", topics, 5, false, 0) == 0,
+        "unbounded group is refused");
+  check(tm->getSubscriberCount(topics[0]) == 0 &&
+            tm->getSubscriberCount(topics[1]) == 0,
+        "refused group subscribes nothing");
+
+  // only one topic publishes, so nothing matches and items wait
+  uint64_t handle = sm->subscribe("group", topics, 5, false, 2);
+  check(handle != 0, "subscribe");
+  for (uint64_t ts = 1; ts <= 10; ++ts)
+    check(publish(tm, topics[0], ts * 100), "publish");
+  check(live_buffers() <= 2, "unmatched items are bounded");
+  check(publish(tm, topics[1], 1000), "publish a match");
+  check(pull_tuple(sm->find(handle)) == 2, "pull a tuple");
+  check(live_buffers() == 0, "matched and stale items are released");
+
+  // closing unsubscribes from every topic
+  sm->find(handle)->close();
+  check(tm->getSubscriberCount(topics[0]) == 0 &&
+            tm->getSubscriberCount(topics[1]) == 0,
+        "closed group has no subscribers left");
+  check(!publish(tm, topics[0], 1100), "publish without subscribers fails");
+
+  // removing a topic unsubscribes from the others, items held are released
+  handle = sm->subscribe("group", topics, 5, false, 2);
+  check(handle != 0, "subscribe again");
+  check(publish(tm, topics[1], 1200), "publish before removal");
+  check(live_buffers() == 1, "unmatched item is held");
+  tm->removeTopic(topics[0]);
+  check(sm->find(handle)->closed(), "group closes with its topic");
+  check(tm->getSubscriberCount(topics[1]) == 0,
+        "other topic has no subscriber left");
+  check(live_buffers() == 0, "held items are released");
+  for (uint64_t ts = 13; ts <= 20; ++ts)
+    check(!publish(tm, topics[1], ts * 100),
+          "publish to the other topic doesn't queue");
+  check(live_buffers() == 0, "nothing is pinned");
+
+  tm->removeTopic(topics[1]);
+  ShmManager::getInstance()->releaseAll();
+  return report();
+}
@@ -0,0 +1,58 @@
+#include "check.h"
+#include "spdlog/spdlog.h"
+#include "tracer.h"
+
+#include <chrono>
+#include <string>
+#include <thread>
+
+// The tracer matches a release to the pull of the subscriber that released
+// the buffer. Two subscribers pull the same buffer, the second one releases
+// it long before the first.
+
+StageLatency stage(const std::string &name, const std::string &subscriber) {
+  for (auto &it : Tracer::getInstance()->getLatency())
+    if (it.stage == name && it.subscriber == subscriber)
+      return it;
+  return StageLatency();
+}
+
+int main() {
+  spdlog::set_level(spdlog::level::off);
+  Tracer *tracer = Tracer::getInstance();
+  tracer->configure(true, 16, 16);
+
+  uint64_t trace = tracer->published("buffer", "topic");
+  check(trace != 0, "published buffer is traced");
+  TopicQueueItem item = makeTopicQueueItem("buffer", "", 1, trace);
+  tracer->pulled(item, "slow");
+  tracer->pulled(item, "fast");
+
+  tracer->released("buffer", "fast");
+  check(stage("process", "fast").count == 1,
+        "release is matched to the releasing subscriber");
+  check(stage("process", "slow").count == 0,
+        "the earlier pull of another subscriber stays open");
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  tracer->released("buffer", "slow");
+  StageLatency slow = stage("process", "slow");
+  check(slow.count == 1 && slow.maxUs >= 20000,
+        "the other subscriber's release is timed from its own pull");
+  check(stage("process", "fast").maxUs < 20000,
+        "the first release is not timed from the later one");
+
+  // a release that names no subscriber takes the earliest open pull
+  trace = tracer->published("other", "topic");
+  item = makeTopicQueueItem("other", "", 2, trace);
+  tracer->pulled(item, "slow");
+  tracer->pulled(item, "fast");
+  tracer->released("other", "");
+  check(stage("process", "slow").count == 2,
+        "an unnamed release takes the earliest pull");
+  tracer->released("other", "slow");
+  check(stage("process", "slow").count == 2,
+        "a subscriber's pull is released once");
+
+  return report();
+}
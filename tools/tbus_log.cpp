@@ -0,0 +1,483 @@
+#include "tbus_log.h"
+#include "spdlog/spdlog.h"
+
+#include <chrono>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+const char FILE_MAGIC[8] = {'T', 'B', 'U', 'S', 'L', 'O', 'G', '1'};
+const char INDEX_MAGIC[8] = {'T', 'B', 'U', 'S', 'I', 'D', 'X', '1'};
+
+inline size_t align(size_t n, size_t to) { return (n + to - 1) / to * to; }
+
+const size_t FIRST_RECORD = align(sizeof(LogChunkHeader), 8);
+
+// Where the record starting at offset ends, and its payload starts
+inline size_t payloadStart(size_t offset, size_t metadataSize) {
+  return align(offset + sizeof(LogRecordHeader) + metadataSize,
+               LOG_PAYLOAD_ALIGN);
+}
+
+} // namespace
+
+LogWriter::LogWriter()
+    : mFd(-1), mChunkSize(0), mMaxPending(0), mOffset(0), mAllocated(0),
+      mClosing(false) {}
+
+LogWriter::~LogWriter() {
+  if (mWriter.joinable())
+    close();
+  if (mFd >= 0)
+    ::close(mFd);
+}
+
+bool LogWriter::open(const string &path, size_t chunkSize,
+                     size_t maxPending) {
+  mFd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (mFd < 0) {
+    spdlog::error("failed to create log:{} error:{}", path, strerror(errno));
+    return false;
+  }
+  mChunkSize = align(max(chunkSize, LOG_PAGE_SIZE), LOG_PAGE_SIZE);
+  mMaxPending = max<size_t>(maxPending, 2);
+
+  vector<char> page(LOG_PAGE_SIZE, 0);
+  LogFileHeader header;
+  memcpy(header.magic, FILE_MAGIC, sizeof(header.magic));
+  header.version = LOG_VERSION;
+  header.headerSize = LOG_PAGE_SIZE;
+  header.createdNs = chrono::duration_cast<chrono::nanoseconds>(
+                         chrono::system_clock::now().time_since_epoch())
+                         .count();
+  memcpy(page.data(), &header, sizeof(header));
+  if (!writeAll(page.data(), page.size(), 0))
+    return false;
+  mOffset = LOG_PAGE_SIZE;
+
+  mCurrent = newChunk(mChunkSize);
+  mAllocated = 1;
+  mWriter = thread(&LogWriter::writeChunks, this);
+  return true;
+}
+
+unique_ptr<LogWriter::Chunk> LogWriter::newChunk(size_t capacity) {
+  unique_ptr<Chunk> chunk(new Chunk());
+  chunk->data = (char *)aligned_alloc(LOG_PAGE_SIZE, capacity);
+  chunk->capacity = capacity;
+  chunk->used = FIRST_RECORD;
+  return chunk;
+}
+
+// Makes room in the current chunk for a record, sealing it if the record
+// doesn't fit. A record larger than a chunk gets a chunk of its own. There
+// is no current chunk while an append waits for the writer to free one.
+// Note: caller must hold mMutex
+bool LogWriter::reserve(size_t metadataSize, size_t payloadSize,
+                        unique_lock<mutex> &lock) {
+  size_t largest = payloadStart(FIRST_RECORD, metadataSize) + payloadSize;
+  while (!mStats.failed) {
+    if (mCurrent) {
+      size_t needed = payloadStart(align(mCurrent->used, 8), metadataSize) +
+                      payloadSize;
+      if (needed <= mCurrent->capacity)
+        return true;
+      if (mCurrent->records > 0)
+        seal();
+      else
+        mFree.push_back(std::move(mCurrent)); // empty, the record is larger
+    }
+
+    if (largest > mChunkSize) {
+      mCurrent = newChunk(align(largest, LOG_PAGE_SIZE));
+    } else if (!mFree.empty()) {
+      mCurrent = std::move(mFree.back());
+      mFree.pop_back();
+      mCurrent->used = FIRST_RECORD;
+      mCurrent->records = 0;
+    } else if (mAllocated < mMaxPending) {
+      mCurrent = newChunk(mChunkSize);
+      mAllocated++;
+    } else {
+      auto start = chrono::steady_clock::now();
+      mCV.wait(lock, [this]() {
+        return mCurrent || !mFree.empty() || mStats.failed;
+      });
+      mStats.blockedUs += chrono::duration_cast<chrono::microseconds>(
+                              chrono::steady_clock::now() - start)
+                              .count();
+      continue;
+    }
+    if (!mCurrent->data) {
+      spdlog::error("failed to allocate a log chunk of {} bytes",
+                    mCurrent->capacity);
+      mCurrent.reset();
+      return false;
+    }
+  }
+  return false;
+}
+
+// Note: caller must hold mMutex and have reserved the record
+char *LogWriter::append(uint32_t type, uint32_t topic, const string &metadata,
+                        size_t payloadSize, uint64_t timestamp,
+                        uint64_t recvNs) {
+  Chunk &chunk = *mCurrent;
+  size_t offset = align(chunk.used, 8);
+  size_t payload = payloadStart(offset, metadata.size());
+  memset(chunk.data + chunk.used, 0, payload - chunk.used);
+  LogRecordHeader header;
+  header.magic = LOG_RECORD_MAGIC;
+  header.type = type;
+  header.topic = topic;
+  header.metadataSize = metadata.size();
+  header.payloadSize = payloadSize;
+  header.payloadOffset = payload - offset;
+  header.timestamp = timestamp;
+  header.recvNs = recvNs;
+  memcpy(chunk.data + offset, &header, sizeof(header));
+  memcpy(chunk.data + offset + sizeof(header), metadata.data(),
+         metadata.size());
+
+  if (chunk.records++ == 0)
+    chunk.firstNs = recvNs;
+  chunk.lastNs = recvNs;
+  chunk.used = payload + payloadSize;
+  return chunk.data + payload;
+}
+
+// Hands the current chunk to the writer thread
+// Note: caller must hold mMutex
+void LogWriter::seal() {
+  Chunk &chunk = *mCurrent;
+  LogChunkHeader header;
+  header.magic = LOG_CHUNK_MAGIC;
+  header.records = chunk.records;
+  header.size = align(chunk.used, LOG_PAGE_SIZE);
+  header.firstNs = chunk.firstNs;
+  header.lastNs = chunk.lastNs;
+  memcpy(chunk.data, &header, sizeof(header));
+  memset(chunk.data + chunk.used, 0, header.size - chunk.used);
+  mFull.push_back(std::move(mCurrent));
+  mCV.notify_all();
+}
+
+uint32_t LogWriter::topic(const string &name) {
+  unique_lock<mutex> lock(mMutex);
+  for (uint32_t id = 0; id < mTopics.size(); ++id)
+    if (mTopics[id] == name)
+      return id;
+
+  uint32_t id = mTopics.size();
+  mTopics.push_back(name);
+  if (!mClosing && reserve(0, name.size(), lock))
+    memcpy(append(RECORD_TOPIC, id, "", name.size(), 0, 0), name.data(),
+           name.size());
+  return id;
+}
+
+bool LogWriter::append(uint32_t topic, const void *payload, size_t size,
+                       const string &metadata, uint64_t timestamp,
+                       uint64_t recvNs) {
+  unique_lock<mutex> lock(mMutex);
+  if (mClosing || !reserve(metadata.size(), size, lock))
+    return false;
+  memcpy(append(RECORD_MESSAGE, topic, metadata, size, timestamp, recvNs),
+         payload, size);
+  mStats.records++;
+  return true;
+}
+
+bool LogWriter::writeAll(const void *data, size_t size, uint64_t offset) {
+  const char *p = (const char *)data;
+  while (size > 0) {
+    ssize_t n = pwrite(mFd, p, size, offset);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0) {
+      spdlog::error("failed to write log error:{}", strerror(errno));
+      return false;
+    }
+    p += n;
+    size -= n;
+    offset += n;
+  }
+  return true;
+}
+
+// Chunks are written in the order they were sealed, one write each
+void LogWriter::writeChunks() {
+  unique_lock<mutex> lock(mMutex);
+  while (true) {
+    mCV.wait(lock, [this]() { return !mFull.empty() || mClosing; });
+    if (mFull.empty())
+      break;
+    unique_ptr<Chunk> chunk = std::move(mFull.front());
+    mFull.pop_front();
+    LogChunkInfo info;
+    info.offset = mOffset;
+    info.size = ((LogChunkHeader *)chunk->data)->size;
+    info.records = chunk->records;
+    info.firstNs = chunk->firstNs;
+    mOffset += info.size;
+
+    lock.unlock();
+    bool written = writeAll(chunk->data, info.size, info.offset);
+    lock.lock();
+    if (written) {
+      mChunks.push_back(info);
+      mStats.chunks++;
+      mStats.bytes += info.size;
+    } else
+      mStats.failed = true;
+    if (chunk->capacity == mChunkSize)
+      mFree.push_back(std::move(chunk));
+    mCV.notify_all();
+  }
+}
+
+// The index lists the topics, then the chunks:
+//   uint32 topic count, uint32 chunk count
+//   per topic, uint32 length and the name, padded to 8 bytes
+//   LogChunkInfo per chunk
+bool LogWriter::close() {
+  {
+    lock_guard<mutex> lock(mMutex);
+    if (mCurrent && mCurrent->records > 0)
+      seal();
+    mCurrent.reset();
+    mClosing = true;
+    mCV.notify_all();
+  }
+  if (mWriter.joinable())
+    mWriter.join();
+  if (mFd < 0 || mStats.failed)
+    return false;
+
+  string index;
+  uint32_t counts[2] = {(uint32_t)mTopics.size(), (uint32_t)mChunks.size()};
+  index.append((const char *)counts, sizeof(counts));
+  for (auto &name : mTopics) {
+    uint32_t length = name.size();
+    index.append((const char *)&length, sizeof(length));
+    index.append(name);
+  }
+  index.resize(align(index.size(), 8), '\0');
+  index.append((const char *)mChunks.data(),
+               mChunks.size() * sizeof(LogChunkInfo));
+  LogFooter footer;
+  footer.indexOffset = mOffset;
+  footer.indexSize = index.size();
+  memcpy(footer.magic, INDEX_MAGIC, sizeof(footer.magic));
+  index.append((const char *)&footer, sizeof(footer));
+  bool written = writeAll(index.data(), index.size(), mOffset);
+  ::close(mFd);
+  mFd = -1;
+  return written;
+}
+
+LogWriterStats LogWriter::getStats() {
+  lock_guard<mutex> lock(mMutex);
+  return mStats;
+}
+
+LogReader::LogReader()
+    : mFd(-1), mData(nullptr), mSize(0), mIndexed(false), mChunk(0),
+      mOffset(FIRST_RECORD), mRecord(0) {}
+
+LogReader::~LogReader() { close(); }
+
+bool LogReader::open(const string &path) {
+  mFd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (mFd < 0 || fstat(mFd, &st) < 0) {
+    spdlog::error("failed to open log:{} error:{}", path, strerror(errno));
+    return false;
+  }
+  mSize = st.st_size;
+  if (mSize < LOG_PAGE_SIZE) {
+    spdlog::error("log:{} is truncated", path);
+    return false;
+  }
+  void *data = mmap(nullptr, mSize, PROT_READ, MAP_SHARED, mFd, 0);
+  if (data == MAP_FAILED) {
+    spdlog::error("failed to map log:{} error:{}", path, strerror(errno));
+    return false;
+  }
+  mData = (const char *)data;
+  madvise(data, mSize, MADV_SEQUENTIAL);
+
+  const LogFileHeader *header = (const LogFileHeader *)mData;
+  if (memcmp(header->magic, FILE_MAGIC, sizeof(header->magic)) != 0 ||
+      header->version != LOG_VERSION) {
+    spdlog::error("{} is not a version {} log", path, LOG_VERSION);
+    return false;
+  }
+  if (!readIndex(path))
+    return false;
+  if (!mIndexed) {
+    spdlog::warn("log:{} has no index, scanning its chunks", path);
+    scanChunks();
+  }
+  rewind();
+  return true;
+}
+
+void LogReader::close() {
+  if (mData)
+    munmap((void *)mData, mSize);
+  if (mFd >= 0)
+    ::close(mFd);
+  mData = nullptr;
+  mFd = -1;
+  mTopics.clear();
+  mChunks.clear();
+}
+
+// Reads the index, if the file ends with one, and sets mIndexed. An index
+// whose entries don't fit in the file is corrupt and fails the open.
+bool LogReader::readIndex(const string &path) {
+  mIndexed = false;
+  if (mSize < LOG_PAGE_SIZE + sizeof(LogFooter))
+    return true;
+  const LogFooter *footer =
+      (const LogFooter *)(mData + mSize - sizeof(LogFooter));
+  size_t indexEnd = mSize - sizeof(LogFooter);
+  if (memcmp(footer->magic, INDEX_MAGIC, sizeof(footer->magic)) != 0 ||
+      footer->indexOffset < LOG_PAGE_SIZE || footer->indexOffset > indexEnd ||
+      footer->indexSize != indexEnd - footer->indexOffset)
+    return true;
+
+  const char *p = mData + footer->indexOffset;
+  const char *end = p + footer->indexSize;
+  uint32_t counts[2];
+  if (end - p < (ptrdiff_t)sizeof(counts))
+    return corruptIndex(path);
+  memcpy(counts, p, sizeof(counts));
+  p += sizeof(counts);
+  for (uint32_t i = 0; i < counts[0]; ++i) {
+    uint32_t length;
+    if (end - p < (ptrdiff_t)sizeof(length))
+      return corruptIndex(path);
+    memcpy(&length, p, sizeof(length));
+    p += sizeof(length);
+    if (end - p < (ptrdiff_t)length)
+      return corruptIndex(path);
+    mTopics.emplace_back(p, length);
+    p += length;
+  }
+  p = mData + align(p - mData, 8);
+  if (end - p != (ptrdiff_t)(counts[1] * sizeof(LogChunkInfo)))
+    return corruptIndex(path);
+  mChunks.resize(counts[1]);
+  memcpy(mChunks.data(), p, counts[1] * sizeof(LogChunkInfo));
+
+  // every chunk lies between the file header and the index
+  for (auto &chunk : mChunks)
+    if (chunk.offset < LOG_PAGE_SIZE || chunk.offset > footer->indexOffset ||
+        chunk.size > footer->indexOffset - chunk.offset)
+      return corruptIndex(path);
+  mIndexed = true;
+  return true;
+}
+
+bool LogReader::corruptIndex(const string &path) {
+  spdlog::error("log:{} has a corrupt index", path);
+  mTopics.clear();
+  mChunks.clear();
+  return false;
+}
+
+// Walks the chunk headers, then every record for the topic declarations. A
+// chunk cut short by the end of the file ends the log.
+bool LogReader::scanChunks() {
+  mTopics.clear();
+  mChunks.clear();
+  size_t offset = LOG_PAGE_SIZE;
+  while (offset + sizeof(LogChunkHeader) <= mSize) {
+    const LogChunkHeader *chunk = (const LogChunkHeader *)(mData + offset);
+    if (chunk->magic != LOG_CHUNK_MAGIC || chunk->size < LOG_PAGE_SIZE ||
+        chunk->size > mSize - offset)
+      break;
+    mChunks.push_back({offset, chunk->size, chunk->records, chunk->firstNs});
+    offset += chunk->size;
+  }
+
+  for (auto &chunk : mChunks) {
+    size_t next = FIRST_RECORD;
+    for (uint64_t i = 0; i < chunk.records; ++i) {
+      const LogRecordHeader *record = header(chunk, next);
+      if (!record)
+        break;
+      if (record->type == RECORD_TOPIC && record->topic == mTopics.size())
+        mTopics.emplace_back((const char *)record + record->payloadOffset,
+                             record->payloadSize);
+      next = align(next, 8) + record->payloadOffset + record->payloadSize;
+    }
+  }
+  return !mChunks.empty();
+}
+
+// The record at offset within the chunk, null if it is damaged
+const LogRecordHeader *LogReader::header(const LogChunkInfo &chunk,
+                                         size_t offset) {
+  offset = align(offset, 8);
+  if (offset + sizeof(LogRecordHeader) > chunk.size)
+    return nullptr;
+  const LogRecordHeader *record =
+      (const LogRecordHeader *)(mData + chunk.offset + offset);
+  if (record->magic != LOG_RECORD_MAGIC ||
+      record->payloadOffset < sizeof(LogRecordHeader) + record->metadataSize ||
+      record->payloadOffset > chunk.size - offset ||
+      record->payloadSize > chunk.size - offset - record->payloadOffset)
+    return nullptr;
+  return record;
+}
+
+uint64_t LogReader::messages() const {
+  uint64_t records = 0;
+  for (auto &chunk : mChunks)
+    records += chunk.records;
+  return records - mTopics.size();
+}
+
+bool LogReader::next(LogRecord &record) {
+  while (mChunk < mChunks.size()) {
+    const LogChunkInfo &chunk = mChunks[mChunk];
+    const LogRecordHeader *h =
+        mRecord < chunk.records ? header(chunk, mOffset) : nullptr;
+    if (!h) {
+      if (mRecord < chunk.records)
+        spdlog::warn("skipping damaged chunk at offset:{}", chunk.offset);
+      mChunk++;
+      mOffset = FIRST_RECORD;
+      mRecord = 0;
+      continue;
+    }
+    mOffset = align(mOffset, 8) + h->payloadOffset + h->payloadSize;
+    mRecord++;
+    if (h->type != RECORD_MESSAGE)
+      continue;
+
+    record.topic = h->topic;
+    record.metadata = (const char *)(h + 1);
+    record.metadataSize = h->metadataSize;
+    record.payload = (const char *)h + h->payloadOffset;
+    record.payloadSize = h->payloadSize;
+    record.timestamp = h->timestamp;
+    record.recvNs = h->recvNs;
+    return true;
+  }
+  return false;
+}
+
+void LogReader::rewind() {
+  mChunk = 0;
+  mOffset = FIRST_RECORD;
+  mRecord = 0;
+}
@@ -0,0 +1,187 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+// The log written by tbus-record and replayed by tbus-play. A log is a file
+// header followed by chunks and, once the recording is closed, an index:
+//   LogFileHeader   one page
+//   chunk           LogChunkHeader and records, padded to whole pages
+//   ...
+//   index           topic names and a LogChunkInfo per chunk
+//   LogFooter       the last bytes of the file, locates the index
+// A record is a LogRecordHeader, the metadata and the payload, which starts
+// on a 64 byte boundary. A topic is declared by a RECORD_TOPIC record, whose
+// payload is its name, before its first message, so a log without an index
+// (the recorder died) is read by walking the chunk headers instead. Every
+// chunk is written with one sequential write and the whole file is meant to
+// be mapped by the reader.
+
+const uint32_t LOG_VERSION = 1;
+const size_t LOG_PAGE_SIZE = 4096;
+const size_t LOG_PAYLOAD_ALIGN = 64;
+const uint32_t LOG_CHUNK_MAGIC = 0x4b4e4843;  // "CHNK"
+const uint32_t LOG_RECORD_MAGIC = 0x44524352; // "RCRD"
+
+enum LogRecordType : uint32_t {
+  RECORD_MESSAGE = 0,
+  RECORD_TOPIC = 1,
+};
+
+struct LogFileHeader {
+  char magic[8]; // "TBUSLOG1"
+  uint32_t version;
+  uint32_t headerSize;
+  uint64_t createdNs; // system clock
+};
+
+struct LogChunkHeader {
+  uint32_t magic;
+  uint32_t records;
+  uint64_t size; // including this header and the padding
+  uint64_t firstNs;
+  uint64_t lastNs;
+};
+
+struct LogRecordHeader {
+  uint32_t magic;
+  uint32_t type;
+  uint32_t topic;
+  uint32_t metadataSize;
+  uint64_t payloadSize;
+  uint64_t payloadOffset; // from the record header
+  uint64_t timestamp;     // TopicMessage::timestamp as published
+  uint64_t recvNs;        // steady clock, when the recorder pulled it
+};
+
+struct LogChunkInfo {
+  uint64_t offset;
+  uint64_t size;
+  uint64_t records;
+  uint64_t firstNs;
+};
+
+struct LogFooter {
+  uint64_t indexOffset;
+  uint64_t indexSize;
+  char magic[8]; // "TBUSIDX1"
+};
+
+struct LogWriterStats {
+  uint64_t records = 0;
+  uint64_t chunks = 0;
+  uint64_t bytes = 0;     // written to the file
+  uint64_t blockedUs = 0; // appends waiting for the disk
+  bool failed = false;
+};
+
+// Appends records to chunks in memory, a writer thread writes full chunks.
+// At most maxPending chunks are held, an append waits for the disk when
+// they are all full. Thread safe.
+class LogWriter {
+private:
+  struct Chunk {
+    char *data = nullptr;
+    size_t capacity = 0;
+    size_t used = 0;
+    uint32_t records = 0;
+    uint64_t firstNs = 0;
+    uint64_t lastNs = 0;
+    ~Chunk() { free(data); }
+  };
+
+  int mFd;
+  size_t mChunkSize;
+  size_t mMaxPending;
+  uint64_t mOffset; // where the next chunk is written
+  unique_ptr<Chunk> mCurrent;
+  deque<unique_ptr<Chunk>> mFull;
+  vector<unique_ptr<Chunk>> mFree;
+  size_t mAllocated; // chunks of mChunkSize
+  vector<string> mTopics;
+  vector<LogChunkInfo> mChunks;
+  LogWriterStats mStats;
+  bool mClosing;
+  mutex mMutex;
+  condition_variable mCV;
+  thread mWriter;
+
+  // Note: functions below require mMutex
+  unique_ptr<Chunk> newChunk(size_t capacity);
+  bool reserve(size_t metadataSize, size_t payloadSize,
+               unique_lock<mutex> &lock);
+  char *append(uint32_t type, uint32_t topic, const string &metadata,
+               size_t payloadSize, uint64_t timestamp, uint64_t recvNs);
+  void seal();
+
+  void writeChunks();
+  bool writeAll(const void *data, size_t size, uint64_t offset);
+
+public:
+  LogWriter();
+  virtual ~LogWriter();
+
+  bool open(const string &path, size_t chunkSize = size_t(8) << 20,
+            size_t maxPending = 4);
+  // Returns the topic's id, declaring the topic on its first use
+  uint32_t topic(const string &name);
+  // The payload is copied into the current chunk
+  bool append(uint32_t topic, const void *payload, size_t size,
+              const string &metadata, uint64_t timestamp, uint64_t recvNs);
+  // Writes the last chunk and the index
+  bool close();
+  LogWriterStats getStats();
+};
+
+struct LogRecord {
+  uint32_t topic;
+  const char *metadata;
+  size_t metadataSize;
+  const char *payload;
+  size_t payloadSize;
+  uint64_t timestamp;
+  uint64_t recvNs;
+};
+
+// Maps a log and walks its messages in the order they were recorded
+class LogReader {
+private:
+  int mFd;
+  const char *mData;
+  size_t mSize;
+  vector<string> mTopics;
+  vector<LogChunkInfo> mChunks;
+  bool mIndexed;
+  size_t mChunk;  // current chunk
+  size_t mOffset; // next record, within the current chunk
+  uint32_t mRecord;
+
+  bool readIndex(const string &path);
+  bool corruptIndex(const string &path);
+  bool scanChunks();
+  const LogRecordHeader *header(const LogChunkInfo &chunk, size_t offset);
+
+public:
+  LogReader();
+  virtual ~LogReader();
+
+  bool open(const string &path);
+  void close();
+  const vector<string> &topics() const { return mTopics; }
+  const vector<LogChunkInfo> &chunks() const { return mChunks; }
+  // False if the log was not closed and had to be scanned
+  bool indexed() const { return mIndexed; }
+  uint64_t messages() const;
+  // Returns false at the end of the log
+  bool next(LogRecord &record);
+  void rewind();
+};
@@ -0,0 +1,152 @@
+#include "shm_client.h"
+#include "spdlog/spdlog.h"
+#include "tbus_log.h"
+
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Publishes a log written by tbus-record into a running shm_server. Messages
+// keep the order, timestamps and metadata they were recorded with and are
+// published at the intervals they were pulled at, scaled by --speed, or as
+// fast as possible with --fast. --topic (repeated) replays only some topics,
+// --loop replays the log several times and --wait holds off until every
+// replayed topic has a subscriber.
+//   tbus-play [--server HOST:PORT] [--fast | --speed X] [--loop N] [--wait]
+//             [--no-drop] [--topic NAME]... FILE
+// The log is mapped and each payload is copied once, from the mapping
+// straight into the buffer the server hands out. Buffers are owned by the
+// server, so the log's pages can't be published as they are.
+
+volatile std::sig_atomic_t stop = 0;
+
+void on_signal(int) { stop = 1; }
+
+int main(int argc, char **argv) {
+  std::string server = "localhost:50051";
+  std::string path;
+  bool fast = false, wait = false, drop = true;
+  double speed = 1;
+  unsigned int loops = 1;
+  std::vector<std::string> only;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--server" && i + 1 < argc)
+      server = argv[++i];
+    else if (arg == "--fast")
+      fast = true;
+    else if (arg == "--speed" && i + 1 < argc)
+      speed = std::stod(argv[++i]);
+    else if (arg == "--loop" && i + 1 < argc)
+      loops = std::stoi(argv[++i]);
+    else if (arg == "--wait")
+      wait = true;
+    else if (arg == "--no-drop")
+      drop = false;
+    else if (arg == "--topic" && i + 1 < argc)
+      only.push_back(argv[++i]);
+    else if (arg.rfind("--", 0) == 0 || !path.empty()) {
+      fprintf(stderr, "unknown argument %s\n", arg.c_str());
+      return 1;
+    } else
+      path = arg;
+  }
+  if (path.empty() || speed <= 0) {
+    fprintf(stderr, "usage: tbus-play [--server HOST:PORT] [--fast | --speed X] "
+                    "[--loop N] [--wait] [--no-drop] [--topic NAME]... FILE\n");
+    return 1;
+  }
+  spdlog::set_level(spdlog::level::warn);
+
+  LogReader reader;
+  if (!reader.open(path))
+    return 1;
+  ShmClient client(
+      grpc::CreateChannel(server, grpc::InsecureChannelCredentials()));
+  std::signal(SIGINT, on_signal);
+
+  // topics by their id in the log, empty if not replayed
+  std::vector<std::string> topics = reader.topics();
+  for (auto &topic : topics) {
+    if (!only.empty() &&
+        std::find(only.begin(), only.end(), topic) == only.end()) {
+      topic.clear();
+      continue;
+    }
+    if (client.RegisterTopic(topic, drop) < 0) {
+      fprintf(stderr, "failed to register topic %s\n", topic.c_str());
+      return 1;
+    }
+    unsigned int subscribers = 0;
+    while (wait && !stop &&
+           (client.GetSubscriberCount(topic, subscribers) < 0 ||
+            subscribers == 0))
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  }
+
+  uint64_t published = 0, unsent = 0, bytes = 0;
+  double late_ms = 0, recorded_s = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (unsigned int loop = 0; loop < loops && !stop; ++loop) {
+    reader.rewind();
+    auto base = std::chrono::steady_clock::now();
+    uint64_t first = 0, last = 0;
+    LogRecord record;
+    while (!stop && reader.next(record)) {
+      if (record.topic >= topics.size() || topics[record.topic].empty())
+        continue;
+      if (first == 0)
+        first = record.recvNs;
+      last = record.recvNs;
+      if (!fast) {
+        auto due = base + std::chrono::nanoseconds(
+                              (uint64_t)((record.recvNs - first) / speed));
+        std::this_thread::sleep_until(due);
+        late_ms = std::max(late_ms, std::chrono::duration<double, std::milli>(
+                                        std::chrono::steady_clock::now() - due)
+                                        .count());
+      }
+
+      std::string buffer_name;
+      uint64_t epoch;
+      void *data = nullptr;
+      if (client.CreateBuffer(buffer_name, record.payloadSize, epoch, 0,
+                              topics[record.topic]) == 0)
+        data = client.MapBuffer(buffer_name, record.payloadSize);
+      if (!data) {
+        if (!buffer_name.empty())
+          client.ReleaseBuffer(buffer_name);
+        unsent++;
+        continue;
+      }
+      memcpy(data, record.payload, record.payloadSize);
+      client.UnmapBuffer(buffer_name);
+      // the server releases the buffer if nobody subscribes
+      std::string metadata(record.metadata, record.metadataSize);
+      if (client.Publish(topics[record.topic], buffer_name, metadata,
+                         record.timestamp) == 0) {
+        published++;
+        bytes += record.payloadSize;
+      } else
+        unsent++;
+    }
+    recorded_s += (last - first) / 1e9;
+  }
+
+  double elapsed_s = std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - start)
+                         .count();
+  printf("%llu messages published, %llu not published, %.1f MB\n",
+         (unsigned long long)published, (unsigned long long)unsent,
+         bytes / 1e6);
+  printf("%.3f s recorded, replayed in %.3f s", recorded_s, elapsed_s);
+  if (!fast)
+    printf(", at most %.2f ms late", late_ms);
+  printf("\n");
+  return 0;
+}
@@ -0,0 +1,134 @@
+#include "shm_client.h"
+#include "spdlog/spdlog.h"
+#include "tbus_log.h"
+
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Records topics of a running shm_server into a log, see tbus_log.h. Each
+// topic is pulled on its own thread as subscriber tbus-record, every buffer
+// is copied into the log with its metadata, timestamp and the time it was
+// pulled, then released. Stops on SIGINT or after --duration seconds.
+//   tbus-record [--server HOST:PORT] [--out FILE] [--duration S]
+//               [--depth N] [--chunk-mb N] topic...
+// The log is written one chunk at a time by a writer thread. If the disk
+// falls behind, pulls wait for it and the subscriber queues on the server
+// fill up, which drops messages on topics that drop.
+
+const std::string subscriber_name = "tbus-record";
+volatile std::sig_atomic_t stop = 0;
+
+void on_signal(int) { stop = 1; }
+
+uint64_t now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+struct TopicCount {
+  std::atomic<uint64_t> messages{0};
+  std::atomic<uint64_t> bytes{0};
+  std::atomic<uint64_t> errors{0};
+};
+
+void record(ShmClient &client, LogWriter &writer, const std::string &topic,
+            unsigned int depth, TopicCount &count) {
+  while (!stop && client.Subscribe(topic, subscriber_name, depth) < 0)
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+  uint32_t id = writer.topic(topic);
+
+  std::string buffer_name, metadata;
+  uint64_t timestamp;
+  while (!stop) {
+    if (client.Pull(topic, subscriber_name, buffer_name, metadata, timestamp,
+                    100) < 0)
+      continue;
+    uint64_t pulled = now_ns();
+    int32_t size;
+    void *data = nullptr;
+    if (client.GetBuffer(buffer_name, size) == 0)
+      data = client.MapBuffer(buffer_name, size);
+    if (data && writer.append(id, data, size, metadata, timestamp, pulled)) {
+      count.messages++;
+      count.bytes += size;
+    } else
+      count.errors++;
+    if (data)
+      client.UnmapBuffer(buffer_name);
+    client.ReleaseBuffer(buffer_name);
+  }
+}
+
+int main(int argc, char **argv) {
+  std::string server = "localhost:50051";
+  std::string out = "recording.tbus";
+  double duration = 0;
+  unsigned int depth = 16;
+  size_t chunk_mb = 8;
+  std::vector<std::string> topics;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--server" && i + 1 < argc)
+      server = argv[++i];
+    else if (arg == "--out" && i + 1 < argc)
+      out = argv[++i];
+    else if (arg == "--duration" && i + 1 < argc)
+      duration = std::stod(argv[++i]);
+    else if (arg == "--depth" && i + 1 < argc)
+      depth = std::stoi(argv[++i]);
+    else if (arg == "--chunk-mb" && i + 1 < argc)
+      chunk_mb = std::stoul(argv[++i]);
+    else if (arg.rfind("--", 0) == 0) {
+      fprintf(stderr, "unknown option %s\n", arg.c_str());
+      return 1;
+    } else
+      topics.push_back(arg);
+  }
+  if (topics.empty()) {
+    fprintf(stderr, "usage: tbus-record [--server HOST:PORT] [--out FILE] "
+                    "[--duration S] [--depth N] [--chunk-mb N] topic...\n");
+    return 1;
+  }
+  spdlog::set_level(spdlog::level::warn);
+
+  LogWriter writer;
+  if (!writer.open(out, chunk_mb << 20))
+    return 1;
+  ShmClient client(
+      grpc::CreateChannel(server, grpc::InsecureChannelCredentials()));
+  std::signal(SIGINT, on_signal);
+  std::signal(SIGTERM, on_signal);
+
+  std::vector<TopicCount> counts(topics.size());
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < topics.size(); ++t)
+    threads.emplace_back(record, std::ref(client), std::ref(writer),
+                         std::cref(topics[t]), depth, std::ref(counts[t]));
+  auto start = std::chrono::steady_clock::now();
+  while (!stop) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    if (duration > 0 && std::chrono::duration<double>(
+                            std::chrono::steady_clock::now() - start)
+                                .count() >= duration)
+      stop = 1;
+  }
+  for (auto &thread : threads)
+    thread.join();
+  bool closed = writer.close();
+
+  LogWriterStats stats = writer.getStats();
+  for (size_t t = 0; t < topics.size(); ++t)
+    printf("%-24s %10llu messages %12.1f MB %6llu errors\n",
+           topics[t].c_str(), (unsigned long long)counts[t].messages,
+           counts[t].bytes / 1e6, (unsigned long long)counts[t].errors);
+  printf("%s: %llu chunks, %.1f MB, appends waited %.1f ms for the disk\n",
+         out.c_str(), (unsigned long long)stats.chunks, stats.bytes / 1e6,
+         stats.blockedUs / 1e3);
+  return closed ? 0 : 1;
+}